@@ -283,9 +283,13 @@ static char *cmd_set_prompt(void)
                     current_hub->nick, current_hub->address);
             break;
         case CTX_FILELIST:
-            asprintf(&prompt, "ShakesPeer:browse(%s) \\%s$ ",
-                    current_filelist->nick,
-                    filelist_cdir ? filelist_cdir->path : "");
+            {
+                char *path = filelist_cdir ?
+                    fl_dir_path_dup(filelist_cdir, NULL) : NULL;
+                asprintf(&prompt, "ShakesPeer:browse(%s) \\%s$ ",
+                        current_filelist->nick, path ? path : "");
+                free(path);
+            }
             break;
         case CTX_HUBLIST:
             prompt = strdup("ShakesPeer:hublist$ ");
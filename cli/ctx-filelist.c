@@ -100,24 +100,6 @@ int func_filelist_lsdirs(sp_t *sp, arg_t *args)
     return 0;
 }
 
-static fl_dir_t *find_parent_for(fl_dir_t *dir, fl_dir_t *cdir)
-{
-    fl_file_t *file;
-    TAILQ_FOREACH(file, &dir->files, link)
-    {
-        if(file->dir)
-        {
-            if(cdir == file->dir)
-                return dir;
-            fl_dir_t *foo = find_parent_for(file->dir, cdir);
-            if(foo)
-                return foo;
-        }
-    }
-
-    return 0;
-}
-
 static fl_file_t *fl_lookup_file(fl_dir_t *dir, const char *filename)
 {
     fl_file_t *f;
@@ -134,9 +116,8 @@ int func_filelist_cd(sp_t *sp, arg_t *args)
 {
     if(strcmp(args->argv[1], "..") == 0)
     {
-        filelist_cdir = find_parent_for(current_filelist->root, filelist_cdir);
-        if(filelist_cdir == 0)
-            filelist_cdir = current_filelist->root;
+        if(filelist_cdir->parent)
+            filelist_cdir = filelist_cdir->parent;
         return 0;
     }
 
@@ -166,12 +147,11 @@ int func_filelist_get(sp_t *sp, arg_t *args)
     }
     else
     {
-        char *source;
-
-        asprintf(&source, "%s\\%s", filelist_cdir->path, file->name);
+        char *source = fl_dir_path_dup(filelist_cdir, file->name);
+        char tth[TTH_BASE32_LEN + 1];
         sp_send_download_file(sp, current_filelist->hubaddress,
                 current_filelist->nick,
-                source, file->size, file->name, file->tth);
+                source, file->size, file->name, fl_file_tth(file, tth));
         free(source);
     }
 
@@ -180,12 +160,8 @@ int func_filelist_get(sp_t *sp, arg_t *args)
 
 static void download_recursive(sp_t *sp, fl_dir_t *dir, const char *root)
 {
-    char *slash = strrchr(dir->path, '\\');
-    if(slash++ == 0)
-        slash = dir->path;
-
     char *new_root;
-    asprintf(&new_root, "%s/%s", root, slash);
+    asprintf(&new_root, "%s/%s", root, dir->name);
 
     fl_file_t *file;
     TAILQ_FOREACH(file, &dir->files, link)
@@ -197,12 +173,12 @@ static void download_recursive(sp_t *sp, fl_dir_t *dir, const char *root)
         else
         {
             char *target;
-            char *source;
+            char *source = fl_dir_path_dup(dir, file->name);
+            char tth[TTH_BASE32_LEN + 1];
             asprintf(&target, "%s/%s", new_root, file->name);
-            asprintf(&source, "%s\\%s", dir->path, file->name);
             sp_send_download_file(sp, current_filelist->hubaddress,
                     current_filelist->nick,
-                    source, file->size, target, file->tth);
+                    source, file->size, target, fl_file_tth(file, tth));
             free(source);
             free(target);
         }
@@ -99,13 +99,15 @@
 {
     NSMutableArray *items = [NSMutableArray arrayWithCapacity:dir->nfiles];
 
-    char *e = dir->path;
+    char *dirpath = fl_dir_path_dup(dir, NULL);
+    char *e = dirpath;
     for (; e && *e; e++) {
         if (*e == '/')
             *e = '\\';
     }
 
-    NSString *path = [[NSString alloc] initWithUTF8String:dir->path];
+    NSString *path = [[NSString alloc] initWithUTF8String:dirpath];
+    free(dirpath);
 
     fl_file_t *file;
     TAILQ_FOREACH(file, &dir->files, link) {
@@ -122,8 +124,9 @@
         [fullPath release];
 
         [item setObject:[NSNumber numberWithInt:file->type] forKey:@"type"];
-        if (file->tth) {
-            NSString *tth = [NSString stringWithUTF8String:file->tth];
+        char tthbuf[TTH_BASE32_LEN + 1];
+        if (fl_file_tth(file, tthbuf)) {
+            NSString *tth = [NSString stringWithUTF8String:tthbuf];
             [item setObject:tth forKey:@"TTH"];
             [item setObject:[[tth truncatedString:NSLineBreakByTruncatingMiddle] autorelease] forKey:@"DisplayTTH"];
         }
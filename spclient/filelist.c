@@ -100,57 +100,183 @@ fl_dir_t *fl_parse(const char *filename, xerr_t **err)
     return list;
 }
 
-static void fl_free_file(fl_file_t *flf)
+static uint32_t fl_name_hash(const void *record)
 {
-    if(flf)
+    return htable_hash_string(record);
+}
+
+static int fl_name_match(const void *record, const void *key)
+{
+    return strcmp(record, key) == 0;
+}
+
+void fl_builder_init(fl_builder_t *builder)
+{
+    arena_t *arena = malloc(sizeof(arena_t));
+    arena_init(arena);
+
+    fl_dir_t *root = arena_calloc(arena, sizeof(fl_dir_t));
+    TAILQ_INIT(&root->files);
+    root->name = "";
+    root->arena = arena;
+
+    builder->root = root;
+    htable_init(&builder->names, fl_name_hash);
+}
+
+/* Frees the parser state. The list is kept. */
+void fl_builder_done(fl_builder_t *builder)
+{
+    htable_free(&builder->names);
+}
+
+static const char *fl_builder_intern(fl_builder_t *builder, const char *name)
+{
+    uint32_t hash = htable_hash_string(name);
+    char *interned = htable_lookup(&builder->names, hash, fl_name_match, name);
+    if(interned == NULL)
     {
-        free(flf->name);
-        free(flf->tth);
-        if(flf->dir)
-            fl_free_dir(flf->dir);
-        free(flf);
+        interned = arena_strdup(builder->root->arena, name);
+        htable_insert(&builder->names, interned);
     }
+    return interned;
+}
+
+/* Adds a subdirectory to parent, and returns it. */
+fl_dir_t *fl_builder_add_directory(fl_builder_t *builder, fl_dir_t *parent,
+        const char *name)
+{
+    arena_t *arena = parent->arena;
+
+    fl_dir_t *dir = arena_calloc(arena, sizeof(fl_dir_t));
+    TAILQ_INIT(&dir->files);
+    dir->parent = parent;
+    dir->name = fl_builder_intern(builder, name);
+    dir->arena = arena;
+
+    fl_file_t *f = arena_calloc(arena, sizeof(fl_file_t));
+    f->name = dir->name;
+    f->type = SHARE_TYPE_DIRECTORY;
+    f->dir = dir;
+
+    TAILQ_INSERT_TAIL(&parent->files, f, link);
+    parent->nfiles++;
+
+    return dir;
+}
+
+fl_file_t *fl_builder_add_file(fl_builder_t *builder, fl_dir_t *dir,
+        const char *name, uint64_t size, const char *tth)
+{
+    fl_file_t *f = arena_calloc(dir->arena, sizeof(fl_file_t));
+    f->name = fl_builder_intern(builder, name);
+    f->type = share_filetype(name);
+    f->size = size;
+    f->has_tth = (tth && tth_from_base32(&f->tth, tth) == 0);
+
+    TAILQ_INSERT_TAIL(&dir->files, f, link);
+    dir->nfiles++;
+    dir->size += size;
+
+    return f;
 }
 
+/* Frees a whole list, given its root. */
 void fl_free_dir(fl_dir_t *dir)
 {
     if(dir)
     {
-        fl_file_t *f, *next;
-        for(f = TAILQ_FIRST(&dir->files); f; f = next)
-        {
-            next = TAILQ_NEXT(f, link);
-            TAILQ_REMOVE(&dir->files, f, link);
-            fl_free_file(f);
-        }
-        free(dir->path);
-        free(dir);
+        return_if_fail(dir->parent == NULL);
+
+        arena_t *arena = dir->arena;
+        arena_free(arena);
+        free(arena);
     }
 }
 
+/* Returns the directory with the backslash separated path below root. */
 fl_dir_t *fl_find_directory(fl_dir_t *root, const char *directory)
 {
     assert(root);
-    assert(root->path);
-
-    if(strcmp(root->path, directory) == 0)
-        return root;
+    assert(directory);
 
-    fl_file_t *file;
-    TAILQ_FOREACH(file, &root->files, link)
+    fl_dir_t *dir = root;
+    while(*directory)
     {
-        if(file->dir &&
-           strncmp(file->dir->path, directory, strlen(file->dir->path)) == 0)
+        size_t len = strcspn(directory, "\\");
+
+        fl_file_t *file;
+        TAILQ_FOREACH(file, &dir->files, link)
         {
-            if(strcmp(file->dir->path, directory) == 0)
-                return file->dir;
-            fl_dir_t *found_dir = fl_find_directory(file->dir, directory);
-            if(found_dir)
-                return found_dir;
-            /* else keep looking */
+            if(file->dir && strncmp(file->name, directory, len) == 0 &&
+               file->name[len] == 0)
+                break;
         }
+        if(file == NULL)
+            return NULL;
+
+        dir = file->dir;
+        directory += len;
+        if(*directory)
+            directory++;
     }
 
+    return dir;
+}
+
+/* Writes the path of name in dir, or of dir itself if name is NULL, to
+ * buf. Returns the length of the path. Nothing is written unless buf is
+ * larger than that.
+ */
+size_t fl_dir_path(const fl_dir_t *dir, const char *name,
+        char *buf, size_t size)
+{
+    size_t namelen = name ? strlen(name) : 0;
+    size_t len = name ? namelen + 1 : 0;
+
+    const fl_dir_t *d;
+    for(d = dir; d->parent; d = d->parent)
+        len += strlen(d->name) + (d->parent->parent ? 1 : 0);
+
+    if(buf == NULL || len >= size)
+        return len;
+
+    /* fill in from the end */
+    char *p = buf + len;
+    *p = 0;
+    if(name)
+    {
+        p -= namelen;
+        memcpy(p, name, namelen);
+        *--p = '\\';
+    }
+    for(d = dir; d->parent; d = d->parent)
+    {
+        size_t dlen = strlen(d->name);
+        p -= dlen;
+        memcpy(p, d->name, dlen);
+        if(d->parent->parent)
+            *--p = '\\';
+    }
+
+    return len;
+}
+
+char *fl_dir_path_dup(const fl_dir_t *dir, const char *name)
+{
+    size_t len = fl_dir_path(dir, name, NULL, 0);
+    char *path = malloc(len + 1);
+    fl_dir_path(dir, name, path, len + 1);
+    return path;
+}
+
+/* Returns the TTH of the file in base32 in buf, which must hold
+ * TTH_BASE32_LEN + 1 bytes, or NULL if it has none.
+ */
+const char *fl_file_tth(const fl_file_t *file, char *buf)
+{
+    if(file->has_tth)
+        return tth_to_base32(&file->tth, buf);
     return NULL;
 }
 
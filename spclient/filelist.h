@@ -19,23 +19,34 @@
 
 #include "sys_queue.h"
 
+#include <stdbool.h>
 #include <stdio.h>
 
+#include "arena.h"
+#include "htable.h"
+#include "tth.h"
 #include "xml.h"
 #include "util.h"
 #include "xerr.h"
 
+/* A parsed filelist. All directories, files and names of a list are
+ * allocated from an arena owned by the root directory, and freed together
+ * by fl_free_dir(). Names are interned while parsing, so a name repeated
+ * in many directories is stored once. Directories keep their name and
+ * their parent instead of a full path; fl_dir_path() builds the path.
+ */
+
 struct fl_file;
 
 typedef struct fl_dir fl_dir_t;
 struct fl_dir
 {
-    LIST_ENTRY(fl_dir) link;
-
     TAILQ_HEAD(fl_file_list, fl_file) files;
-    char *path;
+    fl_dir_t *parent; /* NULL for the root */
+    const char *name; /* "" for the root */
     unsigned nfiles;
     uint64_t size;
+    arena_t *arena;
 };
 
 typedef struct fl_file fl_file_t;
@@ -43,14 +54,30 @@ struct fl_file
 {
     TAILQ_ENTRY(fl_file) link;
     
-    char *name;
+    const char *name;
     share_type_t type;
+    bool has_tth;
     uint64_t size;
-    char *tth;
+    tth_t tth;
+
+    fl_dir_t *dir; /* for directories */
+};
 
-    fl_dir_t *dir;
+/* State of a parser building a list. */
+typedef struct fl_builder fl_builder_t;
+struct fl_builder
+{
+    fl_dir_t *root;
+    htable_t names; /* interned names */
 };
 
+void fl_builder_init(fl_builder_t *builder);
+void fl_builder_done(fl_builder_t *builder);
+fl_dir_t *fl_builder_add_directory(fl_builder_t *builder, fl_dir_t *parent,
+        const char *name);
+fl_file_t *fl_builder_add_file(fl_builder_t *builder, fl_dir_t *dir,
+        const char *name, uint64_t size, const char *tth);
+
 fl_dir_t *fl_parse(const char *filename, xerr_t **err);
 
 typedef void (*fl_xml_file_callback_t)(const char *path, const char *tth,
@@ -59,8 +86,17 @@ typedef void (*fl_xml_file_callback_t)(const char *path, const char *tth,
 typedef struct fl_xml_ctx fl_xml_ctx_t;
 struct fl_xml_ctx
 {
-    LIST_HEAD(, fl_dir) dir_stack;
+    fl_builder_t builder;
     fl_dir_t *root;
+    fl_dir_t *curdir;
+    unsigned nskipped; /* open directories without a name */
+
+    /* Path of the current directory, when files are passed to the
+     * callback instead of building a list. */
+    char *path;
+    size_t pathlen;
+    size_t pathsize;
+
     FILE *fp;
     void *user_data;
     fl_xml_file_callback_t file_callback;
@@ -77,6 +113,10 @@ fl_dir_t *fl_parse_dclst(const char *filename);
 void fl_sort_recursive(fl_dir_t *dir);
 void fl_free_dir(fl_dir_t *dir);
 fl_dir_t *fl_find_directory(fl_dir_t *root, const char *directory);
+size_t fl_dir_path(const fl_dir_t *dir, const char *name,
+        char *buf, size_t size);
+char *fl_dir_path_dup(const fl_dir_t *dir, const char *name);
+const char *fl_file_tth(const fl_file_t *file, char *buf);
 
 #endif
 
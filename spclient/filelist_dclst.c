@@ -41,13 +41,9 @@ static char *fl_dclst_read_line(FILE *fp)
     return line;
 }
 
-static fl_dir_t *fl_parse_dclst_recursive(FILE *fp, char **saved,
-        int level, char *path)
+static void fl_parse_dclst_recursive(FILE *fp, char **saved,
+        int level, fl_builder_t *builder, fl_dir_t *dir)
 {
-    fl_dir_t *dir = calloc(1, sizeof(fl_dir_t));
-    TAILQ_INIT(&dir->files);
-    dir->path = strdup(path ? path : "");
-
     while (1) {
         char *line = 0;
         if (saved && *saved) {
@@ -75,41 +71,22 @@ static fl_dir_t *fl_parse_dclst_recursive(FILE *fp, char **saved,
 
         char *filename = line + tabs;
 
-        fl_file_t *file = calloc(1, sizeof(fl_file_t));
-        file->name = xstrdup(filename);
-
         if (pipe) {
             /* regular file */
-            file->type = share_filetype(filename);
-            file->size = strtoull(pipe + 1, NULL, 10);
-            dir->size += file->size;
+            fl_builder_add_file(builder, dir, filename,
+                    strtoull(pipe + 1, NULL, 10), NULL);
         }
         else {
             /* directory */
-            file->type = SHARE_TYPE_DIRECTORY;
-
-            char *newpath;
-            if (path) {
-                int num_returned_bytes = asprintf(&newpath, "%s\\%s", path, filename);
-                if (num_returned_bytes == -1)
-                    DEBUG("asprintf did not return anything");
-            }
-            else
-                newpath = xstrdup(filename);
-
-            file->dir = fl_parse_dclst_recursive(fp, saved, level + 1, newpath);
-            free(newpath);
-            dir->nfiles += file->dir->nfiles;
-            dir->size += file->dir->size;
+            fl_dir_t *subdir = fl_builder_add_directory(builder, dir,
+                    filename);
+            fl_parse_dclst_recursive(fp, saved, level + 1, builder, subdir);
+            dir->nfiles += subdir->nfiles;
+            dir->size += subdir->size;
         }
 
-        dir->nfiles++;
-        TAILQ_INSERT_TAIL(&dir->files, file, link);
-
         free(line);
     }
-
-    return dir;
 }
 
 fl_dir_t *fl_parse_dclst(const char *filename)
@@ -120,11 +97,16 @@ fl_dir_t *fl_parse_dclst(const char *filename)
         INFO("failed to open %s: %s", filename, strerror(errno));
         return NULL;
     }
+
+    fl_builder_t builder;
+    fl_builder_init(&builder);
+
     char *saved = 0;
-    fl_dir_t *root = fl_parse_dclst_recursive(fp, &saved, 0, NULL);
+    fl_parse_dclst_recursive(fp, &saved, 0, &builder, builder.root);
     fclose(fp);
+    fl_builder_done(&builder);
 
-    return root;
+    return builder.root;
 }
 
 #ifdef TEST
@@ -140,6 +122,9 @@ int main(void)
     fl_dir_t *root = fl_find_directory(fl, "spclient\\CVS");
     fail_unless(root);
     fail_unless(root->nfiles == 3);
+    char *path = fl_dir_path_dup(root, NULL);
+    fail_unless(strcmp(path, "spclient\\CVS") == 0);
+    free(path);
     fl_free_dir(fl);
 
     return 0;
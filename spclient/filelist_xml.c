@@ -15,6 +15,7 @@
  */
 
 #include <assert.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 
@@ -22,18 +23,35 @@
 #include "log.h"
 #include "xstr.h"
 
+/* Appends a name to the path of the current directory. */
+static void fl_xml_path_push(fl_xml_ctx_t *ctx, const char *name,
+        bool separator)
+{
+    size_t len = strlen(name);
+    if(ctx->pathlen + len + 2 > ctx->pathsize)
+    {
+        ctx->pathsize = 2 * (ctx->pathlen + len + 2);
+        ctx->path = realloc(ctx->path, ctx->pathsize);
+    }
+
+    if(separator)
+        ctx->path[ctx->pathlen++] = '\\';
+    memcpy(ctx->path + ctx->pathlen, name, len + 1);
+    ctx->pathlen += len;
+}
+
+static void fl_xml_path_truncate(fl_xml_ctx_t *ctx, size_t len)
+{
+    ctx->pathlen = len;
+    ctx->path[len] = 0;
+}
+
 static void fl_xml_parse_start_tag(void *user_data,
         const char *el, const char **attr)
 {
     fl_xml_ctx_t *ctx = user_data;
     assert(ctx);
 
-    /* the current directory is at the top of the stack */
-    fl_dir_t *curdir = LIST_FIRST(&ctx->dir_stack);
-    assert(curdir);
-    
-    int num_returned_bytes;
-
     if (strcasecmp(el, "Directory") == 0) {
         int i;
         const char *dirname = 0;
@@ -44,33 +62,29 @@ static void fl_xml_parse_start_tag(void *user_data,
             }
         }
 
-        if (dirname == 0)
+        if (dirname == 0) {
             WARNING("Missing Name attribute in Directory tag");
+            ctx->nskipped++;
+        }
+        else if (ctx->nskipped) {
+            /* inside a skipped directory */
+            ctx->nskipped++;
+        }
+        else if (ctx->file_callback) {
+            fl_xml_path_push(ctx, dirname, ctx->pathlen > 0);
+        }
         else {
-            fl_dir_t *dir = calloc(1, sizeof(fl_dir_t));
-            TAILQ_INIT(&dir->files);
-            int num_returned_bytes = asprintf(&dir->path, "%s%s%s", curdir->path, *curdir->path ? "\\" : "", dirname);
-            if (num_returned_bytes == -1)
-                DEBUG("asprintf did not return anything");
-
-            if (ctx->file_callback == NULL) {
-                fl_file_t *f = calloc(1, sizeof(fl_file_t));
-                f->name = strdup(dirname);
-                f->type = SHARE_TYPE_DIRECTORY;
-                f->dir = dir;
-
-                TAILQ_INSERT_TAIL(&curdir->files, f, link);
-                curdir->nfiles++;
-            }
-
-            /* push the new directory on the stack */
-            LIST_INSERT_HEAD(&ctx->dir_stack, dir, link);
+            ctx->curdir = fl_builder_add_directory(&ctx->builder,
+                    ctx->curdir, dirname);
         }
     }
     else if (strcasecmp(el, "File") == 0) {
         const char *name = 0, *tth = 0;
         uint64_t size = 0;
 
+        if (ctx->nskipped)
+            return;
+
         int i;
         for (i = 0; attr && attr[i]; i += 2) {
             if(strcmp(attr[i], "Name") == 0)
@@ -83,28 +97,17 @@ static void fl_xml_parse_start_tag(void *user_data,
 
         if (ctx->file_callback) {
             if (name && tth) {
-                char *path = 0;
-                num_returned_bytes = asprintf(&path, "%s\\%s", curdir->path, name);
-                if (num_returned_bytes == -1)
-                    DEBUG("asprintf did not return anything");
-                ctx->file_callback(path, tth, size, ctx->user_data);
-                free(path);
+                size_t dirlen = ctx->pathlen;
+                fl_xml_path_push(ctx, name, true);
+                ctx->file_callback(ctx->path, tth, size, ctx->user_data);
+                fl_xml_path_truncate(ctx, dirlen);
             }
         }
-        else {
+        else if (name) {
 	    /* If no callback wants to handle the file, we collect
 	     * all files in a list to be processed later.
 	     */
-            fl_file_t *f = calloc(1, sizeof(fl_file_t));
-            f->name = strdup(name);
-            f->type = share_filetype(name);
-            f->size = size;
-            f->tth = xstrdup(tth);
-
-            TAILQ_INSERT_TAIL(&curdir->files, f, link);
-
-            curdir->nfiles++;
-            curdir->size += f->size;
+            fl_builder_add_file(&ctx->builder, ctx->curdir, name, size, tth);
         }
     }
 }
@@ -113,24 +116,25 @@ static void fl_xml_parse_end_tag(void *user_data, const char *el)
 {
     fl_xml_ctx_t *ctx = user_data;
     assert(ctx);
-    assert(LIST_FIRST(&ctx->dir_stack) != NULL);
 
     if(strcasecmp(el, "Directory") == 0)
     {
-        /* pop the current directory off the stack */
-        fl_dir_t *curdir = LIST_FIRST(&ctx->dir_stack);
-        LIST_REMOVE(curdir, link);
-
-        if(ctx->file_callback == NULL)
+        if(ctx->nskipped)
+        {
+            ctx->nskipped--;
+        }
+        else if(ctx->file_callback)
         {
-            fl_dir_t *dir = LIST_FIRST(&ctx->dir_stack);
-            dir->nfiles += curdir->nfiles;
-            dir->size += curdir->size;
+            char *sep = strrchr(ctx->path, '\\');
+            fl_xml_path_truncate(ctx, sep ? sep - ctx->path : 0);
         }
-        else
+        else if(ctx->curdir->parent)
         {
-            free(curdir->path);
-            free(curdir);
+            /* go back up to the parent directory */
+            fl_dir_t *dir = ctx->curdir->parent;
+            dir->nfiles += ctx->curdir->nfiles;
+            dir->size += ctx->curdir->size;
+            ctx->curdir = dir;
         }
     }
 }
@@ -140,6 +144,10 @@ int fl_parse_xml_chunk(fl_xml_ctx_t *ctx)
     return xml_parse_chunk(ctx->xml, NULL);
 }
 
+/* Prepares parsing a filelist in chunks. If file_callback is set, it is
+ * called with the path of each file and no list is built; otherwise the
+ * list is available in ctx->root.
+ */
 fl_xml_ctx_t *fl_xml_prepare_file(const char *filename,
         fl_xml_file_callback_t file_callback, void *user_data)
 {
@@ -148,16 +156,20 @@ fl_xml_ctx_t *fl_xml_prepare_file(const char *filename,
     FILE *fp = fopen(filename, "r");
     return_val_if_fail(fp, NULL);
 
-    fl_dir_t *root = calloc(1, sizeof(fl_dir_t));
-    TAILQ_INIT(&root->files);
-    root->path = strdup("");
-
     fl_xml_ctx_t *ctx = calloc(1, sizeof(fl_xml_ctx_t));
 
-    LIST_INIT(&ctx->dir_stack);
-    LIST_INSERT_HEAD(&ctx->dir_stack, root, link);
+    if(file_callback)
+    {
+        ctx->pathsize = 256;
+        ctx->path = malloc(ctx->pathsize);
+        fl_xml_path_truncate(ctx, 0);
+    }
+    else
+    {
+        fl_builder_init(&ctx->builder);
+        ctx->root = ctx->curdir = ctx->builder.root;
+    }
 
-    ctx->root = root;
     ctx->fp = fp;
     ctx->user_data = user_data;
     ctx->file_callback = file_callback;
@@ -168,12 +180,16 @@ fl_xml_ctx_t *fl_xml_prepare_file(const char *filename,
     return ctx;
 }
 
+/* Frees the parser. The list in ctx->root is kept. */
 void fl_xml_free_context(fl_xml_ctx_t *ctx)
 {
     return_if_fail(ctx);
 
     xml_ctx_free(ctx->xml);
     fclose(ctx->fp);
+    if(ctx->file_callback == NULL)
+        fl_builder_done(&ctx->builder);
+    free(ctx->path);
     free(ctx);
 }
 
@@ -197,6 +213,21 @@ fl_dir_t *fl_parse_xml(const char *filename)
 
 #include "unit_test.h"
 
+static int ncallbacks = 0;
+
+static void file_callback(const char *path, const char *tth,
+        uint64_t size, void *user_data)
+{
+    if(ncallbacks == 0)
+    {
+        fail_unless(strcmp(path, "spclient\\Makefile.am") == 0);
+        fail_unless(size == 1370);
+    }
+    else if(strcmp(tth, "BWPCGVUWNUBNPRJGI4LPOA2VXZAOCLPHATGMQEY") == 0)
+        fail_unless(strcmp(path, "spclient\\CVS\\Entries") == 0);
+    ncallbacks++;
+}
+
 int main(void)
 {
     sp_log_set_level("debug");
@@ -208,6 +239,29 @@ int main(void)
     fl_dir_t *root = fl_find_directory(fl, "spclient\\CVS - copy");
     fail_unless(root);
     fail_unless(root->nfiles == 3);
+    fail_unless(fl_find_directory(fl, "spclient\\CVS - cop") == NULL);
+    fail_unless(fl_find_directory(fl, "") == fl);
+
+    char path[64];
+    fail_unless(fl_dir_path(root, NULL, path, sizeof(path)) == 19);
+    fail_unless(strcmp(path, "spclient\\CVS - copy") == 0);
+    fail_unless(fl_dir_path(root, "Entries", path, 10) == 27);
+    char *p = fl_dir_path_dup(root, "Entries");
+    fail_unless(strcmp(p, "spclient\\CVS - copy\\Entries") == 0);
+    free(p);
+
+    /* TTHs are kept in binary, names are shared */
+    fl_dir_t *cvs = fl_find_directory(fl, "spclient\\CVS");
+    fail_unless(cvs);
+    fl_file_t *f1 = TAILQ_LAST(&cvs->files, fl_file_list);
+    fl_file_t *f2 = TAILQ_LAST(&root->files, fl_file_list);
+    fail_unless(strcmp(f1->name, "Entries") == 0);
+    fail_unless(f1->name == f2->name);
+    char tth[TTH_BASE32_LEN + 1];
+    fail_unless(f1->has_tth);
+    fail_unless(strcmp(fl_file_tth(f1, tth),
+                "BWPCGVUWNUBNPRJGI4LPOA2VXZAOCLPHATGMQEY") == 0);
+    fail_unless(!tth_equal(&f1->tth, &f2->tth));
     fl_free_dir(fl);
 
     fl = fl_parse_xml("fl_test3-invalid-utf8.xml");
@@ -216,6 +270,16 @@ int main(void)
     fail_unless(fl->size == 612026);
     fl_free_dir(fl);
 
+    /* files can be passed to a callback without building the list */
+    fl_xml_ctx_t *ctx = fl_xml_prepare_file("fl_test1.xml",
+            file_callback, NULL);
+    fail_unless(ctx);
+    while(fl_parse_xml_chunk(ctx) == 0)
+        ;
+    fail_unless(ctx->root == NULL);
+    fail_unless(ncallbacks == 37);
+    fl_xml_free_context(ctx);
+
     return 0;
 }
 
@@ -132,14 +132,13 @@ int sp_in_event(int fd, short why, void *data)
 
     while(1)
     {
-        char *cmd = io_evbuffer_readline(sp->input);
+        char *cmd = io_line_reader_next(&sp->reader, sp->input);
         if(cmd == NULL)
         {
             break;
         }
-        print_command(cmd, "<- (fd %d)", fd);
+        print_command(SP_TRACE_UI, cmd, "<- (fd %d)", fd);
         sp_dispatch_command(cmd, "$", 1, sp);
-        free(cmd);
     }
 
     return 0;
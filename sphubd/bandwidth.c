@@ -0,0 +1,346 @@
+/*
+ * Copyright (c) 2007 Martin Hedenfalk <martin@bzero.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Bandwidth limits for file transfers. Upload and download rates are
+ * limited by token buckets: one in total, one per hub and one per client
+ * connection, each with its own rate (0 = unlimited). A transfer may send
+ * or receive as much as the emptiest bucket allows.
+ *
+ * Only file data is limited. Commands, and all traffic with the hubs, go
+ * out as before, so the hub connections get through even when transfers
+ * use all the bandwidth.
+ *
+ * Transfers out of bandwidth wait to be retried from a timer. Downloads
+ * stop reading from their socket while waiting.
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <event.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "sys_queue.h"
+
+#include "bandwidth.h"
+#include "client.h"
+#include "globals.h"
+#include "log.h"
+#include "ui.h"
+
+static struct bw_bucket bw_total[2];
+static uint64_t bw_nbytes[2];   /* transferred since the last stats */
+static struct timeval bw_last_stats;
+
+static LIST_HEAD(, cc) bw_waiting_head = LIST_HEAD_INITIALIZER(bw_waiting_head);
+static struct event bw_timer;
+static bool bw_timer_scheduled = false;
+
+static unsigned bw_total_rate(enum bw_direction dir)
+{
+    return dir == BW_UPLOAD ? global_upload_rate : global_download_rate;
+}
+
+static unsigned bw_connection_rate(enum bw_direction dir)
+{
+    return dir == BW_UPLOAD ? global_connection_upload_rate :
+        global_connection_download_rate;
+}
+
+/* Refills the bucket for the time passed. Returns the number of bytes
+ * available, or SIZE_MAX if unlimited. */
+static size_t bw_refill(struct bw_bucket *b, unsigned rate,
+        const struct timeval *now)
+{
+    if(rate == 0)
+    {
+        b->limited = false;
+        return SIZE_MAX;
+    }
+
+    double burst = rate * BW_BURST_MSEC / 1000.0;
+    if(burst < 1)
+        burst = 1;
+
+    if(!b->limited)
+    {
+        /* just limited, start with a full bucket */
+        b->tokens = burst;
+        b->limited = true;
+    }
+    else
+    {
+        double elapsed = (now->tv_sec - b->last_refill.tv_sec) +
+            (now->tv_usec - b->last_refill.tv_usec) / 1000000.0;
+        if(elapsed > 0)
+            b->tokens += elapsed * rate;
+        if(b->tokens > burst)
+            b->tokens = burst;
+    }
+    b->last_refill = *now;
+
+    return b->tokens < 1 ? 0 : (size_t)b->tokens;
+}
+
+/* Returns how many of <wanted> bytes the connection may transfer now. */
+size_t bw_allowance(cc_t *cc, enum bw_direction dir, size_t wanted)
+{
+    return_val_if_fail(cc, 0);
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+
+    size_t avail = bw_refill(&bw_total[dir], bw_total_rate(dir), &now);
+    if(wanted > avail)
+        wanted = avail;
+
+    if(cc->hub)
+    {
+        avail = bw_refill(&cc->hub->bw[dir], cc->hub->bw_rate[dir], &now);
+        if(wanted > avail)
+            wanted = avail;
+    }
+
+    avail = bw_refill(&cc->bw[dir], bw_connection_rate(dir), &now);
+    if(wanted > avail)
+        wanted = avail;
+
+    return wanted;
+}
+
+/* Takes <nbytes> transferred by the connection from its buckets. */
+void bw_consume(cc_t *cc, enum bw_direction dir, size_t nbytes)
+{
+    return_if_fail(cc);
+
+    bw_nbytes[dir] += nbytes;
+
+    if(bw_total[dir].limited)
+        bw_total[dir].tokens -= nbytes;
+    if(cc->hub && cc->hub->bw[dir].limited)
+        cc->hub->bw[dir].tokens -= nbytes;
+    if(cc->bw[dir].limited)
+        cc->bw[dir].tokens -= nbytes;
+}
+
+static void bw_timer_event(int fd, short why, void *user_data)
+{
+    bw_timer_scheduled = false;
+
+    /* Connections waiting again after being woken up wait for the next
+     * tick, so take the ones waiting now off the list first. They are
+     * still marked as waiting, so a connection closed while another one
+     * is woken up is removed from this list. */
+    LIST_HEAD(, cc) wake_head = LIST_HEAD_INITIALIZER(wake_head);
+    cc_t *cc;
+    while((cc = LIST_FIRST(&bw_waiting_head)) != NULL)
+    {
+        LIST_REMOVE(cc, bw_link);
+        LIST_INSERT_HEAD(&wake_head, cc, bw_link);
+    }
+
+    while((cc = LIST_FIRST(&wake_head)) != NULL)
+    {
+        LIST_REMOVE(cc, bw_link);
+        cc->bw_waiting = false;
+
+        if(cc->state != CC_STATE_BUSY)
+            bufferevent_enable(cc->bufev, EV_READ);
+        else if(cc->direction == CC_DIR_DOWNLOAD)
+        {
+            bufferevent_enable(cc->bufev, EV_READ);
+            cc_download_read(cc);
+        }
+        else if(cc->direction == CC_DIR_UPLOAD)
+            cc_out_event(cc->bufev, cc);
+    }
+
+    if(!LIST_EMPTY(&bw_waiting_head))
+    {
+        struct timeval tv = {.tv_sec = 0, .tv_usec = BW_TICK_MSEC * 1000};
+        evtimer_add(&bw_timer, &tv);
+        bw_timer_scheduled = true;
+    }
+}
+
+/* Retries the transfer of the connection when more bandwidth is
+ * available. */
+void bw_wait(cc_t *cc, enum bw_direction dir)
+{
+    return_if_fail(cc);
+
+    if(dir == BW_DOWNLOAD)
+    {
+        /* leave the data in the socket buffer, this slows the sender */
+        bufferevent_disable(cc->bufev, EV_READ);
+    }
+
+    if(!cc->bw_waiting)
+    {
+        LIST_INSERT_HEAD(&bw_waiting_head, cc, bw_link);
+        cc->bw_waiting = true;
+    }
+
+    if(!bw_timer_scheduled)
+    {
+        struct timeval tv = {.tv_sec = 0, .tv_usec = BW_TICK_MSEC * 1000};
+        evtimer_set(&bw_timer, bw_timer_event, NULL);
+        evtimer_add(&bw_timer, &tv);
+        bw_timer_scheduled = true;
+    }
+}
+
+/* Called when the connection is closed. */
+void bw_cancel(cc_t *cc)
+{
+    return_if_fail(cc);
+
+    if(cc->bw_waiting)
+    {
+        LIST_REMOVE(cc, bw_link);
+        cc->bw_waiting = false;
+    }
+}
+
+/* Sends the transfer rates since the last call, and the limits, to the
+ * UI. */
+void bw_send_stats(void)
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+
+    double elapsed = (now.tv_sec - bw_last_stats.tv_sec) +
+        (now.tv_usec - bw_last_stats.tv_usec) / 1000000.0;
+    bw_last_stats = now;
+    if(elapsed <= 0)
+        return;
+
+    unsigned upload_rate = bw_nbytes[BW_UPLOAD] / elapsed;
+    unsigned download_rate = bw_nbytes[BW_DOWNLOAD] / elapsed;
+    bw_nbytes[BW_UPLOAD] = bw_nbytes[BW_DOWNLOAD] = 0;
+
+    ui_send_bandwidth_stats(NULL, upload_rate, global_upload_rate,
+            download_rate, global_download_rate);
+}
+
+#ifdef TEST
+
+#include <unistd.h>
+
+#include "unit_test.h"
+
+static int nwakeups = 0;
+
+void cc_download_read(cc_t *cc)
+{
+    nwakeups++;
+}
+
+void cc_out_event(struct bufferevent *bufev, void *data)
+{
+    cc_t *cc = data;
+    nwakeups++;
+
+    /* still out of bandwidth */
+    if(bw_allowance(cc, BW_UPLOAD, 1) == 0)
+        bw_wait(cc, BW_UPLOAD);
+}
+
+int ui_send_bandwidth_stats(ui_t *ui, unsigned int upload_rate,
+        unsigned int upload_limit, unsigned int download_rate,
+        unsigned int download_limit)
+{
+    return 0;
+}
+
+int main(void)
+{
+    event_init();
+    sp_log_set_level("warning");
+
+    hub_t hub, hub2;
+    memset(&hub, 0, sizeof(hub));
+    memset(&hub2, 0, sizeof(hub2));
+    cc_t cc1, cc2, cc3;
+    memset(&cc1, 0, sizeof(cc1));
+    memset(&cc2, 0, sizeof(cc2));
+    memset(&cc3, 0, sizeof(cc3));
+    cc1.hub = cc2.hub = &hub;
+    cc3.hub = &hub2;
+    cc1.state = cc2.state = cc3.state = CC_STATE_BUSY;
+    cc1.direction = cc2.direction = cc3.direction = CC_DIR_UPLOAD;
+
+    /* unlimited */
+    fail_unless(bw_allowance(&cc1, BW_UPLOAD, 100000) == 100000);
+
+    /* a full bucket holds BW_BURST_MSEC worth of data */
+    global_upload_rate = 40000;
+    fail_unless(bw_allowance(&cc1, BW_UPLOAD, 100000) == 10000);
+    bw_consume(&cc1, BW_UPLOAD, 10000);
+    fail_unless(bw_allowance(&cc2, BW_UPLOAD, 100000) < 100);
+
+    /* and is refilled at the rate */
+    usleep(100000);
+    size_t n = bw_allowance(&cc2, BW_UPLOAD, 100000);
+    fail_unless(n >= 4000 && n <= 10000);
+    bw_consume(&cc2, BW_UPLOAD, n);
+
+    /* downloads are limited separately */
+    fail_unless(bw_allowance(&cc1, BW_DOWNLOAD, 100000) == 100000);
+
+    /* per hub and per connection limits */
+    global_upload_rate = 0;
+    hub.bw_rate[BW_UPLOAD] = 8000;
+    global_connection_upload_rate = 4000;
+    fail_unless(bw_allowance(&cc1, BW_UPLOAD, 100000) == 1000);
+    bw_consume(&cc1, BW_UPLOAD, 1000);
+    fail_unless(bw_allowance(&cc1, BW_UPLOAD, 100000) < 10);
+    fail_unless(bw_allowance(&cc2, BW_UPLOAD, 100000) == 1000);
+    bw_consume(&cc2, BW_UPLOAD, 1000);
+    fail_unless(bw_allowance(&cc2, BW_UPLOAD, 100000) < 10);
+
+    /* each hub has its own bucket and rate */
+    fail_unless(bw_allowance(&cc3, BW_UPLOAD, 100000) == 1000);
+    global_connection_upload_rate = 0;
+    hub2.bw_rate[BW_UPLOAD] = 16000;
+    fail_unless(bw_allowance(&cc3, BW_UPLOAD, 100000) == 4000);
+    fail_unless(bw_allowance(&cc2, BW_UPLOAD, 100000) < 2000);
+    bw_consume(&cc3, BW_UPLOAD, 4000);
+    global_connection_upload_rate = 4000;
+
+    /* waiting transfers are retried until there is bandwidth, all of
+     * them in the same tick */
+    bw_wait(&cc1, BW_UPLOAD);
+    bw_wait(&cc1, BW_UPLOAD);
+    bw_wait(&cc3, BW_UPLOAD);
+    fail_unless(nwakeups == 0);
+    event_loop(EVLOOP_ONCE);
+    fail_unless(nwakeups == 2);
+    fail_unless(!cc1.bw_waiting);
+    fail_unless(bw_allowance(&cc1, BW_UPLOAD, 100000) > 0);
+
+    /* closed connections aren't woken up */
+    global_connection_upload_rate = 0;
+    bw_wait(&cc2, BW_UPLOAD);
+    bw_cancel(&cc2);
+    fail_unless(LIST_EMPTY(&bw_waiting_head));
+
+    return 0;
+}
+
+#endif
+
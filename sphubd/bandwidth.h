@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2007 Martin Hedenfalk <martin@bzero.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _bandwidth_h_
+#define _bandwidth_h_
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <stdbool.h>
+
+/* transfers waiting for bandwidth are retried this often */
+#define BW_TICK_MSEC 50
+
+/* a bucket holds at most this much of its rate */
+#define BW_BURST_MSEC 250
+
+enum bw_direction
+{
+    BW_UPLOAD,
+    BW_DOWNLOAD
+};
+
+struct bw_bucket
+{
+    double tokens;
+    struct timeval last_refill;
+    bool limited;
+};
+
+struct cc;
+
+size_t bw_allowance(struct cc *cc, enum bw_direction dir, size_t wanted);
+void bw_consume(struct cc *cc, enum bw_direction dir, size_t nbytes);
+void bw_wait(struct cc *cc, enum bw_direction dir);
+void bw_cancel(struct cc *cc);
+void bw_send_stats(void);
+
+#endif
+
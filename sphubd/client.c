@@ -54,6 +54,7 @@ cc_t *cc_new(int fd, hub_t *hub)
     cc->fd = fd;
     cc->last_activity = time(0);
     cc->local_fd = -1;
+    cc->iconv = iconv_cache_new();
 
     return cc;
 }
@@ -109,22 +110,28 @@ void cc_free(cc_t *cc)
             queue_free(cc->current_queue);
         }
 
+        cc_download_free_hash(cc);
+        free(cc->leafdata);
         free(cc->local_filename);
+        free(cc->write_buf);
         free(cc->nick);
+        iconv_cache_free(cc->iconv);
         free(cc);
     }
 }
 
 void cc_cancel_transfer(const char *local_filename)
 {
+    /* a segmented download may use several connections */
     cc_t *cc = cc_find_by_local_filename(local_filename);
-    if(cc)
+    if(cc == NULL)
     {
-        cc_close_connection(cc);
+        DEBUG("didn't find any connection for '%s'", local_filename);
     }
-    else
+    while(cc)
     {
-        DEBUG("didn't find any connection for '%s'", local_filename);
+        cc_close_connection(cc);
+        cc = cc_find_by_local_filename(local_filename);
     }
 }
 
@@ -155,7 +162,7 @@ void cc_cancel_directory_transfers(const char *target_directory)
 
 int cc_send_string(cc_t *cc, const char *string)
 {
-    print_command(string, "-> (fd %i)", cc->fd);
+    print_command(SP_TRACE_PEER, string, "-> (fd %i)", cc->fd);
     cc->last_activity = time(0);
     return bufferevent_write(cc->bufev, (void *)string, strlen(string));
 }
@@ -223,8 +230,18 @@ void cc_close_connection(cc_t *cc)
     if(event_initialized(&cc->handshake_timer_event))
         event_del(&cc->handshake_timer_event);
 
+    if(event_initialized(&cc->upload_event))
+        event_del(&cc->upload_event);
+
+    bw_cancel(cc);
+
     if(cc->local_fd != -1)
+    {
+        /* keep what we got for resuming */
+        if(cc->direction == CC_DIR_DOWNLOAD && cc_download_flush(cc) == 0)
+            cc_download_sync(cc);
         close(cc->local_fd);
+    }
 
     INFO("removing client connection with nick [%s]",
             cc->nick ? cc->nick : "unknown");
@@ -279,22 +296,20 @@ void cc_in_event(struct bufferevent *bufev, void *data)
 
     while(1)
     {
-        char *cmd = io_evbuffer_readline(EVBUFFER_INPUT(bufev));
+        char *cmd = io_line_reader_next(&cc->reader, EVBUFFER_INPUT(bufev));
         if(cmd == NULL)
         {
             break;
         }
-        print_command(cmd, "<- (fd %d)", cc->fd);
+        print_command(SP_TRACE_PEER, cmd, "<- (fd %d)", cc->fd);
         if(strcmp(cmd, "ping") == 0)
         {
             DEBUG("received ping, sending pong");
             cc_send_command_as_is(cc, "pong|");
-            free(cmd);
             return;
         }
 
         int rc = client_execute_command(cc->fd, data, cmd);
-        free(cmd);
         if(rc < 0)
         {
             WARNING("command [%s] returned -1, closing connection on fd %i",
@@ -332,6 +347,10 @@ void cc_out_event(struct bufferevent *bufev, void *data)
         {
             cc_finish_upload(cc);
         }
+        else if(cc->upload_sendfile && cc->local_fd != -1)
+        {
+            cc_upload_sendfile(cc);
+        }
         else
         {
             static char buf[8192];
@@ -342,6 +361,13 @@ void cc_out_event(struct bufferevent *bufev, void *data)
                 nbytes = cc->bytes_to_transfer - cc->bytes_done;
             }
 
+            nbytes = bw_allowance(cc, BW_UPLOAD, nbytes);
+            if(nbytes == 0)
+            {
+                bw_wait(cc, BW_UPLOAD);
+                return;
+            }
+
             ssize_t bytes_read = cc_upload_read(cc, buf, nbytes);
             if(bytes_read == -1)
             {
@@ -352,6 +378,7 @@ void cc_out_event(struct bufferevent *bufev, void *data)
             {
                 bufferevent_write(bufev, buf, bytes_read);
                 cc->bytes_done += bytes_read;
+                bw_consume(cc, BW_UPLOAD, bytes_read);
             }
         }
     }
@@ -551,9 +578,17 @@ static void cc_send_transfer_stats(int fd, short condition, void *data)
 	unsigned bytes_per_sec = cc->bytes_done / (duration ? duration : 1);
 
 	const char *target = NULL;
+	uint64_t offset = cc->offset;
 	if(cc->direction == CC_DIR_DOWNLOAD && cc->current_queue)
 	{
 	    target = cc->current_queue->target_filename;
+
+	    /* report progress of the whole target, not this segment */
+	    queue_target_t *qt = NULL;
+	    if(cc->current_queue->segment >= 0)
+		qt = queue_lookup_target(target);
+	    if(qt)
+		offset = queue_segment_bytes_done(qt);
 	}
 	else if(cc->direction == CC_DIR_UPLOAD)
 	{
@@ -562,7 +597,7 @@ static void cc_send_transfer_stats(int fd, short condition, void *data)
 
 	if(target)
 	{
-	    ui_send_transfer_stats(NULL, target, cc->bytes_done + cc->offset,
+	    ui_send_transfer_stats(NULL, target, cc->bytes_done + offset,
 		    cc->filesize, bytes_per_sec);
 	}
 
@@ -575,6 +610,8 @@ static void cc_send_transfer_stats(int fd, short condition, void *data)
 #endif
     }
 
+    bw_send_stats();
+
     /* re-schedule event */
     cc_set_transfer_stats_interval(-1);
 }
@@ -28,13 +28,19 @@
 #include "sys_queue.h"
 #include "hub.h"
 #include "queue.h"
+#include "tigertree.h"
+#include "iconv_string.h"
 #include "io.h"
 #include "ui.h"
 #include "xerr.h"
+#include "bandwidth.h"
 
 /* idle timeout in seconds before a transfer is aborted due to inactivity */
 #define CC_IDLE_TIMEOUT 5*60
 
+/* downloaded data is synced to disk this often */
+#define CC_DOWNLOAD_SYNC_INTERVAL (64*1024*1024)
+
 enum cc_direction {
     CC_DIR_UNKNOWN,
     CC_DIR_DOWNLOAD = 1,
@@ -62,6 +68,7 @@ struct cc
     
     int fd;
     struct bufferevent *bufev;
+    struct io_line_reader reader;
     struct sockaddr_in addr;
 
     /* close connections if handshake takes too long */
@@ -85,6 +92,8 @@ struct cc
     int upload_buf_offset;
     int upload_buf_size;
     int local_fd;
+    bool upload_sendfile; /* send local_fd with io_sendfile() */
+    struct event upload_event; /* socket writable in sendfile mode */
     uint64_t filesize; /* total file size */ /* FIXME: also in current_queue->size */
     uint64_t offset; /* FIXME: also in current_queue->offset */
     uint64_t bytes_to_transfer;
@@ -95,10 +104,21 @@ struct cc
     queue_t *current_queue;
     char *local_filename;
     int fetch_leaves;
+    TT_CONTEXT *tt; /* hash of the data downloaded, NULL if not verified */
+    char *write_buf; /* downloaded data not yet written */
+    size_t write_buf_len;
+    size_t write_buf_size;
+    uint64_t write_offset; /* file offset of write_buf */
+    uint64_t synced_offset; /* resume offset after a crash */
+    iconv_cache_t *iconv; /* converts requests from the hub encoding */
 
     void *leafdata;
     unsigned leafdata_len;
     unsigned leafdata_index;
+
+    struct bw_bucket bw[2]; /* upload and download limits */
+    LIST_ENTRY(cc) bw_link;
+    bool bw_waiting; /* for bandwidth, see bandwidth.c */
 };
 
 cc_t *cc_new(int fd, hub_t *hub);
@@ -136,7 +156,10 @@ int client_execute_command(int fd, void *data, char *cmdstr);
 /* client_download.c
  */
 void cc_download_read(cc_t *cc);
+int cc_download_flush(cc_t *cc);
+int cc_download_sync(cc_t *cc);
 int cc_start_download(cc_t *cc);
+void cc_download_free_hash(cc_t *cc);
 void cc_fl_match_queue(const char *filelist_path, const char *nick);
 
 /* client_upload.c
@@ -146,6 +169,7 @@ int cc_upload_prepare(cc_t *cc, const char *filename,
 int cc_start_upload(cc_t *cc);
 void cc_finish_upload(cc_t *cc);
 ssize_t cc_upload_read(cc_t *cc, void *buf, size_t nbytes);
+void cc_upload_sendfile(cc_t *cc);
 
 #endif
 
@@ -34,7 +34,17 @@ static void
 cc_download_request_failed(cc_t *cc, const char *reason)
 {
 	return_if_fail(cc->current_queue);
-	if(cc->current_queue)
+	if(cc->fetch_leaves == 1)
+	{
+		/* no leaves available, download the segment unverified */
+		INFO("leaves for %s not available from %s: %s",
+			cc->current_queue->target_filename, cc->nick,
+			(reason && reason[0]) ? reason : "unknown reason");
+		cc->fetch_leaves = 2;
+		cc->state = CC_STATE_READY;
+		cc_request_download(cc);
+	}
+	else if(cc->current_queue)
 	{
 		ui_send_status_message(NULL, cc->hub ? cc->hub->address : NULL,
 			"Download request for %s from %s failed: %s",
@@ -115,9 +125,14 @@ static int cc_cmd_Get(void *data, int argc, char **argv)
     }
     *e = 0;
 
-    char *utf8_path = str_convert_to_unescaped_utf8(argv[0], cc->hub->encoding);
+    char *utf8_path = str_legacy_to_utf8_cached(cc->iconv, argv[0],
+            cc->hub->encoding);
     return_val_if_fail(utf8_path, 0);
 
+    char *unescaped = NULL;
+    if(str_need_unescape_unicode(utf8_path))
+        utf8_path = unescaped = str_unescape_unicode(utf8_path);
+
     uint64_t offset = strtoull(e + 1, 0, 10);
     if(offset > 0)
     {
@@ -130,7 +145,7 @@ static int cc_cmd_Get(void *data, int argc, char **argv)
 
     xerr_t *err = 0;
     int rc = cc_upload_prepare(cc, utf8_path, offset, 0, &err);
-    free(utf8_path);
+    free(unescaped);
     if(rc != 0)
     {
         rc = cc_send_command(cc, "$Error %s|", xerr_msg(err));
@@ -171,9 +186,11 @@ static int cc_cmd_ADCGET(void *data, int argc, char **argv)
     if(strcmp(subs->subs[0], "tthl") == 0)
     {
         struct tth_entry *te = NULL;
+        tth_t tth;
         if(str_has_prefix(subs->subs[1], "TTH/"))
         {
-            te = tth_store_lookup(global_tth_store, subs->subs[1] + 4);
+            if(tth_from_base32(&tth, subs->subs[1] + 4) == 0)
+                te = tth_store_lookup(global_tth_store, &tth);
             if(te)
             {
                 /* Found the TTH, check if the file is shared. */
@@ -196,9 +213,12 @@ static int cc_cmd_ADCGET(void *data, int argc, char **argv)
             }
         }
 
-        if(te && tth_store_load_leafdata(global_tth_store, te) == 0)
+        const char *leafdata = NULL;
+        if(te && tth_store_load_leafdata(global_tth_store, te, &leafdata) == 0)
         {
-            cc->leafdata = te->leafdata;
+            /* copy it, the store may be compacted during the upload */
+            cc->leafdata = malloc(te->leafdata_len);
+            memcpy(cc->leafdata, leafdata, te->leafdata_len);
             cc->leafdata_len = te->leafdata_len;
         }
         else
@@ -626,24 +646,7 @@ cc_cmd_MyNick(void *data, int argc, char **argv)
 	return 0;
 }
 
-static cmd_t cc_cmds[] = {
-    {"$MyNick", cc_cmd_MyNick, 1},
-    {"$Lock", cc_cmd_Lock, 2},
-    {"$Supports", cc_cmd_Supports, 1},
-    {"$Direction", cc_cmd_Direction, 2},
-    {"$FileLength", cc_cmd_FileLength, 1},
-    {"$Get", cc_cmd_Get, -1},
-    {"$GetListLen", cc_cmd_GetListLen, 0},
-    {"$Send", cc_cmd_Send, 0},
-    {"$UGetBlock", cc_cmd_UGetBlock, -1},
-    {"$ADCGET", cc_cmd_ADCGET, -1},
-    {"$ADCSND", cc_cmd_ADCSND, -1},
-    {"$Sending", cc_cmd_Sending, 1},
-    {"$Error", cc_cmd_Failed, -1},
-    {"$Failed", cc_cmd_Failed, -1},
-    {"$MaxedOut", cc_cmd_MaxedOut, 0},
-    {0, 0, -1}
-};
+#include "client_cmd_table.h"
 
 int client_execute_command(int fd, void *data, char *cmdstr)
 {
@@ -651,6 +654,6 @@ int client_execute_command(int fd, void *data, char *cmdstr)
     {
         return cc_cmd_Key(data, cmdstr);
     }
-    return cmd_dispatch(cmdstr, " ", 0, cc_cmds, data);
+    return cmd_dispatch(cmdstr, " ", 0, &cc_cmds, data);
 }
 
@@ -28,12 +28,15 @@
 #include <errno.h>
 #include <time.h>
 
+#include "base32.h"
+#include "base64.h"
 #include "log.h"
 #include "globals.h"
 #include "client.h"
 #include "bz2.h"
 #include "he3.h"
 #include "notifications.h"
+#include "tthdb.h"
 #include "xerr.h"
 #include "xstr.h"
 
@@ -53,6 +56,10 @@ cc_send_download_request(cc_t *cc)
     cc->state = CC_STATE_REQUEST;
     cc->last_activity = time(0);
 
+    uint64_t length = queue->size - queue->offset;
+    if(queue->segment >= 0)
+        length = queue->length;
+
     if(cc->has_adcget)
     {
         if(queue->is_filelist)
@@ -69,31 +76,37 @@ cc_send_download_request(cc_t *cc)
                 base = "TTH/";
                 request_filename = queue->tth;
             }
-            /* fetching of TTH leafdata is not enabled, since we're not even
-             * verifying the TTH on downloaded files yet */
-#if 0
-            if(cc->has_tthl && queue->tth && cc->fetch_leaves == 0)
+            /* Segments are verified against the leaves, fetch them first
+             * unless we already have them. */
+            if(queue->segment >= 0 && cc->has_tthl && queue->tth &&
+               cc->fetch_leaves == 0 &&
+               !queue_segment_has_leaves(queue->target_filename))
             {
                 cc->fetch_leaves = 1;
                 return cc_send_command_as_is(cc, "$ADCGET tthl %s%s 0 -1|",
                         base, request_filename);
             }
             else
-#endif
             {
                 return cc_send_command_as_is(cc,
 			"$ADCGET file %s%s %"PRIu64" %"PRIu64"|",
                         base, request_filename,
-                        queue->offset, queue->size - queue->offset);
+                        queue->offset, length);
             }
         }
     }
     else if(cc->has_xmlbzlist && queue->size > 0 && !queue->is_filelist)
     {
         return cc_send_command_as_is(cc, "$UGetBlock %"PRIu64" %"PRIu64" %s|",
-                queue->offset, queue->size - queue->offset,
+                queue->offset, length,
                 queue->source_filename);
     }
+    else if(queue->segment >= 0)
+    {
+        /* $Get always sends the rest of the file */
+        WARNING("%s can't download segments, closing connection", cc->nick);
+        return -1;
+    }
     else
     {
         return cc_send_command(cc, "$Get %s$%"PRIu64"|",
@@ -116,8 +129,6 @@ cc_request_download(cc_t *cc)
             return -1;
         }
 
-        queue->offset = 0ULL;
-
         if (queue->is_directory) {
             if (queue_resolve_directory(cc->nick, queue->source_filename, queue->target_filename, NULL) != 0) {
                 /* Directory was not directly resolvable, but it should be! */
@@ -169,6 +180,12 @@ cc_request_download(cc_t *cc)
                 queue_remove_target(queue->target_filename);
                 free(target);
             }
+            else if (queue->segment >= 0) {
+                /* segments already downloaded are marked as done in the
+                 * queue, the size of the incomplete file tells nothing */
+                free(target);
+                break;
+            }
             else {
                 free(target);
                 num_returned_bytes = asprintf(&target, "%s/%s", global_incomplete_directory, queue->target_filename);
@@ -176,10 +193,23 @@ cc_request_download(cc_t *cc)
                     DEBUG("aasprintf did not return anything");
 
                 int rc = stat(target, &stbuf);
-                free(target);
                 if (rc == 0) {
                     /* file already exists, resume */
                     queue->offset = stbuf.st_size;
+
+                    /* data past the last sync may not have reached the
+                     * disk before a crash */
+                    queue_target_t *qt = queue_lookup_target(queue->target_filename);
+                    if (qt && queue->offset > qt->synced_offset) {
+                        INFO("[%s]: truncating to synced offset %"PRIu64,
+                                queue->target_filename, qt->synced_offset);
+                        if (truncate(target, qt->synced_offset) != 0)
+                            WARNING("truncate: %s", strerror(errno));
+                        queue->offset = qt->synced_offset;
+                    }
+                }
+                free(target);
+                if (rc == 0) {
                     if (queue->offset >= queue->size) {
                         INFO("local file has larger or equal size than remote,"
                                 " can't resume, removing queue");
@@ -225,9 +255,84 @@ cc_request_download(cc_t *cc)
     return 0;
 }
 
+/* Handles a download whose data doesn't match its TTH. The incomplete file
+ * is discarded and the target is downloaded again, see
+ * queue_discard_corrupt().
+ */
+static void cc_download_corrupt(cc_t *cc)
+{
+    queue_t *queue = cc->current_queue;
+
+    WARNING("[%s] from %s doesn't match TTH %s, downloading it again",
+            queue->target_filename, cc->nick, queue->tth);
+    ui_send_status_message(NULL, cc->hub->address,
+            "File '%s' from %s was corrupt, downloading it again",
+            queue->target_filename, cc->nick);
+
+    queue_discard_corrupt(queue, cc->nick, cc->offset != 0ULL);
+}
+
+/* Adds the TTH and leaves of a verified download to the TTH store, with the
+ * inode of the incomplete file, so it isn't hashed again when shared. The
+ * inode is kept when the file is renamed into the download directory; a
+ * file copied to another filesystem is hashed again.
+ */
+static void cc_download_store_tth(queue_t *queue,
+        const unsigned char *leaves, unsigned nleaves)
+{
+    tth_t tth;
+    if(global_tth_store == NULL || queue->tth == NULL ||
+       tth_from_base32(&tth, queue->tth) != 0)
+        return;
+
+    if(tt_leaf_block_size(queue->size, nleaves) == 0)
+    {
+        /* the root is the only leaf */
+        leaves = tth.data;
+        nleaves = 1;
+    }
+
+    char *target;
+    if(asprintf(&target, "%s/%s", global_incomplete_directory,
+                queue->target_filename) == -1)
+        return;
+
+    struct stat stbuf;
+    if(stat(target, &stbuf) != 0)
+    {
+        WARNING("%s: %s", target, strerror(errno));
+        free(target);
+        return;
+    }
+    free(target);
+
+    size_t len = nleaves * TIGERSIZE;
+    size_t enclen = len * 2 + 4;
+    char *leafdata_base64 = malloc(enclen);
+    if(base64_ntop(leaves, len, leafdata_base64, enclen) > 0)
+    {
+        tth_store_add_entry(global_tth_store, &tth, leafdata_base64, 0);
+        tth_store_add_inode(global_tth_store, stbuf.st_ino, stbuf.st_mtime,
+                &tth);
+    }
+    free(leafdata_base64);
+}
+
 void cc_finish_download(cc_t *cc)
 {
     INFO("finished downloading file");
+
+    /* the data must be on disk before the queue says it's done */
+    if(cc_download_flush(cc) != 0 || fsync(cc->local_fd) != 0)
+    {
+        ui_send_status_message(NULL, cc->hub->address,
+                "Unable to save %s: %s",
+                cc->current_queue ? cc->current_queue->target_filename : "",
+                strerror(errno));
+        cc_close_connection(cc);
+        return;
+    }
+
     if(close(cc->local_fd) != 0)
     {
         WARNING("close: %s", strerror(errno));
@@ -236,39 +341,86 @@ void cc_finish_download(cc_t *cc)
 
     return_if_fail(cc->current_queue);
 
-    if(cc->current_queue->is_filelist)
+    if(cc->fetch_leaves == 1)
     {
-	nc_send_filelist_finished_notification(nc_default(),
-	    cc->hub->address,
-	    cc->current_queue->nick,
-	    cc->current_queue->target_filename,
-	    cc->current_queue->auto_matched);
+        /* got the leaves, now request the file data */
+        queue_segment_check_leaves(cc->current_queue->target_filename);
+        cc->fetch_leaves = 2;
     }
-    else if(cc->fetch_leaves != 1)
+    else
     {
-        nc_send_download_finished_notification(nc_default(),
-                cc->current_queue->target_filename);
-        ui_send_download_finished(NULL, cc->current_queue->target_filename);
-    }
+        unsigned char root[TIGERSIZE];
+        unsigned char *leaves = NULL;
+        unsigned nleaves = 0;
+        bool verified = (cc->tt != NULL);
+        if(verified)
+        {
+            tt_digest(cc->tt, root);
+            leaves = cc->tt->leaves;
+            nleaves = cc->tt->leaves_len / TIGERSIZE;
+            cc->tt->leaves = NULL;
+            cc_download_free_hash(cc);
+        }
+
+        /* a segmented target is complete when all segments are, and
+         * verified against the leaves fetched before the segments */
+        bool complete = true;
+        if(cc->current_queue->segment >= 0)
+        {
+            complete = (queue_segment_finish(cc->current_queue,
+                        verified ? root : NULL) == 1);
+            free(leaves);
+            leaves = NULL;
+            nleaves = 0;
+            if(complete)
+            {
+                nleaves = queue_segment_load_leaves(
+                        cc->current_queue->target_filename, &leaves);
+                queue_segment_remove_leaves(
+                        cc->current_queue->target_filename);
+            }
+        }
+        else if(verified)
+        {
+            char *root_base32 = base32_encode(root, TIGERSIZE);
+            if(strcmp(root_base32, cc->current_queue->tth) != 0)
+            {
+                cc_download_corrupt(cc);
+                complete = false;
+            }
+            else
+                DEBUG("[%s] matches TTH", cc->current_queue->target_filename);
+            free(root_base32);
+        }
 
-    if(cc->fetch_leaves != 1)
-    {
         if(cc->current_queue->is_filelist)
         {
+            nc_send_filelist_finished_notification(nc_default(),
+                cc->hub->address,
+                cc->current_queue->nick,
+                cc->current_queue->target_filename,
+                cc->current_queue->auto_matched);
             queue_remove_filelist(cc->current_queue->nick);
         }
-        else
+        else if(complete)
         {
+            if(verified || cc->current_queue->segment >= 0)
+                cc_download_store_tth(cc->current_queue, leaves, nleaves);
+            /* the UI is told when the file is moved, see sphubd.c */
+            nc_send_download_finished_notification(nc_default(),
+                    cc->current_queue->target_filename);
             queue_remove_target(cc->current_queue->target_filename);
         }
+        else if(cc->current_queue->segment >= 0)
+        {
+            queue_set_active(cc->current_queue, 0);
+        }
+
+        free(leaves);
         queue_free(cc->current_queue);
         cc->current_queue = NULL;
         cc->fetch_leaves = 0;
     }
-    else
-    {
-        cc->fetch_leaves = 2;
-    }
 
     cc->state = CC_STATE_READY;
     cc->last_activity = time(0);
@@ -277,22 +429,184 @@ void cc_finish_download(cc_t *cc)
     cc_request_download(cc);
 }
 
-static int cc_download_write(cc_t *cc, char *buf, size_t bytes_read)
+void cc_download_free_hash(cc_t *cc)
+{
+    if(cc->tt)
+    {
+        tt_destroy(cc->tt);
+        free(cc->tt);
+        cc->tt = NULL;
+    }
+}
+
+/* Starts hashing the data downloaded, if the target has a TTH. A segment is
+ * hashed by itself. A resumed download is seeded with the data already in
+ * the incomplete file, which is at most QUEUE_SEGMENT_MIN_SIZE bytes as
+ * larger files are segmented.
+ */
+static void cc_download_init_hash(cc_t *cc, uint64_t offset)
+{
+    queue_t *queue = cc->current_queue;
+
+    cc_download_free_hash(cc);
+    if(cc->fetch_leaves == 1 || queue->is_filelist ||
+       queue->tth == NULL || *queue->tth == 0)
+    {
+        return;
+    }
+
+    /* the leaves of a segment come from the TTHL instead; a whole file
+     * collects them at the same level as sphashd, for the TTH store */
+    cc->tt = malloc(sizeof(TT_CONTEXT));
+    if(queue->segment >= 0)
+    {
+        tt_init(cc->tt, 0);
+        return;
+    }
+    tt_init(cc->tt, tt_calc_block_size(queue->size, 10));
+
+    unsigned char buf[64*1024];
+    uint64_t pos = 0;
+    while(pos < offset)
+    {
+        size_t n = sizeof(buf);
+        if(offset - pos < n)
+            n = offset - pos;
+        ssize_t rc = pread(cc->local_fd, buf, n, pos);
+        if(rc <= 0)
+        {
+            WARNING("[%s]: can't read resumed data (%s), not verified",
+                    queue->target_filename,
+                    rc == 0 ? "unexpected end of file" : strerror(errno));
+            cc_download_free_hash(cc);
+            return;
+        }
+        tt_update(cc->tt, buf, rc);
+        pos += rc;
+    }
+}
+
+static int cc_download_pwrite(cc_t *cc, const char *buf, size_t len)
+{
+    while(len > 0)
+    {
+        ssize_t rc = pwrite(cc->local_fd, buf, len, cc->write_offset);
+        if(rc == -1)
+        {
+            if(errno == EINTR)
+                continue;
+            WARNING("write failed: %s", strerror(errno));
+            return -1;
+        }
+        buf += rc;
+        len -= rc;
+        cc->write_offset += rc;
+    }
+
+    /* checkpoint */
+    if(cc->write_offset - cc->synced_offset >= CC_DOWNLOAD_SYNC_INTERVAL)
+        return cc_download_sync(cc);
+
+    return 0;
+}
+
+/* Only whole files are resumed from the size of the incomplete file. */
+static bool cc_download_is_resumable(cc_t *cc)
+{
+    queue_t *queue = cc->current_queue;
+    return queue && cc->fetch_leaves != 1 && !queue->is_filelist &&
+        queue->segment < 0;
+}
+
+/* Syncs the data written so far to disk, and saves the offset in the queue
+ * for resuming. Returns 0 on success, or -1 on error. */
+int cc_download_sync(cc_t *cc)
 {
     return_val_if_fail(cc, -1);
-    return_val_if_fail(buf, -1);
 
-    if(write(cc->local_fd, buf, bytes_read) == -1)
+    if(fdatasync(cc->local_fd) != 0)
     {
-        WARNING("write failed: %s", strerror(errno));
+        WARNING("fdatasync failed: %s", strerror(errno));
         return -1;
     }
+    cc->synced_offset = cc->write_offset;
+
+    if(cc_download_is_resumable(cc))
+        queue_db_set_synced_offset(cc->current_queue->target_filename,
+                cc->synced_offset);
+
+    return 0;
+}
+
+/* Writes any data buffered by cc_download_write to the file. Returns 0 on
+ * success, or -1 on error. */
+int cc_download_flush(cc_t *cc)
+{
+    return_val_if_fail(cc, -1);
+
+    if(cc->write_buf_len == 0)
+        return 0;
+
+    size_t len = cc->write_buf_len;
+    cc->write_buf_len = 0;
+    return cc_download_pwrite(cc, cc->write_buf, len);
+}
+
+/* Buffers downloaded data, and writes it in chunks of write_buf_size
+ * aligned in the file. */
+static int cc_download_write(cc_t *cc, char *buf, size_t bytes_read)
+{
+    return_val_if_fail(cc, -1);
+    return_val_if_fail(buf, -1);
+
+    if(cc->tt)
+        tt_update(cc->tt, (unsigned char *)buf, bytes_read);
 
     cc->bytes_done += bytes_read;
 
+    if(cc->write_buf_size == 0)
+        return cc_download_pwrite(cc, buf, bytes_read);
+
+    while(bytes_read > 0)
+    {
+        /* the buffer ends at the next aligned offset */
+        uint64_t start = cc->write_offset;
+        size_t fill = cc->write_buf_size - start % cc->write_buf_size;
+
+        size_t n = fill - cc->write_buf_len;
+        if(n > bytes_read)
+            n = bytes_read;
+        memcpy(cc->write_buf + cc->write_buf_len, buf, n);
+        cc->write_buf_len += n;
+        buf += n;
+        bytes_read -= n;
+
+        if(cc->write_buf_len == fill && cc_download_flush(cc) != 0)
+            return -1;
+    }
+
     return 0;
 }
 
+/* Reserves disk space for the whole target, so that downloads running in
+ * parallel don't fragment it. The file size is not changed; the size of
+ * the incomplete file is the resume offset. */
+static void cc_download_preallocate(cc_t *cc)
+{
+#if defined(__linux__)
+    queue_t *queue = cc->current_queue;
+    if(cc->fetch_leaves == 1 || queue->is_filelist || queue->size == 0)
+        return;
+
+    if(fallocate(cc->local_fd, FALLOC_FL_KEEP_SIZE, 0, queue->size) != 0 &&
+       errno != EOPNOTSUPP && errno != ENOSYS)
+    {
+        WARNING("[%s]: unable to preallocate %"PRIu64" bytes: %s",
+                queue->target_filename, queue->size, strerror(errno));
+    }
+#endif
+}
+
 int cc_start_download(cc_t *cc)
 {
     return_val_if_fail(cc, -1);
@@ -326,10 +640,12 @@ int cc_start_download(cc_t *cc)
     char *target = 0; /* complete, absolute target path in local filesystem */
     int num_returned_bytes;
 
+    uint64_t offset = cc->offset;
+    int flags = O_RDWR | O_CREAT;
     if (cc->fetch_leaves == 1) {
-        num_returned_bytes = asprintf(&target, "%s/%s.tthl", global_incomplete_directory, cc->current_queue->target_filename);
-        if (num_returned_bytes == -1)
-            DEBUG("asprintf did not return anything");
+        target = queue_segment_leaves_filename(cc->current_queue->target_filename);
+        offset = 0;
+        flags |= O_TRUNC;
     }
     else if (cc->current_queue->is_filelist)
         target = strdup(cc->current_queue->target_filename);
@@ -349,7 +665,7 @@ int cc_start_download(cc_t *cc)
     DEBUG("mkpath(%s)", local_dir);
     mkpath(local_dir);
 
-    cc->local_fd = open(target, O_RDWR | O_CREAT, 0644);
+    cc->local_fd = open(target, flags, 0644);
     DEBUG("opened %s for writing, fd = %d", target, cc->local_fd);
     free(target);
     target = cc->current_queue->target_filename;
@@ -364,12 +680,20 @@ int cc_start_download(cc_t *cc)
     }
     free(local_dir);
 
-    if(lseek(cc->local_fd, cc->offset, SEEK_SET) == -1)
+    cc->write_offset = cc->synced_offset = offset;
+    if(cc_download_is_resumable(cc))
+        queue_db_set_synced_offset(target, offset);
+    cc->write_buf_len = 0;
+    if(cc->write_buf_size != global_download_write_size)
     {
-        WARNING("lseek failed: %s", strerror(errno));
-        return -1;
+        free(cc->write_buf);
+        cc->write_buf_size = global_download_write_size;
+        cc->write_buf = cc->write_buf_size ? malloc(cc->write_buf_size) : NULL;
     }
 
+    cc_download_preallocate(cc);
+    cc_download_init_hash(cc, offset);
+
     cc->transfer_start_time = time(0);
     cc->last_transfer_activity = time(0);
 
@@ -386,6 +710,10 @@ int cc_start_download(cc_t *cc)
 void cc_download_read(cc_t *cc)
 {
     struct evbuffer *input_buffer = EVBUFFER_INPUT(cc->bufev);
+
+    /* the command that started the download is followed by file data */
+    io_line_reader_done(&cc->reader, input_buffer);
+
     size_t input_data_len = EVBUFFER_LENGTH(input_buffer);
 
     if(input_data_len == 0)
@@ -402,6 +730,16 @@ void cc_download_read(cc_t *cc)
         input_data_len = (size_t)maxsize;
     }
 
+    size_t allowed = bw_allowance(cc, BW_DOWNLOAD, input_data_len);
+    if(allowed < input_data_len)
+    {
+        /* take the rest when there's bandwidth */
+        bw_wait(cc, BW_DOWNLOAD);
+        if(allowed == 0)
+            return;
+        input_data_len = allowed;
+    }
+
     char *input_data = (char *)EVBUFFER_DATA(input_buffer);
 
     if(cc_download_write(cc, input_data, input_data_len) != 0)
@@ -411,6 +749,7 @@ void cc_download_read(cc_t *cc)
     else
     {
         evbuffer_drain(input_buffer, input_data_len);
+        bw_consume(cc, BW_DOWNLOAD, input_data_len);
 
         cc->last_transfer_activity = time(0);
 
@@ -24,6 +24,7 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <errno.h>
 #include <time.h>
 
@@ -33,8 +34,15 @@
 #include "xstr.h"
 #include "xerr.h"
 
+/* max number of bytes handed to sendfile() per write event */
+#define CC_SENDFILE_CHUNK (1024*1024)
+
 void cc_finish_upload(cc_t *cc)
 {
+    if(event_initialized(&cc->upload_event))
+        event_del(&cc->upload_event);
+    cc->upload_sendfile = false;
+
     if(cc->local_fd != -1)
     {
 	INFO("finished uploading file [%s]", cc->local_filename);
@@ -45,7 +53,7 @@ void cc_finish_upload(cc_t *cc)
     else
     {
 	INFO("finished uploading leafdata for [%s]", cc->local_filename);
-	/* don't free the leafdata, it belongs to the tth_store */
+        free(cc->leafdata);
         cc->leafdata = NULL;
         cc->leafdata_index = 0;
         cc->leafdata_len = 0;
@@ -98,6 +106,87 @@ ssize_t cc_upload_read(cc_t *cc, void *buf, size_t nbytes)
     }
 }
 
+static void cc_upload_event(int fd, short why, void *data)
+{
+    cc_t *cc = data;
+    cc_out_event(cc->bufev, cc);
+}
+
+/* Sends the next chunk of the local file directly from cc->local_fd to the
+ * socket, bypassing the bufferevent. Called from cc_out_event when the
+ * output buffer has drained, and from our own write event when the socket
+ * has room for more data.
+ */
+void cc_upload_sendfile(cc_t *cc)
+{
+    /* Commands already queued (eg, $ADCSND) must go out first. We're called
+     * again from the write callback when the buffer is drained. */
+    if(EVBUFFER_LENGTH(EVBUFFER_OUTPUT(cc->bufev)) > 0)
+        return;
+
+    if(!event_initialized(&cc->upload_event))
+        event_set(&cc->upload_event, cc->fd, EV_WRITE, cc_upload_event, cc);
+
+    size_t nbytes = CC_SENDFILE_CHUNK;
+    if(cc->bytes_done + nbytes > cc->bytes_to_transfer)
+    {
+        /* this is the last chunk */
+        nbytes = cc->bytes_to_transfer - cc->bytes_done;
+    }
+
+    nbytes = bw_allowance(cc, BW_UPLOAD, nbytes);
+    if(nbytes == 0)
+    {
+        bw_wait(cc, BW_UPLOAD);
+        return;
+    }
+
+    ssize_t bytes_sent = io_sendfile(cc->fd, cc->local_fd,
+            cc->offset + cc->bytes_done, nbytes);
+    if(bytes_sent == -1)
+    {
+        if(errno == EAGAIN || errno == EINTR)
+        {
+            event_add(&cc->upload_event, NULL);
+        }
+        else if(errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)
+        {
+            /* not supported for this file, fall back to read/write */
+            INFO("sendfile not available for [%s] (%s), using buffered upload",
+                    cc->local_filename, strerror(errno));
+            cc->upload_sendfile = false;
+            if(lseek(cc->local_fd, cc->offset + cc->bytes_done,
+                        SEEK_SET) == -1)
+            {
+                WARNING("lseek failed: %s", strerror(errno));
+                cc_close_connection(cc);
+                return;
+            }
+            cc_out_event(cc->bufev, cc);
+        }
+        else
+        {
+            WARNING("sendfile failed: %s", strerror(errno));
+            cc_close_connection(cc);
+        }
+        return;
+    }
+
+    if(bytes_sent == 0)
+    {
+        WARNING("[%s]: unexpected end of file", cc->local_filename);
+        cc_close_connection(cc);
+        return;
+    }
+
+    cc->bytes_done += bytes_sent;
+    bw_consume(cc, BW_UPLOAD, bytes_sent);
+    if(cc->bytes_done >= cc->bytes_to_transfer)
+        cc_finish_upload(cc);
+    else
+        event_add(&cc->upload_event, NULL);
+}
+
 int cc_start_upload(cc_t *cc)
 {
     return_val_if_fail(cc->state == CC_STATE_REQUEST, -1);
@@ -147,6 +236,10 @@ int cc_upload_prepare(cc_t *cc, const char *filename,
         int num_returned_bytes = asprintf(&local_filename, "%s/%s", global_working_directory, filename);
         if (num_returned_bytes == -1)
             DEBUG("asprintf did not return anything");
+        /* only saved on request, most clients use files.xml.bz2 */
+        if (!str_has_suffix(filename, ".bz2")) {
+            global_share->save_xml = true;
+        }
         if (share_save(global_share, fl_type) != 0) {
             WARNING("failed to save share");
             free(local_filename);
@@ -223,6 +316,9 @@ int cc_upload_prepare(cc_t *cc, const char *filename,
     cc->filesize = stbuf.st_size;
     cc->bytes_done = 0ULL;
 
+    /* The filelist is re-saved on demand, keep it on the buffered path. */
+    cc->upload_sendfile = (fl_type == FILELIST_NONE);
+
     cc->upload_buf_size = cc->upload_buf_offset = 0;
 
     return 0;
@@ -13,7 +13,7 @@ int global_init_completion = 0;
 int global_expected_shared_paths = -1;
 
 int global_port = -1;
-void *global_share = 0;
+struct share *global_share = 0;
 void *global_search_listener = 0;
 char *global_working_directory = 0;
 char *argv0_path = 0;
@@ -21,6 +21,18 @@ bool global_follow_redirects = true;
 bool global_auto_match_filelists = true;
 bool global_auto_search_sources = true;
 unsigned global_hash_prio = 2;
+unsigned global_search_reply_rate = 500; /* replies per second, 0 = unlimited */
+
+/* bytes per second, 0 = unlimited */
+unsigned global_upload_rate = 0;
+unsigned global_download_rate = 0;
+unsigned global_hub_upload_rate = 0;
+unsigned global_hub_download_rate = 0;
+unsigned global_connection_upload_rate = 0;
+unsigned global_connection_download_rate = 0;
+
+/* downloaded data is written in chunks of this size, 0 = as received */
+unsigned global_download_write_size = 1024*1024;
 
 char *global_incomplete_directory = 0;
 char *global_download_directory = 0;
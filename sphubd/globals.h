@@ -3,10 +3,12 @@
 
 #include <stdbool.h>
 
+struct share;
+
 extern int global_init_completion;
 extern int global_expected_shared_paths;
 extern int global_port;
-extern void *global_share;
+extern struct share *global_share;
 extern void *global_search_listener;
 extern char *global_working_directory;
 extern char *argv0_path;
@@ -14,6 +16,14 @@ extern bool global_follow_redirects;
 extern bool global_auto_match_filelists;
 extern bool global_auto_search_sources;
 extern unsigned global_hash_prio;
+extern unsigned global_search_reply_rate;
+extern unsigned global_upload_rate;
+extern unsigned global_download_rate;
+extern unsigned global_hub_upload_rate;
+extern unsigned global_hub_download_rate;
+extern unsigned global_connection_upload_rate;
+extern unsigned global_connection_download_rate;
+extern unsigned global_download_write_size;
 extern char *global_incomplete_directory;
 extern char *global_download_directory;
 
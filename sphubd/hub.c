@@ -100,7 +100,7 @@ int hub_send_string(hub_t *hub, const char *string)
     return_val_if_fail(hub->bufev, -1);
     return_val_if_fail(hub->fd != -1, -1);
 
-    print_command(string, "-> (fd %i)", hub->fd);
+    print_command(SP_TRACE_HUB, string, "-> (fd %i)", hub->fd);
     return bufferevent_write(hub->bufev, (void *)string, strlen(string));
 }
 
@@ -205,6 +205,8 @@ hub_new_from_hcd(hub_connect_data_t *hcd)
     free(hub->hubname);
     hub->hubname = strdup(hcd->address);
     hub->hubip = strdup(hcd->resolved_ip);
+    hub->bw_rate[BW_UPLOAD] = global_hub_upload_rate;
+    hub->bw_rate[BW_DOWNLOAD] = global_hub_download_rate;
     if(hcd->encoding)
     {
         hub_set_encoding(hub, hcd->encoding);
@@ -723,6 +725,34 @@ void hub_set_passive(bool on)
     hub_set_need_myinfo_update(true);
 }
 
+static void hub_set_bandwidth_limit_GFunc(hub_t *hub, void *user_data)
+{
+    unsigned *rate = user_data;
+    hub_set_bandwidth_limit(hub, rate[BW_UPLOAD], rate[BW_DOWNLOAD]);
+}
+
+/* Sets the bandwidth limits of the hub. If <hub> is NULL, sets the limits
+ * of all hubs, and of hubs connected later. */
+void hub_set_bandwidth_limit(hub_t *hub, unsigned upload_rate,
+        unsigned download_rate)
+{
+    if(hub == NULL)
+    {
+        global_hub_upload_rate = upload_rate;
+        global_hub_download_rate = download_rate;
+
+        unsigned rate[2];
+        rate[BW_UPLOAD] = upload_rate;
+        rate[BW_DOWNLOAD] = download_rate;
+        hub_foreach(hub_set_bandwidth_limit_GFunc, rate);
+    }
+    else
+    {
+        hub->bw_rate[BW_UPLOAD] = upload_rate;
+        hub->bw_rate[BW_DOWNLOAD] = download_rate;
+    }
+}
+
 void hub_send_nmdc_default_user_commands(hub_t *hub)
 {
     return_if_fail(hub);
@@ -29,8 +29,10 @@
 #include <stdint.h>
 
 #include "user.h"
-
-#define HUB_USER_NHASH 509
+#include "iconv_string.h"
+#include "bandwidth.h"
+#include "htable.h"
+#include "io.h"
 
 /* user-command types */
 #define UC_TYPE_SEPARATOR 0
@@ -85,6 +87,7 @@ struct hub
     int fd;
     struct event idle_timeout_event;
     struct bufferevent *bufev;
+    struct io_line_reader reader;
 
     bool expected_disconnect;
     struct event reconnect_event;
@@ -111,7 +114,7 @@ struct hub
     bool is_registered;
     bool got_lock;
 
-    LIST_HEAD(, user) users[HUB_USER_NHASH];
+    htable_t users; /* user_t by nick */
 
     char *myinfo_string;
     int sent_user_commands;
@@ -121,6 +124,9 @@ struct hub
     int num_messages;
     int num_user_commands;
     char *encoding;
+    iconv_cache_t *iconv; /* converts commands from the hub encoding */
+    struct bw_bucket bw[2]; /* upload and download limits */
+    unsigned bw_rate[2]; /* rates of the buckets, 0 = unlimited */
 };
 
 typedef enum {SLOT_NONE, SLOT_FREE, SLOT_EXTRA, SLOT_NORMAL} slot_state_t;
@@ -135,7 +141,6 @@ void hub_attach_io_channel(hub_t *hub, int fd);
  */
 void hub_list_init(void);
 hub_t *hub_new(void);
-unsigned hub_user_hash(const char *nick);
 user_t *hub_lookup_user(hub_t *hub, const char *nick);
 void hub_free(hub_t *hub);
 void hub_list_add(hub_t *hub);
@@ -194,6 +199,8 @@ void hub_update_user_info(const char *speed, const char *description, const char
 void hub_start_myinfo_updater(void);
 // void hub_all_set_ip_address(const char *ip_address);
 void hub_set_passive(bool on);
+void hub_set_bandwidth_limit(hub_t *hub, unsigned upload_rate,
+        unsigned download_rate);
 void hub_set_idle_timeout(hub_t *hub);
 void hub_send_nmdc_default_user_commands(hub_t *hub);
 void hub_set_encoding(hub_t *hub, const char *encoding);
@@ -42,6 +42,7 @@
 #include "rx.h"
 #include "xstr.h"
 #include "extip.h"
+#include "search_reply.h"
 
 typedef struct hub_search_data hub_search_data_t;
 struct hub_search_data
@@ -50,11 +51,7 @@ struct hub_search_data
     bool passive;
     union
     {
-        struct
-        {
-            int fd;
-            struct sockaddr_in addr;
-        } active;
+        struct sockaddr_in addr;
         char *nick;
     } dest;
 };
@@ -118,38 +115,23 @@ static int hub_search_match_callback(const share_search_t *search,
     }
     else
     { /* searching nick is active, send results directly via UDP */
-        if(hsd->dest.active.fd == -1)
-        {
-            hsd->dest.active.fd = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
-
-            if(hsd->dest.active.fd == -1)
-            {
-                WARNING("socket(): %s", strerror(errno));
-                free(response);
-                return -1;
-            }
-        }
-
-        print_command(response, "-> (UDP:%s:%d)",
-                inet_ntoa(hsd->dest.active.addr.sin_addr),
-                ntohs(hsd->dest.active.addr.sin_port));
+        print_command(SP_TRACE_PEER, response, "-> (UDP:%s:%d)",
+                inet_ntoa(hsd->dest.addr.sin_addr),
+                ntohs(hsd->dest.addr.sin_port));
 
+        /* queued, sent in batches from the event loop */
         int rc = -1;
         char *response_encoded = str_utf8_to_escaped_legacy(response,
                 hub->encoding);
         if(response_encoded)
         {
-            size_t len = strlen(response_encoded);
-
-            rc = sendto(hsd->dest.active.fd, response_encoded, len, 0,
-                    (const struct sockaddr *)&hsd->dest.active.addr,
-                    sizeof(struct sockaddr_in));
+            rc = search_reply_queue(&hsd->dest.addr, response_encoded,
+                    strlen(response_encoded));
             free(response_encoded);
         }
 
         if(rc == -1)
         {
-            WARNING("unable to send UDP response: %s", strerror(errno));
             free(response);
             return -1;
         }
@@ -185,7 +167,7 @@ static int hub_cmd_Quit(void *data, int argc, char **argv)
             /* abort current transfer with logged out nick */
             cc_close_connection(cc);
         }
-        LIST_REMOVE(user, link);
+        htable_remove(&hub->users, user);
         user_free(user);
         ui_send_user_logout(NULL, hub->address, argv[0]);
     }
@@ -239,7 +221,7 @@ static int hub_cmd_MyINFO(void *opaque_param, int argc, char **argv)
             }
 
             /* remove the old user */
-            LIST_REMOVE(user, link);
+            htable_remove(&hub->users, user);
             user_free(user);
         }
         else
@@ -252,8 +234,7 @@ static int hub_cmd_MyINFO(void *opaque_param, int argc, char **argv)
         }
 
         /* insert the new user */
-        LIST_INSERT_HEAD(&hub->users[hub_user_hash(new_user->nick)],
-                new_user, link);
+        htable_insert(&hub->users, new_user);
     }
 
     return 0;
@@ -268,6 +249,8 @@ static int hub_cmd_ForceMove(void *opaque_param, int argc, char **argv)
     {
         ui_send_hub_redirect(NULL, hub->address, argv[0]);
 
+        /* the arguments point into the hub's input buffer */
+        char *address = xstrdup(argv[0]);
         char *nick = xstrdup(hub->me->nick);
         char *email = xstrdup(hub->me->email);
         char *description = xstrdup(hub->me->description);
@@ -276,8 +259,9 @@ static int hub_cmd_ForceMove(void *opaque_param, int argc, char **argv)
         bool passive = hub->me->passive;
         hub->expected_disconnect = true;
         hub_close_connection(hub);
-        hub_connect(argv[0], nick, email, description, speed,
+        hub_connect(address, nick, email, description, speed,
                 passive, NULL, encoding);
+        free(address);
         free(nick);
         free(email);
         free(description);
@@ -462,8 +446,8 @@ static int hub_cmd_Search(void *data, int argc, char **argv)
     }
     else
     {
-        memset(&hsd.dest.active.addr, 0, sizeof(struct sockaddr_in));
-        if(inet_aton(s->host, &hsd.dest.active.addr.sin_addr) == 0)
+        memset(&hsd.dest.addr, 0, sizeof(struct sockaddr_in));
+        if(inet_aton(s->host, &hsd.dest.addr.sin_addr) == 0)
         {
             WARNING("invalid IPv4 address in search request: '%s'"
                     " (skipping search request)", s->host);
@@ -471,18 +455,12 @@ static int hub_cmd_Search(void *data, int argc, char **argv)
 
             return 0;
         }
-        hsd.dest.active.addr.sin_port = htons(s->port);
-        hsd.dest.active.addr.sin_family = AF_INET;
-        hsd.dest.active.fd = -1; /* will be set on first found search result */
+        hsd.dest.addr.sin_port = htons(s->port);
+        hsd.dest.addr.sin_family = AF_INET;
     }
 
     share_search(global_share, s, hub_search_match_callback, &hsd);
 
-    if(!hsd.passive && hsd.dest.active.fd != -1)
-    {
-        close(hsd.dest.active.fd);
-    }
-
     share_search_free(s);
 
     return 0;
@@ -552,8 +530,7 @@ static int hub_cmd_OpList(void *data, int argc, char **argv)
             if(user)
             {
                 user->is_operator = true;
-                LIST_INSERT_HEAD(&hub->users[hub_user_hash(user->nick)],
-                        user, link);
+                htable_insert(&hub->users, user);
             }
         }
 
@@ -831,30 +808,7 @@ static int hub_cmd_Usercommand(void *data, int argc, char **argv)
     return 0;
 }
 
-static cmd_t hub_cmds[] = {
-    {"$Hello", hub_cmd_Hello, 1},
-    {"$Quit", hub_cmd_Quit, 1},
-    {"$MyINFO", hub_cmd_MyINFO, -1},
-    {"$HubName", hub_cmd_HubName, -1},
-    {"$Supports", hub_cmd_Supports, 1},
-    {"$Search", hub_cmd_Search, -1},
-    {"$MultiSearch", hub_cmd_Search, -1},
-    {"$SR", hub_cmd_SR, -1},
-    {"$ConnectToMe", hub_cmd_ConnectToMe, 2},
-    {"$RevConnectToMe", hub_cmd_RevConnectToMe, 2},
-    {"$To:", hub_cmd_To, -1},
-    {"$NickList", hub_cmd_NickList, -1},
-    {"$OpList", hub_cmd_OpList, -1},
-    {"$GetPass", hub_cmd_GetPass, 0},
-    {"$ForceMove", hub_cmd_ForceMove, 1},
-    {"$UserIP", hub_cmd_UserIP, -1},
-    {"$UserIP2", hub_cmd_UserIP, -1},
-    {"$LogedIn", hub_cmd_LogedIn, 0},
-    {"$BadPass", hub_cmd_BadPass, 0},
-    {"$ValidateDenide", hub_cmd_ValidateDenide, 0},
-    {"$UserCommand", hub_cmd_Usercommand, -1},
-    {0, 0, -1}
-};
+#include "hub_cmd_table.h"
 
 int hub_dispatch_command(hub_t *hub, char *cmdstr)
 {
@@ -870,22 +824,22 @@ int hub_dispatch_command(hub_t *hub, char *cmdstr)
     }
     else
     {
-        char *cmdstr_utf8 = str_legacy_to_utf8_lossy(cmdstr, hub->encoding);
+        /* Most commands are plain ASCII and used as is. Converted commands
+         * are only valid until the next command is converted. */
+        char *cmdstr_utf8 = str_legacy_to_utf8_cached(hub->iconv, cmdstr,
+                hub->encoding);
         if(cmdstr_utf8 == NULL)
         {
             WARNING("command [%s] failed to convert to (lossy) UTF-8", cmdstr);
             return 0;
         }
 
-        char *cmdstr_utf8_unescaped;
+        char *unescaped = NULL;
+        char *cmdstr_utf8_unescaped = cmdstr_utf8;
         if(str_need_unescape_unicode(cmdstr_utf8))
         {
-            cmdstr_utf8_unescaped = str_unescape_unicode(cmdstr_utf8);
-            free(cmdstr_utf8);
-        }
-        else
-        {
-            cmdstr_utf8_unescaped = cmdstr_utf8;
+            unescaped = str_unescape_unicode(cmdstr_utf8);
+            cmdstr_utf8_unescaped = unescaped;
         }
 
         if(cmdstr_utf8_unescaped[0] == '<')
@@ -906,10 +860,10 @@ int hub_dispatch_command(hub_t *hub, char *cmdstr)
         }
         else
         {
-            rc = cmd_dispatch(cmdstr_utf8_unescaped, " ", 0, hub_cmds, hub);
+            rc = cmd_dispatch(cmdstr_utf8_unescaped, " ", 0, &hub_cmds, hub);
         }
 
-        free(cmdstr_utf8_unescaped);
+        free(unescaped);
     }
 
     return rc;
@@ -925,14 +879,13 @@ static void hub_in_event(struct bufferevent *bufev, void *data)
 
     while(1)
     {
-        char *cmd = io_evbuffer_readline(EVBUFFER_INPUT(bufev));
+        char *cmd = io_line_reader_next(&hub->reader, EVBUFFER_INPUT(bufev));
         if(cmd == NULL)
         {
             break;
         }
-        print_command(cmd, "<- (fd %d)", hub->fd);
+        print_command(SP_TRACE_HUB, cmd, "<- (fd %d)", hub->fd);
         int rc = hub_dispatch_command(hub, cmd);
-        free(cmd);
         if(rc != 0)
         {
             break;
@@ -51,20 +51,14 @@ void hub_list_init(void)
 		hub_handle_external_ip_notification, NULL);
 }
 
-unsigned hub_user_hash(const char *nick)
+static uint32_t hub_user_hash(const void *record)
 {
-    const char *p = nick;
-    unsigned h = *p;
-
-    if(h)
-    {
-        for(p += 1; *p; p++)
-        {
-            h = (h << 5) - h + *p;
-        }
-    }
+    return htable_hash_string(((const user_t *)record)->nick);
+}
 
-    return h % HUB_USER_NHASH;
+static int hub_user_match(const void *record, const void *key)
+{
+    return strcmp(((const user_t *)record)->nick, key) == 0;
 }
 
 hub_t *hub_new(void)
@@ -75,12 +69,9 @@ hub_t *hub_new(void)
     TAILQ_INIT(&hub->messages_head);
     TAILQ_INIT(&hub->user_commands_head);
     hub->encoding = strdup("WINDOWS-1252");
+    hub->iconv = iconv_cache_new();
 
-    int i;
-    for(i = 0; i < HUB_USER_NHASH; i++)
-    {
-        LIST_INIT(&hub->users[i]);
-    }
+    htable_init(&hub->users, hub_user_hash);
 
     return hub;
 }
@@ -91,17 +82,11 @@ void hub_free(hub_t *hub)
     if(hub)
     {
         /* free all users */
-        int i;
-        for(i = 0; i < HUB_USER_NHASH; i++)
-        {
-            user_t *user, *next;
-            for(user = LIST_FIRST(&hub->users[i]); user; user = next)
-            {
-                next = LIST_NEXT(user, link);
-                LIST_REMOVE(user, link);
-                user_free(user);
-            }
-        }
+        unsigned pos = 0;
+        user_t *user;
+        while((user = htable_next(&hub->users, &pos)) != NULL)
+            user_free(user);
+        htable_free(&hub->users);
         
         user_free(hub->me);
         free(hub->hubname);
@@ -112,6 +97,7 @@ void hub_free(hub_t *hub)
         hub_message_free_all(hub);
         hub_user_command_free_all(hub);
         free(hub->encoding);
+        iconv_cache_free(hub->iconv);
         free(hub);
     }
 }
@@ -181,16 +167,8 @@ hub_t *hub_find_by_fd(int fd)
 
 user_t *hub_lookup_user(hub_t *hub, const char *nick)
 {
-    user_t *user;
-    LIST_FOREACH(user, &hub->users[hub_user_hash(nick)], link)
-    {
-        if(strcmp(user->nick, nick) == 0)
-        {
-            return user;
-        }
-    }
-
-    return NULL;
+    return htable_lookup(&hub->users, htable_hash_string(nick),
+            hub_user_match, nick);
 }
 
 hub_t *hub_find_by_nick(const char *nick)
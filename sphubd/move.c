@@ -0,0 +1,841 @@
+/*
+ * Copyright (c) 2007 Martin Hedenfalk <martin@bzero.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Moves completed downloads to the download directory. A rename is tried
+ * first. If the download directory is on another filesystem, the files are
+ * copied in chunks of MOVE_CHUNK_SIZE from the event loop, one file at a
+ * time, and the source is removed when the copy is complete.
+ *
+ * Pending moves are kept in a journal in the working directory, with the
+ * offset up to which the copy is known to be on disk. Moves interrupted by
+ * a crash or shutdown are resumed from there by move_init(). Fields are
+ * separated by tabs, and tabs, newlines and backslashes in them are quoted
+ * with a backslash.
+ *
+ * The UI is told that a download is finished once it is moved.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <event.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sys_queue.h"
+
+#include "globals.h"
+#include "log.h"
+#include "move.h"
+#include "quote.h"
+#include "ui.h"
+#include "util.h"
+#include "xstr.h"
+
+#define MOVE_JOURNAL_FILENAME "moves"
+
+struct move
+{
+    TAILQ_ENTRY(move) link;
+
+    char *source;
+    char *target;
+    char *tmpname;  /* the copy in progress, renamed to target when done */
+    char *root;     /* empty directories are removed up to here, or NULL */
+    char *finished; /* download reported finished when moved, or NULL */
+
+    int in_fd;
+    int out_fd;
+    uint64_t size;
+    uint64_t offset;
+    uint64_t synced;    /* offset up to which the copy is on disk */
+    bool no_copy_range;
+};
+
+static TAILQ_HEAD(move_list, move) move_head =
+    TAILQ_HEAD_INITIALIZER(move_head);
+static struct event move_event;
+static bool move_scheduled = false;
+static time_t move_last_progress = 0;
+
+/* always copy instead of renaming, used by the tests */
+static bool move_force_copy = false;
+
+static void move_event_func(int fd, short why, void *user_data);
+
+static void move_schedule(void)
+{
+    if(move_scheduled || TAILQ_EMPTY(&move_head))
+        return;
+
+    struct timeval tv = {.tv_sec = 0, .tv_usec = 0};
+    evtimer_set(&move_event, move_event_func, NULL);
+    evtimer_add(&move_event, &tv);
+    move_scheduled = true;
+}
+
+static char *move_journal_filename(void)
+{
+    char *filename;
+    if(asprintf(&filename, "%s/%s", global_working_directory,
+                MOVE_JOURNAL_FILENAME) == -1)
+        return NULL;
+    return filename;
+}
+
+/* Rewrites the journal of pending moves. */
+static void move_journal_write(void)
+{
+    char *filename = move_journal_filename();
+    return_if_fail(filename);
+
+    if(TAILQ_EMPTY(&move_head))
+    {
+        unlink(filename);
+        free(filename);
+        return;
+    }
+
+    char *tmpfilename;
+    if(asprintf(&tmpfilename, "%s.tmp", filename) == -1)
+    {
+        free(filename);
+        return;
+    }
+
+    FILE *fp = fopen(tmpfilename, "w");
+    if(fp == NULL)
+    {
+        WARNING("%s: %s", tmpfilename, strerror(errno));
+        free(tmpfilename);
+        free(filename);
+        return;
+    }
+
+    struct move *m;
+    TAILQ_FOREACH(m, &move_head, link)
+    {
+        char *source = str_quote_backslash(m->source, "\t\n");
+        char *target = str_quote_backslash(m->target, "\t\n");
+        char *root = str_quote_backslash(m->root ? m->root : "", "\t\n");
+        char *finished = str_quote_backslash(
+                m->finished ? m->finished : "", "\t\n");
+        fprintf(fp, "%"PRIu64"\t%s\t%s\t%s\t%s\n", m->synced,
+                source, target, root, finished);
+        free(source);
+        free(target);
+        free(root);
+        free(finished);
+    }
+
+    if(fflush(fp) != 0 || fsync(fileno(fp)) != 0)
+        WARNING("%s: %s", tmpfilename, strerror(errno));
+    fclose(fp);
+
+    if(rename(tmpfilename, filename) != 0)
+        WARNING("%s: %s", filename, strerror(errno));
+
+    free(tmpfilename);
+    free(filename);
+}
+
+/* Removes the directories of <path> that are empty, up to and including
+ * <root>. */
+static void move_remove_empty_parents(const char *path, const char *root)
+{
+    if(root == NULL)
+        return;
+
+    size_t rootlen = strlen(root);
+    char *dir = xstrdup(path);
+    char *e;
+    while((e = strrchr(dir, '/')) != NULL)
+    {
+        *e = 0;
+        if(strncmp(dir, root, rootlen) != 0 ||
+           (dir[rootlen] != 0 && dir[rootlen] != '/'))
+            break;
+
+        if(rmdir(dir) != 0)
+        {
+            if(errno != ENOTEMPTY && errno != EEXIST && errno != ENOENT)
+            {
+                ui_send_status_message(NULL, NULL,
+                        "Unable to remove directory %s: %s",
+                        dir, strerror(errno));
+            }
+            break;
+        }
+    }
+    free(dir);
+}
+
+static void move_close_files(struct move *m)
+{
+    if(m->in_fd != -1)
+        close(m->in_fd);
+    if(m->out_fd != -1)
+        close(m->out_fd);
+    m->in_fd = m->out_fd = -1;
+}
+
+static void move_free(struct move *m)
+{
+    move_close_files(m);
+    free(m->source);
+    free(m->target);
+    free(m->tmpname);
+    free(m->root);
+    free(m->finished);
+    free(m);
+}
+
+static struct move *move_add(const char *source, const char *target,
+        const char *root, const char *finished, uint64_t offset)
+{
+    struct move *m = calloc(1, sizeof(struct move));
+    m->source = xstrdup(source);
+    m->target = xstrdup(target);
+    m->root = root && *root ? xstrdup(root) : NULL;
+    m->finished = finished && *finished ? xstrdup(finished) : NULL;
+    m->in_fd = m->out_fd = -1;
+    m->offset = m->synced = offset;
+
+    /* a hidden name, so the copy isn't shared until it's complete */
+    const char *base = strrchr(target, '/');
+    int dirlen = base ? base - target + 1 : 0;
+    if(asprintf(&m->tmpname, "%.*s.%s.part", dirlen, target,
+                base ? base + 1 : target) == -1)
+    {
+        m->tmpname = NULL;
+        move_free(m);
+        return NULL;
+    }
+
+    TAILQ_INSERT_TAIL(&move_head, m, link);
+    return m;
+}
+
+/* Tells the UI the download is finished, if the move completes one. */
+static void move_done(struct move *m)
+{
+    if(m->finished)
+        ui_send_download_finished(NULL, m->finished);
+}
+
+/* Removes a failed move. The source is left in the incomplete directory. */
+static void move_fail(struct move *m, const char *what, int error)
+{
+    ui_send_status_message(NULL, NULL, "Unable to move file %s: %s: %s",
+            m->source, what, strerror(error));
+    move_done(m);
+
+    move_close_files(m);
+    unlink(m->tmpname);
+    TAILQ_REMOVE(&move_head, m, link);
+    move_free(m);
+    move_journal_write();
+}
+
+static int move_open(struct move *m)
+{
+    m->in_fd = open(m->source, O_RDONLY);
+    if(m->in_fd == -1)
+    {
+        move_fail(m, "open", errno);
+        return -1;
+    }
+
+    struct stat stbuf;
+    if(fstat(m->in_fd, &stbuf) != 0)
+    {
+        move_fail(m, "stat", errno);
+        return -1;
+    }
+    m->size = stbuf.st_size;
+
+    m->out_fd = open(m->tmpname, O_WRONLY | O_CREAT, stbuf.st_mode & 0777);
+    if(m->out_fd == -1)
+    {
+        move_fail(m, "open", errno);
+        return -1;
+    }
+
+    /* anything after the synced offset may not have made it to disk */
+    if(m->offset > m->size || fstat(m->out_fd, &stbuf) != 0 ||
+       (uint64_t)stbuf.st_size < m->offset)
+        m->offset = 0;
+    m->synced = m->offset;
+    if(ftruncate(m->out_fd, m->offset) != 0)
+    {
+        move_fail(m, "truncate", errno);
+        return -1;
+    }
+
+    if(m->offset > 0)
+    {
+        INFO("resuming move of [%s] at offset %"PRIu64,
+                m->source, m->offset);
+    }
+
+    return 0;
+}
+
+/* Copies at most <len> bytes at the current offset. Returns the number of
+ * bytes copied, or -1 on error. */
+static ssize_t move_copy(struct move *m, size_t len)
+{
+#if defined(__linux__)
+    if(!m->no_copy_range)
+    {
+        loff_t in_off = m->offset;
+        loff_t out_off = m->offset;
+        ssize_t rc = copy_file_range(m->in_fd, &in_off, m->out_fd, &out_off,
+                len, 0);
+        if(rc >= 0)
+            return rc;
+        if(errno != EXDEV && errno != ENOSYS && errno != EINVAL &&
+           errno != EOPNOTSUPP)
+            return -1;
+
+        /* not supported between these filesystems */
+        m->no_copy_range = true;
+    }
+#endif
+
+    static char buf[64 * 1024];
+    size_t done = 0;
+    while(done < len)
+    {
+        size_t n = len - done < sizeof(buf) ? len - done : sizeof(buf);
+        ssize_t nread = pread(m->in_fd, buf, n, m->offset + done);
+        if(nread <= 0)
+            return nread == 0 || done > 0 ? (ssize_t)done : -1;
+
+        ssize_t nwritten = 0;
+        while(nwritten < nread)
+        {
+            ssize_t rc = pwrite(m->out_fd, buf + nwritten, nread - nwritten,
+                    m->offset + done + nwritten);
+            if(rc == -1)
+                return -1;
+            nwritten += rc;
+        }
+        done += nread;
+    }
+
+    return done;
+}
+
+static void move_finish(struct move *m)
+{
+    if(fsync(m->out_fd) != 0)
+    {
+        move_fail(m, "sync", errno);
+        return;
+    }
+    move_close_files(m);
+
+    if(rename(m->tmpname, m->target) != 0)
+    {
+        move_fail(m, "rename", errno);
+        return;
+    }
+
+    DEBUG("moved [%s] to [%s]", m->source, m->target);
+    ui_send_move_progress(NULL, m->target, m->size, m->size);
+
+    if(unlink(m->source) != 0)
+    {
+        ui_send_status_message(NULL, NULL, "Unable to remove file %s: %s",
+                m->source, strerror(errno));
+    }
+    move_remove_empty_parents(m->source, m->root);
+    move_done(m);
+
+    TAILQ_REMOVE(&move_head, m, link);
+    move_free(m);
+    move_journal_write();
+}
+
+/* Copies the next chunk of the first pending move. */
+static void move_step(void)
+{
+    struct move *m = TAILQ_FIRST(&move_head);
+    if(m == NULL)
+        return;
+
+    if(m->in_fd == -1 && move_open(m) != 0)
+        return;
+
+    uint64_t left = m->size - m->offset;
+    size_t len = left < MOVE_CHUNK_SIZE ? left : MOVE_CHUNK_SIZE;
+    if(len > 0)
+    {
+        ssize_t rc = move_copy(m, len);
+        if(rc <= 0)
+        {
+            /* the source shouldn't shrink under us */
+            move_fail(m, "copy", rc == 0 ? EIO : errno);
+            return;
+        }
+        m->offset += rc;
+    }
+
+    if(m->offset == m->size)
+    {
+        move_finish(m);
+        return;
+    }
+
+    if(m->offset - m->synced >= MOVE_SYNC_INTERVAL)
+    {
+        if(fdatasync(m->out_fd) != 0)
+        {
+            move_fail(m, "sync", errno);
+            return;
+        }
+        m->synced = m->offset;
+        move_journal_write();
+    }
+
+    time_t now = time(NULL);
+    if(now != move_last_progress)
+    {
+        ui_send_move_progress(NULL, m->target, m->offset, m->size);
+        move_last_progress = now;
+    }
+}
+
+static void move_event_func(int fd, short why, void *user_data)
+{
+    move_scheduled = false;
+    move_step();
+    move_schedule();
+}
+
+/* Queues the files in the directory <source> to be copied to <target>. */
+static void move_add_directory(const char *source, const char *target,
+        const char *root)
+{
+    DIR *fsdir = opendir(source);
+    if(fsdir == NULL)
+    {
+        ui_send_status_message(NULL, NULL, "Unable to move directory %s: %s",
+                source, strerror(errno));
+        return;
+    }
+
+    mkpath(target);
+
+    struct dirent *dp;
+    while((dp = readdir(fsdir)) != NULL)
+    {
+        if(strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0)
+            continue;
+
+        char *src, *dst;
+        if(asprintf(&src, "%s/%s", source, dp->d_name) == -1)
+            continue;
+        if(asprintf(&dst, "%s/%s", target, dp->d_name) == -1)
+        {
+            free(src);
+            continue;
+        }
+
+        struct stat stbuf;
+        if(lstat(src, &stbuf) == 0)
+        {
+            if(S_ISDIR(stbuf.st_mode))
+                move_add_directory(src, dst, root);
+            else if(S_ISREG(stbuf.st_mode))
+                move_add(src, dst, root, NULL, 0);
+        }
+
+        free(src);
+        free(dst);
+    }
+    closedir(fsdir);
+}
+
+/* Moves the file or directory <source> to <target>. Directories emptied by
+ * the move are removed, up to and including <root> (may be NULL). When the
+ * move is done, or has failed, the download <finished> (may be NULL) is
+ * reported finished to the UI.
+ *
+ * Returns 0 if moved or queued to be copied, -1 on error.
+ */
+int move_start(const char *source, const char *target, const char *root,
+        const char *finished)
+{
+    return_val_if_fail(source, -1);
+    return_val_if_fail(target, -1);
+
+    if(!move_force_copy && rename(source, target) == 0)
+    {
+        move_remove_empty_parents(source, root);
+        if(finished)
+            ui_send_download_finished(NULL, finished);
+        return 0;
+    }
+
+    if(!move_force_copy && errno != EXDEV)
+    {
+        ui_send_status_message(NULL, NULL, "Unable to move file %s: %s",
+                source, strerror(errno));
+        return -1;
+    }
+
+    struct stat stbuf;
+    if(stat(source, &stbuf) != 0)
+    {
+        ui_send_status_message(NULL, NULL, "Unable to move file %s: %s",
+                source, strerror(errno));
+        return -1;
+    }
+
+    INFO("copying [%s] to another filesystem", source);
+
+    if(S_ISDIR(stbuf.st_mode))
+    {
+        struct move *prev_last = TAILQ_LAST(&move_head, move_list);
+        move_add_directory(source, target, root ? root : source);
+
+        /* finished when the last file of the directory is moved */
+        struct move *last = TAILQ_LAST(&move_head, move_list);
+        if(last != prev_last)
+        {
+            if(finished)
+                last->finished = xstrdup(finished);
+        }
+        else
+        {
+            /* no files to copy */
+            if(rmdir(source) == 0)
+                move_remove_empty_parents(source, root);
+            if(finished)
+                ui_send_download_finished(NULL, finished);
+        }
+    }
+    else
+        move_add(source, target, root, finished, 0);
+
+    move_journal_write();
+    move_schedule();
+
+    return 0;
+}
+
+/* Reads a line of the journal, without the newline. A quoted newline is
+ * part of the line. Returns NULL at end of file. */
+static char *move_journal_read_line(FILE *fp)
+{
+    char *line = NULL;
+    size_t linesize = 0;
+    ssize_t len = getline(&line, &linesize, fp);
+    if(len == -1)
+    {
+        free(line);
+        return NULL;
+    }
+
+    for(;;)
+    {
+        if(len == 0 || line[len - 1] != '\n')
+            break;
+
+        /* the newline is quoted if preceded by an odd number of
+         * backslashes */
+        ssize_t i = len - 1;
+        while(i > 0 && line[i - 1] == '\\')
+            i--;
+        if((len - 1 - i) % 2 == 0)
+        {
+            line[--len] = 0;
+            break;
+        }
+
+        char *next = NULL;
+        size_t nextsize = 0;
+        ssize_t nextlen = getline(&next, &nextsize, fp);
+        if(nextlen == -1)
+        {
+            free(next);
+            break;
+        }
+        line = realloc(line, len + nextlen + 1);
+        memcpy(line + len, next, nextlen + 1);
+        len += nextlen;
+        free(next);
+    }
+
+    return line;
+}
+
+/* Resumes moves interrupted by a crash or shutdown. */
+int move_init(void)
+{
+    char *filename = move_journal_filename();
+    return_val_if_fail(filename, -1);
+
+    FILE *fp = fopen(filename, "r");
+    free(filename);
+    if(fp == NULL)
+        return 0;
+
+    char *line;
+    while((line = move_journal_read_line(fp)) != NULL)
+    {
+        char *p = line;
+        char *offset = q_strsep(&p, "\t");
+        char *source = q_strsep(&p, "\t");
+        char *target = q_strsep(&p, "\t");
+        char *root = q_strsep(&p, "\t");
+        char *finished = q_strsep(&p, "\t");
+        if(*source == 0 || *target == 0)
+        {
+            WARNING("invalid line in move journal (ignored)");
+            free(line);
+            continue;
+        }
+
+        if(access(source, F_OK) == 0)
+        {
+            move_add(source, target, root, finished,
+                    strtoull(offset, NULL, 10));
+        }
+        else if(access(target, F_OK) == 0)
+        {
+            /* completed, but not yet removed from the journal */
+            move_remove_empty_parents(source, *root ? root : NULL);
+            if(*finished)
+                ui_send_download_finished(NULL, finished);
+        }
+        else
+        {
+            WARNING("unable to resume move of [%s]: %s",
+                    source, strerror(errno));
+        }
+        free(line);
+    }
+    fclose(fp);
+
+    move_journal_write();
+    move_schedule();
+
+    return 0;
+}
+
+/* Stops copying. Pending moves are resumed by move_init() at next start. */
+void move_close(void)
+{
+    if(move_scheduled)
+    {
+        evtimer_del(&move_event);
+        move_scheduled = false;
+    }
+
+    struct move *m;
+    while((m = TAILQ_FIRST(&move_head)) != NULL)
+    {
+        TAILQ_REMOVE(&move_head, m, link);
+        move_free(m);
+    }
+}
+
+#ifdef TEST
+
+#include "unit_test.h"
+
+int ui_send_status_message(ui_t *ui, const char *hub_address,
+        const char *message, ...)
+{
+    return 0;
+}
+
+static uint64_t last_progress = 0;
+static char *last_finished = NULL;
+
+int ui_send_download_finished(ui_t *ui, const char *local_filename)
+{
+    free(last_finished);
+    last_finished = xstrdup(local_filename);
+    return 0;
+}
+
+int ui_send_move_progress(ui_t *ui, const char *local_filename,
+        uint64_t offset, uint64_t filesize)
+{
+    last_progress = offset;
+    return 0;
+}
+
+static void write_file(const char *filename, size_t size)
+{
+    FILE *fp = fopen(filename, "w");
+    fail_unless(fp);
+    size_t i;
+    for(i = 0; i < size; i++)
+        fputc(i % 251, fp);
+    fclose(fp);
+}
+
+static bool check_file(const char *filename, size_t size)
+{
+    FILE *fp = fopen(filename, "r");
+    if(fp == NULL)
+        return false;
+    size_t i;
+    for(i = 0; i < size; i++)
+    {
+        if(fgetc(fp) != i % 251)
+        {
+            fclose(fp);
+            return false;
+        }
+    }
+    bool eof = (fgetc(fp) == EOF);
+    fclose(fp);
+    return eof;
+}
+
+static void run_moves(void)
+{
+    while(!TAILQ_EMPTY(&move_head))
+        event_loop(EVLOOP_ONCE);
+}
+
+int main(void)
+{
+    event_init();
+    sp_log_set_level("warning");
+
+    global_working_directory = "/tmp/move_test";
+    system("/bin/rm -rf /tmp/move_test");
+    mkpath("/tmp/move_test/incomplete/dir/sub");
+    mkpath("/tmp/move_test/download");
+
+    /* same filesystem: renamed */
+    write_file("/tmp/move_test/incomplete/a", 1000);
+    fail_unless(move_start("/tmp/move_test/incomplete/a",
+                "/tmp/move_test/download/a", NULL, "a") == 0);
+    fail_unless(TAILQ_EMPTY(&move_head));
+    fail_unless(check_file("/tmp/move_test/download/a", 1000));
+    fail_unless(last_finished && strcmp(last_finished, "a") == 0);
+
+    /* copied in chunks */
+    move_force_copy = true;
+    size_t size = 2 * MOVE_CHUNK_SIZE + 17;
+    write_file("/tmp/move_test/incomplete/b", size);
+    fail_unless(move_start("/tmp/move_test/incomplete/b",
+                "/tmp/move_test/download/b", NULL, "b") == 0);
+    fail_unless(access("/tmp/move_test/moves", F_OK) == 0);
+    event_loop(EVLOOP_ONCE);
+    fail_unless(TAILQ_FIRST(&move_head)->offset == MOVE_CHUNK_SIZE);
+    fail_unless(access("/tmp/move_test/download/.b.part", F_OK) == 0);
+    /* the download isn't finished until it is moved */
+    fail_unless(strcmp(last_finished, "a") == 0);
+    run_moves();
+    fail_unless(strcmp(last_finished, "b") == 0);
+    fail_unless(last_progress == size);
+    fail_unless(check_file("/tmp/move_test/download/b", size));
+    fail_unless(access("/tmp/move_test/incomplete/b", F_OK) != 0);
+    fail_unless(access("/tmp/move_test/download/.b.part", F_OK) != 0);
+    fail_unless(access("/tmp/move_test/moves", F_OK) != 0);
+
+    /* directories are copied file by file and removed */
+    write_file("/tmp/move_test/incomplete/dir/c", 10);
+    write_file("/tmp/move_test/incomplete/dir/sub/d", 20);
+    fail_unless(move_start("/tmp/move_test/incomplete/dir",
+                "/tmp/move_test/download/dir", NULL, "dir/c") == 0);
+    fail_unless(strcmp(last_finished, "b") == 0);
+    run_moves();
+    fail_unless(strcmp(last_finished, "dir/c") == 0);
+    fail_unless(check_file("/tmp/move_test/download/dir/c", 10));
+    fail_unless(check_file("/tmp/move_test/download/dir/sub/d", 20));
+    fail_unless(access("/tmp/move_test/incomplete/dir", F_OK) != 0);
+
+    /* an empty directory is done at once, not when another copy is */
+    write_file("/tmp/move_test/incomplete/h", size);
+    fail_unless(move_start("/tmp/move_test/incomplete/h",
+                "/tmp/move_test/download/h", NULL, "h") == 0);
+    mkpath("/tmp/move_test/incomplete/empty");
+    fail_unless(move_start("/tmp/move_test/incomplete/empty",
+                "/tmp/move_test/download/empty", NULL, "empty") == 0);
+    fail_unless(strcmp(last_finished, "empty") == 0);
+    fail_unless(access("/tmp/move_test/incomplete/empty", F_OK) != 0);
+    fail_unless(strcmp(TAILQ_FIRST(&move_head)->finished, "h") == 0);
+    run_moves();
+    fail_unless(strcmp(last_finished, "h") == 0);
+    fail_unless(check_file("/tmp/move_test/download/h", size));
+
+    /* an interrupted move is resumed from the synced offset */
+    write_file("/tmp/move_test/incomplete/e", size);
+    fail_unless(move_start("/tmp/move_test/incomplete/e",
+                "/tmp/move_test/download/e", NULL, "e") == 0);
+    event_loop(EVLOOP_ONCE);
+    move_close();
+    fail_unless(access("/tmp/move_test/download/.e.part", F_OK) == 0);
+    fail_unless(move_init() == 0);
+    fail_unless(TAILQ_FIRST(&move_head)->offset == 0);
+    run_moves();
+    fail_unless(check_file("/tmp/move_test/download/e", size));
+    fail_unless(strcmp(last_finished, "e") == 0);
+
+    /* names with tabs, newlines and backslashes survive the journal */
+    write_file("/tmp/move_test/incomplete/g\t\n\\", 10);
+    fail_unless(move_start("/tmp/move_test/incomplete/g\t\n\\",
+                "/tmp/move_test/download/g\t\n\\", NULL, "g\t\n\\") == 0);
+    move_close();
+    fail_unless(move_init() == 0);
+    fail_unless(strcmp(TAILQ_FIRST(&move_head)->source,
+                "/tmp/move_test/incomplete/g\t\n\\") == 0);
+    fail_unless(strcmp(TAILQ_FIRST(&move_head)->target,
+                "/tmp/move_test/download/g\t\n\\") == 0);
+    run_moves();
+    fail_unless(check_file("/tmp/move_test/download/g\t\n\\", 10));
+    fail_unless(strcmp(last_finished, "g\t\n\\") == 0);
+
+    FILE *fp = fopen("/tmp/move_test/moves", "w");
+    write_file("/tmp/move_test/incomplete/f", size);
+    fprintf(fp, "%u\t/tmp/move_test/incomplete/f\t/tmp/move_test/download/f\t\n",
+            MOVE_CHUNK_SIZE);
+    fclose(fp);
+    write_file("/tmp/move_test/download/.f.part", MOVE_CHUNK_SIZE + 100);
+    fail_unless(move_init() == 0);
+    fail_unless(TAILQ_FIRST(&move_head)->offset == MOVE_CHUNK_SIZE);
+    event_loop(EVLOOP_ONCE);
+    fail_unless(TAILQ_FIRST(&move_head)->offset == 2 * MOVE_CHUNK_SIZE);
+    run_moves();
+    fail_unless(check_file("/tmp/move_test/download/f", size));
+
+    system("/bin/rm -rf /tmp/move_test");
+    free(last_finished);
+
+    return 0;
+}
+
+#endif
+
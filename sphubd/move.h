@@ -0,0 +1,32 @@
+/*
+ * Copyright (c) 2007 Martin Hedenfalk <martin@bzero.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _move_h_
+#define _move_h_
+
+/* bytes copied per event when moving between filesystems */
+#define MOVE_CHUNK_SIZE (4 * 1024 * 1024)
+
+/* the copy is synced and the journal updated this often */
+#define MOVE_SYNC_INTERVAL (64 * 1024 * 1024)
+
+int move_init(void);
+int move_start(const char *source, const char *target, const char *root,
+        const char *finished);
+void move_close(void);
+
+#endif
+
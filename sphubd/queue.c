@@ -17,11 +17,14 @@
 #include "sys_queue.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <time.h>
+#include <unistd.h>
 
+#include "globals.h"
 #include "queue.h"
 #include "xstr.h"
 #include "log.h"
@@ -43,6 +46,7 @@ queue_t *queue_get_next_source_for_nick(const char *nick)
         queue = calloc(1, sizeof(queue_t));
         queue->nick = xstrdup(nick);
         queue->is_filelist = true;
+        queue->segment = -1;
         queue->auto_matched = ((qf->flags & QUEUE_TARGET_AUTO_MATCHED)
                 == QUEUE_TARGET_AUTO_MATCHED);
         return queue;
@@ -56,6 +60,7 @@ queue_t *queue_get_next_source_for_nick(const char *nick)
         queue = calloc(1, sizeof(queue_t));
         queue->nick = xstrdup(nick);
         queue->is_directory = true;
+        queue->segment = -1;
         queue->target_filename = xstrdup(qd->target_directory);
         queue->source_filename = xstrdup(qd->source_directory);
         return queue;
@@ -66,18 +71,15 @@ queue_t *queue_get_next_source_for_nick(const char *nick)
     queue_source_t *qs_candidate = NULL;
     queue_target_t *qt_candidate = NULL;
 
-    struct queue_source *qs;
-    TAILQ_FOREACH(qs, &q_store->sources, link)
+    struct queue_source *qs = NULL;
+    while((qs = queue_db_next_source_by_nick(nick, qs)) != NULL)
     {
-        if(strcmp(qs->nick, nick) != 0)
-            continue;
-
         queue_target_t *qt = queue_lookup_target(qs->target_filename);
         if(qt == NULL)
             continue;
 
-        if((qt->flags & QUEUE_TARGET_ACTIVE) == QUEUE_TARGET_ACTIVE)
-            /* skip targets already active */
+        if(!queue_target_available(qt))
+            /* skip targets already active (or all segments active) */
             continue;
 
         if(qt->priority == 0)
@@ -99,8 +101,15 @@ queue_t *queue_get_next_source_for_nick(const char *nick)
         queue->nick = xstrdup(nick);
         queue->source_filename = xstrdup(qs_candidate->source_filename);
         queue->target_filename = xstrdup(qs_candidate->target_filename);
-        queue->tth = xstrdup(qt_candidate->tth);
+        char tth[TTH_BASE32_LEN + 1];
+        queue->tth = xstrdup(queue_target_tth(qt_candidate, tth));
         queue->size = qt_candidate->size;
+        queue->segment = -1;
+        if(qt_candidate->nsegments > 0)
+        {
+            queue_segment_fill(queue, qt_candidate,
+                    queue_segment_find_free(qt_candidate));
+        }
         queue->is_filelist = false;
         queue->auto_matched = ((qt_candidate->flags & QUEUE_TARGET_AUTO_MATCHED)
                 == QUEUE_TARGET_AUTO_MATCHED);
@@ -177,7 +186,7 @@ int queue_add_internal(const char *nick, const char *source_filename,
     else
     {
         qt = queue_lookup_target(target_filename);
-        if(qt && (qt->size != size || qt->tth[0] == 0))
+        if(qt && (qt->size != size || !qt->has_tth))
         {
             /* Size must also match, and there should be no TTH (?) */
             qt = NULL;
@@ -191,6 +200,8 @@ int queue_add_internal(const char *nick, const char *source_filename,
     {
 	qt = queue_target_add(target_filename, tth, target_directory, size, 0,
 		default_priority, 0);
+	if(qt == NULL)
+	    return -1;
     }
 
     /* setup a source and add it to the queue */
@@ -230,7 +241,7 @@ int queue_add_filelist(const char *nick, bool auto_matched_filelist)
 	qf->priority = 5;
 	qf->flags = flags;
 
-	TAILQ_INSERT_TAIL(&q_store->filelists, qf, link);
+	queue_db_insert_filelist(qf);
 	if(!q_store->loading)
 	    queue_db_print_add_filelist(q_store->fp, qf);
         nc_send_filelist_added_notification(nc_default(), nick, qf->priority);
@@ -267,13 +278,10 @@ queue_remove_source(const char *target_filename, const char *nick)
     return_val_if_fail(target_filename, -1);
     return_val_if_fail(nick, -1);
 
-    struct queue_source *qs;
-    TAILQ_FOREACH(qs, &q_store->sources, link)
+    struct queue_source *qs = NULL;
+    while((qs = queue_db_next_source_by_target(target_filename, qs)) != NULL)
     {
-        if(strcmp(qs->nick, nick) != 0)
-            continue;
-
-        if(strcmp(target_filename, qs->target_filename) == 0)
+        if(strcmp(qs->nick, nick) == 0)
         {
             DEBUG("removing source [%s], target [%s]",
                     nick, qs->target_filename);
@@ -315,6 +323,28 @@ queue_set_active(queue_t *queue, int flag)
 		queue_target_t *qt =
 			queue_lookup_target(queue->target_filename);
 		return_if_fail(qt);
+
+		if(queue->segment >= 0)
+		{
+			return_if_fail(queue->segment < qt->nsegments);
+			if(flag)
+				qt->segments[queue->segment] =
+					QUEUE_SEGMENT_ACTIVE;
+			else if(qt->segments[queue->segment] ==
+				QUEUE_SEGMENT_ACTIVE)
+				qt->segments[queue->segment] =
+					QUEUE_SEGMENT_FREE;
+
+			/* the target is active as long as any segment is */
+			unsigned i;
+			for(i = 0; i < qt->nsegments; i++)
+			{
+				if(qt->segments[i] == QUEUE_SEGMENT_ACTIVE)
+					break;
+			}
+			flag = (i < qt->nsegments);
+		}
+
 		if(flag)
 			qt->flags |= QUEUE_TARGET_ACTIVE;
 		else
@@ -324,6 +354,31 @@ queue_set_active(queue_t *queue, int flag)
 	/* no need to make this persistent as it's volatile information */
 }
 
+/* Discards the incomplete file of a target whose data doesn't match its
+ * TTH. The target is left in the queue, so it is downloaded again. Unless
+ * the download was resumed, the data came from <nick> only, which is no
+ * longer used as a source.
+ */
+void queue_discard_corrupt(queue_t *queue, const char *nick, bool resumed)
+{
+    return_if_fail(queue);
+    return_if_fail(queue->target_filename);
+    return_if_fail(nick);
+
+    char *target;
+    if(asprintf(&target, "%s/%s", global_incomplete_directory,
+                queue->target_filename) != -1)
+    {
+        if(unlink(target) != 0 && errno != ENOENT)
+            WARNING("%s: %s", target, strerror(errno));
+        free(target);
+    }
+
+    if(!resumed)
+        queue_remove_source(queue->target_filename, nick);
+    queue_set_active(queue, 0);
+}
+
 void queue_set_size(queue_t *queue, uint64_t size)
 {
     return_if_fail(queue);
@@ -333,6 +388,8 @@ void queue_set_size(queue_t *queue, uint64_t size)
 
     queue_target_t *qt = queue_lookup_target(queue->target_filename);
     return_if_fail(qt);
+    /* the segments are laid out from the size */
+    return_if_fail(qt->nsegments == 0);
 
     qt->size = size;
     queue->size = size;
@@ -397,8 +454,10 @@ void queue_send_to_ui(void)
     struct queue_target *qt;
     TAILQ_FOREACH(qt, &q_store->targets, link)
     {
+        char tth[TTH_BASE32_LEN + 1];
         nc_send_queue_target_added_notification(nc_default(),
-                qt->filename, qt->size, qt->tth, qt->priority);
+                qt->filename, qt->size, queue_target_tth(qt, tth),
+                qt->priority);
     }
 
     /* Send all sources
@@ -413,7 +472,7 @@ void queue_send_to_ui(void)
 
 #ifdef TEST
 
-#include "globals.h"
+#include "tigertree.h"
 #include "unit_test.h"
 
 int got_filelist_notification = 0;
@@ -497,12 +556,31 @@ void test_add_file(void)
     struct queue_target *qt = queue_lookup_target_by_tth(q->tth);
     fail_unless(qt);
 
-    /* mark this file as active (ie, it is currently being downloaded) */
+    /* the file is large enough to be downloaded in segments */
+    fail_unless(qt->nsegments == 5);
+    fail_unless(q->segment == 0);
+    fail_unless(q->length == QUEUE_SEGMENT_MIN_SIZE);
+
+    /* mark this segment as active (ie, it is currently being downloaded) */
     queue_set_active(q, 1);
     queue_free(q);
 
-    /* there shouldn't be any more sources for foo, the one and only file is
-     * already active */
+    /* the next segment can be downloaded from another connection */
+    int i;
+    for(i = 1; i < qt->nsegments; i++)
+    {
+        q = queue_get_next_source_for_nick("foo");
+        fail_unless(q);
+        fail_unless(q->segment == i);
+        fail_unless(q->offset == i * QUEUE_SEGMENT_MIN_SIZE);
+        if(i == qt->nsegments - 1)
+            fail_unless(q->length == 17471142ULL - 4 * QUEUE_SEGMENT_MIN_SIZE);
+        queue_set_active(q, 1);
+        queue_free(q);
+    }
+
+    /* there shouldn't be any more sources for foo, all segments of the one
+     * and only file are already active */
     fail_unless(!queue_has_source_for_nick("foo"));
 
     test_teardown();
@@ -533,11 +611,17 @@ void test_add_source(void)
     fail_unless(strcmp(q->source_filename,
                 "another/path/to_the/same-file.img") == 0);
 
-    /* mark this file as active (ie, it is currently being downloaded) */
+    /* mark this segment as active (ie, it is currently being downloaded) */
     queue_set_active(q, 1);
+    fail_unless(q->segment == 0);
+    queue_free(q);
 
-    /* this file is being downloaded from "bar", nothing to do for "foo" */
-    fail_unless(!queue_has_source_for_nick("foo"));
+    /* the first segment is being downloaded from "bar", "foo" can download
+     * the next one at the same time */
+    q = queue_get_next_source_for_nick("foo");
+    fail_unless(q);
+    fail_unless(strcmp(q->target_filename, "file.img") == 0);
+    fail_unless(q->segment == 1);
     queue_free(q);
 
     got_target_removed_notification = 0;
@@ -671,6 +755,15 @@ void test_persistence(void)
     /* ...and remove it */
     fail_unless(queue_remove_target("local_file:0") == 0);
 
+    /* mark some segments as downloaded, one of them found corrupt */
+    fail_unless(qt->nsegments == 5);
+    unsigned char root[24];
+    memset(root, 0x5A, sizeof(root));
+    queue_db_set_segment_done("file.img", 0, root);
+    queue_db_set_segment_done("file.img", 2, NULL);
+    queue_db_set_segment_done("file.img", 3, root);
+    queue_db_reset_segment("file.img", 3);
+
     /* close and re-open the queue
      */
     queue_close();
@@ -681,12 +774,22 @@ void test_persistence(void)
     qt = queue_lookup_target("file.img");
     fail_unless(qt);
     fail_unless(qt->priority == 4);
-
-    /* look up the standard source */
+    fail_unless(qt->nsegments == 5);
+    fail_unless(qt->segments[0] == QUEUE_SEGMENT_DONE);
+    fail_unless(qt->segments[1] == QUEUE_SEGMENT_FREE);
+    fail_unless(qt->segments[2] == QUEUE_SEGMENT_DONE);
+    fail_unless(qt->segments[3] == QUEUE_SEGMENT_FREE);
+    fail_unless(memcmp(qt->segment_roots, root, sizeof(root)) == 0);
+    fail_unless(qt->segment_roots[2 * sizeof(root)] == 0);
+    fail_unless(queue_segment_bytes_done(qt) == 2 * QUEUE_SEGMENT_MIN_SIZE);
+
+    /* look up the standard source, it should get the first missing segment */
     queue_t *q = queue_get_next_source_for_nick("foo");
     fail_unless(q);
     fail_unless(q->target_filename);
     fail_unless(strcmp(q->target_filename, "file.img") == 0);
+    fail_unless(q->segment == 1);
+    fail_unless(q->offset == QUEUE_SEGMENT_MIN_SIZE);
     queue_free(q);
 
     /* look up the extra source */
@@ -740,7 +843,7 @@ void test_target_name_clashes(void)
      */
     fail_unless(queue_add("bar", "another/path/to/another-file.img", 17471142,
                 "file.img", /* same target name as added in test_setup() */
-		"DIFFERENTTTHTHATTHEPREVIOUSONE000123456") == 0);
+		"DIFFERENTTTHTHATTHEPREVIOUSONEAAA223456") == 0);
 
     /* verify we can look up the download with a modified target filename */
     queue_t *q = queue_get_next_source_for_nick("bar");
@@ -751,7 +854,7 @@ void test_target_name_clashes(void)
 
     /* add yet another target with same name */
 
-    const char *tth2 = "YETANOTHERTTHFORYETANOTHERFILE000123456";
+    const char *tth2 = "YETANOTHERTTHFORYETANOTHERFILEAAA223456";
     fail_unless(queue_add("bar",
 	"yet/another/path/to/yet-another-file.img", 3123414,
 	"file.img", /* same target name as added in test_setup() */
@@ -766,6 +869,153 @@ void test_target_name_clashes(void)
     test_teardown();
 }
 
+/* Leaves of a large target must be accepted however many there are. */
+void test_many_leaves(void)
+{
+    INFO("testing many leaves");
+    test_setup();
+    global_incomplete_directory = "/tmp/sp-queue-test.d";
+
+    unsigned nleaves = 4096;
+    unsigned char *leaves = malloc(nleaves * TIGERSIZE);
+    unsigned i;
+    for(i = 0; i < nleaves * TIGERSIZE; i++)
+        leaves[i] = i * 7;
+
+    tth_t root;
+    char tth[TTH_BASE32_LEN + 1];
+    tt_leaves_root(leaves, nleaves, root.data);
+    tth_to_base32(&root, tth);
+
+    fail_unless(queue_add("foo", "remote/big.img", nleaves * 1024ULL,
+                "big.img", tth) == 0);
+    fail_unless(!queue_segment_has_leaves("big.img"));
+
+    char *filename = queue_segment_leaves_filename("big.img");
+    FILE *fp = fopen(filename, "w");
+    fail_unless(fp);
+    fail_unless(fwrite(leaves, TIGERSIZE, nleaves, fp) == nleaves);
+    fclose(fp);
+
+    fail_unless(queue_segment_check_leaves("big.img") == 0);
+    fail_unless(queue_segment_has_leaves("big.img"));
+    fail_unless(access(filename, F_OK) == 0);
+
+    free(filename);
+    free(leaves);
+    global_incomplete_directory = NULL;
+    test_teardown();
+}
+
+/* Data that doesn't match the TTH is discarded and downloaded again. */
+void test_corrupt_download(void)
+{
+    INFO("testing corrupt downloads");
+    test_setup();
+    global_incomplete_directory = "/tmp/sp-queue-test.d";
+
+    /* segments are reset when their combined root doesn't match */
+    queue_target_t *qt = queue_lookup_target("file.img");
+    fail_unless(qt);
+    fail_unless(qt->nsegments == 5);
+
+    unsigned char root[TIGERSIZE];
+    memset(root, 0x5A, sizeof(root));
+    int i;
+    for(i = 0; i < qt->nsegments; i++)
+    {
+        queue_t *q = queue_get_next_source_for_nick("foo");
+        fail_unless(q);
+        fail_unless(q->segment == i);
+        queue_set_active(q, 1);
+        fail_unless(queue_segment_finish(q, root) == 0);
+        queue_free(q);
+    }
+    for(i = 0; i < qt->nsegments; i++)
+        fail_unless(qt->segments[i] == QUEUE_SEGMENT_FREE);
+    fail_unless(queue_segment_bytes_done(qt) == 0);
+
+    /* and so are segments without a root, which can't be verified */
+    for(i = 0; i < qt->nsegments; i++)
+    {
+        queue_t *q = queue_get_next_source_for_nick("foo");
+        fail_unless(q);
+        fail_unless(q->segment == i);
+        queue_set_active(q, 1);
+        fail_unless(queue_segment_finish(q, NULL) == 0);
+        queue_free(q);
+    }
+    for(i = 0; i < qt->nsegments; i++)
+        fail_unless(qt->segments[i] == QUEUE_SEGMENT_FREE);
+
+    queue_t *q = queue_get_next_source_for_nick("foo");
+    fail_unless(q);
+    fail_unless(q->segment == 0);
+    queue_free(q);
+
+    /* a whole file is removed, and so is the source it came from */
+    fail_unless(queue_add("bar", "remote/small.img", 4096, "small.img",
+                "ABCDEFGHIJKLMNOPQRSTUVWXYZ234567ABCDEFG") == 0);
+    fail_unless(queue_add_source("baz", "small.img", "remote/small.img") == 0);
+
+    q = queue_get_next_source_for_nick("bar");
+    fail_unless(q);
+    fail_unless(q->segment == -1);
+    queue_set_active(q, 1);
+    FILE *fp = fopen("/tmp/sp-queue-test.d/small.img", "w");
+    fail_unless(fp);
+    fclose(fp);
+
+    queue_discard_corrupt(q, "bar", false);
+    queue_free(q);
+    fail_unless(access("/tmp/sp-queue-test.d/small.img", F_OK) != 0);
+    fail_unless(queue_lookup_target("small.img"));
+    fail_unless(!queue_has_source_for_nick("bar"));
+
+    /* the data of a resumed download may have come from another source */
+    q = queue_get_next_source_for_nick("baz");
+    fail_unless(q);
+    fail_unless(strcmp(q->target_filename, "small.img") == 0);
+    queue_set_active(q, 1);
+    queue_discard_corrupt(q, "baz", true);
+    queue_free(q);
+    fail_unless(queue_has_source_for_nick("baz"));
+
+    global_incomplete_directory = NULL;
+    test_teardown();
+}
+
+/* A download resumed after a crash starts from the last synced offset. */
+void test_synced_offset(void)
+{
+    INFO("testing synced offsets");
+    test_setup();
+
+    fail_unless(queue_add("bar", "remote/small.img", 4096, "sm:all.img",
+                "ABCDEFGHIJKLMNOPQRSTUVWXYZ234567ABCDEFG") == 0);
+    queue_target_t *qt = queue_lookup_target("sm:all.img");
+    fail_unless(qt);
+    fail_unless(qt->nsegments == 0);
+    fail_unless(qt->synced_offset == UINT64_MAX);
+
+    queue_db_set_synced_offset("sm:all.img", 0);
+    queue_db_set_synced_offset("sm:all.img", 2048);
+
+    /* the offset is saved with the queue */
+    queue_close();
+    queue_init();
+    qt = queue_lookup_target("sm:all.img");
+    fail_unless(qt);
+    fail_unless(qt->synced_offset == 2048);
+
+    /* targets from older versions have no synced offset */
+    qt = queue_lookup_target("file.img");
+    fail_unless(qt);
+    fail_unless(qt->synced_offset == UINT64_MAX);
+
+    test_teardown();
+}
+
 int main(void)
 {
     sp_log_set_level("debug");
@@ -782,6 +1032,9 @@ int main(void)
     test_filelist_dups();
     test_persistence();
     test_target_name_clashes();
+    test_many_leaves();
+    test_corrupt_download();
+    test_synced_offset();
 
     return 0;
 }
@@ -21,18 +21,33 @@
 #define QUEUE_TARGET_AUTO_MATCHED 2
 #define QUEUE_DIRECTORY_RESOLVED 4
 
+/* state of each segment of a target */
+#define QUEUE_SEGMENT_FREE 0
+#define QUEUE_SEGMENT_ACTIVE 1
+#define QUEUE_SEGMENT_DONE 2
+
+/* Targets with a TTH larger than QUEUE_SEGMENT_MIN_SIZE are split into
+ * segments of a power-of-two size, so that they can be downloaded from
+ * several sources in parallel. */
+#define QUEUE_SEGMENT_MIN_SIZE (4*1024*1024)
+#define QUEUE_SEGMENT_MAX_COUNT 1024
+
 #include <stdint.h>
 #include <stdio.h>
 #include <time.h>
 #include <stdbool.h>
 
+#include "htable.h"
+#include "tth.h"
+
 typedef struct queue_target queue_target_t;
 struct queue_target
 {
 	TAILQ_ENTRY(queue_target) link;
 
 	char *filename; /* target filename in local filesystem */
-	char tth[40];
+	tth_t tth;
+	bool has_tth;
 
 	char *target_directory; /* relative to download directory */
 	uint64_t size;
@@ -40,12 +55,33 @@ struct queue_target
 	time_t ctime;
 	int priority;
 	unsigned seq;
+
+	uint64_t segment_size;
+	unsigned nsegments; /* 0 if not downloaded in segments */
+	unsigned char *segments; /* QUEUE_SEGMENT_* state of each segment */
+	unsigned char *segment_roots; /* tiger tree root of each done segment,
+					 all zeros if unknown */
+	uint64_t synced_offset; /* data of the incomplete file known to be
+				   on disk, UINT64_MAX if unknown */
+};
+
+/* The sources with the same nick, or for the same target, in the order
+ * they were added. Indexed by the key.
+ */
+struct queue_source_list
+{
+	char *key;
+	TAILQ_HEAD(, queue_source) sources;
 };
 
 typedef struct queue_source queue_source_t;
 struct queue_source
 {
 	TAILQ_ENTRY(queue_source) link;
+	TAILQ_ENTRY(queue_source) nick_link;
+	TAILQ_ENTRY(queue_source) target_link;
+	struct queue_source_list *by_nick;
+	struct queue_source_list *by_target;
 
 	char *target_filename;
 	char *nick;
@@ -88,6 +124,13 @@ struct queue_store
 	TAILQ_HEAD(, queue_source) sources;
 	TAILQ_HEAD(, queue_filelist) filelists;
 	TAILQ_HEAD(, queue_directory) directories;
+
+	/* indexes */
+	htable_t targets_by_filename;
+	htable_t targets_by_tth;
+	htable_t sources_by_nick; /* queue_source_list */
+	htable_t sources_by_target; /* queue_source_list */
+	htable_t filelists_by_nick;
 };
 
 typedef struct queue queue_t;
@@ -99,6 +142,8 @@ struct queue
 	char *tth;
 	uint64_t size;
 	uint64_t offset;
+	int segment; /* segment index, or -1 for the whole file */
+	uint64_t length; /* bytes in segment */
 	bool is_filelist;
 	bool is_directory;
 	bool auto_matched;
@@ -111,6 +156,7 @@ void queue_free(queue_t *queue);
 
 queue_target_t *queue_lookup_target(const char *target_filename);
 queue_target_t *queue_lookup_target_by_tth(const char *tth);
+const char *queue_target_tth(const queue_target_t *qt, char *buf);
 
 struct queue_target *queue_target_add(const char *target_filename,
 	const char *tth,
@@ -135,6 +181,8 @@ int queue_db_print_remove_source(FILE *fp, struct queue_source *qs);
 int queue_db_print_add_filelist(FILE *fp, struct queue_filelist *qf);
 int queue_db_print_add_directory(FILE *fp, struct queue_directory *qd);
 int queue_db_print_set_resolved(FILE *fp, struct queue_directory *qd);
+int queue_db_print_segment(FILE *fp, struct queue_target *qt, unsigned segment);
+int queue_db_print_synced_offset(FILE *fp, struct queue_target *qt);
 
 int queue_add_source(const char *nick, const char *target_filename,
         const char *source_filename);
@@ -142,8 +190,13 @@ int queue_add_source(const char *nick, const char *target_filename,
 int queue_remove_sources(const char *target_filename);
 int queue_remove_sources_by_nick(const char *nick);
 
+queue_source_t *queue_db_next_source_by_nick(const char *nick,
+        queue_source_t *qs);
+queue_source_t *queue_db_next_source_by_target(const char *target_filename,
+        queue_source_t *qs);
+
 int queue_add_filelist(const char *nick, bool auto_matched_filelist);
-int queue_db_add_filelist(const char *nick, queue_filelist_t *qf);
+void queue_db_insert_filelist(queue_filelist_t *qf);
 int queue_update_filelist(const char *nick, queue_filelist_t *qf);
 int queue_remove_filelist(const char *nick);
 
@@ -156,6 +209,11 @@ int queue_db_remove_directory(const char *target_directory);
 
 void queue_db_set_resolved(const char *target_directory, unsigned nfiles);
 
+void queue_db_set_segment_done(const char *target_filename, unsigned segment,
+	const unsigned char *root);
+void queue_db_reset_segment(const char *target_filename, unsigned segment);
+void queue_db_set_synced_offset(const char *target_filename, uint64_t offset);
+
 queue_filelist_t *queue_lookup_filelist(const char *nick);
 
 int queue_add_internal(const char *nick, const char *remote_filename,
@@ -173,6 +231,7 @@ int queue_remove_directory(const char *target_directory);
 void queue_send_to_ui(void);
 
 int queue_remove_source(const char *local_filename, const char *nick);
+void queue_discard_corrupt(queue_t *queue, const char *nick, bool resumed);
 int queue_add(const char *nick, const char *remote_filename, uint64_t size,
         const char *local_filename, const char *tth);
 int queue_add_directory(const char *nick,
@@ -181,6 +240,21 @@ int queue_add_directory(const char *nick,
 int queue_remove_nick(const char *nick);
 void queue_set_priority(const char *target_filename, unsigned priority);
 
+/* queue_segment.c
+ */
+void queue_segment_init(queue_target_t *qt);
+int queue_segment_find_free(queue_target_t *qt);
+bool queue_target_available(queue_target_t *qt);
+void queue_segment_fill(queue_t *queue, queue_target_t *qt, int segment);
+char *queue_segment_leaves_filename(const char *target_filename);
+unsigned queue_segment_load_leaves(const char *target_filename,
+        unsigned char **leaves_p);
+bool queue_segment_has_leaves(const char *target_filename);
+int queue_segment_check_leaves(const char *target_filename);
+int queue_segment_finish(queue_t *queue, const unsigned char *root);
+void queue_segment_remove_leaves(const char *target_filename);
+uint64_t queue_segment_bytes_done(queue_target_t *qt);
+
 /* queue_auto_search.c
  */
 void queue_auto_search_init(void);
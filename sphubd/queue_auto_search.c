@@ -85,13 +85,14 @@ static char *queue_auto_search_get_tth(void)
     struct queue_target *qt;
     TAILQ_FOREACH(qt, &q_store->targets, link)
     {
-        if(qt->tth[0] == 0) /* TTH required */
+        if(!qt->has_tth) /* TTH required */
             continue;
 
         if(qt->priority == 0) /* skip paused targets */
             continue;
 
-        if(is_recently_searched(qt->tth))
+        char tth_base32[TTH_BASE32_LEN + 1];
+        if(is_recently_searched(queue_target_tth(qt, tth_base32)))
             continue;
 
         ncandidates++;
@@ -112,7 +113,8 @@ static char *queue_auto_search_get_tth(void)
 
     if(qt_candidate)
     {
-        tth = strdup(qt_candidate->tth);
+        char tth_base32[TTH_BASE32_LEN + 1];
+        tth = strdup(queue_target_tth(qt_candidate, tth_base32));
         DEBUG("found tth [%s]", tth);
         struct recent_search_entry *e = calloc(1,
 	    sizeof(struct recent_search_entry));
@@ -161,7 +161,7 @@ void queue_trigger_connect_targets(queue_connect_callback_t connect_callback,
             continue;
         }
 
-        if((qt->flags && QUEUE_TARGET_ACTIVE) == QUEUE_TARGET_ACTIVE)
+        if(!queue_target_available(qt))
         {
             /* this target is already active (by another nick) */
             continue;
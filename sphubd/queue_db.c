@@ -24,6 +24,7 @@
 #include <string.h>
 #include <inttypes.h>
 
+#include "base32.h"
 #include "xstr.h"
 #include "globals.h"
 #include "log.h"
@@ -31,13 +32,101 @@
 #include "notifications.h"
 #include "quote.h"
 #include "compat.h"
+#include "tigertree.h"
 
 #define QUEUE_DB_FILENAME "queue2.db"
 
+/* initial number of buckets in the hash indexes, must be a power of 2 */
 struct queue_store *q_store = NULL;
 
 static void queue_db_normalize(void);
 
+static uint32_t
+queue_target_filename_hash(const void *record)
+{
+	return htable_hash_string(((const queue_target_t *)record)->filename);
+}
+
+static int
+queue_target_filename_match(const void *record, const void *key)
+{
+	return strcmp(((const queue_target_t *)record)->filename, key) == 0;
+}
+
+static uint32_t
+queue_target_tth_hash(const void *record)
+{
+	return tth_hash(&((const queue_target_t *)record)->tth);
+}
+
+static int
+queue_target_tth_match(const void *record, const void *key)
+{
+	const tth_t *tth = key;
+	return tth_equal(&((const queue_target_t *)record)->tth, tth);
+}
+
+static uint32_t
+queue_filelist_hash(const void *record)
+{
+	return htable_hash_string(((const queue_filelist_t *)record)->nick);
+}
+
+static int
+queue_filelist_match(const void *record, const void *key)
+{
+	return strcmp(((const queue_filelist_t *)record)->nick, key) == 0;
+}
+
+static uint32_t
+queue_source_list_hash(const void *record)
+{
+	return htable_hash_string(((const struct queue_source_list *)record)->key);
+}
+
+static int
+queue_source_list_match(const void *record, const void *key)
+{
+	return strcmp(((const struct queue_source_list *)record)->key, key) == 0;
+}
+
+/* Returns the list of sources with the key in the index, or NULL if none.
+ */
+static struct queue_source_list *
+queue_source_list_lookup(htable_t *index, const char *key)
+{
+	return htable_lookup(index, htable_hash_string(key),
+		queue_source_list_match, key);
+}
+
+/* Returns the list of sources with the key in the index, adding an empty
+ * one if needed.
+ */
+static struct queue_source_list *
+queue_source_list_get(htable_t *index, const char *key)
+{
+	struct queue_source_list *ql = queue_source_list_lookup(index, key);
+	if(ql == NULL)
+	{
+		ql = calloc(1, sizeof(struct queue_source_list));
+		ql->key = strdup(key);
+		TAILQ_INIT(&ql->sources);
+		htable_insert(index, ql);
+	}
+	return ql;
+}
+
+static void
+queue_source_list_release(htable_t *index, struct queue_source_list *ql)
+{
+	if(TAILQ_EMPTY(&ql->sources))
+	{
+		htable_remove(index, ql);
+		free(ql->key);
+		free(ql);
+	}
+}
+
 static void
 queue_parse_add_target(char *buf, size_t len)
 {
@@ -171,6 +260,49 @@ queue_parse_set_priority(char *buf, size_t len)
 	queue_set_priority(target_filename, priority);
 }
 
+static void
+queue_parse_segment(char *buf, size_t len, bool done)
+{
+	buf += 3;  /* skip past "=C:" or "-C:" */
+
+	/* syntax is 'target_filename:segment[:root]' */
+
+	char *target_filename = q_strsep(&buf, ":");
+	return_if_fail(*target_filename);
+	return_if_fail(buf && *buf);
+	char *segment_str = q_strsep(&buf, ":");
+	unsigned segment = strtoul(segment_str, NULL, 10);
+
+	if(done)
+	{
+		/* without a root the segment can't be verified, and is
+		 * downloaded again; decoding 39 characters spills 3 bits into
+		 * an extra byte */
+		unsigned char root[TIGERSIZE + 1];
+		bool has_root = buf && strlen(buf) == 39 &&
+			base32_decode_into(buf, 39, root) == TIGERSIZE;
+		queue_db_set_segment_done(target_filename, segment,
+			has_root ? root : NULL);
+	}
+	else
+		queue_db_reset_segment(target_filename, segment);
+}
+
+static void
+queue_parse_set_synced_offset(char *buf, size_t len)
+{
+	buf += 3;  /* skip past "=O:" */
+
+	/* syntax is 'target_filename:offset' */
+
+	char *target_filename = q_strsep(&buf, ":");
+	return_if_fail(*target_filename);
+	return_if_fail(buf && *buf);
+	uint64_t offset = strtoull(buf, NULL, 10);
+
+	queue_db_set_synced_offset(target_filename, offset);
+}
+
 static void
 queue_parse_remove_target(char *buf, size_t len)
 {
@@ -284,6 +416,18 @@ queue_load(void)
 		{
 			queue_parse_set_priority(buf, len);
 		}
+		else if(strncmp(buf, "=C:", 3) == 0)
+		{
+			queue_parse_segment(buf, len, true);
+		}
+		else if(strncmp(buf, "-C:", 3) == 0)
+		{
+			queue_parse_segment(buf, len, false);
+		}
+		else if(strncmp(buf, "=O:", 3) == 0)
+		{
+			queue_parse_set_synced_offset(buf, len);
+		}
 		else
 		{
 			ERROR("unknown directive on line %u",
@@ -330,6 +474,12 @@ queue_init(void)
 	TAILQ_INIT(&q_store->filelists);
 	TAILQ_INIT(&q_store->directories);
 
+	htable_init(&q_store->targets_by_filename, queue_target_filename_hash);
+	htable_init(&q_store->targets_by_tth, queue_target_tth_hash);
+	htable_init(&q_store->sources_by_nick, queue_source_list_hash);
+	htable_init(&q_store->sources_by_target, queue_source_list_hash);
+	htable_init(&q_store->filelists_by_nick, queue_filelist_hash);
+
 	queue_db_open_logfile();
 
 	return_if_fail(q_store->fp);
@@ -345,8 +495,13 @@ queue_target_free(struct queue_target *qt)
 	if(qt)
 	{
 		TAILQ_REMOVE(&q_store->targets, qt, link);
+		htable_remove(&q_store->targets_by_filename, qt);
+		if(qt->has_tth)
+			htable_remove(&q_store->targets_by_tth, qt);
 		free(qt->filename);
 		free(qt->target_directory);
+		free(qt->segments);
+		free(qt->segment_roots);
 		free(qt);
 	}
 }
@@ -357,6 +512,12 @@ queue_source_free(struct queue_source *qs)
 	if(qs)
 	{
 		TAILQ_REMOVE(&q_store->sources, qs, link);
+		TAILQ_REMOVE(&qs->by_nick->sources, qs, nick_link);
+		queue_source_list_release(&q_store->sources_by_nick,
+			qs->by_nick);
+		TAILQ_REMOVE(&qs->by_target->sources, qs, target_link);
+		queue_source_list_release(&q_store->sources_by_target,
+			qs->by_target);
 		free(qs->target_filename);
 		free(qs->nick);
 		free(qs->source_filename);
@@ -370,6 +531,7 @@ queue_filelist_free(struct queue_filelist *qf)
 	if(qf)
 	{
 		TAILQ_REMOVE(&q_store->filelists, qf, link);
+		htable_remove(&q_store->filelists_by_nick, qf);
 		free(qf->nick);
 		free(qf);
 	}
@@ -416,6 +578,12 @@ queue_close(void)
 	while((qd = TAILQ_FIRST(&q_store->directories)) != NULL)
 		queue_directory_free(qd);
 
+	htable_free(&q_store->targets_by_filename);
+	htable_free(&q_store->targets_by_tth);
+	htable_free(&q_store->sources_by_nick);
+	htable_free(&q_store->sources_by_target);
+	htable_free(&q_store->filelists_by_nick);
+
 	free(q_store);
 	q_store = NULL;
 
@@ -428,14 +596,9 @@ queue_lookup_target(const char *target_filename)
 	return_val_if_fail(q_store, NULL);
 	return_val_if_fail(target_filename, NULL);
 
-	struct queue_target *qt;
-	TAILQ_FOREACH(qt, &q_store->targets, link)
-	{
-		if(strcmp(qt->filename, target_filename) == 0)
-			return qt;
-	}
-
-	return NULL;
+	return htable_lookup(&q_store->targets_by_filename,
+		htable_hash_string(target_filename),
+		queue_target_filename_match, target_filename);
 }
 
 queue_target_t *
@@ -444,14 +607,24 @@ queue_lookup_target_by_tth(const char *tth)
 	return_val_if_fail(q_store, NULL);
 	return_val_if_fail(tth, NULL);
 
-	struct queue_target *qt;
-	TAILQ_FOREACH(qt, &q_store->targets, link)
-	{
-		if(strcmp(qt->tth, tth) == 0)
-			return qt;
-	}
+	tth_t binary_tth;
+	if(tth_from_base32(&binary_tth, tth) != 0)
+		return NULL;
 
-	return NULL;
+	return htable_lookup(&q_store->targets_by_tth, tth_hash(&binary_tth),
+		queue_target_tth_match, &binary_tth);
+}
+
+/* Returns the TTH of the target in base32 in buf, which must hold
+ * TTH_BASE32_LEN + 1 bytes, or an empty string if it has none.
+ */
+const char *
+queue_target_tth(const queue_target_t *qt, char *buf)
+{
+	if(qt->has_tth)
+		return tth_to_base32(&qt->tth, buf);
+	*buf = 0;
+	return buf;
 }
 
 queue_filelist_t *
@@ -460,14 +633,51 @@ queue_lookup_filelist(const char *nick)
 	return_val_if_fail(q_store, NULL);
 	return_val_if_fail(nick, NULL);
 
-	struct queue_filelist *qf;
-	TAILQ_FOREACH(qf, &q_store->filelists, link)
-	{
-		if(strcmp(qf->nick, nick) == 0)
-			return qf;
-	}
+	return htable_lookup(&q_store->filelists_by_nick,
+		htable_hash_string(nick), queue_filelist_match, nick);
+}
 
-	return NULL;
+void
+queue_db_insert_filelist(queue_filelist_t *qf)
+{
+	return_if_fail(q_store);
+	return_if_fail(qf);
+
+	TAILQ_INSERT_TAIL(&q_store->filelists, qf, link);
+	htable_insert(&q_store->filelists_by_nick, qf);
+}
+
+/* Returns the source for nick following qs, or the first source for nick if
+ * qs is NULL. Sources are returned in the order they were added.
+ */
+queue_source_t *
+queue_db_next_source_by_nick(const char *nick, queue_source_t *qs)
+{
+	return_val_if_fail(q_store, NULL);
+	return_val_if_fail(nick, NULL);
+
+	if(qs)
+		return TAILQ_NEXT(qs, nick_link);
+
+	struct queue_source_list *ql = queue_source_list_lookup(
+		&q_store->sources_by_nick, nick);
+	return ql ? TAILQ_FIRST(&ql->sources) : NULL;
+}
+
+/* Like queue_db_next_source_by_nick, but for sources of target_filename. */
+queue_source_t *
+queue_db_next_source_by_target(const char *target_filename,
+	queue_source_t *qs)
+{
+	return_val_if_fail(q_store, NULL);
+	return_val_if_fail(target_filename, NULL);
+
+	if(qs)
+		return TAILQ_NEXT(qs, target_link);
+
+	struct queue_source_list *ql = queue_source_list_lookup(
+		&q_store->sources_by_target, target_filename);
+	return ql ? TAILQ_FIRST(&ql->sources) : NULL;
 }
 
 queue_directory_t *
@@ -501,6 +711,17 @@ queue_target_add(const char *target_filename,
 	int index = 1;
 	char *base_filename = NULL, *extension = NULL;
 
+	tth_t binary_tth;
+	bool has_tth = false;
+	if(tth && *tth)
+	{
+		if(tth_from_base32(&binary_tth, tth) == 0)
+			has_tth = true;
+		else
+			WARNING("invalid TTH [%s] for [%s], ignored",
+				tth, target_filename);
+	}
+
 	struct queue_target *qt = NULL;
 	while(true)
 	{
@@ -512,8 +733,9 @@ queue_target_add(const char *target_filename,
 		 * the wrong way. The caller should only add another
 		 * source.
 		 */
-		if(tth && qt->tth)
-			return_val_if_fail(strcmp(tth, qt->tth) != 0, NULL);
+		if(has_tth && qt->has_tth)
+			return_val_if_fail(!tth_equal(&binary_tth, &qt->tth),
+				NULL);
 
 		if(base_filename == NULL)
 		{
@@ -544,14 +766,19 @@ queue_target_add(const char *target_filename,
 	DEBUG("adding target [%s]", unique_target_filename);
 
         qt = calloc(1, sizeof(struct queue_target));
-	qt->filename = strdup(unique_target_filename);
-        if(tth)
-            strlcpy(qt->tth, tth, sizeof(qt->tth));
+	qt->filename = unique_target_filename;
+        if(has_tth)
+        {
+            qt->tth = binary_tth;
+            qt->has_tth = true;
+        }
 	qt->target_directory = xstrdup(target_directory);
         qt->size = size;
         time(&qt->ctime);
 	qt->flags = flags;
         qt->priority = priority;
+	qt->synced_offset = UINT64_MAX;
+	queue_segment_init(qt);
 
 	if(sequence == 0)
 		qt->seq = q_store->sequence++;
@@ -563,14 +790,19 @@ queue_target_add(const char *target_filename,
 	}
 
 	TAILQ_INSERT_TAIL(&q_store->targets, qt, link);
+	htable_insert(&q_store->targets_by_filename, qt);
+	if(qt->has_tth)
+		htable_insert(&q_store->targets_by_tth, qt);
 
 	if(!q_store->loading)
 	{
 		queue_db_print_add_target(q_store->fp, qt);
 
 		/* notify UI:s */
+		char tth_base32[TTH_BASE32_LEN + 1];
 		nc_send_queue_target_added_notification(nc_default(),
-			qt->filename, qt->size, qt->tth, qt->priority);
+			qt->filename, qt->size,
+			queue_target_tth(qt, tth_base32), qt->priority);
 	}
 
 	return qt;
@@ -588,13 +820,10 @@ queue_add_source(const char *nick, const char *target_filename,
 	/* Lookup the (nick, target_filename) pair.
 	 */
 	struct queue_source *qs = NULL;
-	TAILQ_FOREACH(qs, &q_store->sources, link)
+	while((qs = queue_db_next_source_by_target(target_filename, qs)) != NULL)
 	{
-		if(strcmp(qs->nick, nick) == 0 &&
-		   strcmp(qs->target_filename, target_filename) == 0)
-		{
+		if(strcmp(qs->nick, nick) == 0)
 			break;
-		}
 	}
 
 	if(qs == NULL)
@@ -608,6 +837,12 @@ queue_add_source(const char *nick, const char *target_filename,
 			nick, source_filename, target_filename);
 
 		TAILQ_INSERT_TAIL(&q_store->sources, qs, link);
+		qs->by_nick = queue_source_list_get(&q_store->sources_by_nick,
+			qs->nick);
+		TAILQ_INSERT_TAIL(&qs->by_nick->sources, qs, nick_link);
+		qs->by_target = queue_source_list_get(
+			&q_store->sources_by_target, qs->target_filename);
+		TAILQ_INSERT_TAIL(&qs->by_target->sources, qs, target_link);
 
 		if(!q_store->loading)
 			queue_db_print_add_source(q_store->fp, qs);
@@ -736,18 +971,17 @@ queue_remove_sources(const char *target_filename)
 	DEBUG("removing sources for target [%s]", target_filename);
 
 	struct queue_source *qs, *next;
-	for(qs = TAILQ_FIRST(&q_store->sources); qs; qs = next)
+	for(qs = queue_db_next_source_by_target(target_filename, NULL); qs;
+		qs = next)
 	{
-		next = TAILQ_NEXT(qs, link);
-		if(strcmp(target_filename, qs->target_filename) == 0)
-		{
-			DEBUG("removing source [%s], target [%s]",
-				qs->nick, qs->target_filename);
+		next = queue_db_next_source_by_target(target_filename, qs);
 
-			if(!q_store->loading)
-				queue_db_print_remove_source(q_store->fp, qs);
-			queue_source_free(qs);
-		}
+		DEBUG("removing source [%s], target [%s]",
+			qs->nick, qs->target_filename);
+
+		if(!q_store->loading)
+			queue_db_print_remove_source(q_store->fp, qs);
+		queue_source_free(qs);
 	}
 
 	return 0;
@@ -761,12 +995,9 @@ queue_remove_sources_by_nick(const char *nick)
 	DEBUG("removing sources for nick [%s]", nick);
 
 	struct queue_source *qs, *next;
-	for(qs = TAILQ_FIRST(&q_store->sources); qs; qs = next)
+	for(qs = queue_db_next_source_by_nick(nick, NULL); qs; qs = next)
 	{
-		next = TAILQ_NEXT(qs, link);
-
-		if(strcmp(qs->nick, nick) != 0)
-			continue;
+		next = queue_db_next_source_by_nick(nick, qs);
 
 		DEBUG("removing source [%s], target [%s]",
 			nick, qs->target_filename);
@@ -887,6 +1118,67 @@ queue_db_set_resolved(const char *target_directory, unsigned nfiles)
 	}
 }
 
+/* Marks a segment as downloaded. The root of the segment is used to verify
+ * the target when all segments are done; it may be NULL if unknown.
+ */
+void
+queue_db_set_segment_done(const char *target_filename, unsigned segment,
+	const unsigned char *root)
+{
+	return_if_fail(target_filename);
+
+	queue_target_t *qt = queue_lookup_target(target_filename);
+	return_if_fail(qt);
+	return_if_fail(segment < qt->nsegments);
+
+	qt->segments[segment] = QUEUE_SEGMENT_DONE;
+
+	if(qt->segment_roots == NULL)
+		qt->segment_roots = calloc(qt->nsegments, TIGERSIZE);
+	if(root)
+		memcpy(qt->segment_roots + segment * TIGERSIZE, root,
+			TIGERSIZE);
+	else
+		memset(qt->segment_roots + segment * TIGERSIZE, 0, TIGERSIZE);
+
+	if(!q_store->loading)
+		queue_db_print_segment(q_store->fp, qt, segment);
+}
+
+void
+queue_db_reset_segment(const char *target_filename, unsigned segment)
+{
+	return_if_fail(target_filename);
+
+	queue_target_t *qt = queue_lookup_target(target_filename);
+	return_if_fail(qt);
+	return_if_fail(segment < qt->nsegments);
+
+	qt->segments[segment] = QUEUE_SEGMENT_FREE;
+
+	if(!q_store->loading)
+		queue_db_print_segment(q_store->fp, qt, segment);
+}
+
+/* Records how much of the incomplete file of a target is synced to disk.
+ * A download resumed after a crash starts from there.
+ */
+void
+queue_db_set_synced_offset(const char *target_filename, uint64_t offset)
+{
+	return_if_fail(target_filename);
+
+	queue_target_t *qt = queue_lookup_target(target_filename);
+	return_if_fail(qt);
+
+	if(qt->synced_offset == offset)
+		return;
+	qt->synced_offset = offset;
+
+	if(!q_store->loading)
+		queue_db_print_synced_offset(q_store->fp, qt);
+}
+
 struct queue_target *
 queue_target_duplicate(struct queue_target *qt)
 {
@@ -896,6 +1188,17 @@ queue_target_duplicate(struct queue_target *qt)
 	memcpy(qt_dup, qt, sizeof(struct queue_target));
 	qt_dup->filename = xstrdup(qt->filename);
 	qt_dup->target_directory = xstrdup(qt->target_directory);
+	if(qt->segments)
+	{
+		qt_dup->segments = malloc(qt->nsegments);
+		memcpy(qt_dup->segments, qt->segments, qt->nsegments);
+	}
+	if(qt->segment_roots)
+	{
+		qt_dup->segment_roots = malloc(qt->nsegments * TIGERSIZE);
+		memcpy(qt_dup->segment_roots, qt->segment_roots,
+			qt->nsegments * TIGERSIZE);
+	}
 
 	return qt_dup;
 }
@@ -908,13 +1211,14 @@ queue_db_print_add_target(FILE *fp, struct queue_target *qt)
 
 	char *tmp1 = str_quote_backslash(qt->filename, ":");
 	char *tmp2 = str_quote_backslash(qt->target_directory, ":");
+	char tth_base32[TTH_BASE32_LEN + 1];
 
 	int rc = fprintf(fp,
 		"+T:%s:%s:%"PRIu64":%s:%u:%lu:%i:%u\n",
 		tmp1,
 		tmp2 ? tmp2 : "",
 		qt->size,
-		qt->tth ? qt->tth : "",
+		queue_target_tth(qt, tth_base32),
 		qt->flags,
 		(unsigned long)qt->ctime,
 		qt->priority,
@@ -1005,6 +1309,47 @@ queue_db_print_set_resolved(FILE *fp, struct queue_directory *qd)
 	return rc;
 }
 
+/* Logs the state of a segment: "=C" and its root if done, otherwise "-C". */
+int
+queue_db_print_segment(FILE *fp, struct queue_target *qt, unsigned segment)
+{
+	return_val_if_fail(fp, -1);
+	return_val_if_fail(qt, -1);
+	return_val_if_fail(segment < qt->nsegments, -1);
+
+	static const unsigned char unknown_root[TIGERSIZE];
+	char root_base32[40] = "";
+	if(qt->segments[segment] == QUEUE_SEGMENT_DONE &&
+	   memcmp(qt->segment_roots + segment * TIGERSIZE, unknown_root,
+		TIGERSIZE) != 0)
+	{
+		base32_encode_into(qt->segment_roots + segment * TIGERSIZE,
+			TIGERSIZE, root_base32);
+		root_base32[39] = 0;
+	}
+
+	char *tmp = str_quote_backslash(qt->filename, ":");
+	int rc = fprintf(fp, "%s:%s:%u%s%s\n",
+		qt->segments[segment] == QUEUE_SEGMENT_DONE ? "=C" : "-C",
+		tmp, segment, *root_base32 ? ":" : "", root_base32);
+	free(tmp);
+
+	return rc;
+}
+
+int
+queue_db_print_synced_offset(FILE *fp, struct queue_target *qt)
+{
+	return_val_if_fail(fp, -1);
+	return_val_if_fail(qt, -1);
+
+	char *tmp = str_quote_backslash(qt->filename, ":");
+	int rc = fprintf(fp, "=O:%s:%"PRIu64"\n", tmp, qt->synced_offset);
+	free(tmp);
+
+	return rc;
+}
+
 static int
 queue_db_save(FILE *fp)
 {
@@ -1018,6 +1363,18 @@ queue_db_save(FILE *fp)
 	{
 		if(queue_db_print_add_target(fp, qt) < 0)
 			return -1;
+
+		unsigned i;
+		for(i = 0; i < qt->nsegments; i++)
+		{
+			if(qt->segments[i] == QUEUE_SEGMENT_DONE &&
+			   queue_db_print_segment(fp, qt, i) < 0)
+				return -1;
+		}
+
+		if(qt->synced_offset != UINT64_MAX &&
+		   queue_db_print_synced_offset(fp, qt) < 0)
+			return -1;
 	}
 
 	/* save sources */
@@ -40,6 +40,7 @@ static void queue_resolve_directory_recursively(const char *nick,
 {
     fl_file_t *file;
     int num_returned_bytes;
+    char *path = fl_dir_path_dup(root, NULL);
     TAILQ_FOREACH(file, &root->files, link)
     {
         char *target;
@@ -55,12 +56,13 @@ static void queue_resolve_directory_recursively(const char *nick,
         else
         {
             char *source;
-            num_returned_bytes = asprintf(&source, "%s\\%s", root->path, file->name);
+            num_returned_bytes = asprintf(&source, "%s\\%s", path, file->name);
             if (num_returned_bytes == -1)
                 DEBUG("asprintf did not return anything");
 
+            char tth[TTH_BASE32_LEN + 1];
             queue_add_internal(nick, source, file->size, target,
-                    file->tth, 0, target_directory);
+                    fl_file_tth(file, tth), 0, target_directory);
 
             if(nfiles_p)
                 (*nfiles_p)++;
@@ -68,6 +70,7 @@ static void queue_resolve_directory_recursively(const char *nick,
         }
         free(target);
     }
+    free(path);
 }
 
 /* Resolves all files and subdirectories in a directory download request
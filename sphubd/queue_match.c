@@ -86,7 +86,6 @@ static void queue_match_filelist_event(int fd, short why, void *data)
 
     if(fl_parse_xml_chunk(udata->fl_ctx) != 0)
     {
-        fl_free_dir(udata->fl_ctx->root);
         fl_xml_free_context(udata->fl_ctx);
 
         DEBUG("done matching queue against %s's filelist", udata->nick);
@@ -0,0 +1,372 @@
+/*
+ * Copyright (c) 2007 Martin Hedenfalk <martin@bzero.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Segmented downloads.
+ *
+ * A target with a TTH is split into segments of a power-of-two size, each
+ * downloaded by its own client connection with a ranged request. Segments
+ * are either free, active (being downloaded) or done. Only done segments are
+ * logged in the queue database; active segments become free again if the
+ * daemon is restarted.
+ *
+ * The data of each segment is hashed as it is received, and the root of the
+ * segment is logged when it is done. The leaves of the hash tree (TTHL) are
+ * fetched into a .tthl file next to the incomplete target. When all segments
+ * covering a leaf are done, their roots are combined and compared with the
+ * leaf; without leaves, all segment roots are combined and compared with the
+ * TTH. Segments covering a corrupt leaf are reset and downloaded again.
+ */
+
+#include "sys_queue.h"
+
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "base32.h"
+#include "globals.h"
+#include "log.h"
+#include "queue.h"
+#include "tigertree.h"
+
+/* Sets up the segments of a target from its size. Any previous segment
+ * state is discarded.
+ */
+void
+queue_segment_init(queue_target_t *qt)
+{
+	return_if_fail(qt);
+
+	free(qt->segments);
+	qt->segments = NULL;
+	qt->nsegments = 0;
+	qt->segment_size = 0;
+
+	if(!qt->has_tth || qt->size <= QUEUE_SEGMENT_MIN_SIZE)
+		return;
+
+	uint64_t segment_size = QUEUE_SEGMENT_MIN_SIZE;
+	while((qt->size + segment_size - 1) / segment_size >
+		QUEUE_SEGMENT_MAX_COUNT)
+	{
+		segment_size *= 2;
+	}
+
+	qt->segment_size = segment_size;
+	qt->nsegments = (qt->size + segment_size - 1) / segment_size;
+	qt->segments = calloc(qt->nsegments, 1);
+}
+
+/* Returns the index of the first free segment, or -1 if all segments are
+ * active or done.
+ */
+int
+queue_segment_find_free(queue_target_t *qt)
+{
+	return_val_if_fail(qt, -1);
+
+	unsigned i;
+	for(i = 0; i < qt->nsegments; i++)
+	{
+		if(qt->segments[i] == QUEUE_SEGMENT_FREE)
+			return i;
+	}
+
+	return -1;
+}
+
+/* Returns true if another download can be started for the target. */
+bool
+queue_target_available(queue_target_t *qt)
+{
+	return_val_if_fail(qt, false);
+
+	if(qt->nsegments > 0)
+		return queue_segment_find_free(qt) != -1;
+	return (qt->flags & QUEUE_TARGET_ACTIVE) == 0;
+}
+
+void
+queue_segment_fill(queue_t *queue, queue_target_t *qt, int segment)
+{
+	return_if_fail(queue);
+	return_if_fail(qt);
+	return_if_fail(segment >= 0 && segment < qt->nsegments);
+
+	queue->segment = segment;
+	queue->offset = segment * qt->segment_size;
+	queue->length = qt->segment_size;
+	if(queue->offset + queue->length > qt->size)
+		queue->length = qt->size - queue->offset;
+}
+
+/* Returns the filename of the leaves of the target in the incomplete
+ * directory. Should be freed by the caller.
+ */
+char *
+queue_segment_leaves_filename(const char *target_filename)
+{
+	char *filename;
+	if(asprintf(&filename, "%s/%s.tthl", global_incomplete_directory,
+		target_filename) == -1)
+	{
+		return NULL;
+	}
+	return filename;
+}
+
+/* Loads the leaves of the target. Returns the number of leaves, or 0 if no
+ * usable leaves are available. The leaves should be freed by the caller.
+ */
+unsigned
+queue_segment_load_leaves(const char *target_filename,
+	unsigned char **leaves_p)
+{
+	*leaves_p = NULL;
+
+	char *filename = queue_segment_leaves_filename(target_filename);
+	return_val_if_fail(filename, 0);
+
+	unsigned nleaves = 0;
+	FILE *fp = fopen(filename, "r");
+	struct stat stbuf;
+	if(fp && fstat(fileno(fp), &stbuf) == 0 &&
+	   stbuf.st_size > 0 && stbuf.st_size % TIGERSIZE == 0)
+	{
+		/* the leaves are checked against the size of the target by
+		 * the caller, there is no other limit on their number */
+		size_t size = stbuf.st_size;
+		unsigned char *leaves = malloc(size);
+		size_t len = leaves ? fread(leaves, 1, size, fp) : 0;
+
+		if(len == size)
+		{
+			nleaves = len / TIGERSIZE;
+			*leaves_p = leaves;
+		}
+		else
+			free(leaves);
+	}
+	if(fp)
+		fclose(fp);
+	free(filename);
+
+	return nleaves;
+}
+
+bool
+queue_segment_has_leaves(const char *target_filename)
+{
+	unsigned char *leaves;
+	unsigned nleaves = queue_segment_load_leaves(target_filename, &leaves);
+	free(leaves);
+	return nleaves > 0;
+}
+
+/* Checks freshly downloaded leaves against the TTH and size of the target.
+ * Invalid leaves are removed. Returns 0 if the leaves are valid.
+ */
+int
+queue_segment_check_leaves(const char *target_filename)
+{
+	return_val_if_fail(target_filename, -1);
+
+	queue_target_t *qt = queue_lookup_target(target_filename);
+	return_val_if_fail(qt, -1);
+
+	unsigned char *leaves;
+	unsigned nleaves = queue_segment_load_leaves(target_filename, &leaves);
+
+	int rc = -1;
+	if(nleaves > 0 && tt_leaf_block_size(qt->size, nleaves) != 0)
+	{
+		tth_t root;
+		tt_leaves_root(leaves, nleaves, root.data);
+		if(tth_equal(&root, &qt->tth))
+			rc = 0;
+	}
+	free(leaves);
+
+	if(rc != 0)
+	{
+		WARNING("invalid leaves for [%s], removed", target_filename);
+		char *filename = queue_segment_leaves_filename(target_filename);
+		unlink(filename);
+		free(filename);
+	}
+
+	return rc;
+}
+
+/* Gets the root of a done segment. Returns 0 on success, or -1 if the root
+ * is unknown and the segment can't be verified.
+ */
+static int
+queue_segment_root(queue_target_t *qt, unsigned segment, unsigned char *root)
+{
+	static const unsigned char unknown_root[TIGERSIZE];
+	unsigned char *known_root = qt->segment_roots + segment * TIGERSIZE;
+
+	if(memcmp(known_root, unknown_root, TIGERSIZE) == 0)
+		return -1;
+	memcpy(root, known_root, TIGERSIZE);
+	return 0;
+}
+
+/* Verifies the part of the target that the segment belongs to, once all
+ * segments in that part are done. The roots of the segments are combined
+ * and compared with the leaves covering the same part. Without leaves, the
+ * whole file is checked against the TTH. Segments in a corrupt part are
+ * reset. Returns the number of segments reset.
+ */
+static unsigned
+queue_segment_verify(queue_target_t *qt, unsigned segment)
+{
+	unsigned char *leaves;
+	unsigned nleaves = queue_segment_load_leaves(qt->filename, &leaves);
+	uint64_t leaf_size = tt_leaf_block_size(qt->size, nleaves);
+	if(leaf_size == 0)
+	{
+		/* the root is the only leaf */
+		free(leaves);
+		leaves = malloc(TIGERSIZE);
+		memcpy(leaves, qt->tth.data, TIGERSIZE);
+		nleaves = 1;
+		leaf_size = tt_leaf_block_size(qt->size, 1);
+	}
+
+	/* both sizes are powers of two */
+	uint64_t part_size = leaf_size;
+	if(qt->segment_size > part_size)
+		part_size = qt->segment_size;
+
+	uint64_t start = segment * qt->segment_size / part_size * part_size;
+	uint64_t end = start + part_size;
+	if(end > qt->size)
+		end = qt->size;
+
+	unsigned first = start / qt->segment_size;
+	unsigned last = (end - 1) / qt->segment_size;
+	unsigned i;
+	for(i = first; i <= last; i++)
+	{
+		if(qt->segments[i] != QUEUE_SEGMENT_DONE)
+		{
+			/* wait for the rest of the part */
+			free(leaves);
+			return 0;
+		}
+	}
+
+	unsigned nroots = last - first + 1;
+	unsigned char *roots = malloc(nroots * TIGERSIZE);
+	for(i = 0; i < nroots; i++)
+	{
+		if(queue_segment_root(qt, first + i, roots + i * TIGERSIZE) != 0)
+			break;
+	}
+
+	unsigned nreset = 0;
+	unsigned char expected[TIGERSIZE], actual[TIGERSIZE];
+	if(i == nroots)
+	{
+		tt_leaves_root(roots, nroots, actual);
+		tt_leaves_root(leaves + start / leaf_size * TIGERSIZE,
+			(end - start + leaf_size - 1) / leaf_size, expected);
+	}
+	if(i < nroots || memcmp(actual, expected, TIGERSIZE) != 0)
+	{
+		WARNING("[%s]: bytes %"PRIu64"-%"PRIu64" are corrupt or"
+			" unverified, downloading them again",
+			qt->filename, start, end);
+		for(i = first; i <= last; i++)
+		{
+			queue_db_reset_segment(qt->filename, i);
+			nreset++;
+		}
+	}
+
+	free(roots);
+	free(leaves);
+
+	return nreset;
+}
+
+/* Marks the segment of the queue as done, with the root hash of the data
+ * received, and verifies it if possible. Returns 1 if the whole target is
+ * complete, otherwise 0. The leaves of a complete target are kept until
+ * removed with queue_segment_remove_leaves().
+ */
+int
+queue_segment_finish(queue_t *queue, const unsigned char *root)
+{
+	return_val_if_fail(queue, 0);
+	return_val_if_fail(queue->segment >= 0, 0);
+
+	queue_target_t *qt = queue_lookup_target(queue->target_filename);
+	return_val_if_fail(qt, 0);
+	return_val_if_fail(queue->segment < qt->nsegments, 0);
+
+	queue_db_set_segment_done(qt->filename, queue->segment, root);
+	queue_segment_verify(qt, queue->segment);
+
+	unsigned i;
+	for(i = 0; i < qt->nsegments; i++)
+	{
+		if(qt->segments[i] != QUEUE_SEGMENT_DONE)
+			return 0;
+	}
+
+	return 1;
+}
+
+void
+queue_segment_remove_leaves(const char *target_filename)
+{
+	char *filename = queue_segment_leaves_filename(target_filename);
+	return_if_fail(filename);
+	if(unlink(filename) != 0 && errno != ENOENT)
+		WARNING("%s: %s", filename, strerror(errno));
+	free(filename);
+}
+
+/* Returns the number of bytes in done segments. */
+uint64_t
+queue_segment_bytes_done(queue_target_t *qt)
+{
+	return_val_if_fail(qt, 0);
+
+	uint64_t bytes = 0;
+	unsigned i;
+	for(i = 0; i < qt->nsegments; i++)
+	{
+		if(qt->segments[i] == QUEUE_SEGMENT_DONE)
+		{
+			if(i == qt->nsegments - 1)
+				bytes += qt->size - i * qt->segment_size;
+			else
+				bytes += qt->segment_size;
+		}
+	}
+
+	return bytes;
+}
+
@@ -14,103 +14,213 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include "sys_queue.h"
+
 #include <sys/time.h>
 
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "globals.h"
 #include "queue.h"
 #include "util.h"
 #include "log.h"
+#include "unit_test.h"
 
-int main(int argc, char **argv)
-{
-    int i;
-    int n = argc > 1 ? atoi(argv[1]) : 1000;
+/* sources per nick in the lookup benchmark */
+#define NICK_NSOURCES 10
 
-    sp_log_set_level("debug");
+/* number of lookups timed for each queue size */
+#define NLOOKUPS 20000
 
-    struct timeval tv_start;
-    gettimeofday(&tv_start, NULL);
+static double elapsed(struct timeval *tv_start)
+{
+    struct timeval tv_end, d;
+    gettimeofday(&tv_end, NULL);
+    timersub(&tv_end, tv_start, &d);
+    return (double)d.tv_sec + (double)d.tv_usec / 1000000.0;
+}
+
+/* a TTH in base32 that is unique for i */
+static void make_tth(char *buf, int i)
+{
+    tth_t tth;
+    memset(&tth, 0x5A, sizeof(tth));
+    memcpy(tth.data, &i, sizeof(i));
+    tth_to_base32(&tth, buf);
+}
 
+static void stress_setup(void)
+{
     global_working_directory = "/tmp/queue_stress_test_dir";
     mkpath(global_working_directory);
+    unlink("/tmp/queue_stress_test_dir/queue2.db");
     queue_init();
+}
 
-    struct timeval tv_init_done;
-    gettimeofday(&tv_init_done, NULL);
+/* Randomly adds and removes targets, sources and filelists, and kills
+ * itself now and then. Run it repeatedly to exercise replaying the log.
+ */
+static void stress(int n)
+{
+    int i;
+
+    global_working_directory = "/tmp/queue_stress_test_dir";
+    mkpath(global_working_directory);
+
+    struct timeval tv_start;
+    gettimeofday(&tv_start, NULL);
+    queue_init();
+    printf("queue_init() took %.2f seconds\n", elapsed(&tv_start));
 
     char nick[32] = "nick____";
-    char tth[40] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ____";
+    char tth[TTH_BASE32_LEN + 1];
     char remote_filename[64] = "share\\remote\\file____";
     char local_filename[64] = "/var/media/local/file____";
     uint64_t size;
 
     srandom(time(0) * getpid());
 
+    gettimeofday(&tv_start, NULL);
     for(i = 0; i < n; i++)
     {
 	sprintf(nick + 4, "%06li", random());
 
 	if((random() % 7) == 0)
 	{
-	    g_debug("++++ ADDING filelist for %s", nick);
+	    DEBUG("++++ ADDING filelist for %s", nick);
 	    queue_add_filelist(nick, true);
 	    continue;
 	}
 
-	sprintf(tth + 26, "%04i", i);
+	make_tth(tth, i);
 	sprintf(remote_filename + 17, "%04i", i);
 	sprintf(local_filename + 21, "%04i", i);
 	size = random();
 
 	if((random() % 47) == 0)
 	{
-	    g_debug("!!!! CRASHING");
+	    DEBUG("!!!! CRASHING");
 	    kill(getpid(), SIGKILL);
 	}
 	else if((random() % 3) == 0)
 	{
-	    g_debug("---- REMOVING target %i", i);
+	    DEBUG("---- REMOVING target %i", i);
 	    queue_remove_target(local_filename);
 	}
+	else if((random() % 3) == 0)
+	{
+	    DEBUG("++++ ADDING target %i", i);
+	    queue_add(nick, remote_filename, size, local_filename, tth);
+	}
 	else
 	{
-	    if((random() % 3) == 0)
-	    {
-		g_debug("++++ ADDING target %i", i);
-		queue_add(nick, remote_filename, size, local_filename, tth);
-	    }
-	    else
-	    {
-		queue_source_t qs;
-		memset(&qs, 0, sizeof(queue_source_t));
-		strlcpy(qs.target_filename, local_filename, QUEUE_TARGET_MAXPATH);
-		strlcpy(qs.source_filename, remote_filename, QUEUE_TARGET_MAXPATH);
-
-		g_debug("++++ ADDING source %i", i);
-		queue_add_source(nick, &qs);
-	    }
+	    DEBUG("++++ ADDING source %i", i);
+	    queue_add_source(nick, local_filename, remote_filename);
 	}
-	g_debug("done");
     }
+    printf("%i queue operations took %.2f seconds\n", n, elapsed(&tv_start));
 
-    struct timeval tv_end;
-    gettimeofday(&tv_end, NULL);
+    queue_close();
+}
+
+/* Fills the queue with ntargets targets, each with a source, spread over
+ * nicks with NICK_NSOURCES sources each, and a filelist for each of another
+ * set of nicks. Returns the average time in microseconds of a lookup by
+ * target filename, TTH and filelist nick and of finding the next source for
+ * a nick.
+ */
+static double time_lookups(int ntargets)
+{
+    int i;
+    char nick[32];
+    char filelist_nick[32];
+    char tth[TTH_BASE32_LEN + 1];
+    char remote_filename[64];
+    char local_filename[64];
+
+    stress_setup();
+
+    struct timeval tv_start;
+    gettimeofday(&tv_start, NULL);
+    for(i = 0; i < ntargets; i++)
+    {
+	snprintf(nick, sizeof(nick), "nick%08i", i / NICK_NSOURCES);
+	make_tth(tth, i);
+	snprintf(remote_filename, sizeof(remote_filename),
+		"share\\remote\\file%08i", i);
+	snprintf(local_filename, sizeof(local_filename),
+		"/var/media/local/file%08i", i);
+	fail_unless(queue_add(nick, remote_filename, 4711 + i,
+		    local_filename, tth) == 0);
+	if(i % NICK_NSOURCES == 0)
+	{
+	    snprintf(filelist_nick, sizeof(filelist_nick), "list%08i",
+		    i / NICK_NSOURCES);
+	    fail_unless(queue_add_filelist(filelist_nick, false) == 0);
+	}
+    }
+    double add_time = elapsed(&tv_start);
+
+    srandom(ntargets);
+
+    gettimeofday(&tv_start, NULL);
+    for(i = 0; i < NLOOKUPS; i++)
+    {
+	int n = random() % ntargets;
+
+	snprintf(nick, sizeof(nick), "nick%08i", n / NICK_NSOURCES);
+	snprintf(filelist_nick, sizeof(filelist_nick), "list%08i",
+		n / NICK_NSOURCES);
+	make_tth(tth, n);
+	snprintf(local_filename, sizeof(local_filename),
+		"/var/media/local/file%08i", n);
+
+	queue_target_t *qt = queue_lookup_target(local_filename);
+	fail_unless(qt);
+	fail_unless(queue_lookup_target_by_tth(tth) == qt);
+	fail_unless(queue_lookup_filelist(filelist_nick));
+
+	queue_t *queue = queue_get_next_source_for_nick(nick);
+	fail_unless(queue);
+	fail_unless(!queue->is_filelist);
+	fail_unless(queue->tth);
+	queue_free(queue);
+    }
+    double lookup_time = elapsed(&tv_start) * 1000000.0 / NLOOKUPS;
+
+    printf("%7i targets: adding %.2f s, lookups %.2f us\n",
+	    ntargets, add_time, lookup_time);
 
     queue_close();
 
-    struct timeval d1;
-    timersub(&tv_init_done, &tv_start, &d1);
-    printf("queue_init() took %.2f seconds\n", (float)d1.tv_sec + (float)d1.tv_usec / 1000000.0);
+    return lookup_time;
+}
+
+int main(int argc, char **argv)
+{
+    sp_log_set_level("warning");
 
-    struct timeval d2;
-    timersub(&tv_end, &tv_init_done, &d2);
-    printf("1000 queue_add() took %.2f seconds\n", (float)d2.tv_sec + (float)d2.tv_usec / 1000000.0);
+    if(argc > 1)
+    {
+	stress(atoi(argv[1]));
+	return 0;
+    }
+
+    /* Lookups should not depend on the size of the queue. With the old
+     * linear scans, the largest queue was ~100 times slower than the
+     * smallest. This is a benchmark, not run by make check, as the timings
+     * depend on the machine and its load. */
+    double t_small = time_lookups(1000);
+    time_lookups(10000);
+    double t_large = time_lookups(100000);
+
+    printf("100000 vs 1000 targets: lookups %.1fx slower\n",
+	    t_small > 0 ? t_large / t_small : 0);
 
     return 0;
 }
-
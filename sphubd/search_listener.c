@@ -22,6 +22,7 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 
+#include <ctype.h>
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
@@ -32,43 +33,96 @@
 #include "nmdc.h"
 #include "notifications.h"
 #include "queue.h"
-#include "rx.h"
 #include "search_listener.h"
+#include "tth.h"
 #include "ui.h"
 #include "log.h"
 #include "xstr.h"
 
-int search_listener_handle_response(search_listener_t *sl, const char *buf);
+static int sl_handle_response(search_listener_t *sl, char *buf);
 
-static void sl_in_event(int fd, short condition, void *data)
+static void sl_handle_datagram(search_listener_t *sl, char *buf, size_t len,
+        struct sockaddr_in *fromaddr)
 {
-    static char buf[1500];
-    struct sockaddr_in fromaddr;
-    unsigned int fromlen = sizeof(fromaddr);
-    ssize_t bytes_read = recvfrom(fd, buf, sizeof(buf), 0,
-            (struct sockaddr *)&fromaddr, &fromlen);
-    if(bytes_read == -1)
-    {
-        WARNING("recvfrom: %s", strerror(errno));
-        return;
-    }
-
-    if(bytes_read)
+    if(len == 4 && strncmp(buf, "ping", 4) == 0)
     {
-        if(bytes_read == 4 && strncmp(buf, "ping", 4) == 0)
+        DEBUG("received ping, sending pong");
+        if(sendto(sl->fd, "pong", 4, 0, (const struct sockaddr *)fromaddr,
+                    sizeof(struct sockaddr_in)) == -1)
         {
-            DEBUG("received ping, sending pong");
-            if(sendto(fd, "pong", 4, 0,
-                        (const struct sockaddr *)&fromaddr, fromlen) == -1)
-            {
-                WARNING("sendto(pong): %s", strerror(errno));
-            }
+            WARNING("sendto(pong): %s", strerror(errno));
         }
-        else
+    }
+    else if(len > 0)
+    {
+        buf[len] = 0;
+        sl_handle_response(sl, buf);
+    }
+}
+
+/* Reads up to SL_RECV_BATCH datagrams. Returns the number read, or -1 on
+ * error.
+ */
+static int sl_receive(search_listener_t *sl)
+{
+    static char bufs[SL_RECV_BATCH][1501];
+    static struct sockaddr_in fromaddrs[SL_RECV_BATCH];
+
+#if defined(__linux__)
+    struct mmsghdr msgs[SL_RECV_BATCH];
+    struct iovec iov[SL_RECV_BATCH];
+    int i;
+
+    memset(msgs, 0, sizeof(msgs));
+    for(i = 0; i < SL_RECV_BATCH; i++)
+    {
+        iov[i].iov_base = bufs[i];
+        iov[i].iov_len = sizeof(bufs[i]) - 1;
+        msgs[i].msg_hdr.msg_name = &fromaddrs[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int n = recvmmsg(sl->fd, msgs, SL_RECV_BATCH, MSG_DONTWAIT, NULL);
+    for(i = 0; i < n; i++)
+        sl_handle_datagram(sl, bufs[i], msgs[i].msg_len, &fromaddrs[i]);
+    return n;
+#else
+    int n;
+    for(n = 0; n < SL_RECV_BATCH; n++)
+    {
+        socklen_t fromlen = sizeof(struct sockaddr_in);
+        ssize_t len = recvfrom(sl->fd, bufs[n], sizeof(bufs[n]) - 1, 0,
+                (struct sockaddr *)&fromaddrs[n], &fromlen);
+        if(len == -1)
+            return n ? n : -1;
+        sl_handle_datagram(sl, bufs[n], len, &fromaddrs[n]);
+    }
+    return n;
+#endif
+}
+
+/* Drains the socket, but lets other events in after SL_RECV_MAX_PER_EVENT
+ * datagrams.
+ */
+static void sl_in_event(int fd, short condition, void *data)
+{
+    search_listener_t *sl = data;
+    int nread = 0;
+
+    while(nread < SL_RECV_MAX_PER_EVENT)
+    {
+        int n = sl_receive(sl);
+        if(n == -1)
         {
-            buf[bytes_read] = 0;
-            search_listener_handle_response(data, buf);
+            if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                WARNING("recvfrom: %s", strerror(errno));
+            break;
         }
+        nread += n;
+        if(n < SL_RECV_BATCH)
+            break;
     }
 }
 
@@ -93,6 +147,10 @@ static search_listener_t *search_listener_create(void)
 {
     search_listener_t *sl = calloc(1, sizeof(search_listener_t));
     TAILQ_INIT(&sl->search_request_head);
+    LIST_INIT(&sl->word_groups);
+    int i;
+    for(i = 0; i < SL_TTH_BUCKETS; i++)
+        LIST_INIT(&sl->tth_buckets[i]);
 
     return sl;
 }
@@ -153,66 +211,139 @@ search_listener_t *search_listener_new(int port)
     return sl;
 }
 
-int search_result_matches_request(const char *filename, uint64_t size, const char *tth,
-        search_request_t *sreq)
+/* Checks the size restriction, and the words after the first (the first
+ * word is checked for the whole group). <xfilename> is in composed,
+ * casefolded form.
+ */
+static int sl_request_matches(search_request_t *sreq, const char *xfilename,
+        uint64_t size)
 {
-    char *xfilename;
     int i;
+    for(i = 1; i < sreq->words->argc; i++)
+    {
+        if(strstr(xfilename, sreq->words->argv[i]) == 0)
+            return 0;
+    }
 
-    return_val_if_fail(sreq, 0);
+    switch(sreq->size_restriction)
+    {
+        case SHARE_SIZE_MIN:
+            if(size < sreq->real_size)
+                return 0;
+            break;
+        case SHARE_SIZE_MAX:
+            if(size > sreq->real_size)
+                return 0;
+            break;
+        case SHARE_SIZE_EQUAL:
+            if(size != sreq->real_size)
+                return 0;
+            break;
+        case SHARE_SIZE_NONE:
+            break;
+    }
 
-    if(sreq->tth)
+    return 1;
+}
+
+/* Returns the latest added request matching the response, or NULL. */
+static search_request_t *sl_find_request(search_listener_t *sl,
+        search_response_t *resp)
+{
+    search_request_t *best = NULL;
+    search_request_t *sreq;
+
+    tth_t tth;
+    if(resp->tth && tth_from_base32(&tth, resp->tth) == 0)
     {
-        if(tth && strcmp(tth, sreq->tth) == 0)
-            return 1;
-        return 0;
+        unsigned bucket = tth_hash(&tth) % SL_TTH_BUCKETS;
+        LIST_FOREACH(sreq, &sl->tth_buckets[bucket], index_link)
+        {
+            if(tth_equal(&tth, &sreq->tth_key) &&
+               (best == NULL || sreq->seq > best->seq))
+                best = sreq;
+        }
     }
 
-    return_val_if_fail(filename, 0);
+    if(LIST_EMPTY(&sl->word_groups) || resp->filename == NULL)
+        return best;
 
     /* ensure composed form. */
-    char *filename_utf8_composed = g_utf8_normalize(filename, -1, G_NORMALIZE_DEFAULT_COMPOSE);
-    xfilename = g_utf8_casefold(filename_utf8_composed, -1);
+    char *filename_utf8_composed = g_utf8_normalize(resp->filename, -1,
+            G_NORMALIZE_DEFAULT_COMPOSE);
+    if(filename_utf8_composed == NULL)
+        return best;
+    char *xfilename = g_utf8_casefold(filename_utf8_composed, -1);
     free(filename_utf8_composed);
 
-    for(i = 0; i < sreq->words->argc; i++)
+    struct sl_word_group *group;
+    LIST_FOREACH(group, &sl->word_groups, link)
     {
-        if(strstr(xfilename, sreq->words->argv[i]) == 0)
-            break;
+        if(strstr(xfilename, group->word) == 0)
+            continue;
+
+        LIST_FOREACH(sreq, &group->requests, index_link)
+        {
+            if((best == NULL || sreq->seq > best->seq) &&
+               sl_request_matches(sreq, xfilename, resp->size))
+                best = sreq;
+        }
     }
     free(xfilename);
 
-    if(i == sreq->words->argc)
+    return best;
+}
+
+/* Returns the hub address at the end of a search response: the last
+ * "(address)" in <buf>. The address is terminated in place and the opening
+ * parenthesis is returned in <open>.
+ */
+static char *sl_parse_hub_address(char *buf, char **open)
+{
+    char *p = buf + strlen(buf);
+    while(p > buf)
     {
-        /* we got a match on the filename, now check the size
-         */
-        switch(sreq->size_restriction)
+        if(*--p != ')')
+            continue;
+
+        char *start = p;
+        while(start > buf && (isalnum((unsigned char)start[-1]) ||
+                    strchr("-_.:", start[-1]) != NULL))
+            --start;
+        if(start < p && start > buf && start[-1] == '(')
         {
-            case SHARE_SIZE_MIN:
-                if(size < sreq->real_size)
-                    return 0;
-                break;
-            case SHARE_SIZE_MAX:
-                if(size > sreq->real_size)
-                    return 0;
-                break;
-            case SHARE_SIZE_EQUAL:
-                if(size != sreq->real_size)
-                    return 0;
-                break;
-            case SHARE_SIZE_NONE:
-                break;
+            *p = 0;
+            *open = start - 1;
+            return start;
         }
-        return 1;
     }
 
-    return 0;
+    return NULL;
 }
 
-search_response_t *sl_parse_response(const char *buf)
+/* Parses "<open>/<total>" ending at <end>. Returns a pointer to the digits
+ * of the open slots, or NULL.
+ */
+static char *sl_parse_slots_backwards(char *buf, char *end)
 {
-    return_val_if_fail(buf, NULL);
+    char *p = end;
+    while(p > buf && isdigit((unsigned char)p[-1]))
+        --p;
+    if(p == end || p == buf || p[-1] != '/')
+        return NULL;
+    end = --p;
+    while(p > buf && isdigit((unsigned char)p[-1]))
+        --p;
+    if(p == end)
+        return NULL;
+    return p;
+}
 
+/* Parses a search response, modifying <buf> in place. Returns NULL if
+ * unparseable or from an unknown hub.
+ */
+static search_response_t *sl_parse_response_inplace(char *buf)
+{
     DEBUG("parsing [%s]", buf);
 
     if(str_has_prefix(buf, "$SR "))
@@ -221,134 +352,161 @@ search_response_t *sl_parse_response(const char *buf)
         ++buf;
 
     char *delim = strchr(buf, '|');
-    char *xbuf = 0;
     if(delim)
-        xbuf = xstrndup(buf, delim - buf);
-    else
-        xbuf = xstrdup(buf);
+        *delim = 0;
 
-    int i, x5 = 0;
-    int is_directory;
+    /* count number of 0x05's in the search response in order to decide if
+     * it's a directory or file response.
+     */
+    char *x5 = strchr(buf, 0x05);
+    if(x5 == NULL)
+    {
+        INFO("unparseable search response: [%s]", buf);
+        return NULL;
+    }
+    int is_directory = (strchr(x5 + 1, 0x05) == NULL);
 
-    /* count number of 0x05's in the search response in order to decide if it's
-     * a directory or file response.
+    /* <nick> <filename>[0x05<size>] <open>/<total>0x05<hub name> (<address>)
      */
-    for(i = 0; xbuf[i]; i++)
+    char *nick = buf;
+    char *filename = strchr(buf, ' ');
+    if(filename == NULL || filename == nick || filename > x5)
     {
-        if(xbuf[i] == 0x05)
-            x5++;
+        INFO("unparseable search response: [%s]", buf);
+        return NULL;
     }
-    is_directory = (x5 == 1 ? 1 : 0);
+    *filename++ = 0;
 
-    const void *rx = NULL;
+    uint64_t size = 0;
+    char *slots, *field;
     if(is_directory)
     {
-        static const void *rx_dir = NULL;
-        if(rx_dir == NULL)
+        slots = sl_parse_slots_backwards(filename, x5);
+        if(slots == NULL || slots - 1 <= filename || slots[-1] != ' ')
         {
-            rx_dir = rx_compile("([^ ]+) (.+) ([0-9]+)/([0-9]+)\x05(.*)\\(([-0-9a-zA-Z_.:]+)\\)\\|?");
+            INFO("unparseable search response: [%s]", filename);
+            return NULL;
         }
-        rx = rx_dir;
+        slots[-1] = 0;
+        field = x5 + 1;
     }
     else
     {
-        static const void *rx_file = NULL;
-        if(rx_file == NULL)
+        if(x5 == filename)
+        {
+            INFO("unparseable search response: [%s]", filename);
+            return NULL;
+        }
+        *x5 = 0;
+
+        char *p = x5 + 1;
+        if(!isdigit((unsigned char)*p))
         {
-            rx_file = rx_compile("([^ ]+) ([^\x05]+)\x05([0-9]+) ([0-9]+)/([0-9]+)\x05(.*)\\(([-0-9a-zA-Z_.:]+)\\)\\|?");
+            INFO("unparseable search response: [%s]", filename);
+            return NULL;
+        }
+        size = strtoull(p, &p, 10);
+        if(*p++ != ' ')
+        {
+            INFO("unparseable search response: [%s]", filename);
+            return NULL;
         }
-        rx = rx_file;
+        slots = p;
+        field = strchr(p, 0x05);
+        if(field == NULL || sl_parse_slots_backwards(p, field) != slots)
+        {
+            INFO("unparseable search response: [%s]", filename);
+            return NULL;
+        }
+        ++field;
     }
-    return_val_if_fail(rx, NULL);
 
-    search_response_t *resp = NULL;
-    rx_subs_t *subs = rx_search_precompiled(xbuf, rx);
-    if(subs && \
-            ((subs->nsubs == 6 && is_directory) || \
-             (subs->nsubs == 7 && !is_directory)))
+    char *open;
+    char *hub_address = sl_parse_hub_address(field, &open);
+    if(hub_address == NULL)
     {
-        /* regexp matched */
-
-        char *nick = subs->subs[0];
-        char *filename = subs->subs[1];
+        INFO("unparseable search response: [%s]", filename);
+        return NULL;
+    }
+    *open = 0;
 
-        if(nick && filename)
+    char *tth = NULL;
+    if(strncmp(field, "TTH:", 4) == 0)
+    {
+        tth = str_trim_end_inplace(field + 4, NULL);
+        tth_t binary_tth;
+        size_t tthlen = strlen(tth);
+        if(tthlen < TTH_BASE32_LEN || tthlen > TTH_BASE32_LEN + 1 ||
+           tth_from_base32(&binary_tth, tth) != 0)
         {
-            /* Need to find the associated hub in order to determine what
-             * encoding to use.
-             */
-            char *hub_address = subs->subs[6 - is_directory];
-            char *nick_utf8 = 0;
-            hub_t *hub = hub_find_by_address(hub_address);
-            if(hub == 0)
-            {
-                hub = hub_find_encoding_by_nick(nick, &nick_utf8);
-                if(hub == NULL)
-                {
-                    WARNING("unknown hub address '%s'"
-                            " in search response (skipping)", hub_address);
-                    rx_free_subs(subs);
-                    free(xbuf);
-                    return NULL;
-                }
-            }
-            else
-            {
-                nick_utf8 = str_convert_to_unescaped_utf8(nick, hub->encoding);
-            }
+            WARNING("invalid TTH in search response [%s]", tth);
+            return NULL;
+        }
+    }
 
-            if(nick_utf8 == NULL)
-            {
-                WARNING("no valid nick in search response (skipping)");
-                rx_free_subs(subs);
-                free(xbuf);
-                return NULL;
-            }
-            
-            resp = calloc(1, sizeof(search_response_t));
+    /* Need to find the associated hub in order to determine what
+     * encoding to use.
+     */
+    char *nick_utf8 = 0;
+    hub_t *hub = hub_find_by_address(hub_address);
+    if(hub == 0)
+    {
+        hub = hub_find_encoding_by_nick(nick, &nick_utf8);
+        if(hub == NULL)
+        {
+            WARNING("unknown hub address '%s'"
+                    " in search response (skipping)", hub_address);
+            return NULL;
+        }
+    }
+    else
+    {
+        nick_utf8 = str_convert_to_unescaped_utf8(nick, hub->encoding);
+    }
 
-            resp->nick = nick_utf8;
-            resp->filename = str_legacy_to_utf8(filename, hub->encoding);
+    if(nick_utf8 == NULL)
+    {
+        WARNING("no valid nick in search response (skipping)");
+        return NULL;
+    }
 
-            if(resp->filename == NULL)
-            {
-                free(resp);
-                free(nick_utf8);
-                rx_free_subs(subs);
-                free(xbuf);
-                return NULL;
-            }
-            
-            resp->hub = hub;
-            resp->openslots = strtoull(subs->subs[3 - is_directory], 0, 10);
-            resp->totalslots = strtoull(subs->subs[4 - is_directory], 0, 10);
-
-            resp->type = SHARE_TYPE_DIRECTORY;
-            resp->size = 0;
-            if(!is_directory)
-            {
-                resp->type = share_filetype(filename);
-                resp->size = strtoull(subs->subs[2], 0, 10);
-            }
+    char *filename_utf8 = str_legacy_to_utf8(filename, hub->encoding);
+    if(filename_utf8 == NULL)
+    {
+        free(nick_utf8);
+        return NULL;
+    }
 
-            if(strncmp(subs->subs[5 - is_directory], "TTH:", 4) == 0)
-            {
-                resp->tth = str_trim_end_inplace(xstrdup(subs->subs[5 - is_directory] + 4), NULL);
-            }
+    search_response_t *resp = calloc(1, sizeof(search_response_t));
+    resp->nick = nick_utf8;
+    resp->filename = filename_utf8;
+    resp->hub = hub;
+    resp->openslots = strtoull(slots, 0, 10);
+    resp->totalslots = strtoull(strchr(slots, '/') + 1, 0, 10);
 
-            if(resp->tth && !valid_tth(resp->tth))
-            {
-                WARNING("invalid TTH in search response [%s]", xbuf);
-                sl_response_free(resp);
-                resp = NULL;
-            }
-        }
-        rx_free_subs(subs);
+    resp->type = SHARE_TYPE_DIRECTORY;
+    resp->size = 0;
+    if(!is_directory)
+    {
+        resp->type = share_filetype(filename);
+        resp->size = size;
     }
-    else
+
+    if(tth)
     {
-        INFO("regexp failed on: [%s]", xbuf);
+        strlcpy(resp->tth_buf, tth, sizeof(resp->tth_buf));
+        resp->tth = resp->tth_buf;
     }
+
+    return resp;
+}
+
+search_response_t *sl_parse_response(const char *buf)
+{
+    return_val_if_fail(buf, NULL);
+
+    char *xbuf = xstrdup(buf);
+    search_response_t *resp = sl_parse_response_inplace(xbuf);
     free(xbuf);
 
     return resp;
@@ -360,38 +518,27 @@ void sl_response_free(search_response_t *resp)
     {
         free(resp->filename);
         free(resp->nick);
-        free(resp->tth);
         free(resp);
     }
 }
 
-int search_listener_handle_response(search_listener_t *sl, const char *buf)
+/* Handles a search response in <buf>, which is modified. */
+static int sl_handle_response(search_listener_t *sl, char *buf)
 {
-    return_val_if_fail(sl, -1);
-    return_val_if_fail(buf, -1);
-
-    search_response_t *resp = sl_parse_response(buf);
+    search_response_t *resp = sl_parse_response_inplace(buf);
     if(resp == NULL)
     {
         INFO("invalid search response (ignored)");
         return 1;
     }
 
-    /* Go through the list of search requests and find a matching search
-     * ID. The list is traversed backwards, so if there are multiple
-     * matches, the last search is used. */
+    /* If there are multiple matching requests, the last search is used. */
     int search_id = 0;
-    struct search_request *sreq;
-    TAILQ_FOREACH_REVERSE(sreq, &sl->search_request_head,
-            search_request_list, link)
+    search_request_t *sreq = sl_find_request(sl, resp);
+    if(sreq)
     {
-        if(search_result_matches_request(resp->filename, resp->size,
-                    resp->tth, sreq))
-        {
-            DEBUG("Found search ID %i", sreq->id);
-            search_id = sreq->id;
-            break;
-        }
+        DEBUG("Found search ID %i", sreq->id);
+        search_id = sreq->id;
     }
 
     resp->id = search_id;
@@ -404,6 +551,18 @@ int search_listener_handle_response(search_listener_t *sl, const char *buf)
     return 1;
 }
 
+int search_listener_handle_response(search_listener_t *sl, const char *buf)
+{
+    return_val_if_fail(sl, -1);
+    return_val_if_fail(buf, -1);
+
+    char *xbuf = xstrdup(buf);
+    int rc = sl_handle_response(sl, xbuf);
+    free(xbuf);
+
+    return rc;
+}
+
 /* <words> assumed to be in UTF-8 */
 search_request_t *search_listener_create_search_request(const char *words,
         uint64_t size,
@@ -426,7 +585,7 @@ search_request_t *search_listener_create_search_request(const char *words,
     {
         sreq->tth = xstrdup(tth);
         free(words_unescaped);
-        if(!valid_tth(sreq->tth))
+        if(tth_from_base32(&sreq->tth_key, sreq->tth) != 0)
         {
             DEBUG("invalid TTH [%s], skipping search", sreq->tth);
             free(sreq->tth);
@@ -510,6 +669,52 @@ void sl_request_free(search_request_t *sreq)
     }
 }
 
+/* Adds the request to the TTH index, or to the group of requests with the
+ * same first word. */
+static void sl_index_request(search_listener_t *sl, search_request_t *sreq)
+{
+    if(sreq->tth)
+    {
+        unsigned bucket = tth_hash(&sreq->tth_key) % SL_TTH_BUCKETS;
+        LIST_INSERT_HEAD(&sl->tth_buckets[bucket], sreq, index_link);
+        return;
+    }
+
+    const char *word = sreq->words->argc > 0 ? sreq->words->argv[0] : "";
+
+    struct sl_word_group *group;
+    LIST_FOREACH(group, &sl->word_groups, link)
+    {
+        if(strcmp(group->word, word) == 0)
+            break;
+    }
+
+    if(group == NULL)
+    {
+        group = calloc(1, sizeof(struct sl_word_group));
+        group->word = xstrdup(word);
+        LIST_INIT(&group->requests);
+        LIST_INSERT_HEAD(&sl->word_groups, group, link);
+    }
+
+    sreq->group = group;
+    LIST_INSERT_HEAD(&group->requests, sreq, index_link);
+}
+
+static void sl_unindex_request(search_request_t *sreq)
+{
+    LIST_REMOVE(sreq, index_link);
+
+    struct sl_word_group *group = sreq->group;
+    if(group && LIST_EMPTY(&group->requests))
+    {
+        LIST_REMOVE(group, link);
+        free(group->word);
+        free(group);
+    }
+    sreq->group = NULL;
+}
+
 void search_listener_add_request(search_listener_t *sl, search_request_t *request)
 {
     return_if_fail(sl);
@@ -525,11 +730,15 @@ void search_listener_add_request(search_listener_t *sl, search_request_t *reques
          * manual searches from the UI.
          */
         TAILQ_INSERT_HEAD(&sl->search_request_head, request, link);
+        request->seq = --sl->first_seq;
     }
     else
     {
         TAILQ_INSERT_TAIL(&sl->search_request_head, request, link);
+        request->seq = ++sl->last_seq;
     }
+
+    sl_index_request(sl, request);
 }
 
 void sl_forget_search(search_listener_t *sl, int search_id)
@@ -545,6 +754,7 @@ void sl_forget_search(search_listener_t *sl, int search_id)
         {
             DEBUG("forgetting search ID %i", sreq->id);
             TAILQ_REMOVE(&sl->search_request_head, sreq, link);
+            sl_unindex_request(sreq);
             sl_request_free(sreq);
         }
     }
@@ -558,6 +768,7 @@ void sl_forget_search(search_listener_t *sl, int search_id)
             {
                 DEBUG("forgetting search ID %i", sreq->id);
                 TAILQ_REMOVE(&sl->search_request_head, sreq, link);
+                sl_unindex_request(sreq);
                 sl_request_free(sreq);
             }
         }   
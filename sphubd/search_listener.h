@@ -32,12 +32,26 @@
 
 #include "args.h"
 #include "share.h"
+#include "tth.h"
+
+/* datagrams read per system call */
+#define SL_RECV_BATCH 32
+
+/* datagrams read before returning to the event loop */
+#define SL_RECV_MAX_PER_EVENT 1024
+
+/* number of buckets in the index of TTH searches */
+#define SL_TTH_BUCKETS 64
 
 typedef struct search_request search_request_t;
 struct search_request
 {
     TAILQ_ENTRY(search_request) link;
-    
+    LIST_ENTRY(search_request) index_link;
+    int seq;    /* later requests are preferred when matching responses */
+    tth_t tth_key;
+    struct sl_word_group *group;
+
     share_size_restriction_t size_restriction;
     uint64_t search_size; /* the size we're searching for (sent to hub) */
     uint64_t real_size;   /* the real size we're looking for (to
@@ -60,17 +74,33 @@ struct search_response
     uint64_t size;
     int openslots;
     int totalslots;
-    char *tth;
+    char *tth; /* points to tth_buf if the response has a TTH */
+    char tth_buf[TTH_BASE32_LEN + 1];
     hub_t *hub;
 };
 
 typedef struct search_listener search_listener_t;
 
+/* Requests for words that start with the same word. The word is checked
+ * once for all of them.
+ */
+struct sl_word_group
+{
+    LIST_ENTRY(sl_word_group) link;
+    char *word;
+    LIST_HEAD(, search_request) requests;
+};
+
 struct search_listener
 {
     struct event in_event;
     int fd;
     TAILQ_HEAD(search_request_list, search_request) search_request_head;
+
+    /* index of the requests, by TTH and by first word */
+    LIST_HEAD(, search_request) tth_buckets[SL_TTH_BUCKETS];
+    LIST_HEAD(, sl_word_group) word_groups;
+    int first_seq, last_seq;
 };
 
 search_listener_t *search_listener_new(int port);
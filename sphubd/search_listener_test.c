@@ -25,6 +25,7 @@
 #include "unit_test.h"
 
 static int got_response = 0;
+static int last_id = 0;
 
 /* ouch! */
 int extra_slots_get_for_user(const char *nick)
@@ -47,6 +48,7 @@ void handle_search_response_notification(nc_t *nc, const char *channel,
     fail_unless(response->nick);
     fail_unless(response->filename);
 
+    last_id = response->id;
     if(response->id > 0)
     {
         got_response++;
@@ -169,6 +171,58 @@ int main(void)
     fail_unless(request->tth);
     fail_unless(strcmp(request->tth, tth) == 0);
     fail_unless(request->words == NULL);
+    sl_request_free(request);
+
+    /* invalid TTHs are rejected */
+    request = search_listener_create_search_request(
+            "TTH:FAKEDTTHTOPROTECTTHE1NNOCENTADSEGCVBFRX", 0,
+            SHARE_SIZE_NONE, SHARE_TYPE_ANY, 43);
+    fail_unless(request == NULL);
+
+    /* the latest matching request is used */
+    search_listener_handle_response(sl, search_response_string);
+    fail_unless(last_id == 2);
+    request = search_listener_create_search_request("example", 0,
+            SHARE_SIZE_NONE, SHARE_TYPE_ANY, 3);
+    search_listener_add_request(sl, request);
+    search_listener_handle_response(sl, search_response_string);
+    fail_unless(last_id == 3);
+
+    /* but not if it's an internal search */
+    request = search_listener_create_search_request("example zip", 0,
+            SHARE_SIZE_NONE, SHARE_TYPE_ANY, -1);
+    search_listener_add_request(sl, request);
+    search_listener_handle_response(sl, search_response_string);
+    fail_unless(last_id == 3);
+
+    /* requests with the same first word are checked separately */
+    request = search_listener_create_search_request("example rar", 0,
+            SHARE_SIZE_NONE, SHARE_TYPE_ANY, 4);
+    search_listener_add_request(sl, request);
+    request = search_listener_create_search_request("example", 1000,
+            SHARE_SIZE_MIN, SHARE_TYPE_ANY, 5);
+    search_listener_add_request(sl, request);
+    search_listener_handle_response(sl, search_response_string);
+    fail_unless(last_id == 5);
+    request = search_listener_create_search_request("example", 1000,
+            SHARE_SIZE_MAX, SHARE_TYPE_ANY, 6);
+    search_listener_add_request(sl, request);
+    search_listener_handle_response(sl, search_response_string);
+    fail_unless(last_id == 5);
+
+    /* forgotten searches are removed from the index */
+    sl_forget_search(sl, 5);
+    search_listener_handle_response(sl, search_response_string);
+    fail_unless(last_id == 3);
+    sl_forget_search(sl, 3);
+    sl_forget_search(sl, 2);
+    search_listener_handle_response(sl, search_response_string);
+    fail_unless(last_id == 1);
+    sl_forget_search(sl, 0);
+    fail_unless(LIST_EMPTY(&sl->word_groups));
+    search_listener_handle_response(sl, search_response_string);
+    fail_unless(last_id == 0);
+    free(search_response_string);
 
     return 0;
 }
@@ -0,0 +1,372 @@
+/*
+ * Copyright (c) 2007 Martin Hedenfalk <martin@bzero.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Queue of $SR replies to active searchers. Replies are sent with UDP from
+ * a single socket, in batches from the event loop instead of one by one
+ * from the $Search handler. At most global_search_reply_rate replies are
+ * sent per second; when more are queued than can be sent, the oldest are
+ * dropped, as searchers stop listening after a while anyway.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+
+#include <errno.h>
+#include <event.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "globals.h"
+#include "io.h"
+#include "log.h"
+#include "search_reply.h"
+
+struct search_reply
+{
+    struct sockaddr_in addr;
+    char *data;
+    size_t len;
+};
+
+static int sr_fd = -1;
+static struct event sr_flush_event;
+static bool sr_flush_scheduled = false;
+
+/* ring buffer of queued replies */
+static struct search_reply sr_queue[SEARCH_REPLY_MAX_QUEUED];
+static unsigned sr_head = 0;
+static unsigned sr_count = 0;
+static unsigned sr_ndropped = 0;
+
+/* token bucket for the reply rate, holds at most a second's worth */
+static double sr_tokens = 0;
+static struct timeval sr_last_refill;
+
+static void search_reply_flush_event(int fd, short why, void *user_data);
+
+static void search_reply_schedule(unsigned usec)
+{
+    if(sr_flush_scheduled)
+        return;
+
+    struct timeval tv = {.tv_sec = usec / 1000000, .tv_usec = usec % 1000000};
+    evtimer_set(&sr_flush_event, search_reply_flush_event, NULL);
+    evtimer_add(&sr_flush_event, &tv);
+    sr_flush_scheduled = true;
+}
+
+static void search_reply_drop_head(void)
+{
+    free(sr_queue[sr_head].data);
+    sr_queue[sr_head].data = NULL;
+    sr_head = (sr_head + 1) % SEARCH_REPLY_MAX_QUEUED;
+    sr_count--;
+}
+
+/* Queues a datagram to be sent to addr from the event loop. Returns 0 if
+ * queued, or -1 on error.
+ */
+int search_reply_queue(const struct sockaddr_in *addr,
+        const char *datagram, size_t len)
+{
+    return_val_if_fail(addr, -1);
+    return_val_if_fail(datagram, -1);
+
+    if(sr_fd == -1)
+    {
+        sr_fd = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        if(sr_fd == -1)
+        {
+            WARNING("socket(): %s", strerror(errno));
+            return -1;
+        }
+        io_set_blocking(sr_fd, 0);
+        gettimeofday(&sr_last_refill, NULL);
+        sr_tokens = global_search_reply_rate;
+    }
+
+    if(sr_count == SEARCH_REPLY_MAX_QUEUED)
+    {
+        search_reply_drop_head();
+        sr_ndropped++;
+    }
+
+    struct search_reply *sr =
+        &sr_queue[(sr_head + sr_count) % SEARCH_REPLY_MAX_QUEUED];
+    sr->addr = *addr;
+    sr->data = malloc(len);
+    memcpy(sr->data, datagram, len);
+    sr->len = len;
+    sr_count++;
+
+    /* send when we're back in the event loop */
+    search_reply_schedule(0);
+
+    return 0;
+}
+
+/* Sends up to n replies from the head of the queue. Returns the number of
+ * replies sent, or -1 on error.
+ */
+static int search_reply_send(unsigned n)
+{
+#if defined(__linux__)
+    struct mmsghdr msgs[SEARCH_REPLY_BATCH];
+    struct iovec iov[SEARCH_REPLY_BATCH];
+    unsigned i;
+
+    memset(msgs, 0, n * sizeof(struct mmsghdr));
+    for(i = 0; i < n; i++)
+    {
+        struct search_reply *sr =
+            &sr_queue[(sr_head + i) % SEARCH_REPLY_MAX_QUEUED];
+        iov[i].iov_base = sr->data;
+        iov[i].iov_len = sr->len;
+        msgs[i].msg_hdr.msg_name = &sr->addr;
+        msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    return sendmmsg(sr_fd, msgs, n, 0);
+#else
+    unsigned i;
+    for(i = 0; i < n; i++)
+    {
+        struct search_reply *sr =
+            &sr_queue[(sr_head + i) % SEARCH_REPLY_MAX_QUEUED];
+        if(sendto(sr_fd, sr->data, sr->len, 0,
+                    (const struct sockaddr *)&sr->addr,
+                    sizeof(struct sockaddr_in)) == -1)
+            return i ? i : -1;
+    }
+    return n;
+#endif
+}
+
+static void search_reply_refill(void)
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+
+    double elapsed = (now.tv_sec - sr_last_refill.tv_sec) +
+        (now.tv_usec - sr_last_refill.tv_usec) / 1000000.0;
+    sr_last_refill = now;
+
+    if(elapsed > 0)
+        sr_tokens += elapsed * global_search_reply_rate;
+    if(sr_tokens > global_search_reply_rate)
+        sr_tokens = global_search_reply_rate;
+}
+
+/* Sends as many queued replies as the rate allows. */
+void search_reply_flush(void)
+{
+    bool limited = global_search_reply_rate > 0;
+    bool blocked = false;
+
+    if(limited)
+        search_reply_refill();
+
+    while(sr_count > 0)
+    {
+        unsigned n = sr_count < SEARCH_REPLY_BATCH ? sr_count :
+            SEARCH_REPLY_BATCH;
+        if(limited && n > sr_tokens)
+            n = sr_tokens;
+        if(n == 0)
+            break;
+
+        int rc = search_reply_send(n);
+        if(rc == -1)
+        {
+            if(errno == EAGAIN || errno == EWOULDBLOCK ||
+               errno == ENOBUFS || errno == EINTR)
+            {
+                blocked = true;
+                break;
+            }
+
+            /* don't let one unreachable searcher hold up the rest */
+            WARNING("unable to send UDP response: %s", strerror(errno));
+            rc = 1;
+        }
+
+        int i;
+        for(i = 0; i < rc; i++)
+            search_reply_drop_head();
+        if(limited)
+            sr_tokens -= rc;
+    }
+
+    if(sr_ndropped)
+    {
+        WARNING("too many search results, dropped %u", sr_ndropped);
+        sr_ndropped = 0;
+    }
+
+    if(sr_count > 0)
+    {
+        /* wait until there is room in the socket buffer, or until the
+         * next reply may be sent */
+        unsigned usec = 10000;
+        if(!blocked && limited)
+            usec = 1000000.0 * (1 - sr_tokens) / global_search_reply_rate + 1;
+        search_reply_schedule(usec);
+    }
+}
+
+static void search_reply_flush_event(int fd, short why, void *user_data)
+{
+    sr_flush_scheduled = false;
+    search_reply_flush();
+}
+
+/* Drops all queued replies and closes the socket. */
+void search_reply_close(void)
+{
+    while(sr_count > 0)
+        search_reply_drop_head();
+
+    if(sr_flush_scheduled)
+    {
+        evtimer_del(&sr_flush_event);
+        sr_flush_scheduled = false;
+    }
+
+    if(sr_fd != -1)
+    {
+        close(sr_fd);
+        sr_fd = -1;
+    }
+}
+
+#ifdef TEST
+
+#include <arpa/inet.h>
+#include <stdio.h>
+
+#include "unit_test.h"
+
+static int bind_receiver(struct sockaddr_in *addr)
+{
+    int fd = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    fail_unless(fd != -1);
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    fail_unless(bind(fd, (struct sockaddr *)addr, sizeof(*addr)) == 0);
+
+    socklen_t len = sizeof(*addr);
+    fail_unless(getsockname(fd, (struct sockaddr *)addr, &len) == 0);
+
+    int size = 256 * 1024;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    io_set_blocking(fd, 0);
+
+    return fd;
+}
+
+/* returns the number of datagrams waiting, checking they are in order */
+static unsigned receive(int fd, unsigned *next)
+{
+    char buf[128];
+    unsigned n = 0;
+    ssize_t len;
+
+    while((len = recv(fd, buf, sizeof(buf) - 1, 0)) > 0)
+    {
+        buf[len] = 0;
+        unsigned i;
+        fail_unless(sscanf(buf, "$SR reply %u|", &i) == 1);
+        fail_unless(i >= *next);
+        *next = i + 1;
+        n++;
+    }
+
+    return n;
+}
+
+static void queue_replies(struct sockaddr_in *addr, unsigned from,
+        unsigned n)
+{
+    unsigned i;
+    for(i = from; i < from + n; i++)
+    {
+        char buf[64];
+        int len = snprintf(buf, sizeof(buf), "$SR reply %u|", i);
+        fail_unless(search_reply_queue(addr, buf, len) == 0);
+    }
+}
+
+int main(void)
+{
+    event_init();
+    sp_log_set_level("warning");
+
+    struct sockaddr_in addr;
+    int fd = bind_receiver(&addr);
+    unsigned next = 0;
+
+    /* replies are sent from the event loop, in batches */
+    global_search_reply_rate = 0;
+    queue_replies(&addr, 0, 100);
+    fail_unless(sr_count == 100);
+    fail_unless(sr_flush_scheduled);
+    fail_unless(receive(fd, &next) == 0);
+    search_reply_flush();
+    fail_unless(sr_count == 0);
+    fail_unless(receive(fd, &next) == 100);
+
+    /* the rate is limited, at most a second's worth is sent at once */
+    search_reply_close();
+    global_search_reply_rate = 50;
+    next = 0;
+    queue_replies(&addr, 0, 100);
+    search_reply_flush();
+    unsigned sent = 100 - sr_count;
+    fail_unless(sent > 0 && sent <= 50);
+    fail_unless(receive(fd, &next) == sent);
+    fail_unless(sr_flush_scheduled);
+
+    /* the rest follow as the rate allows */
+    unsigned received = 0;
+    while(sr_count > 0)
+    {
+        event_loop(EVLOOP_ONCE);
+        received += receive(fd, &next);
+    }
+    fail_unless(sent + received + receive(fd, &next) == 100);
+
+    /* the oldest replies are dropped when too many are queued */
+    search_reply_close();
+    queue_replies(&addr, 0, SEARCH_REPLY_MAX_QUEUED + 10);
+    fail_unless(sr_count == SEARCH_REPLY_MAX_QUEUED);
+    fail_unless(strncmp(sr_queue[sr_head].data, "$SR reply 10|", 13) == 0);
+
+    search_reply_close();
+    close(fd);
+
+    return 0;
+}
+
+#endif
+
@@ -0,0 +1,35 @@
+/*
+ * Copyright (c) 2007 Martin Hedenfalk <martin@bzero.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _search_reply_h_
+#define _search_reply_h_
+
+#include <sys/types.h>
+#include <netinet/in.h>
+
+/* replies kept waiting to be sent, the oldest are dropped beyond this */
+#define SEARCH_REPLY_MAX_QUEUED 2048
+
+/* number of replies sent per system call */
+#define SEARCH_REPLY_BATCH 64
+
+int search_reply_queue(const struct sockaddr_in *addr,
+        const char *datagram, size_t len);
+void search_reply_flush(void);
+void search_reply_close(void);
+
+#endif
+
@@ -39,6 +39,16 @@
 
 RB_GENERATE(file_tree, share_file, entry, share_file_cmp);
 
+static uint32_t share_inode_hash(const void *record)
+{
+    return htable_hash_uint64(((const share_file_t *)record)->inode);
+}
+
+static int share_inode_match(const void *record, const void *key)
+{
+    return ((const share_file_t *)record)->inode == *(const uint64_t *)key;
+}
+
 share_t *share_new(void)
 {
     DEBUG("initializing share");
@@ -48,12 +58,9 @@ share_t *share_new(void)
     RB_INIT(&share->files);
     RB_INIT(&share->unhashed_files);
     LIST_INIT(&share->mountpoints);
+    share->index = share_index_new();
 
-    int i;
-    for(i = 0; i < SHARE_INODE_BUCKETS; i++)
-    {
-        LIST_INIT(&share->inodes[i]);
-    }
+    htable_init(&share->inodes, share_inode_hash);
 
     share->cid = share_get_cid(share);
     share_bloom_init(share);
@@ -96,6 +103,13 @@ int share_add(share_t *share, const char *path)
         share->bloom = bloom_create(32768);
     }
 
+    if(share_snapshot_restore(share, mp) == 0)
+    {
+        /* serve the snapshot while checking it */
+        ui_send_status_message(NULL, NULL, "Verifying %s...", path);
+        return share_scan_verify(share, mp);
+    }
+
     ui_send_status_message(NULL, NULL, "Scanning %s...", path);
 
     return share_scan(share, mp);
@@ -113,6 +127,12 @@ void share_rescan(share_t *share)
     for(mp = LIST_FIRST(&share->mountpoints); mp; mp = next)
     {
         next = LIST_NEXT(mp, link);
+        if(mp->watch)
+        {
+            /* changes are already picked up as they happen */
+            DEBUG("[%s] is watched, skipping rescan", mp->local_root);
+            continue;
+        }
         char *local_root = strdup(mp->local_root);
         share_add(share, local_root);
         free(local_root);
@@ -138,6 +158,8 @@ int share_remove(share_t *share, const char *local_root, bool is_rescan)
 
     nc_send_will_remove_share_notification(nc_default(), local_root);
 
+    share_index_remove_mountpoint(share->index, mp);
+
     share_file_t *f;
     share_file_t *next;
     for(f = RB_MIN(file_tree, &share->files); f; f = next)
@@ -147,6 +169,7 @@ int share_remove(share_t *share, const char *local_root, bool is_rescan)
 	if(f->mp == mp)
         {
             RB_REMOVE(file_tree, &share->files, f);
+            share->nremoved++;
             share_remove_from_inode_table(share, f);
             share_file_free(f);
         }
@@ -165,8 +188,9 @@ int share_remove(share_t *share, const char *local_root, bool is_rescan)
     }
 
     share->uptodate = false;
+    share_watch_stop(mp);
 
-    if(mp->scan_in_progress)
+    if(mp->nscans > 0)
     {
 	WARNING("removing mountpoint currently scanning, delaying removal");
 	mp->removed = true;
@@ -221,6 +245,10 @@ share_mountpoint_t *share_add_mountpoint(share_t *share, const char *local_root)
 
     mp = calloc(1, sizeof(share_mountpoint_t));
     mp->local_root = strdup(local_root);
+    mp->root_dir = calloc(1, sizeof(share_dir_t));
+    RB_INIT(&mp->root_dir->children);
+    mp->root_dir->name = strdup("");
+    mp->root_dir->refcount = 1;
 
     /* Add a new mountpoint */
 
@@ -260,6 +288,8 @@ void share_free_mountpoint(share_mountpoint_t *mp)
 {
     if(mp)
     {
+        share_watch_stop(mp);
+        share_dir_unref(mp->root_dir);
         free(mp->local_root);
         free(mp->virtual_root);
         free(mp);
@@ -273,6 +303,50 @@ void share_remove_mountpoint(share_t *share, share_mountpoint_t *mp)
 
     LIST_REMOVE(mp, link);
     share_free_mountpoint(mp);
+
+    if(LIST_EMPTY(&share->mountpoints))
+    {
+        /* nothing is shared, release the posting tree */
+        share_index_free(share->index);
+        share->index = share_index_new();
+    }
+}
+
+void share_free(share_t *share)
+{
+    if(share)
+    {
+        DEBUG("freeing share");
+
+        share_file_t *f, *next;
+        for(f = RB_MIN(file_tree, &share->files); f; f = next)
+        {
+            next = RB_NEXT(file_tree, &share->files, f);
+            RB_REMOVE(file_tree, &share->files, f);
+            share_file_free(f);
+        }
+
+        for(f = RB_MIN(file_tree, &share->unhashed_files); f; f = next)
+        {
+            next = RB_NEXT(file_tree, &share->unhashed_files, f);
+            RB_REMOVE(file_tree, &share->unhashed_files, f);
+            share_file_free(f);
+        }
+
+        share_mountpoint_t *mp;
+        while((mp = LIST_FIRST(&share->mountpoints)) != NULL)
+        {
+            LIST_REMOVE(mp, link);
+            share_free_mountpoint(mp);
+        }
+
+        share_index_free(share->index);
+        htable_free(&share->inodes);
+        share_snapshot_free(share);
+        share_bloom_free(share);
+        free(share->cid);
+        free(share);
+    }
 }
 
 share_mountpoint_t *share_lookup_local_root(share_t *share,
@@ -304,86 +378,197 @@ share_mountpoint_t *share_lookup_mountpoint(share_t *share,
     return NULL;
 }
 
-/*
- * /folder
- * /folder/prout
- * /folder 1
- *
- * /folder < /folder/prout
- *
- * /folder/prout < /folder 1
- * 
- */
-
-static int share_path_cmp(const char *a, const char *b)
+/* sort function for the subdirectories of a directory */
+int share_dir_cmp(share_dir_t *a, share_dir_t *b)
 {
-    const char *slash_a = a, *slash_b = b;
-    int rc = 0;
-
-    int a_total_len = strlen(a);
-    int b_total_len = strlen(b);
+    unsigned minlen = a->namelen < b->namelen ? a->namelen : b->namelen;
+    int rc = memcmp(a->name, b->name, minlen);
+    if(rc == 0)
+        rc = (int)a->namelen - (int)b->namelen;
+    return rc;
+}
 
-    if(a_total_len == b_total_len &&
-            strncmp(a, b, a_total_len) == 0)
-    {
-        return 0;
-    }
+RB_GENERATE(share_dir_tree, share_dir, entry, share_dir_cmp);
 
-    int alen = 0;
-    int blen = 0;
-    int minlen;
+/* Returns the directory at dirpath (len bytes, relative to the mountpoint),
+ * optionally creating it and its parents. */
+static share_dir_t *share_get_dir(share_mountpoint_t *mp,
+        const char *dirpath, size_t len, bool create)
+{
+    share_dir_t *dir = mp->root_dir;
+    const char *p = dirpath;
+    const char *end = dirpath + len;
 
-    do
+    while(p < end)
     {
-        const char *pa = slash_a + 1;
-        const char *pb = slash_b + 1;
-
-        slash_a = strchr(pa, '/');
-        slash_b = strchr(pb, '/');
-
-        if(slash_a == NULL)
+        if(*p == '/')
         {
-            if(slash_b)
-            {
-                return -1;
-            }
-            /* slash_a = a + a_total_len; */
+            p++;
+            continue;
         }
 
-        if(slash_b == NULL)
-        {
-            if(slash_a)
-            {
-                return 1;
-            }
-            /* slash_b = b + b_total_len; */
-        }
+        const char *e = memchr(p, '/', end - p);
+        if(e == NULL)
+            e = end;
 
-        if(slash_a == NULL)
+        share_dir_t find;
+        find.name = (char *)p;
+        find.namelen = e - p;
+        share_dir_t *child = RB_FIND(share_dir_tree, &dir->children, &find);
+        if(child == NULL)
         {
-            rc = strcmp(a, b);
-            break;
+            if(!create)
+                return NULL;
+
+            child = calloc(1, sizeof(share_dir_t));
+            RB_INIT(&child->children);
+            child->name = xstrndup(p, e - p);
+            child->namelen = e - p;
+            child->parent = dir;
+            child->depth = dir->depth + 1;
+            RB_INSERT(share_dir_tree, &dir->children, child);
+            dir->refcount++;
         }
 
-        alen = slash_a - a;
-        blen = slash_b - b;
+        dir = child;
+        p = e;
+    }
+
+    return dir;
+}
 
-        minlen = alen;
-        if(blen < minlen)
-            minlen = blen;
+share_dir_t *share_lookup_dir(share_mountpoint_t *mp, const char *dirpath,
+        size_t len)
+{
+    return_val_if_fail(mp, NULL);
+    return_val_if_fail(dirpath, NULL);
 
-        rc = strncmp(a, b, minlen);
+    return share_get_dir(mp, dirpath, len, false);
+}
 
-        if(rc == 0 && alen != blen)
-        {
-            rc = alen - blen;
-        }
-    } while(rc == 0);
+/* Returns true if dir is ancestor, or a subdirectory of it. */
+bool share_dir_is_within(share_dir_t *dir, share_dir_t *ancestor)
+{
+    while(dir && dir->depth > ancestor->depth)
+        dir = dir->parent;
+    return dir == ancestor;
+}
 
-    return rc < 0 ? -1 : 1;
+void share_dir_ref(share_dir_t *dir)
+{
+    return_if_fail(dir);
+    dir->refcount++;
+}
+
+/* Releases a reference to the directory, freeing it and any parents no
+ * longer used. */
+void share_dir_unref(share_dir_t *dir)
+{
+    while(dir && --dir->refcount == 0)
+    {
+        share_dir_t *parent = dir->parent;
+        if(parent)
+            RB_REMOVE(share_dir_tree, &parent->children, dir);
+        free(dir->name);
+        free(dir);
+        dir = parent;
+    }
+}
+
+/* Creates a file at partial_path (eg, "/a/b/c.mp3") in the mountpoint. */
+share_file_t *share_file_new(share_mountpoint_t *mp, const char *partial_path)
+{
+    return_val_if_fail(mp, NULL);
+    return_val_if_fail(partial_path, NULL);
+
+    const char *name = strrchr(partial_path, '/');
+    if(name++ == NULL)
+        name = partial_path;
+
+    share_file_t *file = calloc(1, sizeof(share_file_t));
+    file->mp = mp;
+    file->dir = share_get_dir(mp, partial_path, name - partial_path, true);
+    share_dir_ref(file->dir);
+    file->name = strdup(name);
+
+    return file;
 }
 
-/* sort function used by the red-black tree */
+/* Writes root followed by the path of the file within the mountpoint (eg,
+ * "/a/b/c.mp3") to buf. Returns the length of the path. Nothing is written
+ * unless buf can hold the path and the terminating nul.
+ */
+size_t share_file_path(share_file_t *file, const char *root,
+        char *buf, size_t size)
+{
+    size_t rootlen = strlen(root);
+    size_t namelen = strlen(file->name);
+    size_t len = rootlen + 1 + namelen;
+
+    share_dir_t *dir;
+    for(dir = file->dir; dir->parent; dir = dir->parent)
+        len += dir->namelen + 1;
+
+    if(buf == NULL || len >= size)
+        return len;
+
+    /* fill in from the end */
+    char *p = buf + len;
+    *p = 0;
+    p -= namelen;
+    memcpy(p, file->name, namelen);
+    *--p = '/';
+    for(dir = file->dir; dir->parent; dir = dir->parent)
+    {
+        p -= dir->namelen;
+        memcpy(p, dir->name, dir->namelen);
+        *--p = '/';
+    }
+    memcpy(buf, root, rootlen);
+
+    return len;
+}
+
+/* Returns true if local_path is the complete path of the file. */
+bool share_file_is_at(share_file_t *file, const char *local_path)
+{
+    return_val_if_fail(file, false);
+    return_val_if_fail(local_path, false);
+
+    size_t len = strlen(local_path);
+    if(share_file_path(file, file->mp->local_root, NULL, 0) != len)
+        return false;
+
+    /* compare from the end, where paths differ the most */
+    const char *p = local_path + len;
+    size_t namelen = strlen(file->name);
+    p -= namelen;
+    if(memcmp(p, file->name, namelen) != 0 || *--p != '/')
+        return false;
+
+    share_dir_t *dir;
+    for(dir = file->dir; dir->parent; dir = dir->parent)
+    {
+        p -= dir->namelen;
+        if(memcmp(p, dir->name, dir->namelen) != 0 || *--p != '/')
+            return false;
+    }
+
+    return memcmp(local_path, file->mp->local_root, p - local_path) == 0;
+}
+
+/* Sort function used by the red-black tree. Within a mountpoint, files in
+ * a directory are sorted by name, and before the files in its
+ * subdirectories:
+ *
+ * /folder
+ * /folder/prout
+ * /folder 1
+ *
+ * /folder < /folder/prout
+ *
+ * /folder/prout < /folder 1
+ */
 int share_file_cmp(share_file_t *a, share_file_t *b)
 {
     if(a->mp < b->mp)
@@ -391,55 +576,84 @@ int share_file_cmp(share_file_t *a, share_file_t *b)
     if(a->mp > b->mp)
 	return 1;
 
-    return share_path_cmp(a->partial_path, b->partial_path);
-}
+    share_dir_t *da = a->dir;
+    share_dir_t *db = b->dir;
+    int rc;
 
-unsigned share_inode_hash(uint64_t inode)
-{
-    return (unsigned)inode % SHARE_INODE_BUCKETS;
+    if(da == db)
+        rc = strcmp(a->name, b->name);
+    else
+    {
+        /* compare the directories where the paths diverge */
+        while(da->depth > db->depth)
+        {
+            da = da->parent;
+            if(da == db)
+                return 1; /* a is in a subdirectory of b's directory */
+        }
+        while(db->depth > da->depth)
+        {
+            db = db->parent;
+            if(db == da)
+                return -1;
+        }
+        while(da->parent != db->parent)
+        {
+            da = da->parent;
+            db = db->parent;
+        }
+        rc = share_dir_cmp(da, db);
+    }
+
+    if(rc == 0)
+        return 0;
+    return rc < 0 ? -1 : 1;
 }
 
 void share_add_to_inode_table(share_t *share, share_file_t *file)
 {
-    LIST_INSERT_HEAD(&share->inodes[share_inode_hash(file->inode)],
-            file, inode_link);
+    htable_insert(&share->inodes, file);
 }
 
 void share_remove_from_inode_table(share_t *share, share_file_t *file)
 {
-    LIST_REMOVE(file, inode_link);
+    htable_remove(&share->inodes, file);
 }
 
-share_file_t *share_lookup_file(share_t *share, const char *local_path)
+static share_file_t *share_lookup_path(share_t *share, file_tree_t *tree,
+        const char *local_path)
 {
     share_file_t find;
     find.mp = share_lookup_local_root(share, local_path);
     if(find.mp == NULL)
 	return NULL;
-    find.partial_path = (char *)local_path + strlen(find.mp->local_root);
-    return RB_FIND(file_tree, &share->files, &find);
+
+    const char *partial_path = local_path + strlen(find.mp->local_root);
+    const char *name = strrchr(partial_path, '/');
+    if(name++ == NULL)
+        return NULL;
+    find.dir = share_lookup_dir(find.mp, partial_path, name - partial_path);
+    if(find.dir == NULL)
+        return NULL;
+    find.name = (char *)name;
+
+    return RB_FIND(file_tree, tree, &find);
+}
+
+share_file_t *share_lookup_file(share_t *share, const char *local_path)
+{
+    return share_lookup_path(share, &share->files, local_path);
 }
 
 share_file_t *share_lookup_unhashed_file(share_t *share, const char *local_path)
 {
-    share_file_t find;
-    find.mp = share_lookup_local_root(share, local_path);
-    if(find.mp == NULL)
-	return NULL;
-    find.partial_path = (char *)local_path + strlen(find.mp->local_root);
-    return RB_FIND(file_tree, &share->unhashed_files, &find);
+    return share_lookup_path(share, &share->unhashed_files, local_path);
 }
 
 share_file_t *share_lookup_file_by_inode(share_t *share, uint64_t inode)
 {
-    share_file_t *f;
-    LIST_FOREACH(f, &share->inodes[share_inode_hash(inode)], inode_link)
-    {
-        if(f->inode == inode)
-            return f;
-    }
-
-    return NULL;
+    return htable_lookup(&share->inodes, htable_hash_uint64(inode),
+            share_inode_match, &inode);
 }
 
 char *share_get_cid(share_t *share)
@@ -496,26 +710,28 @@ char *share_local_to_virtual_path(share_t *share, share_file_t *file)
     return_val_if_fail(file, NULL);
     return_val_if_fail(file->mp, NULL);
 
-    char *virtual_path;
-    int num_returned_bytes = asprintf(&virtual_path, "%s%s", file->mp->virtual_root, file->partial_path);
-    if (num_returned_bytes == -1)
-        DEBUG("asprintf did not return anything");
+    size_t len = share_file_path(file, file->mp->virtual_root, NULL, 0);
+    char *virtual_path = malloc(len + 1);
+    share_file_path(file, file->mp->virtual_root, virtual_path, len + 1);
     str_replace_set(virtual_path, "/", '\\');
-    
+
     return virtual_path;
 }
 
 share_file_t *share_file_dup(share_file_t *file)
 {
     return_val_if_fail(file, NULL);
-    return_val_if_fail(file->partial_path, NULL);
+    return_val_if_fail(file->name, NULL);
 
     share_file_t *dup = calloc(1, sizeof(share_file_t));
-    dup->partial_path = strdup(file->partial_path);
+    dup->dir = file->dir;
+    share_dir_ref(dup->dir);
+    dup->name = strdup(file->name);
     dup->mp = file->mp;
     dup->type = file->type;
     dup->size = file->size;
     dup->inode = file->inode;
+    dup->mtime = file->mtime;
     return dup;
 }
 
@@ -554,10 +770,9 @@ char *share_complete_path(share_file_t *file)
     return_val_if_fail(file->mp, NULL);
 
     /* construct the complete local path */
-    char *local_path;
-    int num_returned_bytes = asprintf(&local_path, "%s%s", file->mp->local_root, file->partial_path);
-    if (num_returned_bytes == -1)
-        DEBUG("asprintf did not return anything");
+    size_t len = share_file_path(file, file->mp->local_root, NULL, 0);
+    char *local_path = malloc(len + 1);
+    share_file_path(file, file->mp->local_root, local_path, len + 1);
 
     return local_path;
 }
@@ -565,8 +780,11 @@ char *share_complete_path(share_file_t *file)
 /* returned string should be freed by caller */
 char *share_translate_tth(share_t *share, const char *tth)
 {
-    struct tth_entry *te = tth_store_lookup(global_tth_store, tth);
-    
+    tth_t binary_tth;
+    if(tth_from_base32(&binary_tth, tth) != 0)
+        return NULL;
+
+    struct tth_entry *te = tth_store_lookup(global_tth_store, &binary_tth);
     if(te == NULL)
         return NULL;
 
@@ -581,7 +799,8 @@ void share_file_free(share_file_t *file)
 {
     if(file)
     {
-        free(file->partial_path);
+        share_dir_unref(file->dir);
+        free(file->name);
         free(file);
     }
 }
@@ -607,6 +826,9 @@ void share_get_stats(share_t *share, share_stats_t *stats)
 }
 
 #ifdef TEST
+#include <unistd.h>
+
+#include "bz2.h"
 #include "unit_test.h"
 
 int ui_send_status_message(ui_t *ui, const char *hub_address, const char *message, ...)
@@ -614,6 +836,169 @@ int ui_send_status_message(ui_t *ui, const char *hub_address, const char *messag
     return 0;
 }
 
+static share_file_t *test_add_file(share_t *share, share_mountpoint_t *mp,
+        const char *partial_path, uint64_t size)
+{
+    share_file_t *f = share_file_new(mp, partial_path);
+    f->size = size;
+    f->inode = size;
+    RB_INSERT(file_tree, &share->files, f);
+    return f;
+}
+
+/* compares files at two paths in the mountpoint */
+static int test_path_cmp(share_mountpoint_t *mp, const char *a, const char *b)
+{
+    share_file_t *fa = share_file_new(mp, a);
+    share_file_t *fb = share_file_new(mp, b);
+    int rc = share_file_cmp(fa, fb);
+    fail_unless(rc == -share_file_cmp(fb, fa));
+    share_file_free(fa);
+    share_file_free(fb);
+    return rc;
+}
+
+static void test_paths(void)
+{
+    share_t *share = share_new();
+    share_mountpoint_t *mp = share_add_mountpoint(share, "/music");
+
+    share_file_t *f1 = test_add_file(share, mp, "/a/b/one.mp3", 1);
+    share_file_t *f2 = test_add_file(share, mp, "/a/b/two.mp3", 2);
+    share_file_t *f3 = test_add_file(share, mp, "/a/three.mp3", 3);
+
+    /* directories are shared */
+    fail_unless(f1->dir == f2->dir);
+    fail_unless(f3->dir == f1->dir->parent);
+    fail_unless(f1->dir->depth == 2);
+    fail_unless(f1->dir->refcount == 2);
+    fail_unless(strcmp(f1->name, "one.mp3") == 0);
+    fail_unless(share_lookup_dir(mp, "/a/b", 4) == f1->dir);
+    fail_unless(share_lookup_dir(mp, "/a/c", 4) == NULL);
+    fail_unless(share_dir_is_within(f1->dir, f3->dir));
+    fail_unless(!share_dir_is_within(f3->dir, f1->dir));
+
+    char buf[64];
+    fail_unless(share_file_path(f1, "/music", buf, sizeof(buf)) == 18);
+    fail_unless(strcmp(buf, "/music/a/b/one.mp3") == 0);
+    fail_unless(share_file_path(f1, "/music", NULL, 0) == 18);
+    fail_unless(share_lookup_file(share, "/music/a/b/two.mp3") == f2);
+    fail_unless(share_lookup_file(share, "/music/a/three.mp3") == f3);
+    fail_unless(share_lookup_file(share, "/music/a/b/three.mp3") == NULL);
+    fail_unless(share_lookup_file(share, "/music/a/c/one.mp3") == NULL);
+
+    char *virtual_path = share_local_to_virtual_path(share, f1);
+    fail_unless(strcmp(virtual_path, "music\\a\\b\\one.mp3") == 0);
+    free(virtual_path);
+
+    /* and freed with their last file */
+    share_dir_t *dir_a = f3->dir;
+    RB_REMOVE(file_tree, &share->files, f1);
+    share_file_free(f1);
+    RB_REMOVE(file_tree, &share->files, f2);
+    share_file_free(f2);
+    fail_unless(RB_EMPTY(&dir_a->children));
+    fail_unless(share_lookup_dir(mp, "/a/b", 4) == NULL);
+    fail_unless(share_lookup_dir(mp, "/a", 2) == dir_a);
+}
+
+/* decompresses the saved filelist and returns its contents */
+static char *test_read_filelist(void)
+{
+    fail_unless(bz2_decode("/tmp/share_save_test/files.xml.bz2",
+                "/tmp/share_save_test/decoded.xml", NULL) == 0);
+    FILE *fp = fopen("/tmp/share_save_test/decoded.xml", "r");
+    fail_unless(fp);
+    char *buf = calloc(1, 64 * 1024);
+    fread(buf, 1, 64 * 1024 - 1, fp);
+    fclose(fp);
+    return buf;
+}
+
+static void test_save(void)
+{
+    event_init();
+    global_working_directory = "/tmp/share_save_test";
+    global_id_generator = "ShakesPeer";
+    global_id_version = "test";
+    system("/bin/rm -rf /tmp/share_save_test");
+    mkpath("/tmp/share_save_test");
+    tth_store_init();
+
+    share_t *share = share_new();
+    free(share->cid);
+    share->cid = strdup("HAEK3YLCADGFS");
+
+    share_mountpoint_t *mp = share_add_mountpoint(share, "/music");
+    test_add_file(share, mp, "/a/b/one.mp3", 1);
+    test_add_file(share, mp, "/a/two & three.mp3", 2);
+    test_add_file(share, mp, "/c/four.mp3", 3);
+
+    /* without a previous filelist, it is saved immediately */
+    fail_unless(share_save(share, FILELIST_XML) == 0);
+    fail_unless(share->saving == NULL);
+    fail_unless(share->uptodate);
+    fail_unless(access("/tmp/share_save_test/files.xml", F_OK) != 0);
+
+    char *xml = test_read_filelist();
+    fail_unless(strcmp(xml,
+        "<?xml version=\"1.0\" encoding=\"utf-8\" standalone=\"yes\"?>\r\n"
+        "<FileListing Version=\"1\" CID=\"HAEK3YLCADGFS\" Base=\"/\""
+        " Generator=\"ShakesPeer test\">\r\n"
+        "<Directory Name=\"music\">\r\n"
+        "\t<Directory Name=\"a\">\r\n"
+        "\t\t<File Name=\"two &amp; three.mp3\" Size=\"2\"/>\r\n"
+        "\t\t<Directory Name=\"b\">\r\n"
+        "\t\t\t<File Name=\"one.mp3\" Size=\"1\"/>\r\n"
+        "\t\t</Directory>\r\n"
+        "\t</Directory>\r\n"
+        "\t<Directory Name=\"c\">\r\n"
+        "\t\t<File Name=\"four.mp3\" Size=\"3\"/>\r\n"
+        "\t</Directory>\r\n"
+        "</Directory>\r\n"
+        "</FileListing>\r\n") == 0);
+    free(xml);
+
+    /* up to date, nothing to do */
+    fail_unless(share_save(share, FILELIST_XML) == 0);
+    fail_unless(share->saving == NULL);
+
+    /* a changed share is saved in the background, the previous filelist is
+     * used meanwhile */
+    test_add_file(share, mp, "/c/five.mp3", 5);
+    share->uptodate = false;
+    fail_unless(share_save(share, FILELIST_XML) == 0);
+    fail_unless(share->saving);
+    xml = test_read_filelist();
+    fail_unless(strstr(xml, "five.mp3") == NULL);
+    free(xml);
+
+    /* removing a file restarts the save */
+    share_file_t *f = share_lookup_file(share, "/music/a/b/one.mp3");
+    fail_unless(f);
+    RB_REMOVE(file_tree, &share->files, f);
+    share->nremoved++;
+    share_file_free(f);
+
+    while(share->saving)
+        event_loop(EVLOOP_ONCE);
+    fail_unless(share->uptodate);
+    fail_unless(access("/tmp/share_save_test/files.xml.bz2.tmp", F_OK) != 0);
+    xml = test_read_filelist();
+    fail_unless(strstr(xml, "five.mp3"));
+    fail_unless(strstr(xml, "one.mp3") == NULL);
+    free(xml);
+
+    /* the uncompressed filelist is saved on request */
+    share->save_xml = true;
+    fail_unless(share_save(share, FILELIST_XML) == 0);
+    fail_unless(share->saving == NULL);
+    fail_unless(access("/tmp/share_save_test/files.xml", F_OK) == 0);
+
+    tth_store_close();
+    system("/bin/rm -rf /tmp/share_save_test");
+}
+
 int main(void)
 {
     share_t *share = share_new();
@@ -648,35 +1033,40 @@ int main(void)
      *
      */
 
-    fail_unless(share_path_cmp("/a", "/a2") == -1);
-    fail_unless(share_path_cmp("/a2", "/a/b") == -1);
-    fail_unless(share_path_cmp("/a/b", "/a/b2") == -1);
-    fail_unless(share_path_cmp("/a/b2", "/a/b/c") == -1);
-    fail_unless(share_path_cmp("/a/b2", "/a/c") == -1);
-    fail_unless(share_path_cmp("/a/c", "/a/c2") == -1);
+    fail_unless(test_path_cmp(mp, "/a", "/a2") == -1);
+    fail_unless(test_path_cmp(mp, "/a2", "/a/b") == -1);
+    fail_unless(test_path_cmp(mp, "/a/b", "/a/b2") == -1);
+    fail_unless(test_path_cmp(mp, "/a/b2", "/a/b/c") == -1);
+    fail_unless(test_path_cmp(mp, "/a/b2", "/a/c") == -1);
+    fail_unless(test_path_cmp(mp, "/a/c", "/a/c2") == -1);
+
+    fail_unless(test_path_cmp(mp, "/a", "/a/b/c") == -1);
+    fail_unless(test_path_cmp(mp, "/a", "/a2/b/c") == -1);
+
+    fail_unless(test_path_cmp(mp, "/a", "/a") == 0);
+    fail_unless(test_path_cmp(mp, "/a/b", "/a/b") == 0);
+    fail_unless(test_path_cmp(mp, "/a/b/c", "/a/b/c") == 0);
 
-    fail_unless(share_path_cmp("/a", "/a/b/c") == -1);
-    fail_unless(share_path_cmp("/a", "/a2/b/c") == -1);
+    fail_unless(test_path_cmp(mp, "/a2", "/a") == 1);
+    fail_unless(test_path_cmp(mp, "/a/b", "/a2") == 1);
+    fail_unless(test_path_cmp(mp, "/a/b/c", "/a/b") == 1);
+    fail_unless(test_path_cmp(mp, "/a/b/c", "/a/b2") == 1);
+    fail_unless(test_path_cmp(mp, "/a/c", "/a/b2") == 1);
+    fail_unless(test_path_cmp(mp, "/a/c2", "/a/c") == 1);
 
-    fail_unless(share_path_cmp("/a", "/a") == 0);
-    fail_unless(share_path_cmp("/a/b", "/a/b") == 0);
-    fail_unless(share_path_cmp("/a/b/c", "/a/b/c") == 0);
+    fail_unless(test_path_cmp(mp, "/a", "/a/filen") == -1);
+    fail_unless(test_path_cmp(mp, "/a/filen", "/a") == 1);
 
-    fail_unless(share_path_cmp("/a2", "/a") == 1);
-    fail_unless(share_path_cmp("/a/b", "/a2") == 1);
-    fail_unless(share_path_cmp("/a/b/c", "/a/b") == 1);
-    fail_unless(share_path_cmp("/a/b/c", "/a/b2") == 1);
-    fail_unless(share_path_cmp("/a/c", "/a/b2") == 1);
-    fail_unless(share_path_cmp("/a/c2", "/a/c") == 1);
+    fail_unless(test_path_cmp(mp, "/folder", "/folder/prout") == -1);
+    fail_unless(test_path_cmp(mp, "/folder/prout", "/folder") == 1);
 
-    fail_unless(share_path_cmp("/a", "/a/filen") == -1);
-    fail_unless(share_path_cmp("/a/filen", "/a") == 1);
+    fail_unless(test_path_cmp(mp, "/folder/prout", "/folder 1") == 1);
+    fail_unless(test_path_cmp(mp, "/folder 1", "/folder/prout") == -1);
 
-    fail_unless(share_path_cmp("/folder", "/folder/prout") == -1);
-    fail_unless(share_path_cmp("/folder/prout", "/folder") == 1);
+    share_free(share);
 
-    fail_unless(share_path_cmp("/folder/prout", "/folder 1") == 1);
-    fail_unless(share_path_cmp("/folder 1", "/folder/prout") == -1);
+    test_paths();
+    test_save();
 
     return 0;
 }
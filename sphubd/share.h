@@ -31,8 +31,14 @@
 #include "tiger.h"
 #include "util.h"
 #include "tthdb.h"
+#include "htable.h"
 
-#define SHARE_INODE_BUCKETS 509
+/* a share loaded from the snapshot is verified with this delay between
+ * directories, to leave the disk to others */
+#define SHARE_VERIFY_DELAY_MSEC 10
+
+/* the snapshot is saved this long after the last scan finished */
+#define SHARE_SNAPSHOT_SAVE_DELAY 10
 
 typedef struct share_mountpoint share_mountpoint_t;
 
@@ -43,7 +49,8 @@ struct share_search
     uint64_t size;
     share_type_t type;
     arg_t *words;
-    char *tth;
+    tth_t tth;
+    bool has_tth;
     unsigned matches;
 
     bool passive;
@@ -52,28 +59,58 @@ struct share_search
     char *nick;
 };
 
+/* A directory within a mountpoint. Directories are shared by all files in
+ * them, so files only keep their own name. A directory is freed with its
+ * last file or subdirectory. */
+typedef struct share_dir share_dir_t;
+struct share_dir
+{
+    RB_ENTRY(share_dir) entry; /* in the subdirectories of the parent */
+    RB_HEAD(share_dir_tree, share_dir) children;
+
+    share_dir_t *parent; /* NULL for the root of the mountpoint */
+    char *name;
+    unsigned namelen;
+    unsigned depth; /* 0 for the root of the mountpoint */
+    unsigned refcount; /* files and subdirectories */
+};
+
+RB_PROTOTYPE(share_dir_tree, share_dir, entry, share_dir_cmp);
+
 typedef struct share_file share_file_t;
 struct share_file
 {
     RB_ENTRY(share_file) entry;
-    LIST_ENTRY(share_file) inode_link;
     SLIST_ENTRY(share_file) link; /* used by sphashd_client.c */
 
     share_mountpoint_t *mp;
-    char *partial_path; /* sub-path within the mountpoint */
+    share_dir_t *dir;
+    char *name;
     share_type_t type;
     uint64_t size;
     uint64_t inode;
+    time_t mtime;
+    bool stale; /* loaded from the snapshot, not yet verified */
 };
 
 typedef struct file_tree file_tree_t;
 RB_HEAD(file_tree, share_file);
 
+typedef struct share_index share_index_t;
+
+typedef struct share_save_context share_save_context_t;
+
+typedef struct share_snapshot share_snapshot_t;
+
 typedef struct share share_t;
 struct share
 {
     LIST_HEAD(, share_mountpoint) mountpoints;
     bool uptodate;     /* if false, filelist must be re-saved */
+    bool save_xml;     /* also save the uncompressed filelist */
+    share_save_context_t *saving; /* filelist being saved, or NULL */
+    share_snapshot_t *snapshot; /* mountpoints loaded at startup, or NULL */
+    unsigned nremoved; /* increased when hashed files are removed */
     int scanning;      /* increased for each each share currently scanning */
     bloom_t *bloom;
     char *cid;
@@ -81,7 +118,8 @@ struct share
 
     file_tree_t files;
     file_tree_t unhashed_files;
-    LIST_HEAD(, share_file) inodes[SHARE_INODE_BUCKETS];
+    share_index_t *index; /* filename trigrams of hashed files */
+    htable_t inodes; /* share_file_t by inode */
 };
 
 RB_PROTOTYPE(file_tree, share_file, entry, share_file_cmp);
@@ -103,17 +141,32 @@ struct share_mountpoint
 
     char *local_root;    /* /mnt/media/music */
     char *virtual_root;  /* music */
+    share_dir_t *root_dir;
 
     share_stats_t stats;
     bool scan_in_progress;
+    int nscans; /* full and incremental scans in progress */
     bool removed; /* set to true if removed, so a scanner can abort */
+
+    struct share_watch *watch; /* NULL if changes aren't watched */
 };
 
 typedef SLIST_HEAD(share_file_list, share_file) share_file_list_t;
 
 share_t *share_new(void);
+void share_free(share_t *share);
 
 int share_file_cmp(share_file_t *a, share_file_t *b);
+int share_dir_cmp(share_dir_t *a, share_dir_t *b);
+share_dir_t *share_lookup_dir(share_mountpoint_t *mp, const char *dirpath,
+        size_t len);
+bool share_dir_is_within(share_dir_t *dir, share_dir_t *ancestor);
+void share_dir_ref(share_dir_t *dir);
+void share_dir_unref(share_dir_t *dir);
+share_file_t *share_file_new(share_mountpoint_t *mp, const char *partial_path);
+size_t share_file_path(share_file_t *file, const char *root,
+        char *buf, size_t size);
+bool share_file_is_at(share_file_t *file, const char *local_path);
 share_file_t *share_lookup_file(share_t *share, const char *local_path);
 share_file_t *share_lookup_unhashed_file(share_t *share, const char *local_path);
 share_mountpoint_t *share_lookup_mountpoint(share_t *share,
@@ -137,6 +190,13 @@ char *share_local_to_virtual_path(share_t *share, share_file_t *file);
 char *share_complete_path(share_file_t *file);
 
 int share_scan(share_t *share, share_mountpoint_t *mp);
+int share_scan_verify(share_t *share, share_mountpoint_t *mp);
+share_file_t *share_scan_add(share_t *share, share_mountpoint_t *mp,
+        const char *filepath, uint64_t size, uint64_t inode, time_t mtime);
+void share_scan_path(share_t *share, share_mountpoint_t *mp,
+        const char *dirpath, const char *filename);
+void share_unscan_path(share_t *share, share_mountpoint_t *mp,
+        const char *dirpath, const char *filename);
 
 typedef int (*search_match_func_t)(const share_search_t *search,
         share_file_t *file, const char *tth, void *data);
@@ -151,6 +211,7 @@ void share_rescan(share_t *share);
 
 /* in share_bloom.c */
 void share_bloom_init(share_t *share);
+void share_bloom_free(share_t *share);
 
 /* in share_search.c */
 int share_search(share_t *share, const share_search_t *search,
@@ -159,9 +220,31 @@ share_search_t *share_search_parse_nmdc(const char *search_string,
         const char *encoding);
 void share_search_free(share_search_t *s);
 
+/* in share_index.c */
+share_index_t *share_index_new(void);
+void share_index_free(share_index_t *index);
+void share_index_add_file(share_index_t *index, share_file_t *file);
+void share_index_remove_file(share_index_t *index, share_file_t *file);
+void share_index_remove_mountpoint(share_index_t *index,
+        share_mountpoint_t *mp);
+int share_index_lookup_words(share_index_t *index, const arg_t *words,
+        share_file_t ***files, unsigned *nfiles);
+
 /* in share_save.c */
 int share_save(share_t *share, unsigned int type);
 
+/* in share_snapshot.c */
+int share_snapshot_load(share_t *share);
+int share_snapshot_restore(share_t *share, share_mountpoint_t *mp);
+int share_snapshot_save(share_t *share);
+void share_snapshot_schedule_save(share_t *share);
+void share_snapshot_free(share_t *share);
+
+/* in share_watch.c */
+void share_watch_start(share_t *share, share_mountpoint_t *mp);
+void share_watch_directory(share_mountpoint_t *mp, const char *dirpath);
+void share_watch_stop(share_mountpoint_t *mp);
+
 /* in share_tth.c */
 void share_tth_init_notifications(share_t *share);
 
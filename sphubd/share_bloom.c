@@ -41,10 +41,7 @@ static void share_create_bloom(share_t *share, unsigned length)
     share_file_t *f;
     RB_FOREACH(f, file_tree, &share->files)
     {
-	char *filename = strrchr(f->partial_path, '/');
-	if(filename++ == NULL)
-	    filename = f->partial_path;
-        bloom_add_filename(share->bloom, filename);
+        bloom_add_filename(share->bloom, f->name);
     }
 
     INFO("bloom filter is %.1f%% filled", bloom_filled_percent(share->bloom));
@@ -94,3 +91,13 @@ void share_bloom_init(share_t *share)
 		share_bloom_handle_scan_finished, share);
 }
 
+void share_bloom_free(share_t *share)
+{
+	nc_remove_observer(nc_default(), "did_remove_share",
+		(nc_callback_t)share_bloom_handle_did_remove_share_notification);
+	nc_remove_observer(nc_default(), "share_scan_finished",
+		(nc_callback_t)share_bloom_handle_scan_finished);
+	bloom_free(share->bloom);
+	share->bloom = NULL;
+}
+
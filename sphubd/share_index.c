@@ -0,0 +1,324 @@
+/*
+ * Copyright 2006 Martin Hedenfalk <martin@bzero.se>
+ *
+ * This file is part of ShakesPeer.
+ *
+ * ShakesPeer is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ShakesPeer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ShakesPeer; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "share.h"
+
+/* Inverted index of filename trigrams.
+ *
+ * Filenames are split into tokens on the same delimiters as the bloom
+ * filter, and every (ASCII case-folded) 3-byte substring of a token is mapped
+ * to a posting list of the hashed files containing it. A search word can only
+ * match a filename (with strcasestr) if all trigrams of its tokens are
+ * present, so the shortest posting list among the search words is a complete
+ * set of candidates. The candidates are then checked against the full search
+ * (words, size and type) as before.
+ */
+
+#define SHARE_INDEX_DELIMITERS "$.-_()[]{} "
+
+struct share_posting
+{
+    RB_ENTRY(share_posting) entry;
+    uint32_t trigram;
+    unsigned nfiles;
+    unsigned nalloc;
+    share_file_t **files;
+};
+
+RB_HEAD(posting_tree, share_posting);
+
+struct share_index
+{
+    struct posting_tree postings;
+};
+
+static int share_posting_cmp(struct share_posting *a, struct share_posting *b)
+{
+    if(a->trigram < b->trigram)
+        return -1;
+    if(a->trigram > b->trigram)
+        return 1;
+    return 0;
+}
+
+RB_GENERATE(posting_tree, share_posting, entry, share_posting_cmp);
+
+static int share_index_trigram_cmp(const void *a, const void *b)
+{
+    uint32_t ta = *(const uint32_t *)a;
+    uint32_t tb = *(const uint32_t *)b;
+
+    if(ta < tb)
+        return -1;
+    if(ta > tb)
+        return 1;
+    return 0;
+}
+
+static unsigned char share_index_fold(unsigned char c)
+{
+    /* Same case folding as strcasestr in the C locale. */
+    if(c >= 'A' && c <= 'Z')
+        return c + ('a' - 'A');
+    return c;
+}
+
+/* Fills trigrams (which must have room for strlen(string) entries) with the
+ * sorted, unique trigrams of all tokens in string. Returns the number of
+ * trigrams.
+ */
+static unsigned share_index_trigrams(const char *string, uint32_t *trigrams)
+{
+    unsigned n = 0;
+    const unsigned char *p = (const unsigned char *)string;
+
+    while(*p)
+    {
+        size_t toklen = strcspn((const char *)p, SHARE_INDEX_DELIMITERS);
+        size_t i;
+        for(i = 0; i + 3 <= toklen; i++)
+        {
+            trigrams[n++] = (share_index_fold(p[i]) << 16) |
+                            (share_index_fold(p[i + 1]) << 8) |
+                             share_index_fold(p[i + 2]);
+        }
+
+        p += toklen;
+        if(*p)
+            p++;
+    }
+
+    if(n > 1)
+    {
+        qsort(trigrams, n, sizeof(uint32_t), share_index_trigram_cmp);
+
+        unsigned i, j = 0;
+        for(i = 1; i < n; i++)
+        {
+            if(trigrams[i] != trigrams[j])
+                trigrams[++j] = trigrams[i];
+        }
+        n = j + 1;
+    }
+
+    return n;
+}
+
+static const char *share_index_filename(share_file_t *file)
+{
+    return file->name;
+}
+
+static struct share_posting *share_index_lookup(share_index_t *index,
+        uint32_t trigram)
+{
+    struct share_posting find;
+    find.trigram = trigram;
+    return RB_FIND(posting_tree, &index->postings, &find);
+}
+
+share_index_t *share_index_new(void)
+{
+    share_index_t *index = calloc(1, sizeof(share_index_t));
+    RB_INIT(&index->postings);
+    return index;
+}
+
+static void share_posting_free(struct share_posting *posting)
+{
+    if(posting)
+    {
+        free(posting->files);
+        free(posting);
+    }
+}
+
+void share_index_free(share_index_t *index)
+{
+    if(index)
+    {
+        struct share_posting *posting, *next;
+        for(posting = RB_MIN(posting_tree, &index->postings); posting;
+                posting = next)
+        {
+            next = RB_NEXT(posting_tree, &index->postings, posting);
+            RB_REMOVE(posting_tree, &index->postings, posting);
+            share_posting_free(posting);
+        }
+        free(index);
+    }
+}
+
+void share_index_add_file(share_index_t *index, share_file_t *file)
+{
+    return_if_fail(index);
+    return_if_fail(file);
+
+    const char *filename = share_index_filename(file);
+    uint32_t *trigrams = malloc((strlen(filename) + 1) * sizeof(uint32_t));
+    unsigned n = share_index_trigrams(filename, trigrams);
+
+    unsigned i;
+    for(i = 0; i < n; i++)
+    {
+        struct share_posting *posting = share_index_lookup(index, trigrams[i]);
+        if(posting == NULL)
+        {
+            posting = calloc(1, sizeof(struct share_posting));
+            posting->trigram = trigrams[i];
+            RB_INSERT(posting_tree, &index->postings, posting);
+        }
+
+        if(posting->nfiles == posting->nalloc)
+        {
+            posting->nalloc = posting->nalloc ? posting->nalloc * 2 : 4;
+            posting->files = realloc(posting->files,
+                    posting->nalloc * sizeof(share_file_t *));
+        }
+        posting->files[posting->nfiles++] = file;
+    }
+
+    free(trigrams);
+}
+
+static void share_index_unlink_posting(share_index_t *index,
+        struct share_posting *posting)
+{
+    RB_REMOVE(posting_tree, &index->postings, posting);
+    share_posting_free(posting);
+}
+
+void share_index_remove_file(share_index_t *index, share_file_t *file)
+{
+    return_if_fail(index);
+    return_if_fail(file);
+
+    const char *filename = share_index_filename(file);
+    uint32_t *trigrams = malloc((strlen(filename) + 1) * sizeof(uint32_t));
+    unsigned n = share_index_trigrams(filename, trigrams);
+
+    unsigned i;
+    for(i = 0; i < n; i++)
+    {
+        struct share_posting *posting = share_index_lookup(index, trigrams[i]);
+        if(posting == NULL)
+            continue;
+
+        unsigned j;
+        for(j = 0; j < posting->nfiles; j++)
+        {
+            if(posting->files[j] == file)
+            {
+                posting->files[j] = posting->files[--posting->nfiles];
+                break;
+            }
+        }
+
+        if(posting->nfiles == 0)
+            share_index_unlink_posting(index, posting);
+    }
+
+    free(trigrams);
+}
+
+/* Removes all files in the mountpoint with a single pass over the posting
+ * lists. Cheaper than removing the files one by one when a whole share is
+ * removed.
+ */
+void share_index_remove_mountpoint(share_index_t *index,
+        share_mountpoint_t *mp)
+{
+    return_if_fail(index);
+    return_if_fail(mp);
+
+    struct share_posting *posting, *next;
+    for(posting = RB_MIN(posting_tree, &index->postings); posting;
+            posting = next)
+    {
+        next = RB_NEXT(posting_tree, &index->postings, posting);
+
+        unsigned i, j = 0;
+        for(i = 0; i < posting->nfiles; i++)
+        {
+            if(posting->files[i]->mp != mp)
+                posting->files[j++] = posting->files[i];
+        }
+        posting->nfiles = j;
+
+        if(posting->nfiles == 0)
+            share_index_unlink_posting(index, posting);
+    }
+}
+
+/* Looks up the candidate files for the search words. On success, returns 0
+ * and sets files and nfiles to the shortest posting list of all search
+ * words; every file matching the words is in that list. Returns -1 if no
+ * search word is long enough to be looked up, in which case the caller must
+ * check all files.
+ */
+int share_index_lookup_words(share_index_t *index, const arg_t *words,
+        share_file_t ***files, unsigned *nfiles)
+{
+    return_val_if_fail(index, -1);
+    return_val_if_fail(words, -1);
+
+    struct share_posting *best = NULL;
+    bool found = false;
+
+    int i;
+    for(i = 0; i < words->argc; i++)
+    {
+        const char *word = words->argv[i];
+        uint32_t *trigrams = malloc((strlen(word) + 1) * sizeof(uint32_t));
+        unsigned n = share_index_trigrams(word, trigrams);
+
+        unsigned j;
+        for(j = 0; j < n; j++)
+        {
+            struct share_posting *posting =
+                share_index_lookup(index, trigrams[j]);
+            if(posting == NULL)
+            {
+                /* no file contains this trigram, so nothing can match */
+                free(trigrams);
+                *files = NULL;
+                *nfiles = 0;
+                return 0;
+            }
+
+            if(!found || posting->nfiles < best->nfiles)
+                best = posting;
+            found = true;
+        }
+
+        free(trigrams);
+    }
+
+    if(!found)
+        return -1;
+
+    *files = best->files;
+    *nfiles = best->nfiles;
+    return 0;
+}
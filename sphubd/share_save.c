@@ -18,14 +18,20 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#include <sys/types.h>
+#include <sys/time.h>
+
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <unistd.h>
+#include <event.h>
+#include <bzlib.h>
 
 #include "he3.h"
-#include "bz2.h"
 #include "encoding.h"
 #include "dstring.h"
 #include "log.h"
@@ -34,24 +40,49 @@
 #include "globals.h"
 #include "xstr.h"
 
-typedef void (*share_print_file_func)(FILE *fp, int level, share_file_t *file);
-typedef void (*share_print_directory_func)(FILE *fp, int level, const char *filename);
+/* Number of files written to the filelist in each event. Saving a large
+ * share is spread over many events so hubs and peers are still served. */
+#define SHARE_SAVE_FILES_PER_EVENT 500
+
+/* Buffered XML is flushed to the compressor when it exceeds this size. */
+#define SHARE_SAVE_BUFSIZE (64 * 1024)
+
+typedef void (*share_print_file_func)(share_save_context_t *ctx, int level,
+        share_file_t *file);
+typedef void (*share_print_directory_func)(share_save_context_t *ctx,
+        int level, const char *filename);
 
-typedef struct share_save_context share_save_context_t;
 struct share_save_context
 {
-    FILE *fp;
+    share_t *share;
+    struct event ev;
+
+    char *bz2_filename;     /* files.xml.bz2 */
+    char *bz2_tmp_filename; /* written to, renamed over bz2_filename */
+    FILE *bz2_fp;
+    BZFILE *bzfp;
+    char *xml_filename;     /* NULL unless the uncompressed list is saved */
+    char *xml_tmp_filename;
+    FILE *xml_fp;
+    dstring_t *buf;         /* XML not yet flushed */
+
+    /* position in share->files; only valid while no files are removed */
+    share_file_t *next;
+    unsigned nremoved;
+    share_mountpoint_t *last_mp;
+    share_dir_t *last_dir;  /* directory of the last file written */
+
     int level;
     share_print_file_func file_pfunc;
     share_print_directory_func directory_start_pfunc;
     share_print_directory_func directory_end_pfunc;
 };
 
-static void share_scan_indent(FILE *fp, int level)
+static void share_scan_indent(dstring_t *buf, int level)
 {
     return_if_fail(level >= 0);
     while(level--)
-        fputc('\t', fp);
+        dstring_append_char(buf, '\t');
 }
 
 /* escapes xml data, returned string should be freed by caller */
@@ -86,7 +117,8 @@ static char *share_xml_escape(const char *string)
     return dstring_free(ds, 0);
 }
 
-static void share_xml_print_file(FILE *fp, int level, share_file_t *file)
+static void share_xml_print_file(share_save_context_t *ctx, int level,
+        share_file_t *file)
 {
     /* convert the decomposed utf-8 string to composed form (eg, &Auml; is
      * converted to a single precomposed character instead of a base character
@@ -94,248 +126,446 @@ static void share_xml_print_file(FILE *fp, int level, share_file_t *file)
      * display the filenames.
      */
 
-    char *filename = strrchr(file->partial_path, '/');
-    if(filename++ == 0)
-	filename = file->partial_path;
-
-    char *utf8_composed_filename = g_utf8_normalize(filename, -1,
+    char *utf8_composed_filename = g_utf8_normalize(file->name, -1,
             G_NORMALIZE_DEFAULT_COMPOSE);
     char *escaped_utf8_filename = share_xml_escape(utf8_composed_filename);
     free(utf8_composed_filename);
 
-    share_scan_indent(fp, level);
+    share_scan_indent(ctx->buf, level);
 
     struct tth_inode *ti = tth_store_lookup_inode(global_tth_store, file->inode);
     if(ti)
     {
-        fprintf(fp, "<File Name=\"%s\" Size=\"%"PRIu64"\" TTH=\"%s\"/>\r\n",
-                escaped_utf8_filename, file->size, ti->tth);
+        char tth[TTH_BASE32_LEN + 1];
+        dstring_append_format(ctx->buf,
+                "<File Name=\"%s\" Size=\"%"PRIu64"\" TTH=\"%s\"/>\r\n",
+                escaped_utf8_filename, file->size, tth_to_base32(&ti->tth, tth));
     }
     else
     {
-        fprintf(fp, "<File Name=\"%s\" Size=\"%"PRIu64"\"/>\r\n",
+        dstring_append_format(ctx->buf,
+                "<File Name=\"%s\" Size=\"%"PRIu64"\"/>\r\n",
                 escaped_utf8_filename, file->size);
     }
     free(escaped_utf8_filename);
 }
 
-static void share_xml_print_directory_start(FILE *fp, int level,
-        const char *filename)
+static void share_xml_print_directory_start(share_save_context_t *ctx,
+        int level, const char *filename)
 {
     char *utf8_composed_filename = g_utf8_normalize(filename, -1,
             G_NORMALIZE_DEFAULT_COMPOSE);
     char *escaped_utf8_filename = share_xml_escape(utf8_composed_filename);
     free(utf8_composed_filename);
 
-    share_scan_indent(fp, level);
-    fprintf(fp, "<Directory Name=\"%s\">\r\n", escaped_utf8_filename);
+    share_scan_indent(ctx->buf, level);
+    dstring_append_format(ctx->buf, "<Directory Name=\"%s\">\r\n",
+            escaped_utf8_filename);
     free(escaped_utf8_filename);
 }
 
-static void share_xml_print_directory_end(FILE *fp, int level,
-        const char *filename)
+static void share_xml_print_directory_end(share_save_context_t *ctx,
+        int level, const char *filename)
 {
-    share_scan_indent(fp, level);
-    fprintf(fp, "</Directory>\r\n");
+    share_scan_indent(ctx->buf, level);
+    dstring_append(ctx->buf, "</Directory>\r\n");
 }
 
-static int find_level(const char *filename)
+/* Writes buffered XML to the compressed, and optionally the uncompressed,
+ * filelist. Returns 0 on success, or -1 on error.
+ */
+static int share_save_flush(share_save_context_t *ctx, xerr_t **err)
 {
-    int level = 0;
-    const char *e = filename;
-    for(; *e; e++)
+    if(ctx->buf->length == 0)
+        return 0;
+
+    int bzerror;
+    BZ2_bzWrite(&bzerror, ctx->bzfp, ctx->buf->string, ctx->buf->length);
+    if(bzerror != BZ_OK)
+    {
+        xerr_set(err, -1, "%s: bzWrite failed with error code %d",
+                ctx->bz2_tmp_filename, bzerror);
+        return -1;
+    }
+
+    if(ctx->xml_fp &&
+       fwrite(ctx->buf->string, 1, ctx->buf->length, ctx->xml_fp) !=
+       ctx->buf->length)
     {
-        if(*e == '/')
-            ++level;
+        xerr_set(err, -1, "%s: %s", ctx->xml_tmp_filename, strerror(errno));
+        return -1;
     }
-    return level;
+
+    ctx->buf->length = 0;
+    ctx->buf->string[0] = 0;
+
+    return 0;
 }
 
-/* ui/i18/apan
- * ui/i18/bepan
- *
- * => 7 ( = strlen("ui/i18/") )
- *
- *
- * ""
- * "pix/foo"
- *
- * => 0
- */
+static void share_save_close_directories(share_save_context_t *ctx)
+{
+    while(ctx->level--)
+    {
+        if(ctx->directory_end_pfunc)
+            ctx->directory_end_pfunc(ctx, ctx->level, NULL);
+    }
+    ctx->level = 0;
+}
 
-static int find_common_prefix(const char *p, const char *pp)
+/* Opens the directories from below parent down to dir. */
+static void share_save_open_directories(share_save_context_t *ctx,
+        share_dir_t *dir, share_dir_t *parent)
 {
-    if(pp == NULL)
-        return 0;
+    if(dir == parent)
+        return;
 
-    const char *orig_p = p;
+    share_save_open_directories(ctx, dir->parent, parent);
+    if(ctx->directory_start_pfunc)
+        ctx->directory_start_pfunc(ctx, ctx->level, dir->name);
+    ++ctx->level;
+}
 
-    while(*p)
+static void share_save_file(share_save_context_t *ctx, share_file_t *f)
+{
+    if(f->mp != ctx->last_mp)
     {
-        const char *slash_p = strchr(p, '/');
-        const char *slash_pp = strchr(pp, '/');
+        /* New or changed mountpoint. */
+        share_save_close_directories(ctx);
+        ctx->last_mp = f->mp;
+        ctx->directory_start_pfunc(ctx, 0, ctx->last_mp->virtual_root);
+        ctx->level = 1;
+        ctx->last_dir = f->mp->root_dir;
+    }
 
-        if(slash_p == NULL || slash_pp == NULL)
-            break;
+    if(f->dir != ctx->last_dir)
+    {
+        /* close directories up to the common parent */
+        share_dir_t *common = ctx->last_dir;
+        while(!share_dir_is_within(f->dir, common))
+        {
+            common = common->parent;
+            --ctx->level;
+            if(ctx->directory_end_pfunc)
+                ctx->directory_end_pfunc(ctx, ctx->level, NULL);
+        }
+
+        share_save_open_directories(ctx, f->dir, common);
+        ctx->last_dir = f->dir;
+    }
 
-        size_t len = slash_p - p;
-        if(len != slash_pp - pp)
-            break;
+    ctx->file_pfunc(ctx, ctx->level, f);
+}
 
-        if(strncmp(p, pp, len) != 0)
-            break;
+static void share_save_free_context(share_save_context_t *ctx)
+{
+    if(ctx->share->saving == ctx)
+        ctx->share->saving = NULL;
+    if(event_initialized(&ctx->ev))
+        event_del(&ctx->ev);
+
+    free(ctx->bz2_filename);
+    free(ctx->bz2_tmp_filename);
+    free(ctx->xml_filename);
+    free(ctx->xml_tmp_filename);
+    dstring_free(ctx->buf, 1);
+    free(ctx);
+}
 
-        p += len + 1;
-        pp += len + 1;
+/* Throws away a partially saved filelist. The previous filelist, if any, is
+ * left in place.
+ */
+static void share_save_abort(share_save_context_t *ctx)
+{
+    int bzerror;
+
+    if(ctx->bzfp)
+        BZ2_bzWriteClose(&bzerror, ctx->bzfp, 1, NULL, NULL);
+    if(ctx->bz2_fp)
+        fclose(ctx->bz2_fp);
+    unlink(ctx->bz2_tmp_filename);
+
+    if(ctx->xml_fp)
+    {
+        fclose(ctx->xml_fp);
+        unlink(ctx->xml_tmp_filename);
     }
 
-    return p - orig_p;
+    /* the filelist on disk doesn't reflect the share */
+    ctx->share->uptodate = false;
+
+    share_save_free_context(ctx);
 }
 
-static void share_save_file(share_t *share, share_save_context_t *ctx)
+/* Completes the filelist and moves it in place of the previous one. Peers
+ * requesting the filelist get either the old or the new one, never a
+ * partial one.
+ */
+static int share_save_commit(share_save_context_t *ctx, xerr_t **err)
 {
-    share_mountpoint_t *last_mp = NULL;
-    share_file_t *f;
-    char *last_p = NULL;
-    RB_FOREACH(f, file_tree, &share->files)
-    {
-        if(f->mp != last_mp)
-        {
-            /* New or changed mountpoint. */
-            while(ctx->level--)
-            {
-                if(ctx->directory_end_pfunc)
-                    ctx->directory_end_pfunc(ctx->fp, ctx->level, NULL);
-            }
-	    last_mp = f->mp;
-            ctx->directory_start_pfunc(ctx->fp, 0, last_mp->virtual_root);
-            ctx->level = 1;
-
-            free(last_p);
-            last_p = NULL;
-        }
+    int bzerror;
 
-        char *tmp = f->partial_path + strspn(f->partial_path, "/"); /* skip inital '/' */
-        char *last_slash = strrchr(tmp, '/');
-        if(last_slash++ == NULL)
-            last_slash = tmp;
-        char *p = xstrndup(tmp, last_slash - tmp); /* sub-path */
+    dstring_append(ctx->buf, "</FileListing>\r\n");
+    if(share_save_flush(ctx, err) != 0)
+        return -1;
 
-        int i;
-        int n = 0;
+    BZ2_bzWriteClose(&bzerror, ctx->bzfp, 0, NULL, NULL);
+    ctx->bzfp = NULL;
+    if(bzerror != BZ_OK)
+    {
+        xerr_set(err, -1, "%s: bzWriteClose failed with error code %d",
+                ctx->bz2_tmp_filename, bzerror);
+        return -1;
+    }
+
+    int rc = fclose(ctx->bz2_fp);
+    ctx->bz2_fp = NULL;
+    if(rc != 0)
+    {
+        xerr_set(err, -1, "%s: %s", ctx->bz2_tmp_filename, strerror(errno));
+        return -1;
+    }
 
-        if(last_p)
+    if(ctx->xml_fp)
+    {
+        rc = fclose(ctx->xml_fp);
+        ctx->xml_fp = NULL;
+        if(rc != 0)
         {
-            n = find_common_prefix(p, last_p);
-
-            int down_level = find_level(last_p + n);
-            for(i = 0; i < down_level; i++)
-            {
-                --ctx->level;
-                if(ctx->directory_end_pfunc)
-                {
-                    ctx->directory_end_pfunc(ctx->fp, ctx->level, NULL);
-                }
-            }
+            xerr_set(err, -1, "%s: %s", ctx->xml_tmp_filename, strerror(errno));
+            return -1;
         }
-
-        int up_level = find_level(p + n);
-
-        const char *dir = p + n;
-        for(i = 0; i < up_level; i++)
+        if(rename(ctx->xml_tmp_filename, ctx->xml_filename) != 0)
         {
-            const char *slash = strchr(dir, '/');
-            if(slash == NULL)
-                slash = dir + strlen(dir);
-            if(ctx->directory_start_pfunc)
-            {
-                char *dirname = xstrndup(dir, slash - dir);
-                ctx->directory_start_pfunc(ctx->fp, ctx->level, dirname);
-                free(dirname);
-            }
-            dir = slash + 1;
-            ++ctx->level;
+            xerr_set(err, -1, "%s: %s", ctx->xml_filename, strerror(errno));
+            return -1;
         }
+    }
+    else
+    {
+        /* don't leave an outdated uncompressed filelist around */
+        char *xml_filename = xstrndup(ctx->bz2_filename,
+                strlen(ctx->bz2_filename) - 4);
+        unlink(xml_filename);
+        free(xml_filename);
+    }
+
+    if(rename(ctx->bz2_tmp_filename, ctx->bz2_filename) != 0)
+    {
+        xerr_set(err, -1, "%s: %s", ctx->bz2_filename, strerror(errno));
+        return -1;
+    }
+
+    DEBUG("saved filelist %s", ctx->bz2_filename);
 
-        free(last_p);
-        last_p = p;
+    return 0;
+}
 
-        ctx->file_pfunc(ctx->fp, ctx->level, f);
+/* Writes up to nfiles files to the filelist, or all remaining files if
+ * nfiles is negative. Returns 1 if there are more files to write, 0 when
+ * done, or -1 on error.
+ */
+static int share_save_step(share_save_context_t *ctx, int nfiles,
+        xerr_t **err)
+{
+    int i;
+    for(i = 0; ctx->next && (nfiles < 0 || i < nfiles); i++)
+    {
+        share_save_file(ctx, ctx->next);
+        ctx->next = RB_NEXT(file_tree, &ctx->share->files, ctx->next);
+
+        if(ctx->buf->length >= SHARE_SAVE_BUFSIZE &&
+           share_save_flush(ctx, err) != 0)
+            return -1;
     }
 
-    free(last_p);
+    if(ctx->next)
+        return 1;
 
-    while(ctx->level--)
+    share_save_close_directories(ctx);
+    return share_save_commit(ctx, err);
+}
+
+static void share_save_schedule_event(share_save_context_t *ctx);
+static share_save_context_t *share_save_start(share_t *share, xerr_t **err);
+
+static void share_save_event(int fd, short why, void *user_data)
+{
+    share_save_context_t *ctx = user_data;
+    share_t *share = ctx->share;
+    xerr_t *err = 0;
+
+    if(share->nremoved != ctx->nremoved)
     {
-        if(ctx->directory_end_pfunc)
-            ctx->directory_end_pfunc(ctx->fp, ctx->level, NULL);
+        /* our position in the file tree might have been freed */
+        DEBUG("share changed while saving filelist, restarting");
+        share_save_abort(ctx);
+        if(share_save_start(share, &err) == NULL)
+        {
+            WARNING("failed to save filelist: %s", xerr_msg(err));
+            xerr_free(err);
+        }
+        return;
+    }
+
+    int rc = share_save_step(ctx, SHARE_SAVE_FILES_PER_EVENT, &err);
+    if(rc == 1)
+        share_save_schedule_event(ctx);
+    else if(rc == 0)
+        share_save_free_context(ctx);
+    else
+    {
+        WARNING("failed to save filelist: %s", xerr_msg(err));
+        xerr_free(err);
+        share_save_abort(ctx);
     }
 }
 
-static int share_save_xml(share_t *share, const char *filename, xerr_t **err)
+static void share_save_schedule_event(share_save_context_t *ctx)
 {
-    int rc = 0;
+    if(event_initialized(&ctx->ev))
+    {
+        event_del(&ctx->ev);
+    }
+    else
+    {
+        evtimer_set(&ctx->ev, share_save_event, ctx);
+    }
 
-    g_return_val_if_fail(global_id_generator, -1);
-    g_return_val_if_fail(global_id_version, -1);
+    struct timeval tv = {.tv_sec = 0, .tv_usec = 0};
+    event_add(&ctx->ev, &tv);
+}
 
-    DEBUG("saving XML filelist to %s...", filename);
-    FILE *fp = fopen(filename, "w");
-    if (fp == 0) {
-        xerr_set(err, -1, "%s: %s", filename, strerror(errno));
-        rc = -1;
+/* Starts saving the filelist in the background. The XML is compressed as
+ * it is generated; the uncompressed filelist is only written if
+ * share->save_xml is set.
+ */
+static share_save_context_t *share_save_start(share_t *share, xerr_t **err)
+{
+    return_val_if_fail(global_id_generator, NULL);
+    return_val_if_fail(global_id_version, NULL);
+
+    share_save_context_t *ctx = calloc(1, sizeof(share_save_context_t));
+    ctx->share = share;
+    ctx->buf = dstring_new(NULL);
+    ctx->file_pfunc = share_xml_print_file;
+    ctx->directory_start_pfunc = share_xml_print_directory_start;
+    ctx->directory_end_pfunc = share_xml_print_directory_end;
+
+    int num_returned_bytes = asprintf(&ctx->bz2_filename, "%s/files.xml.bz2", global_working_directory);
+    if (num_returned_bytes == -1)
+        DEBUG("asprintf did not return anything");
+    num_returned_bytes = asprintf(&ctx->bz2_tmp_filename, "%s.tmp", ctx->bz2_filename);
+    if (num_returned_bytes == -1)
+        DEBUG("asprintf did not return anything");
+
+    DEBUG("saving XML filelist to %s...", ctx->bz2_filename);
+
+    ctx->bz2_fp = fopen(ctx->bz2_tmp_filename, "w");
+    if(ctx->bz2_fp == NULL)
+    {
+        xerr_set(err, -1, "%s: %s", ctx->bz2_tmp_filename, strerror(errno));
+        share_save_free_context(ctx);
+        return NULL;
     }
-    else {
-        share_save_context_t ctx;
-        memset(&ctx, 0, sizeof(share_save_context_t));
-
-        ctx.fp = fp;
-        ctx.file_pfunc = share_xml_print_file;
-        ctx.directory_start_pfunc = share_xml_print_directory_start;
-        ctx.directory_end_pfunc = share_xml_print_directory_end;
-
-        fprintf(fp,
-                "<?xml version=\"1.0\" encoding=\"utf-8\" standalone=\"yes\"?>\r\n"
-                "<FileListing Version=\"1\" CID=\"%s\" Base=\"/\""
-                " Generator=\"%s %s\">\r\n",
-                share->cid, global_id_generator, global_id_version);
-        share_save_file(share, &ctx);
-        fprintf(fp, "</FileListing>\r\n");
-        fclose(fp);
-
-        char *dest;
-        int num_returned_bytes = asprintf(&dest, "%s.bz2", filename);
+
+    int bzerror;
+    ctx->bzfp = BZ2_bzWriteOpen(&bzerror, ctx->bz2_fp, 6, 0, 0);
+    if(bzerror != BZ_OK)
+    {
+        xerr_set(err, -1, "bzWriteOpen failed with error code %d", bzerror);
+        ctx->bzfp = NULL;
+        share_save_abort(ctx);
+        return NULL;
+    }
+
+    if(share->save_xml)
+    {
+        ctx->xml_filename = xstrndup(ctx->bz2_filename,
+                strlen(ctx->bz2_filename) - 4);
+        num_returned_bytes = asprintf(&ctx->xml_tmp_filename, "%s.tmp", ctx->xml_filename);
         if (num_returned_bytes == -1)
             DEBUG("asprintf did not return anything");
-        rc = bz2_encode(filename, dest, err);
-        free(dest);
+        ctx->xml_fp = fopen(ctx->xml_tmp_filename, "w");
+        if(ctx->xml_fp == NULL)
+        {
+            xerr_set(err, -1, "%s: %s", ctx->xml_tmp_filename, strerror(errno));
+            share_save_abort(ctx);
+            return NULL;
+        }
     }
 
-    return rc;
+    dstring_append_format(ctx->buf,
+            "<?xml version=\"1.0\" encoding=\"utf-8\" standalone=\"yes\"?>\r\n"
+            "<FileListing Version=\"1\" CID=\"%s\" Base=\"/\""
+            " Generator=\"%s %s\">\r\n",
+            share->cid, global_id_generator, global_id_version);
+
+    ctx->next = RB_MIN(file_tree, &share->files);
+    ctx->nremoved = share->nremoved;
+
+    /* changes made from now on need another save */
+    share->uptodate = true;
+    share->saving = ctx;
+
+    share_save_schedule_event(ctx);
+
+    return ctx;
 }
 
+/* Makes sure a filelist is available. If the share has changed since the
+ * filelist was saved, a new one is written in the background and the
+ * previous filelist is used meanwhile. Only if there is no previous filelist
+ * the new one is written before returning.
+ */
 int share_save(share_t *share, unsigned type)
 {
     int rc = 0;
+    xerr_t *err = 0;
 
     return_val_if_fail(share, -1);
     return_val_if_fail(type == FILELIST_XML, -1);
 
-    if ((type & FILELIST_XML) == FILELIST_XML) {
-        char *xml_filename;
-        int num_returned_bytes = asprintf(&xml_filename, "%s/files.xml", global_working_directory);
-        if (num_returned_bytes == -1)
-            DEBUG("asprintf did not return anything");
-        if (!share->uptodate || access(xml_filename, F_OK) == -1)
-            rc = share_save_xml(share, xml_filename, NULL);
-        else
-            DEBUG("share up to date and file exists, skipping saving xml file");
+    char *bz2_filename, *xml_filename;
+    int num_returned_bytes = asprintf(&bz2_filename, "%s/files.xml.bz2", global_working_directory);
+    if (num_returned_bytes == -1)
+        DEBUG("asprintf did not return anything");
+    num_returned_bytes = asprintf(&xml_filename, "%s/files.xml", global_working_directory);
+    if (num_returned_bytes == -1)
+        DEBUG("asprintf did not return anything");
+
+    bool exists = access(bz2_filename, F_OK) == 0 &&
+        (!share->save_xml || access(xml_filename, F_OK) == 0);
+    free(bz2_filename);
+    free(xml_filename);
+
+    if (exists && share->uptodate) {
+        DEBUG("share up to date and file exists, skipping saving xml file");
+        return 0;
+    }
 
-        free(xml_filename);
+    share_save_context_t *ctx = share->saving;
+    if (ctx && share->save_xml && ctx->xml_fp == NULL) {
+        /* restart to include the uncompressed filelist */
+        share_save_abort(ctx);
+        ctx = NULL;
+    }
+    if (ctx == NULL && (ctx = share_save_start(share, &err)) == NULL) {
+        WARNING("failed to save filelist: %s", xerr_msg(err));
+        xerr_free(err);
+        return -1;
     }
 
-    share->uptodate = (rc == 0 ? true : false);
+    if (exists)
+        return 0;
 
-    return rc;
-}
+    /* nothing to serve meanwhile, finish the filelist now */
+    if ((rc = share_save_step(ctx, -1, &err)) != 0) {
+        WARNING("failed to save filelist: %s", xerr_msg(err));
+        xerr_free(err);
+        share_save_abort(ctx);
+        return -1;
+    }
+    share_save_free_context(ctx);
 
+    return 0;
+}
@@ -51,11 +51,16 @@ struct share_scan_state
     share_t *share;
     struct event ev;
     share_mountpoint_t *mp;
+    bool incremental; /* only part of the mountpoint is scanned */
+    bool verify; /* files loaded from the snapshot are checked */
 };
 
 #define SHARE_STAT_TO_INODE(st) (uint64_t)(((uint64_t)st->st_size << 32) | st->st_ino)
 
 static void share_scan_schedule_event(share_scan_state_t *ctx);
+static void share_scan_free_context(share_scan_state_t *ctx);
+static void share_scan_remove_file(share_t *share, share_file_t *f,
+        bool hashed);
 
 static int share_skip_file(const char *filename)
 {
@@ -68,28 +73,30 @@ static int share_skip_file(const char *filename)
     return 0;
 }
 
-static void share_scan_add_file(share_scan_state_t *ctx,
-        const char *filepath, struct stat *stbuf)
+/* Adds the file at filepath, with the given size, inode and modification
+ * time, to the share. The file is hashed if the TTH store has a TTH for the
+ * inode and time. Returns the added file, or NULL for duplicates. */
+share_file_t *share_scan_add(share_t *share, share_mountpoint_t *mp,
+        const char *filepath, uint64_t size, uint64_t inode, time_t mtime)
 {
-    return_if_fail(filepath);
-    return_if_fail(ctx);
-    return_if_fail(ctx->mp);
-    return_if_fail(ctx->mp->local_root);
+    return_val_if_fail(filepath, NULL);
+    return_val_if_fail(share, NULL);
+    return_val_if_fail(mp, NULL);
+    return_val_if_fail(mp->local_root, NULL);
 
     /* is it already hashed? */
     bool already_hashed = false;
 
-    uint64_t inode = SHARE_STAT_TO_INODE(stbuf);
     bool is_duplicate = false;
 
     /* Check if we're already sharing this inode.
      */
     share_file_t *collision_file =
-	share_lookup_file_by_inode(ctx->share, inode);
+	share_lookup_file_by_inode(share, inode);
     if(collision_file)
     {
 	char *local_path = share_complete_path(collision_file);
-	if(ctx->mp != collision_file->mp)
+	if(mp != collision_file->mp)
 	{
 	    WARNING("%"PRIX64": collision between [%s] and [%s]",
 		inode, filepath, local_path);
@@ -103,7 +110,7 @@ static void share_scan_add_file(share_scan_state_t *ctx,
 	    {
 		WARNING("re-adding the exact same file?");
 		free(local_path);
-		return;
+		return NULL;
 	    }
 	}
 	free(local_path);
@@ -118,11 +125,12 @@ static void share_scan_add_file(share_scan_state_t *ctx,
     {
         /* unhashed */
     }
-    else if(ti->mtime != stbuf->st_mtime)
+    else if(ti->mtime != mtime)
     {
 	DEBUG("[%s] has an obsolete inode", filepath);
+	char tth[TTH_BASE32_LEN + 1];
 	DEBUG("removing obsolete inode %"PRIX64" for TTH %s (modified)",
-	    inode, ti->tth);
+	    inode, tth_to_base32(&ti->tth, tth));
 	tth_store_remove_inode(global_tth_store, inode);
 
 	/* don't remove any corresponding TTH:
@@ -130,7 +138,7 @@ static void share_scan_add_file(share_scan_state_t *ctx,
     }
     else
     {
-	struct tth_entry *td = tth_store_lookup(global_tth_store, ti->tth);
+	struct tth_entry *td = tth_store_lookup(global_tth_store, &ti->tth);
 
 	if(td == NULL)
 	{
@@ -141,7 +149,7 @@ static void share_scan_add_file(share_scan_state_t *ctx,
 	else if(td->active_inode == 0)
 	{
 	    /* TTH is not active, claim this TTH for this inode */
-	    tth_store_set_active_inode(global_tth_store, ti->tth, inode);
+	    tth_store_set_active_inode(global_tth_store, &ti->tth, inode);
 	    already_hashed = true;
 	}
 	else if(td->active_inode != inode)
@@ -151,7 +159,7 @@ static void share_scan_add_file(share_scan_state_t *ctx,
 	    /* DEBUG("duplicate TTH for different inodes"); */
 	    /* check if the original is shared */
 	    share_file_t *original_file =
-		share_lookup_file_by_inode(ctx->share, td->active_inode);
+		share_lookup_file_by_inode(share, td->active_inode);
 	    if(original_file)
 	    {
 		/* ok, keep as duplicate */
@@ -163,7 +171,7 @@ static void share_scan_add_file(share_scan_state_t *ctx,
 	    {
 		/* original not shared, switch with duplicate */
 		/* (this can only happen if shares has been removed live) */
-		tth_store_set_active_inode(global_tth_store, ti->tth, inode);
+		tth_store_set_active_inode(global_tth_store, &ti->tth, inode);
 	    }
 	}
 	else
@@ -174,41 +182,40 @@ static void share_scan_add_file(share_scan_state_t *ctx,
     }
 
 done:
+    ;
+    share_file_t *f = NULL;
 
     if(is_duplicate)
     {
 	/* update mount statistics */
-	ctx->mp->stats.nduplicates++;
-	ctx->mp->stats.dupsize += stbuf->st_size;
+	mp->stats.nduplicates++;
+	mp->stats.dupsize += size;
     }
     else
     {
-	share_file_t *f = calloc(1, sizeof(share_file_t));
-	f->partial_path = strdup(filepath + strlen(ctx->mp->local_root));
-	f->mp = ctx->mp;
-	f->type = share_filetype(f->partial_path);
-	f->size = stbuf->st_size;
-	f->inode = SHARE_STAT_TO_INODE(stbuf);
+	f = share_file_new(mp, filepath + strlen(mp->local_root));
+	f->type = share_filetype(f->name);
+	f->size = size;
+	f->inode = inode;
+	f->mtime = mtime;
 
 	if(already_hashed)
 	{
 	    /* Insert it in the tree. */
-	    RB_INSERT(file_tree, &ctx->share->files, f);
+	    RB_INSERT(file_tree, &share->files, f);
+	    share_index_add_file(share->index, f);
 
 	    /* update the mount statistics */
-	    ctx->mp->stats.nfiles++;
-	    ctx->mp->stats.size += f->size;
+	    mp->stats.nfiles++;
+	    mp->stats.size += f->size;
 
 	    /* add it to the bloom filter */
-	    char *filename = strrchr(f->partial_path, '/');
-	    if(filename++ == NULL)
-		filename = f->partial_path;
-	    bloom_add_filename(ctx->share->bloom, filename);
+	    bloom_add_filename(share->bloom, f->name);
 	}
 	else
 	{
 	    /* Insert it in the unhashed tree. */
-	    RB_INSERT(file_tree, &ctx->share->unhashed_files, f);
+	    RB_INSERT(file_tree, &share->unhashed_files, f);
 	}
 
 	/* Add the file to the inode hash.
@@ -216,14 +223,59 @@ done:
 	 * without the need to hash. If we after hashing get a duplicate,
 	 * the file must be removed from the inode hash table.
 	 */
-	share_add_to_inode_table(ctx->share, f);
+	share_add_to_inode_table(share, f);
     }
 
     /* update the mount statistics */
-    ctx->mp->stats.ntotfiles++;
-    ctx->mp->stats.totsize += stbuf->st_size;
+    mp->stats.ntotfiles++;
+    mp->stats.totsize += size;
 
     nc_send_share_file_added_notification(nc_default());
+
+    return f;
+}
+
+static void share_scan_add_file(share_scan_state_t *ctx,
+        const char *filepath, struct stat *stbuf)
+{
+    return_if_fail(ctx);
+
+    if(ctx->verify)
+    {
+        bool hashed = true;
+        share_file_t *f = share_lookup_file(ctx->share, filepath);
+        if(f == NULL)
+        {
+            hashed = false;
+            f = share_lookup_unhashed_file(ctx->share, filepath);
+        }
+
+        if(f && f->inode == SHARE_STAT_TO_INODE(stbuf) &&
+           f->mtime == stbuf->st_mtime)
+        {
+            /* unchanged since the snapshot was saved */
+            f->stale = false;
+            return;
+        }
+
+        if(f)
+        {
+            DEBUG("[%s] modified since the snapshot was saved", filepath);
+            share_scan_remove_file(ctx->share, f, hashed);
+        }
+
+        /* the inode may have been reused after a file was removed */
+        f = share_lookup_file_by_inode(ctx->share,
+                SHARE_STAT_TO_INODE(stbuf));
+        if(f && f->stale)
+        {
+            share_scan_remove_file(ctx->share, f,
+                    RB_FIND(file_tree, &ctx->share->files, f) == f);
+        }
+    }
+
+    share_scan_add(ctx->share, ctx->mp, filepath, stbuf->st_size,
+            SHARE_STAT_TO_INODE(stbuf), stbuf->st_mtime);
 }
 
 static char *share_scan_absolute_path(const char *dirpath,
@@ -291,6 +343,9 @@ static void share_scan_context(share_scan_state_t *ctx,
         return;
     }
 
+    /* watch before reading, so no file added meanwhile is missed */
+    share_watch_directory(ctx->mp, dirpath);
+
     while((dp = readdir(fsdir)) != NULL)
     {
         const char *filename = dp->d_name;
@@ -334,6 +389,28 @@ static void share_scan_context(share_scan_state_t *ctx,
     closedir(fsdir);
 }
 
+/* Removes the files loaded from the snapshot that the verification scan
+ * didn't find. */
+static void share_scan_remove_stale(share_t *share, share_mountpoint_t *mp)
+{
+    int hashed;
+    for(hashed = 0; hashed < 2; hashed++)
+    {
+        file_tree_t *tree = hashed ? &share->files : &share->unhashed_files;
+        share_file_t *f, *next;
+        for(f = RB_MIN(file_tree, tree); f; f = next)
+        {
+            next = RB_NEXT(file_tree, tree, f);
+            if(f->mp == mp && f->stale)
+            {
+                DEBUG("removing [%s], gone since the snapshot was saved",
+                        f->name);
+                share_scan_remove_file(share, f, hashed);
+            }
+        }
+    }
+}
+
 static void share_scan_event(int fd, short why, void *user_data)
 {
     share_scan_state_t *ctx = user_data;
@@ -343,9 +420,11 @@ static void share_scan_event(int fd, short why, void *user_data)
     if(ctx->mp->removed)
     {
 	WARNING("aborting scanning of removed share [%s]", ctx->mp->local_root);
-	share_remove_mountpoint(ctx->share, ctx->mp);
-	ctx->share->scanning--;
-	free(ctx);
+	if(--ctx->mp->nscans == 0)
+	    share_remove_mountpoint(ctx->share, ctx->mp);
+	if(!ctx->incremental)
+	    ctx->share->scanning--;
+	share_scan_free_context(ctx);
 	return;
     }
 
@@ -355,18 +434,40 @@ static void share_scan_event(int fd, short why, void *user_data)
         share_scan_directory_t *d = LIST_FIRST(&ctx->directories);
         if(d == NULL)
         {
-            INFO("Done scanning directory [%s]", ctx->mp->local_root);
+            share_t *share = ctx->share;
+            share_mountpoint_t *mp = ctx->mp;
+            bool incremental = ctx->incremental;
+            bool verify = ctx->verify;
+
+            share->uptodate = false;
+            mp->nscans--;
+            share_scan_free_context(ctx);
+
+            if(verify)
+            {
+                share_scan_remove_stale(share, mp);
+                INFO("Done verifying [%s]", mp->local_root);
+                share_snapshot_schedule_save(share);
+            }
+
+            if(incremental)
+            {
+                nc_send_share_changed_notification(nc_default(),
+                        mp->local_root);
+                return;
+            }
+
+            INFO("Done scanning directory [%s]", mp->local_root);
 	    INFO("bloom filter is %.1f%% filled",
-		bloom_filled_percent(ctx->share->bloom));
+		bloom_filled_percent(share->bloom));
+            mp->scan_in_progress = false;
             nc_send_share_scan_finished_notification(nc_default(),
-                    ctx->mp->local_root);
-            ctx->share->uptodate = false;
-            ctx->mp->scan_in_progress = false;
-            free(ctx);
+                    mp->local_root);
 
-	    ctx->share->scanning--;
-	    return_if_fail(ctx->share->scanning >= 0);
+	    share->scanning--;
+	    return_if_fail(share->scanning >= 0);
 
+            share_snapshot_schedule_save(share);
             return;
         }
 
@@ -381,6 +482,18 @@ static void share_scan_event(int fd, short why, void *user_data)
     share_scan_schedule_event(ctx);
 }
 
+static void share_scan_free_context(share_scan_state_t *ctx)
+{
+    share_scan_directory_t *d;
+    while((d = LIST_FIRST(&ctx->directories)) != NULL)
+    {
+        LIST_REMOVE(d, link);
+        free(d->dirpath);
+        free(d);
+    }
+    free(ctx);
+}
+
 static void share_scan_schedule_event(share_scan_state_t *ctx)
 {
     if(event_initialized(&ctx->ev))
@@ -393,6 +506,8 @@ static void share_scan_schedule_event(share_scan_state_t *ctx)
     }
 
     struct timeval tv = {.tv_sec = 0, .tv_usec = 0};
+    if(ctx->verify)
+        tv.tv_usec = SHARE_VERIFY_DELAY_MSEC * 1000;
     event_add(&ctx->ev, &tv);
 }
 
@@ -417,6 +532,41 @@ int share_scan(share_t *share, share_mountpoint_t *mp)
     /* reset mountpoint statistics */
     memset(&mp->stats, 0, sizeof(share_stats_t));
     mp->scan_in_progress = true;
+    mp->nscans++;
+
+    /* after this full scan, changes are picked up as they happen */
+    share_watch_start(share, mp);
+
+    share_scan_push_directory(ctx, mp->local_root);
+    share_scan_schedule_event(ctx);
+
+    return 0;
+}
+
+/* Checks a mountpoint loaded from the snapshot against the filesystem.
+ * The share is used meanwhile. New and modified files are added as they are
+ * found, and files no longer there are removed at the end. */
+int share_scan_verify(share_t *share, share_mountpoint_t *mp)
+{
+    return_val_if_fail(share, -1);
+    return_val_if_fail(mp, -1);
+
+    share_scan_state_t *ctx = calloc(1, sizeof(share_scan_state_t));
+
+    LIST_INIT(&ctx->directories);
+    ctx->share = share;
+    ctx->mp = mp;
+    ctx->incremental = true;
+    ctx->verify = true;
+    mp->nscans++;
+
+    /* duplicates aren't in the snapshot, they're counted again */
+    mp->stats.ntotfiles -= mp->stats.nduplicates;
+    mp->stats.totsize -= mp->stats.dupsize;
+    mp->stats.nduplicates = 0;
+    mp->stats.dupsize = 0;
+
+    share_watch_start(share, mp);
 
     share_scan_push_directory(ctx, mp->local_root);
     share_scan_schedule_event(ctx);
@@ -424,3 +574,137 @@ int share_scan(share_t *share, share_mountpoint_t *mp)
     return 0;
 }
 
+/* Removes a file from the share, and updates the statistics. */
+static void share_scan_remove_file(share_t *share, share_file_t *f,
+        bool hashed)
+{
+    nc_send_will_remove_file_notification(nc_default(), f);
+
+    if(hashed)
+    {
+        RB_REMOVE(file_tree, &share->files, f);
+        share->nremoved++;
+        share_index_remove_file(share->index, f);
+        f->mp->stats.nfiles--;
+        f->mp->stats.size -= f->size;
+    }
+    else
+        RB_REMOVE(file_tree, &share->unhashed_files, f);
+    share_remove_from_inode_table(share, f);
+
+    f->mp->stats.ntotfiles--;
+    f->mp->stats.totsize -= f->size;
+
+    share_file_free(f);
+}
+
+/* Removes the file at filepath from the share. If recursive is true and
+ * there is no such file, removes all files in the directory at filepath.
+ */
+static void share_scan_remove_path(share_t *share, share_mountpoint_t *mp,
+        const char *filepath, bool recursive)
+{
+    const char *partial_path = filepath + strlen(mp->local_root);
+    share_dir_t *dir;
+
+    share_file_t *f;
+    if((f = share_lookup_file(share, filepath)) != NULL)
+    {
+        DEBUG("removing file [%s]", filepath);
+        share_scan_remove_file(share, f, true);
+    }
+    else if((f = share_lookup_unhashed_file(share, filepath)) != NULL)
+    {
+        DEBUG("removing unhashed file [%s]", filepath);
+        share_scan_remove_file(share, f, false);
+    }
+    else if(recursive &&
+            (dir = share_lookup_dir(mp, partial_path,
+                                    strlen(partial_path))) != NULL)
+    {
+        /* A directory. Files in a directory aren't necessarily adjacent in
+         * the tree, so check them all. Keep the directory while its files
+         * are removed. */
+        share_dir_ref(dir);
+        share_file_t *next;
+        int hashed;
+        for(hashed = 0; hashed < 2; hashed++)
+        {
+            file_tree_t *tree = hashed ? &share->files : &share->unhashed_files;
+            for(f = RB_MIN(file_tree, tree); f; f = next)
+            {
+                next = RB_NEXT(file_tree, tree, f);
+                if(f->mp == mp && share_dir_is_within(f->dir, dir))
+                    share_scan_remove_file(share, f, hashed);
+            }
+        }
+        share_dir_unref(dir);
+    }
+
+    share->uptodate = false;
+}
+
+/* Removes a file, or all files in a directory, that has been deleted or
+ * moved away from the mountpoint.
+ */
+void share_unscan_path(share_t *share, share_mountpoint_t *mp,
+        const char *dirpath, const char *filename)
+{
+    return_if_fail(share);
+    return_if_fail(mp);
+
+    char *filepath = share_scan_absolute_path(dirpath, filename);
+    if(filepath == NULL)
+        return;
+    share_scan_remove_path(share, mp, filepath, true);
+    free(filepath);
+}
+
+/* Adds a file or directory that has been created, modified or moved into
+ * the mountpoint. Directories are scanned incrementally, without
+ * resetting the statistics of the mountpoint.
+ */
+void share_scan_path(share_t *share, share_mountpoint_t *mp,
+        const char *dirpath, const char *filename)
+{
+    return_if_fail(share);
+    return_if_fail(mp);
+
+    if(share_skip_file(filename))
+        return;
+
+    char *filepath = share_scan_absolute_path(dirpath, filename);
+    if(filepath == NULL)
+        return;
+
+    struct stat stbuf;
+    if(stat(filepath, &stbuf) != 0)
+    {
+        /* already gone */
+        DEBUG("%s: %s", filepath, strerror(errno));
+    }
+    else if(S_ISDIR(stbuf.st_mode))
+    {
+        share_scan_state_t *ctx = calloc(1, sizeof(share_scan_state_t));
+        LIST_INIT(&ctx->directories);
+        ctx->share = share;
+        ctx->mp = mp;
+        ctx->incremental = true;
+        mp->nscans++;
+
+        share_scan_push_directory(ctx, filepath);
+        share_scan_schedule_event(ctx);
+    }
+    else if(S_ISREG(stbuf.st_mode) && stbuf.st_size > 0)
+    {
+        /* replace any previous version of the file */
+        share_scan_remove_path(share, mp, filepath, false);
+
+        share_scan_state_t ctx = {.share = share, .mp = mp};
+        share_scan_add_file(&ctx, filepath, &stbuf);
+        share->uptodate = false;
+    }
+
+    free(filepath);
+}
+
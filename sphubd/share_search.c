@@ -55,9 +55,7 @@ static int file_matches_search(share_file_t *f, const share_search_t *search)
     if(search->type != SHARE_TYPE_ANY && f->type != search->type)
         return 0;
 
-    char *filename = strrchr(f->partial_path, '/');
-    if(filename++ == NULL)
-	filename = f->partial_path;
+    const char *filename = f->name;
 
     int i;
     for(i = 0; i < search->words->argc; i++)
@@ -72,16 +70,42 @@ static int file_matches_search(share_file_t *f, const share_search_t *search)
     return 1;
 }
 
+/* Calls the match function if the file matches the search. Returns non-zero
+ * if no more files should be checked.
+ */
+static int share_search_match_file(share_file_t *f,
+        const share_search_t *search,
+        search_match_func_t func, void *user_data, int *limit)
+{
+    if(file_matches_search(f, search))
+    {
+        struct tth_inode *ti = tth_store_lookup_inode(global_tth_store, f->inode);
+        char tth[TTH_BASE32_LEN + 1];
+        int rc = func(search, f, ti ? tth_to_base32(&ti->tth, tth) : NULL,
+                user_data);
+        if(--*limit == 0)
+            return 1;
+
+        if(rc == -1)
+        {
+            /* search match callback failed, don't try again */
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
 int share_search(share_t *share, const share_search_t *search,
         search_match_func_t func, void *user_data)
 {
     int limit = 10; /* limit number of search responses */
 
-    if(search->tth)
+    if(search->has_tth)
     {
         /* If we're searching for a TTH, just look it up in the database. */
 
-        struct tth_entry *tthd = tth_store_lookup(global_tth_store, search->tth);
+        struct tth_entry *tthd = tth_store_lookup(global_tth_store, &search->tth);
         if(tthd == NULL)
         {
             /* not found */
@@ -92,7 +116,8 @@ int share_search(share_t *share, const share_search_t *search,
         share_file_t *f = share_lookup_file_by_inode(share, tthd->active_inode);
         if(f)
         {
-            func(search, f, search->tth, user_data);
+            char tth[TTH_BASE32_LEN + 1];
+            func(search, f, tth_to_base32(&search->tth, tth), user_data);
         }
 
         return 0;
@@ -122,21 +147,30 @@ int share_search(share_t *share, const share_search_t *search,
         }
         else
         {
-            share_file_t *f;
-            RB_FOREACH(f, file_tree, &share->files)
+            share_file_t **candidates = NULL;
+            unsigned ncandidates = 0;
+            if(share_index_lookup_words(share->index, search->words,
+                        &candidates, &ncandidates) == 0)
             {
-                if(file_matches_search(f, search))
+                /* Only files in the shortest posting list can match. */
+                unsigned i;
+                for(i = 0; i < ncandidates; i++)
                 {
-		    struct tth_inode *ti = tth_store_lookup_inode(global_tth_store, f->inode);
-                    int rc = func(search, f, ti ? ti->tth : NULL, user_data);
-                    if(--limit == 0)
+                    if(share_search_match_file(candidates[i], search,
+                                func, user_data, &limit) != 0)
                         break;
-
-                    if(rc == -1)
-                    {
-                        /* search match callback failed, don't try again */
+                }
+            }
+            else
+            {
+                /* No search word long enough for the index, check all
+                 * files. */
+                share_file_t *f;
+                RB_FOREACH(f, file_tree, &share->files)
+                {
+                    if(share_search_match_file(f, search,
+                                func, user_data, &limit) != 0)
                         break;
-                    }
                 }
             }
 
@@ -239,7 +273,9 @@ share_search_t *share_search_parse_nmdc(const char *command,
 
     if(str_has_prefix(command, "TTH:"))
     {
-        s->tth = strdup(command + 4);
+        if(tth_from_base32(&s->tth, command + 4) != 0)
+            goto error;
+        s->has_tth = true;
         s->words = NULL;
     }
     else
@@ -261,7 +297,7 @@ share_search_t *share_search_parse_nmdc(const char *command,
         char *casefold_utf8_string = g_utf8_casefold(normalized_utf8_string, -1);
         free(normalized_utf8_string);
 
-        s->tth = NULL;
+        s->has_tth = false;
         s->words = arg_create(casefold_utf8_string, "$", 0);
         free(casefold_utf8_string);
     }
@@ -269,7 +305,6 @@ share_search_t *share_search_parse_nmdc(const char *command,
     return s;
 
 error:
-    free(s->tth);
     free(s->host);
     free(s->nick);
     free(s);
@@ -285,7 +320,6 @@ void share_search_free(share_search_t *s)
     {
         free(s->host);
         free(s->nick);
-        free(s->tth);
         arg_free(s->words);
         free(s);
     }
@@ -296,29 +330,163 @@ void share_search_free(share_search_t *s)
 #include "globals.h"
 #include "unit_test.h"
 
+#include <sys/time.h>
+
 #include "ui.h"
 int ui_send_status_message(ui_t *ui, const char *hub_address, const char *message, ...)
 {
     return 0;
 }
 
+static int count_match(const share_search_t *search,
+        share_file_t *file, const char *tth, void *data)
+{
+    unsigned *nmatches = data;
+    (*nmatches)++;
+    return 0;
+}
+
+static const char *bench_words[] = {
+    "artist", "Band 17", "song$042", "live", "remix$mp3", "track$007$flac",
+    "album$1999", "ok", "nonexistent", "b$c", NULL
+};
+
+static unsigned count_matches_by_scan(share_t *share, share_search_t *s)
+{
+    unsigned nmatches = 0;
+    share_file_t *f;
+    RB_FOREACH(f, file_tree, &share->files)
+    {
+        if(file_matches_search(f, s))
+            nmatches++;
+    }
+    return nmatches > 10 ? 10 : nmatches;
+}
+
+static double elapsed(struct timeval *start)
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start->tv_sec) +
+        (now.tv_usec - start->tv_usec) / 1000000.0;
+}
+
+static void test_index(share_t *share)
+{
+    const unsigned nfiles = 100000;
+    share_mountpoint_t *mp = share_add_mountpoint(share, "/bench/root");
+    fail_unless(mp);
+
+    unsigned i;
+    for(i = 0; i < nfiles; i++)
+    {
+        char *partial_path;
+        int rc = asprintf(&partial_path,
+                "/Band %u/Album %u/%03u - Artist %u - Song %u (%s).%s",
+                i % 500, 1990 + i % 20, i % 20, i % 700, i,
+                i % 13 == 0 ? "Live" : "Remix", i % 3 ? "mp3" : "flac");
+        fail_unless(rc != -1);
+        share_file_t *f = share_file_new(mp, partial_path);
+        free(partial_path);
+        f->type = share_filetype(f->name);
+        f->size = 1000 + i;
+        f->inode = i + 1;
+        RB_INSERT(file_tree, &share->files, f);
+        share_index_add_file(share->index, f);
+    }
+
+    /* the index must give exactly the same results as a full scan */
+    for(i = 0; bench_words[i]; i++)
+    {
+        share_search_t s;
+        memset(&s, 0, sizeof(s));
+        s.size_restriction = SHARE_SIZE_NONE;
+        s.type = SHARE_TYPE_ANY;
+        s.words = arg_create(bench_words[i], "$", 0);
+
+        unsigned nmatches = 0;
+        share_search(share, &s, count_match, &nmatches);
+        fail_unless(nmatches == count_matches_by_scan(share, &s));
+
+        arg_free(s.words);
+    }
+
+    const unsigned nsearches = 200;
+    struct timeval start;
+    unsigned n = 0;
+
+    gettimeofday(&start, NULL);
+    for(i = 0; i < nsearches; i++)
+    {
+        share_search_t s;
+        memset(&s, 0, sizeof(s));
+        s.size_restriction = SHARE_SIZE_MIN;
+        s.size = 1000 + nfiles / 2;
+        s.words = arg_create(bench_words[i % 10], "$", 0);
+        n += count_matches_by_scan(share, &s);
+        arg_free(s.words);
+    }
+    double scan_time = elapsed(&start);
+
+    gettimeofday(&start, NULL);
+    for(i = 0; i < nsearches; i++)
+    {
+        share_search_t s;
+        memset(&s, 0, sizeof(s));
+        s.size_restriction = SHARE_SIZE_MIN;
+        s.size = 1000 + nfiles / 2;
+        s.words = arg_create(bench_words[i % 10], "$", 0);
+        share_search(share, &s, count_match, &n);
+        arg_free(s.words);
+    }
+    double index_time = elapsed(&start);
+
+    printf("%u searches in %u files: full scan %.3f ms/search,"
+            " index %.3f ms/search (%.1fx)\n",
+            nsearches, nfiles,
+            1000 * scan_time / nsearches, 1000 * index_time / nsearches,
+            index_time > 0 ? scan_time / index_time : 0);
+
+    /* removing the share must empty the index */
+    share_index_remove_mountpoint(share->index, mp);
+    share_file_t **files = NULL;
+    unsigned nfound = 0;
+    arg_t *words = arg_create("artist", "$", 0);
+    fail_unless(share_index_lookup_words(share->index, words,
+                &files, &nfound) == 0);
+    fail_unless(nfound == 0);
+    arg_free(words);
+
+    /* too short words can't be looked up in the index */
+    words = arg_create("ok$b", "$", 0);
+    fail_unless(share_index_lookup_words(share->index, words,
+                &files, &nfound) == -1);
+    arg_free(words);
+}
+
 int main(void)
 {
-    global_working_directory = "/tmp";
     sp_log_set_level("debug");
-    unlink("/tmp/tth.db");
+    global_working_directory = "/tmp/sp-share-search-test.d";
+    system("/bin/rm -rf /tmp/sp-share-search-test.d");
+    system("mkdir /tmp/sp-share-search-test.d");
+    tth_store_init();
 
     share_t *share = share_new();
     fail_unless(share);
 
+    test_index(share);
+
     share_search_t *s = share_search_parse_nmdc("192.168.1.189:412 F?T?0?9?TTH:QSYBVKR6IAIEF6R4RG7DGBXWEP3PQBTBEBV2IPY", "WINDOWS-1252");
     fail_unless(s);
     fail_unless(s->host);
     fail_unless(strcmp(s->host, "192.168.1.189") == 0);
     fail_unless(s->port == 412);
     fail_unless(s->nick == NULL);
-    fail_unless(s->tth);
-    fail_unless(strcmp(s->tth, "QSYBVKR6IAIEF6R4RG7DGBXWEP3PQBTBEBV2IPY") == 0);
+    fail_unless(s->has_tth);
+    char tth[TTH_BASE32_LEN + 1];
+    tth_to_base32(&s->tth, tth);
+    fail_unless(strcmp(tth, "QSYBVKR6IAIEF6R4RG7DGBXWEP3PQBTBEBV2IPY") == 0);
     fail_unless(s->words == NULL);
     fail_unless(s->type == SHARE_TYPE_TTH);
     fail_unless(s->passive == false);
@@ -327,6 +495,12 @@ int main(void)
     s = share_search_parse_nmdc("1.2.3.4:5922 F?T?0?1?", "WINDOWS-1252");
     fail_unless(s == NULL);
 
+    s = share_search_parse_nmdc("1.2.3.4:5922 F?T?0?9?TTH:INVALID", "WINDOWS-1252");
+    fail_unless(s == NULL);
+
+    tth_store_close();
+    system("/bin/rm -rf /tmp/sp-share-search-test.d");
+
     return 0;
 }
 
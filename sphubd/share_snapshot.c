@@ -0,0 +1,692 @@
+/*
+ * Copyright 2007 Martin Hedenfalk <martin@bzero.se>
+ *
+ * This file is part of ShakesPeer.
+ *
+ * ShakesPeer is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ShakesPeer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ShakesPeer; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* The share snapshot lets a share be used at startup without waiting for a
+ * full scan. The files of each mountpoint are saved to the file
+ * "share.snapshot" in the working directory when scans finish and at
+ * shutdown. When a mountpoint in the snapshot is added again, its files are
+ * restored immediately and then verified by a background scan.
+ *
+ * The file starts with SHARE_SNAPSHOT_MAGIC, followed by one record per
+ * mountpoint. Numbers are stored as varints (7 bits per byte, low bits
+ * first). A record is:
+ *
+ *   length of the rest of the record
+ *   length of the local root, local root
+ *   number of files
+ *   for each file:
+ *     length of the prefix shared with the previous partial path
+ *     length of the rest of the partial path, the rest of the partial path
+ *     size, inode, modification time
+ *
+ * Whether files are hashed isn't saved, the TTH store is checked as when
+ * scanning.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <event.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "share.h"
+#include "notifications.h"
+#include "globals.h"
+
+#define SHARE_SNAPSHOT_MAGIC "SPSHARE1"
+#define SHARE_SNAPSHOT_MAGIC_LEN 8
+
+/* a mountpoint loaded from the snapshot, not yet added again */
+struct share_snapshot_record
+{
+    LIST_ENTRY(share_snapshot_record) link;
+    char *local_root;
+    unsigned char *data; /* the record, without the length */
+    size_t len;
+};
+
+struct share_snapshot
+{
+    LIST_HEAD(, share_snapshot_record) records;
+};
+
+/* the snapshot being saved */
+struct share_snapshot_buf
+{
+    unsigned char *data;
+    size_t len;
+    size_t size;
+};
+
+static struct event share_snapshot_save_event;
+static bool share_snapshot_save_scheduled = false;
+
+static void share_snapshot_put(struct share_snapshot_buf *b,
+        const void *data, size_t len)
+{
+    if(len == 0)
+        return;
+
+    if(b->len + len > b->size)
+    {
+        b->size = b->size ? b->size * 2 : 64 * 1024;
+        if(b->size < b->len + len)
+            b->size = b->len + len;
+        b->data = realloc(b->data, b->size);
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+static void share_snapshot_put_varint(struct share_snapshot_buf *b,
+        uint64_t n)
+{
+    unsigned char buf[10];
+    size_t len = 0;
+    do
+    {
+        buf[len] = n & 0x7F;
+        n >>= 7;
+        if(n)
+            buf[len] |= 0x80;
+        len++;
+    } while(n);
+    share_snapshot_put(b, buf, len);
+}
+
+/* Returns -1 if the varint is truncated or too long. */
+static int share_snapshot_get_varint(const unsigned char **p,
+        const unsigned char *end, uint64_t *n)
+{
+    int shift;
+
+    *n = 0;
+    for(shift = 0; shift < 64; shift += 7)
+    {
+        if(*p >= end)
+            return -1;
+        unsigned char c = *(*p)++;
+        *n |= (uint64_t)(c & 0x7F) << shift;
+        if((c & 0x80) == 0)
+            return 0;
+    }
+
+    return -1;
+}
+
+static void share_snapshot_free_record(struct share_snapshot_record *rec)
+{
+    if(rec)
+    {
+        free(rec->local_root);
+        free(rec->data);
+        free(rec);
+    }
+}
+
+static struct share_snapshot_record *share_snapshot_find_record(
+        share_t *share, const char *local_root)
+{
+    if(share->snapshot == NULL)
+        return NULL;
+
+    struct share_snapshot_record *rec;
+    LIST_FOREACH(rec, &share->snapshot->records, link)
+    {
+        if(strcmp(rec->local_root, local_root) == 0)
+            return rec;
+    }
+
+    return NULL;
+}
+
+static char *share_snapshot_filename(void)
+{
+    char *filename;
+    int num_returned_bytes = asprintf(&filename, "%s/share.snapshot",
+            global_working_directory);
+    if(num_returned_bytes == -1)
+        return NULL;
+    return filename;
+}
+
+/* Loads the mountpoints saved in the snapshot. They are restored by
+ * share_snapshot_restore() when added. */
+int share_snapshot_load(share_t *share)
+{
+    return_val_if_fail(share, -1);
+    return_val_if_fail(global_working_directory, -1);
+
+    char *filename = share_snapshot_filename();
+    return_val_if_fail(filename, -1);
+
+    FILE *fp = fopen(filename, "r");
+    if(fp == NULL)
+    {
+        if(errno != ENOENT)
+            WARNING("%s: %s", filename, strerror(errno));
+        free(filename);
+        return -1;
+    }
+
+    struct stat stbuf;
+    if(fstat(fileno(fp), &stbuf) != 0 ||
+       stbuf.st_size < SHARE_SNAPSHOT_MAGIC_LEN)
+    {
+        WARNING("%s: invalid snapshot, ignored", filename);
+        fclose(fp);
+        free(filename);
+        return -1;
+    }
+
+    unsigned char *buf = malloc(stbuf.st_size);
+    size_t len = fread(buf, 1, stbuf.st_size, fp);
+    fclose(fp);
+
+    if(len != stbuf.st_size ||
+       memcmp(buf, SHARE_SNAPSHOT_MAGIC, SHARE_SNAPSHOT_MAGIC_LEN) != 0)
+    {
+        WARNING("%s: invalid snapshot, ignored", filename);
+        free(buf);
+        free(filename);
+        return -1;
+    }
+
+    if(share->snapshot == NULL)
+    {
+        share->snapshot = calloc(1, sizeof(share_snapshot_t));
+        LIST_INIT(&share->snapshot->records);
+    }
+
+    const unsigned char *p = buf + SHARE_SNAPSHOT_MAGIC_LEN;
+    const unsigned char *end = buf + len;
+    unsigned nrecords = 0;
+    while(p < end)
+    {
+        uint64_t reclen, rootlen;
+        if(share_snapshot_get_varint(&p, end, &reclen) != 0 ||
+           reclen > end - p)
+        {
+            WARNING("%s: truncated snapshot", filename);
+            break;
+        }
+
+        const unsigned char *rec_start = p;
+        p += reclen;
+
+        const unsigned char *q = rec_start;
+        if(share_snapshot_get_varint(&q, p, &rootlen) != 0 ||
+           rootlen == 0 || rootlen > p - q)
+        {
+            WARNING("%s: invalid record, skipped", filename);
+            continue;
+        }
+
+        struct share_snapshot_record *rec =
+            calloc(1, sizeof(struct share_snapshot_record));
+        rec->local_root = malloc(rootlen + 1);
+        memcpy(rec->local_root, q, rootlen);
+        rec->local_root[rootlen] = 0;
+        rec->len = reclen;
+        rec->data = malloc(reclen);
+        memcpy(rec->data, rec_start, reclen);
+
+        /* a later record for the same mountpoint replaces the first */
+        struct share_snapshot_record *old =
+            share_snapshot_find_record(share, rec->local_root);
+        if(old)
+        {
+            LIST_REMOVE(old, link);
+            share_snapshot_free_record(old);
+        }
+
+        LIST_INSERT_HEAD(&share->snapshot->records, rec, link);
+        nrecords++;
+    }
+
+    INFO("loaded %u mountpoints from the share snapshot", nrecords);
+
+    free(buf);
+    free(filename);
+    return 0;
+}
+
+/* Restores the files of the mountpoint from the snapshot, and finishes the
+ * scan of the mountpoint. The files should be checked with
+ * share_scan_verify(). Returns -1 if the mountpoint isn't in the snapshot.
+ */
+int share_snapshot_restore(share_t *share, share_mountpoint_t *mp)
+{
+    return_val_if_fail(share, -1);
+    return_val_if_fail(mp, -1);
+
+    struct share_snapshot_record *rec =
+        share_snapshot_find_record(share, mp->local_root);
+    if(rec == NULL)
+        return -1;
+    LIST_REMOVE(rec, link);
+
+    const unsigned char *p = rec->data;
+    const unsigned char *end = rec->data + rec->len;
+    uint64_t rootlen, nfiles;
+    share_snapshot_get_varint(&p, end, &rootlen);
+    p += rootlen;
+
+    size_t root_len = strlen(mp->local_root);
+    size_t path_size = root_len + 256;
+    char *path = malloc(path_size);
+    memcpy(path, mp->local_root, root_len);
+    size_t partial_len = 0;
+
+    memset(&mp->stats, 0, sizeof(share_stats_t));
+
+    unsigned n = 0;
+    if(share_snapshot_get_varint(&p, end, &nfiles) == 0)
+    {
+        for(n = 0; n < nfiles; n++)
+        {
+            uint64_t prefix, suffix, size, inode, mtime;
+            if(share_snapshot_get_varint(&p, end, &prefix) != 0 ||
+               prefix > partial_len ||
+               share_snapshot_get_varint(&p, end, &suffix) != 0 ||
+               suffix > end - p)
+                break;
+
+            partial_len = prefix + suffix;
+            if(root_len + partial_len + 1 > path_size)
+            {
+                path_size = root_len + partial_len + 256;
+                path = realloc(path, path_size);
+            }
+            memcpy(path + root_len + prefix, p, suffix);
+            path[root_len + partial_len] = 0;
+            p += suffix;
+
+            if(share_snapshot_get_varint(&p, end, &size) != 0 ||
+               share_snapshot_get_varint(&p, end, &inode) != 0 ||
+               share_snapshot_get_varint(&p, end, &mtime) != 0)
+                break;
+
+            share_file_t *f = share_scan_add(share, mp, path,
+                    size, inode, (time_t)mtime);
+            if(f)
+                f->stale = true;
+        }
+    }
+
+    if(n < nfiles)
+    {
+        /* the verification scan adds the rest */
+        WARNING("snapshot of [%s] is truncated after %u files",
+                mp->local_root, n);
+    }
+
+    INFO("restored %u files in [%s] from the snapshot", n, mp->local_root);
+
+    free(path);
+    share_snapshot_free_record(rec);
+
+    share->uptodate = false;
+    nc_send_share_scan_finished_notification(nc_default(), mp->local_root);
+
+    return 0;
+}
+
+static unsigned share_snapshot_put_files(struct share_snapshot_buf *b,
+        file_tree_t *tree, share_mountpoint_t *mp)
+{
+    /* partial paths of this and the previous file */
+    char *path = NULL, *prev = NULL;
+    size_t path_size = 0, prev_size = 0, prev_len = 0;
+    unsigned nfiles = 0;
+
+    share_file_t *f;
+    RB_FOREACH(f, file_tree, tree)
+    {
+        /* files are sorted by mountpoint first */
+        if(f->mp != mp)
+        {
+            if(nfiles > 0)
+                break;
+            continue;
+        }
+
+        size_t len = share_file_path(f, "", path, path_size);
+        if(len >= path_size)
+        {
+            path_size = len + 256;
+            path = realloc(path, path_size);
+            share_file_path(f, "", path, path_size);
+        }
+
+        size_t prefix = 0;
+        while(prefix < prev_len && prev[prefix] == path[prefix])
+            prefix++;
+        size_t suffix = len - prefix;
+
+        share_snapshot_put_varint(b, prefix);
+        share_snapshot_put_varint(b, suffix);
+        share_snapshot_put(b, path + prefix, suffix);
+        share_snapshot_put_varint(b, f->size);
+        share_snapshot_put_varint(b, f->inode);
+        share_snapshot_put_varint(b, (uint64_t)f->mtime);
+
+        char *tmp = prev;
+        prev = path;
+        path = tmp;
+        size_t tmp_size = prev_size;
+        prev_size = path_size;
+        path_size = tmp_size;
+        prev_len = len;
+        nfiles++;
+    }
+
+    free(path);
+    free(prev);
+    return nfiles;
+}
+
+static void share_snapshot_put_mountpoint(struct share_snapshot_buf *b,
+        share_t *share, share_mountpoint_t *mp)
+{
+    struct share_snapshot_buf files = {0};
+    unsigned nfiles = share_snapshot_put_files(&files, &share->files, mp);
+    nfiles += share_snapshot_put_files(&files, &share->unhashed_files, mp);
+
+    struct share_snapshot_buf rec = {0};
+    size_t rootlen = strlen(mp->local_root);
+    share_snapshot_put_varint(&rec, rootlen);
+    share_snapshot_put(&rec, mp->local_root, rootlen);
+    share_snapshot_put_varint(&rec, nfiles);
+    share_snapshot_put(&rec, files.data, files.len);
+
+    share_snapshot_put_varint(b, rec.len);
+    share_snapshot_put(b, rec.data, rec.len);
+
+    free(rec.data);
+    free(files.data);
+}
+
+/* Saves all mountpoints that are completely scanned. */
+int share_snapshot_save(share_t *share)
+{
+    return_val_if_fail(share, -1);
+    return_val_if_fail(global_working_directory, -1);
+
+    struct share_snapshot_buf b = {0};
+    share_snapshot_put(&b, SHARE_SNAPSHOT_MAGIC, SHARE_SNAPSHOT_MAGIC_LEN);
+
+    unsigned nmountpoints = 0;
+    share_mountpoint_t *mp;
+    LIST_FOREACH(mp, &share->mountpoints, link)
+    {
+        if(mp->removed || mp->scan_in_progress)
+            continue;
+        share_snapshot_put_mountpoint(&b, share, mp);
+        nmountpoints++;
+    }
+
+    /* Keep the mountpoints not yet added during startup. Once all shared
+     * paths are added, any left have been unshared. */
+    if(share->snapshot && global_init_completion < 200)
+    {
+        struct share_snapshot_record *rec;
+        LIST_FOREACH(rec, &share->snapshot->records, link)
+        {
+            share_snapshot_put_varint(&b, rec->len);
+            share_snapshot_put(&b, rec->data, rec->len);
+            nmountpoints++;
+        }
+    }
+
+    char *filename = share_snapshot_filename();
+    char *tmp_filename;
+    int rc = -1;
+    if(filename && asprintf(&tmp_filename, "%s.tmp", filename) != -1)
+    {
+        FILE *fp = fopen(tmp_filename, "w");
+        if(fp == NULL)
+            WARNING("%s: %s", tmp_filename, strerror(errno));
+        else
+        {
+            rc = 0;
+            if(fwrite(b.data, 1, b.len, fp) != b.len ||
+               fflush(fp) != 0 || fsync(fileno(fp)) != 0)
+            {
+                WARNING("%s: %s", tmp_filename, strerror(errno));
+                rc = -1;
+            }
+            if(fclose(fp) != 0)
+                rc = -1;
+
+            if(rc == 0 && rename(tmp_filename, filename) != 0)
+            {
+                WARNING("%s: %s", filename, strerror(errno));
+                rc = -1;
+            }
+            if(rc != 0)
+                unlink(tmp_filename);
+        }
+        free(tmp_filename);
+    }
+
+    if(rc == 0)
+    {
+        DEBUG("saved %u mountpoints (%zu bytes) to the share snapshot",
+                nmountpoints, b.len);
+    }
+
+    free(filename);
+    free(b.data);
+    return rc;
+}
+
+static void share_snapshot_save_event_cb(int fd, short why, void *user_data)
+{
+    share_t *share = user_data;
+
+    share_snapshot_save_scheduled = false;
+
+    if(share->scanning > 0)
+    {
+        /* wait for the remaining scans */
+        share_snapshot_schedule_save(share);
+        return;
+    }
+
+    share_snapshot_save(share);
+}
+
+/* Saves the snapshot after a while, so several scans finishing close
+ * together are saved once. */
+void share_snapshot_schedule_save(share_t *share)
+{
+    return_if_fail(share);
+
+    if(global_working_directory == NULL || share_snapshot_save_scheduled)
+        return;
+
+    struct timeval tv = {.tv_sec = SHARE_SNAPSHOT_SAVE_DELAY, .tv_usec = 0};
+    evtimer_set(&share_snapshot_save_event, share_snapshot_save_event_cb,
+            share);
+    evtimer_add(&share_snapshot_save_event, &tv);
+    share_snapshot_save_scheduled = true;
+}
+
+void share_snapshot_free(share_t *share)
+{
+    return_if_fail(share);
+
+    if(share_snapshot_save_scheduled)
+    {
+        evtimer_del(&share_snapshot_save_event);
+        share_snapshot_save_scheduled = false;
+    }
+
+    if(share->snapshot)
+    {
+        struct share_snapshot_record *rec;
+        while((rec = LIST_FIRST(&share->snapshot->records)) != NULL)
+        {
+            LIST_REMOVE(rec, link);
+            share_snapshot_free_record(rec);
+        }
+        free(share->snapshot);
+        share->snapshot = NULL;
+    }
+}
+
+#ifdef TEST
+
+#include "ui.h"
+#include "unit_test.h"
+
+int ui_send_status_message(ui_t *ui, const char *hub_address,
+        const char *message, ...)
+{
+    return 0;
+}
+
+static void write_file(const char *filename, const char *data)
+{
+    FILE *fp = fopen(filename, "w");
+    fail_unless(fp);
+    fputs(data, fp);
+    fclose(fp);
+}
+
+static void wait_for_scans(share_mountpoint_t *mp)
+{
+    while(mp->nscans > 0)
+        event_loop(EVLOOP_ONCE);
+}
+
+int main(void)
+{
+    event_init();
+    sp_log_set_level("warning");
+
+    global_working_directory = "/tmp/share_snapshot_test";
+    global_incomplete_directory = "/tmp/share_snapshot_test/incomplete";
+    system("/bin/rm -rf /tmp/share_snapshot_test");
+    mkpath("/tmp/share_snapshot_test/root/sub/subsub");
+    write_file("/tmp/share_snapshot_test/root/sub/a.txt", "a");
+    write_file("/tmp/share_snapshot_test/root/sub/b.txt", "bb");
+    write_file("/tmp/share_snapshot_test/root/sub/subsub/c.txt", "ccc");
+    write_file("/tmp/share_snapshot_test/root/d.txt", "dddd");
+
+    tth_store_init();
+
+    /* no snapshot yet */
+    share_t *share = share_new();
+    fail_unless(share_snapshot_load(share) == -1);
+    fail_unless(share_add(share, "/tmp/share_snapshot_test/root") == 0);
+    share_mountpoint_t *mp =
+        share_lookup_local_root(share, "/tmp/share_snapshot_test/root");
+    fail_unless(mp);
+    fail_unless(mp->scan_in_progress);
+    wait_for_scans(mp);
+    fail_unless(mp->stats.ntotfiles == 4);
+    fail_unless(share_snapshot_save(share) == 0);
+
+    /* files changed while not running */
+    unlink("/tmp/share_snapshot_test/root/sub/a.txt");
+    write_file("/tmp/share_snapshot_test/root/sub/b.txt", "changed");
+    write_file("/tmp/share_snapshot_test/root/e.txt", "eeeee");
+
+    /* the snapshot is used immediately */
+    share_t *share2 = share_new();
+    fail_unless(share_snapshot_load(share2) == 0);
+    fail_unless(share_add(share2, "/tmp/share_snapshot_test/root") == 0);
+    mp = share_lookup_local_root(share2, "/tmp/share_snapshot_test/root");
+    fail_unless(mp);
+    fail_unless(!mp->scan_in_progress);
+    fail_unless(share2->scanning == 0);
+    fail_unless(mp->stats.ntotfiles == 4);
+    fail_unless(mp->stats.totsize == 1 + 2 + 3 + 4);
+    share_file_t *f = share_lookup_unhashed_file(share2,
+            "/tmp/share_snapshot_test/root/sub/subsub/c.txt");
+    fail_unless(f);
+    fail_unless(f->stale);
+    fail_unless(f->size == 3);
+    fail_unless(share_lookup_unhashed_file(share2,
+                "/tmp/share_snapshot_test/root/sub/a.txt"));
+    fail_unless(share_snapshot_find_record(share2,
+                "/tmp/share_snapshot_test/root") == NULL);
+
+    /* and verified in the background */
+    wait_for_scans(mp);
+    fail_unless(!f->stale);
+    fail_unless(mp->stats.ntotfiles == 4);
+    fail_unless(mp->stats.totsize == 7 + 3 + 4 + 5);
+    fail_unless(share_lookup_unhashed_file(share2,
+                "/tmp/share_snapshot_test/root/sub/a.txt") == NULL);
+    f = share_lookup_unhashed_file(share2,
+            "/tmp/share_snapshot_test/root/sub/b.txt");
+    fail_unless(f);
+    fail_unless(f->size == 7);
+    fail_unless(!f->stale);
+    fail_unless(share_lookup_unhashed_file(share2,
+                "/tmp/share_snapshot_test/root/e.txt"));
+
+    /* mountpoints not yet added are kept in the snapshot */
+    mkpath("/tmp/share_snapshot_test/other");
+    write_file("/tmp/share_snapshot_test/other/f.txt", "f");
+    fail_unless(share_add(share2, "/tmp/share_snapshot_test/other") == 0);
+    share_mountpoint_t *other_mp =
+        share_lookup_local_root(share2, "/tmp/share_snapshot_test/other");
+    wait_for_scans(other_mp);
+    fail_unless(share_snapshot_save(share2) == 0);
+
+    share_t *share3 = share_new();
+    fail_unless(share_snapshot_load(share3) == 0);
+    fail_unless(share_snapshot_find_record(share3,
+                "/tmp/share_snapshot_test/root"));
+    fail_unless(share_snapshot_save(share3) == 0);
+    share_t *share4 = share_new();
+    fail_unless(share_snapshot_load(share4) == 0);
+    fail_unless(share_snapshot_find_record(share4,
+                "/tmp/share_snapshot_test/root"));
+    fail_unless(share_snapshot_find_record(share4,
+                "/tmp/share_snapshot_test/other"));
+
+    /* but dropped once all shared paths are added */
+    global_init_completion = 200;
+    fail_unless(share_snapshot_save(share3) == 0);
+    share_t *share5 = share_new();
+    fail_unless(share_snapshot_load(share5) == -1 ||
+            share_snapshot_find_record(share5,
+                "/tmp/share_snapshot_test/root") == NULL);
+
+    tth_store_close();
+    system("/bin/rm -rf /tmp/share_snapshot_test");
+
+    return 0;
+}
+
+#endif
+
@@ -81,7 +81,8 @@ void handle_share_scan_finished_notification(
 
         if(save_filelist_flag)
         {
-            share_save(global_share, FILELIST_XML | FILELIST_DCLST);
+            global_share->save_xml = true;
+            share_save(global_share, FILELIST_XML);
         }
     }
 }
@@ -106,8 +107,9 @@ static void shutdown_event(int fd, short why, void *data)
 int search_match_cb(const share_search_t *search,
         share_file_t *file, const char *tth, void *data)
 {
-    printf(CLRON "search match: %s%s, TTH/%s" CLROFF "\n",
-	file->mp->local_root, file->partial_path, tth);
+    char *local_path = share_complete_path(file);
+    printf(CLRON "search match: %s, TTH/%s" CLROFF "\n", local_path, tth);
+    free(local_path);
     /* if(tth) */
         /* printf("TTH:%s\n", tth); */
     return 0;
@@ -129,9 +131,14 @@ void do_search(char *search_string)
 
     if(str_has_prefix(search_string, "TTH:"))
     {
-        s.tth = search_string + 4;
+        if(tth_from_base32(&s.tth, search_string + 4) != 0)
+        {
+            printf("Invalid TTH %s\n", search_string + 4);
+            return;
+        }
+        s.has_tth = true;
         s.type = SHARE_TYPE_TTH;
-        printf(CLRON "Searching for TTH %s" CLROFF "\n", s.tth);
+        printf(CLRON "Searching for TTH %s" CLROFF "\n", search_string + 4);
     }
     else
     {
@@ -46,16 +46,22 @@ static void handle_tth_available_notification(nc_t *nc,
 
     /* We're about to move the file from the unhashed to the hashed tree. */
     /* Start by removing it from the unhashed tree. */
-    if(share_lookup_unhashed_file(share, local_path) != NULL)
+    if(RB_FIND(file_tree, &share->unhashed_files, file) == file)
 	RB_REMOVE(file_tree, &share->unhashed_files, file);
     else
 	WARNING("File [%s] not in unhashed tree!?", local_path);
 
+    tth_t tth;
     if(notification->tth == NULL)
     {
 	/* hashing failed for some reason (eg, permission denied) */
 	goto fail;
     }
+    if(tth_from_base32(&tth, notification->tth) != 0)
+    {
+	WARNING("invalid TTH [%s] for [%s]", notification->tth, local_path);
+	goto fail;
+    }
 
     /* Find the modification time of the file, so we can detect changes when we
      * re-scan this file. FIXME: should probably store the mtime as it is when
@@ -69,20 +75,20 @@ static void handle_tth_available_notification(nc_t *nc,
 	WARNING("%s: failed to lookup mtime: %s", local_path, strerror(errno));
 	goto fail;
     }
+    file->mtime = stbuf.st_mtime;
 
-    struct tth_entry *te = tth_store_lookup(global_tth_store,
-	notification->tth);
+    struct tth_entry *te = tth_store_lookup(global_tth_store, &tth);
 
     if(te == NULL)
     {
 	tth_store_add_entry(global_tth_store,
-	    notification->tth,
+	    &tth,
 	    notification->leafdata_base64,
 	    0);
     }
 
     tth_store_add_inode(global_tth_store,
-	file->inode, stbuf.st_mtime, notification->tth);
+	file->inode, stbuf.st_mtime, &tth);
 
     share->uptodate = false;
 
@@ -90,7 +96,7 @@ static void handle_tth_available_notification(nc_t *nc,
     {
 	/* there was no previous conflicting TTH, claim this TTH */
 	tth_store_set_active_inode(global_tth_store,
-		notification->tth, file->inode);
+		&tth, file->inode);
     }
     else
     {
@@ -111,16 +117,17 @@ static void handle_tth_available_notification(nc_t *nc,
 	{
 	    /* original not shared, claim this TTH */
 	    tth_store_set_active_inode(global_tth_store,
-		notification->tth, file->inode);
+		&tth, file->inode);
 	}
     }
 
     /* Now insert the file in the hashed tree. Do a safety check first. */
-    if(share_lookup_file(share, local_path))
+    if(RB_FIND(file_tree, &share->files, file))
         WARNING("File [%s] already in hashed tree!?", local_path);
     else
     {
         RB_INSERT(file_tree, &share->files, file);
+        share_index_add_file(share->index, file);
     }
 
     free(local_path);
@@ -130,10 +137,7 @@ static void handle_tth_available_notification(nc_t *nc,
     file->mp->stats.nfiles++;
 
     /* add the file to the bloom filter */
-    char *filename = strrchr(file->partial_path, '/');
-    if(filename++ == NULL)
-	filename = file->partial_path;
-    bloom_add_filename(share->bloom, filename);
+    bloom_add_filename(share->bloom, file->name);
 
     return;
 
@@ -0,0 +1,472 @@
+/*
+ * Copyright 2006 Martin Hedenfalk <martin@bzero.se>
+ *
+ * This file is part of ShakesPeer.
+ *
+ * ShakesPeer is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ShakesPeer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ShakesPeer; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/* Watches shared directories for changes with inotify, so that added,
+ * modified, moved and removed files are picked up as they happen instead of
+ * rescanning the whole mountpoint periodically. Every directory is watched
+ * as it is scanned. If the kernel event queue overflows, events are lost
+ * and the mountpoint is rescanned.
+ *
+ * Where inotify isn't available, mountpoints aren't watched and are
+ * rescanned periodically.
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <event.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "htable.h"
+#include "share.h"
+#include "log.h"
+#include "notifications.h"
+
+#if defined(__linux__)
+
+#include <sys/inotify.h>
+
+#define SHARE_WATCH_MASK (IN_CREATE | IN_CLOSE_WRITE | IN_DELETE | \
+        IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+
+struct share_watch
+{
+    int fd;
+    struct event ev;
+    share_t *share;
+    share_mountpoint_t *mp;
+
+    htable_t dirs; /* struct share_watch_dir by watch descriptor */
+};
+
+struct share_watch_dir
+{
+    int wd;
+    char *path;
+};
+
+struct share_watch_rescan
+{
+    share_t *share;
+    char *local_root;
+};
+
+static uint32_t share_watch_dir_hash(const void *record)
+{
+    return htable_hash_uint64(((const struct share_watch_dir *)record)->wd);
+}
+
+static int share_watch_dir_match(const void *record, const void *key)
+{
+    return ((const struct share_watch_dir *)record)->wd == *(const int *)key;
+}
+
+static struct share_watch_dir *share_watch_lookup_dir(
+        struct share_watch *watch, int wd)
+{
+    return htable_lookup(&watch->dirs, htable_hash_uint64(wd),
+            share_watch_dir_match, &wd);
+}
+
+static void share_watch_free_dir(struct share_watch *watch,
+        struct share_watch_dir *dir)
+{
+    htable_remove(&watch->dirs, dir);
+    free(dir->path);
+    free(dir);
+}
+
+static void share_watch_rescan_event(int fd, short why, void *user_data)
+{
+    struct share_watch_rescan *rescan = user_data;
+
+    /* the mountpoint may have been unshared since */
+    share_mountpoint_t *mp =
+        share_lookup_local_root(rescan->share, rescan->local_root);
+    if(mp == NULL || mp->removed ||
+       strcmp(mp->local_root, rescan->local_root) != 0)
+    {
+        DEBUG("[%s] no longer shared, not rescanned", rescan->local_root);
+    }
+    else
+    {
+        /* removes and re-adds the mountpoint */
+        share_add(rescan->share, rescan->local_root);
+    }
+
+    free(rescan->local_root);
+    free(rescan);
+}
+
+/* Events were lost. Rescan from a new event, as rescanning frees the watch
+ * we're called from. */
+static void share_watch_overflow(struct share_watch *watch)
+{
+    WARNING("too many changes in [%s], rescanning", watch->mp->local_root);
+
+    struct share_watch_rescan *rescan =
+        malloc(sizeof(struct share_watch_rescan));
+    rescan->share = watch->share;
+    rescan->local_root = strdup(watch->mp->local_root);
+
+    struct timeval tv = {.tv_sec = 0, .tv_usec = 0};
+    event_once(-1, EV_TIMEOUT, share_watch_rescan_event, rescan, &tv);
+
+    share_watch_stop(watch->mp);
+}
+
+/* Stops watching a directory moved out of, or removed from, the mountpoint,
+ * and its subdirectories. */
+static void share_watch_remove_directory(struct share_watch *watch,
+        const char *dirpath)
+{
+    size_t len = strlen(dirpath);
+
+    /* the table can't be changed while iterating over it */
+    struct share_watch_dir **removed =
+        malloc(htable_count(&watch->dirs) * sizeof(struct share_watch_dir *));
+    unsigned nremoved = 0;
+
+    unsigned pos = 0;
+    struct share_watch_dir *dir;
+    while((dir = htable_next(&watch->dirs, &pos)) != NULL)
+    {
+        if(strncmp(dir->path, dirpath, len) == 0 &&
+           (dir->path[len] == 0 || dir->path[len] == '/'))
+            removed[nremoved++] = dir;
+    }
+
+    unsigned i;
+    for(i = 0; i < nremoved; i++)
+    {
+        inotify_rm_watch(watch->fd, removed[i]->wd);
+        share_watch_free_dir(watch, removed[i]);
+    }
+    free(removed);
+}
+
+static void share_watch_handle(struct share_watch *watch,
+        struct inotify_event *iev)
+{
+    struct share_watch_dir *dir = share_watch_lookup_dir(watch, iev->wd);
+    if(dir == NULL)
+        return;
+
+    if(iev->mask & IN_IGNORED)
+    {
+        /* the directory was removed */
+        share_watch_free_dir(watch, dir);
+        return;
+    }
+
+    char *dirpath = dir->path;
+
+    if(iev->len == 0)
+        return; /* event on the watched directory itself */
+
+    DEBUG("event 0x%X on [%s/%s]", iev->mask, dirpath, iev->name);
+
+    if(iev->mask & (IN_DELETE | IN_MOVED_FROM))
+    {
+        share_unscan_path(watch->share, watch->mp, dirpath, iev->name);
+        if(iev->mask & IN_ISDIR)
+        {
+            char *subdir;
+            if(asprintf(&subdir, "%s/%s", dirpath, iev->name) != -1)
+            {
+                share_watch_remove_directory(watch, subdir);
+                free(subdir);
+            }
+        }
+    }
+    else if((iev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) ||
+            ((iev->mask & IN_CREATE) && (iev->mask & IN_ISDIR)))
+    {
+        /* Files are added when closed after writing; there is nothing to
+         * hash until then. */
+        share_scan_path(watch->share, watch->mp, dirpath, iev->name);
+    }
+}
+
+static void share_watch_event(int fd, short why, void *user_data)
+{
+    struct share_watch *watch = user_data;
+    char buf[16 * 1024]
+        __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    bool changed = false;
+
+    for(;;)
+    {
+        ssize_t len = read(fd, buf, sizeof(buf));
+        if(len <= 0)
+        {
+            if(len == -1 && errno != EAGAIN && errno != EINTR)
+                WARNING("inotify: %s", strerror(errno));
+            break;
+        }
+
+        char *p;
+        for(p = buf; p < buf + len; )
+        {
+            struct inotify_event *iev = (struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + iev->len;
+
+            if(iev->mask & IN_Q_OVERFLOW)
+            {
+                share_watch_overflow(watch);
+                return;
+            }
+
+            share_watch_handle(watch, iev);
+            changed = true;
+        }
+    }
+
+    if(changed)
+    {
+        nc_send_share_changed_notification(nc_default(),
+                watch->mp->local_root);
+    }
+}
+
+void share_watch_start(share_t *share, share_mountpoint_t *mp)
+{
+    return_if_fail(share);
+    return_if_fail(mp);
+
+    if(mp->watch)
+        return;
+
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(fd == -1)
+    {
+        WARNING("inotify: %s, [%s] is rescanned periodically",
+                strerror(errno), mp->local_root);
+        return;
+    }
+
+    struct share_watch *watch = calloc(1, sizeof(struct share_watch));
+    watch->fd = fd;
+    watch->share = share;
+    watch->mp = mp;
+    htable_init(&watch->dirs, share_watch_dir_hash);
+    mp->watch = watch;
+
+    event_set(&watch->ev, fd, EV_READ | EV_PERSIST, share_watch_event, watch);
+    event_add(&watch->ev, NULL);
+}
+
+void share_watch_directory(share_mountpoint_t *mp, const char *dirpath)
+{
+    return_if_fail(mp);
+    return_if_fail(dirpath);
+
+    struct share_watch *watch = mp->watch;
+    if(watch == NULL)
+        return;
+
+    int wd = inotify_add_watch(watch->fd, dirpath, SHARE_WATCH_MASK);
+    if(wd == -1)
+    {
+        /* Most likely the limit of watches is reached
+         * (/proc/sys/fs/inotify/max_user_watches). A partial watch would
+         * miss changes, fall back to periodic rescans. */
+        WARNING("can't watch [%s]: %s, [%s] is rescanned periodically",
+                dirpath, strerror(errno), mp->local_root);
+        share_watch_stop(mp);
+        return;
+    }
+
+    /* the same directory may be watched again under a new name */
+    struct share_watch_dir *dir = share_watch_lookup_dir(watch, wd);
+    if(dir)
+    {
+        free(dir->path);
+        dir->path = strdup(dirpath);
+        return;
+    }
+
+    dir = calloc(1, sizeof(struct share_watch_dir));
+    dir->wd = wd;
+    dir->path = strdup(dirpath);
+    htable_insert(&watch->dirs, dir);
+}
+
+void share_watch_stop(share_mountpoint_t *mp)
+{
+    return_if_fail(mp);
+
+    struct share_watch *watch = mp->watch;
+    if(watch == NULL)
+        return;
+
+    event_del(&watch->ev);
+    close(watch->fd);
+
+    unsigned pos = 0;
+    struct share_watch_dir *dir;
+    while((dir = htable_next(&watch->dirs, &pos)) != NULL)
+    {
+        free(dir->path);
+        free(dir);
+    }
+    htable_free(&watch->dirs);
+    free(watch);
+
+    mp->watch = NULL;
+}
+
+#else
+
+void share_watch_start(share_t *share, share_mountpoint_t *mp)
+{
+}
+
+void share_watch_directory(share_mountpoint_t *mp, const char *dirpath)
+{
+}
+
+void share_watch_stop(share_mountpoint_t *mp)
+{
+}
+
+#endif
+
+#ifdef TEST
+
+#include <sys/stat.h>
+#include <stdio.h>
+
+#include "globals.h"
+#include "ui.h"
+#include "unit_test.h"
+
+int ui_send_status_message(ui_t *ui, const char *hub_address,
+        const char *message, ...)
+{
+    return 0;
+}
+
+static void run_events(void)
+{
+    /* let the incremental scans finish */
+    int i;
+    for(i = 0; i < 10; i++)
+        event_loop(EVLOOP_NONBLOCK);
+}
+
+static void touch(const char *filename)
+{
+    FILE *fp = fopen(filename, "w");
+    fail_unless(fp);
+    fputs("data", fp);
+    fclose(fp);
+}
+
+int main(void)
+{
+#if defined(__linux__)
+    event_init();
+    sp_log_set_level("warning");
+
+    global_working_directory = "/tmp/share_watch_test";
+    global_incomplete_directory = "/tmp/share_watch_test/incomplete";
+    system("/bin/rm -rf /tmp/share_watch_test");
+    mkpath("/tmp/share_watch_test/root/sub");
+    touch("/tmp/share_watch_test/root/sub/a.txt");
+
+    tth_store_init();
+    global_share = share_new();
+    fail_unless(share_add(global_share, "/tmp/share_watch_test/root") == 0);
+
+    share_mountpoint_t *mp =
+        share_lookup_local_root(global_share, "/tmp/share_watch_test/root");
+    fail_unless(mp);
+    while(mp->scan_in_progress)
+        event_loop(EVLOOP_ONCE);
+    fail_unless(mp->watch);
+    fail_unless(htable_count(&mp->watch->dirs) == 2);
+    fail_unless(mp->stats.ntotfiles == 1);
+    fail_unless(share_lookup_unhashed_file(global_share,
+                "/tmp/share_watch_test/root/sub/a.txt"));
+
+    /* a new file is added when closed */
+    touch("/tmp/share_watch_test/root/b.txt");
+    run_events();
+    fail_unless(share_lookup_unhashed_file(global_share,
+                "/tmp/share_watch_test/root/b.txt"));
+    fail_unless(mp->stats.ntotfiles == 2);
+
+    /* a renamed directory is moved with its files */
+    fail_unless(rename("/tmp/share_watch_test/root/sub",
+                "/tmp/share_watch_test/root/moved") == 0);
+    run_events();
+    fail_unless(share_lookup_unhashed_file(global_share,
+                "/tmp/share_watch_test/root/sub/a.txt") == NULL);
+    fail_unless(share_lookup_unhashed_file(global_share,
+                "/tmp/share_watch_test/root/moved/a.txt"));
+    fail_unless(mp->stats.ntotfiles == 2);
+
+    /* files in a new subdirectory of the moved directory are found */
+    mkdir("/tmp/share_watch_test/root/moved/new", 0755);
+    run_events();
+    fail_unless(htable_count(&mp->watch->dirs) == 3);
+    touch("/tmp/share_watch_test/root/moved/new/c.txt");
+    run_events();
+    fail_unless(share_lookup_unhashed_file(global_share,
+                "/tmp/share_watch_test/root/moved/new/c.txt"));
+
+    /* removed files are removed from the share */
+    unlink("/tmp/share_watch_test/root/b.txt");
+    run_events();
+    fail_unless(share_lookup_unhashed_file(global_share,
+                "/tmp/share_watch_test/root/b.txt") == NULL);
+    fail_unless(mp->stats.ntotfiles == 2);
+
+    /* hidden files are skipped */
+    touch("/tmp/share_watch_test/root/.hidden");
+    run_events();
+    fail_unless(share_lookup_unhashed_file(global_share,
+                "/tmp/share_watch_test/root/.hidden") == NULL);
+
+    /* watched mountpoints aren't rescanned periodically */
+    share_rescan(global_share);
+    fail_unless(!mp->scan_in_progress);
+
+    /* a mountpoint unshared before the rescan after an overflow isn't
+     * shared again */
+    share_watch_overflow(mp->watch);
+    fail_unless(mp->watch == NULL);
+    fail_unless(share_remove(global_share,
+                "/tmp/share_watch_test/root", false) == 0);
+    run_events();
+    fail_unless(share_lookup_local_root(global_share,
+                "/tmp/share_watch_test/root") == NULL);
+
+    system("/bin/rm -rf /tmp/share_watch_test");
+#endif
+
+    return 0;
+}
+
+#endif
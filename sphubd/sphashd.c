@@ -22,6 +22,8 @@
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
 
 #include <signal.h>
 #include <errno.h>
@@ -30,6 +32,8 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <unistd.h>
+#include <inttypes.h>
 
 #include "share.h"
 #include "tigertree.h"
@@ -37,6 +41,8 @@
 #include "log.h"
 #include "sphashd.h"
 #include "base64.h"
+#include "base32.h"
+#include "cmd_table.h"
 
 #define HASHER_BUFSIZ 4*1024*1024
 
@@ -49,7 +55,7 @@ static void hc_close_connection(hc_t *hc);
 
 static int hc_send_string(hc_t *hc, const char *string)
 {
-    print_command(string, "-> (fd %i)", hc->fd);
+    print_command(SP_TRACE_HASHD, string, "-> (fd %i)", hc->fd);
     return bufferevent_write(hc->bufev, (void *)string, strlen(string));
 }
 
@@ -71,115 +77,537 @@ int hc_send_command(hc_t *hc, const char *fmt, ...)
     return rc;
 }
 
-static void hc_pop_current(hc_t *hc)
+/* Hashing is done by a pool of forked worker processes (no threads, see
+ * DESIGN). Each file is split into segments that are hashed independently
+ * and combined with tt_update_subtree when all are done, so large files are
+ * hashed by all workers in parallel.
+ *
+ * The protocol between the main process and the workers is:
+ *
+ *   -> segment$<offset>$<length>$<leafsize>$<filename>|
+ *   -> set-delay$<usec>|
+ *   <- segment-done$<root base32>$<leaves base64>|
+ *   <- segment-failed|
+ */
+
+/* minimum number of bytes in each segment */
+#define HASHER_SEGMENT_SIZE (64*1024*1024)
+
+#define HASHER_MAX_WORKERS 16
+
+struct hash_worker
 {
-    return_if_fail(hc);
+    pid_t pid;
+    int fd;
+    struct bufferevent *bufev;
+    struct io_line_reader reader;
+    bool busy;
+    /* entry and segment being hashed, entry is NULL if aborted */
+    struct hash_entry *entry;
+    unsigned segment;
+};
+
+static struct hash_worker workers[HASHER_MAX_WORKERS];
+static int num_workers = 0;
+
+static void hash_worker_send(struct hash_worker *worker, const char *fmt, ...)
+    __attribute__ (( format(printf, 2, 3) ));
+
+static void hash_worker_send(struct hash_worker *worker, const char *fmt, ...)
+{
+    char *cmd = 0;
+
+    va_list ap;
+    va_start(ap, fmt);
+    int num_returned_bytes = vasprintf(&cmd, fmt, ap);
+    if (num_returned_bytes == -1)
+        DEBUG("vasprintf did not return anything");
+    va_end(ap);
+
+    print_command(SP_TRACE_HASHD, cmd, "-> (worker fd %i)", worker->fd);
+    bufferevent_write(worker->bufev, cmd, strlen(cmd));
+    free(cmd);
+}
+
+/*
+ * worker process
+ */
+
+/* blocking write of a whole reply to the main process */
+static int worker_write(int fd, const char *buf, size_t len)
+{
+    while(len > 0)
+    {
+        ssize_t n = write(fd, buf, len);
+        if(n == -1)
+        {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int worker_cmd_segment(void *user_data, int argc, char **argv)
+{
+    int fd = *(int *)user_data;
+    uint64_t offset = strtoull(argv[0], NULL, 10);
+    uint64_t length = strtoull(argv[1], NULL, 10);
+    unsigned leafsize = strtoul(argv[2], NULL, 10);
+    const char *filename = argv[3];
+
+    static unsigned char buf[HASHER_BUFSIZ];
+    struct tt_context tth;
+    char *reply = NULL;
 
-    if(hc->current_fd != -1)
+    int file_fd = open(filename, O_RDONLY);
+    if(file_fd == -1)
     {
-        close(hc->current_fd);
+        WARNING("%s: %s", filename, strerror(errno));
+        reply = strdup("segment-failed|");
     }
-    hc->current_fd = -1;
+    else
+    {
+        tt_init(&tth, leafsize);
+
+        while(length > 0)
+        {
+            size_t n = length < HASHER_BUFSIZ ? length : HASHER_BUFSIZ;
+            ssize_t len = pread(file_fd, buf, n, offset);
+            if(len <= 0)
+            {
+                WARNING("read(%s): %s", filename,
+                        len == 0 ? "unexpected end of file" : strerror(errno));
+                break;
+            }
+
+            tt_update(&tth, buf, len);
+            offset += len;
+            length -= len;
+
+            if(global_delay && length > 0)
+                usleep(global_delay);
+        }
+        close(file_fd);
+
+        if(length > 0)
+        {
+            /* unreadable?, disable the file */
+            reply = strdup("segment-failed|");
+        }
+        else
+        {
+            tt_digest(&tth, NULL);
+            char *root_base32 = tt_base32(&tth);
+            char *leaves_base64 = tt_leafdata_base64(&tth);
+            int num_returned_bytes = asprintf(&reply, "segment-done$%s$%s|",
+                    root_base32, leaves_base64);
+            if (num_returned_bytes == -1)
+                DEBUG("asprintf did not return anything");
+            free(leaves_base64);
+            free(root_base32);
+        }
 
-    tt_destroy(&hc->tth);
+        tt_destroy(&tth);
+    }
 
-    if(hc->current_entry)
+    if(worker_write(fd, reply, strlen(reply)) != 0)
     {
-        /* remove the current entry */
-        TAILQ_REMOVE(&hc->hash_queue_head, hc->current_entry, link);
-        free(hc->current_entry->filename);
-        free(hc->current_entry);
-        hc->current_entry = NULL;
+        /* lost the main process */
+        exit(0);
     }
+    free(reply);
+
+    return 0;
 }
 
-static void share_hasher(hc_t *hc)
+static int worker_cmd_set_delay(void *user_data, int argc, char **argv)
 {
-    return_if_fail(hc);
+    global_delay = strtoul(argv[0], NULL, 10);
+    return 0;
+}
+
+#include "worker_cmd_table.h"
 
-    /* huh, why do we support multiple clients... ? */
-    static struct timeval start;
-    static off_t size;
+static void worker_in_event(struct bufferevent *bufev, void *data)
+{
+    static struct io_line_reader reader;
 
-    if(hc->current_fd == -1)
+    while(1)
     {
-        hc->current_entry = TAILQ_FIRST(&hc->hash_queue_head);
-        if(hc->current_entry == NULL)
+        char *cmd = io_line_reader_next(&reader, EVBUFFER_INPUT(bufev));
+        if(cmd == NULL)
         {
-            DEBUG("no more unhashed files");
-            return;
+            break;
         }
+        cmd_dispatch(cmd, "$", 1, &worker_cmds, data);
+    }
+}
 
-        DEBUG("starting hashing %s", hc->current_entry->filename);
+static void worker_out_event(struct bufferevent *bufev, void *data)
+{
+}
+
+static void worker_err_event(struct bufferevent *bufev, short why, void *data)
+{
+    /* the main process is gone */
+    exit(0);
+}
+
+static void worker_main(int fd) __attribute (( noreturn ));
+
+static void worker_main(int fd)
+{
+    event_init();
 
-        gettimeofday(&start, NULL);
+    struct bufferevent *bufev = bufferevent_new(fd,
+            worker_in_event, worker_out_event, worker_err_event, &fd);
+    bufferevent_enable(bufev, EV_READ);
+
+    event_dispatch();
+    exit(0);
+}
+
+/*
+ * main process
+ */
 
-        struct stat sb;
-        if(stat(hc->current_entry->filename, &sb) != 0 ||
-           (hc->current_fd = open(hc->current_entry->filename, O_RDONLY)) == -1)
+static void hash_entry_free(struct hash_entry *entry)
+{
+    if(entry)
+    {
+        /* discard results from workers still hashing this entry */
+        int i;
+        for(i = 0; i < num_workers; i++)
         {
-            WARNING("%s: %s", hc->current_entry->filename, strerror(errno));
+            if(workers[i].entry == entry)
+                workers[i].entry = NULL;
+        }
+
+        unsigned j;
+        for(j = 0; j < entry->nsegments; j++)
+            free(entry->segments[j].leaves);
+        free(entry->segments);
+        free(entry->filename);
+        free(entry);
+    }
+}
+
+static void hash_entry_remove(hc_t *hc, struct hash_entry *entry)
+{
+    TAILQ_REMOVE(&hc->hash_queue_head, entry, link);
+    hash_entry_free(entry);
+}
+
+/* Stats the file and splits it into segments. Returns 0 on success, or -1 if
+ * the file can't be hashed.
+ */
+static int hash_entry_start(struct hash_entry *entry)
+{
+    DEBUG("starting hashing %s", entry->filename);
 
-            if(hc_send_fail_hash(hc, hc->current_entry->filename) != 0)
+    gettimeofday(&entry->start, NULL);
+
+    struct stat sb;
+    if(stat(entry->filename, &sb) != 0)
+    {
+        WARNING("%s: %s", entry->filename, strerror(errno));
+        return -1;
+    }
+
+    entry->size = sb.st_size;
+    entry->leafsize = tt_calc_block_size(sb.st_size, 10);
+
+    /* Segments must be a power-of-two number of leaves for the subtrees to
+     * combine into the same tree as hashing the whole file at once. */
+    entry->segsize = entry->leafsize;
+    while(entry->segsize < HASHER_SEGMENT_SIZE)
+        entry->segsize *= 2;
+
+    entry->nsegments = (entry->size + entry->segsize - 1) / entry->segsize;
+    if(entry->nsegments == 0)
+        entry->nsegments = 1; /* empty file */
+    entry->segments = calloc(entry->nsegments, sizeof(struct hash_segment));
+
+    return 0;
+}
+
+static void hash_entry_finish(struct hash_entry *entry)
+{
+    DEBUG("finished hashing %s", entry->filename);
+
+    struct timeval end;
+    gettimeofday(&end, NULL);
+    double e = end.tv_sec + (double)end.tv_usec / 1000000;
+    double s = entry->start.tv_sec + (double)entry->start.tv_usec / 1000000;
+    double d = e - s;
+    double Mps = ((double)entry->size / (1024*1024)) / d;
+    DEBUG("Hashing speed: %.1lf MiB/s", Mps);
+
+    /* combine the segment roots and concatenate their leaves */
+    struct tt_context tth;
+    tt_init(&tth, 0);
+    unsigned i;
+    for(i = 0; i < entry->nsegments; i++)
+    {
+        struct hash_segment *seg = &entry->segments[i];
+        tt_update_subtree(&tth, seg->root);
+
+        tth.leaves = realloc(tth.leaves, tth.leaves_len + seg->leaves_len);
+        memcpy(tth.leaves + tth.leaves_len, seg->leaves, seg->leaves_len);
+        tth.leaves_len += seg->leaves_len;
+    }
+    tt_digest(&tth, NULL);
+
+    char *hash_base32 = tt_base32(&tth);
+    char *leaves_base64 = tt_leafdata_base64(&tth);
+    hc_send_add_hash(entry->hc, entry->filename,
+            hash_base32, leaves_base64, Mps);
+    free(leaves_base64);
+    free(hash_base32);
+    tt_destroy(&tth);
+}
+
+/* hand out segments to idle workers */
+static void hash_dispatch(void)
+{
+    int i;
+    for(i = 0; i < num_workers; i++)
+    {
+        struct hash_worker *worker = &workers[i];
+        if(worker->fd == -1 || worker->busy)
+            continue;
+
+        struct hash_entry *entry = NULL;
+        hc_t *hc;
+        LIST_FOREACH(hc, &client_head, link)
+        {
+            struct hash_entry *next;
+            for(entry = TAILQ_FIRST(&hc->hash_queue_head); entry;
+                    entry = next)
             {
-                hc_close_connection(hc);
-                return;
+                next = TAILQ_NEXT(entry, link);
+
+                if(entry->segments == NULL && hash_entry_start(entry) != 0)
+                {
+                    if(hc_send_fail_hash(hc, entry->filename) != 0)
+                    {
+                        hc_close_connection(hc);
+                        return;
+                    }
+                    hash_entry_remove(hc, entry);
+                    continue;
+                }
+
+                if(entry->next_segment < entry->nsegments)
+                    break;
             }
+            if(entry)
+                break;
+        }
 
-            hc_pop_current(hc);
+        if(entry == NULL)
+        {
+            DEBUG("no more unhashed files");
             return;
         }
 
-        size = sb.st_size;
+        uint64_t offset = entry->next_segment * entry->segsize;
+        uint64_t length = entry->segsize;
+        if(offset + length > entry->size)
+            length = entry->size - offset;
+
+        worker->busy = true;
+        worker->entry = entry;
+        worker->segment = entry->next_segment++;
+        hash_worker_send(worker, "segment$%"PRIu64"$%"PRIu64"$%u$%s|",
+                offset, length, entry->leafsize, entry->filename);
+    }
+}
 
-        tt_init(&hc->tth, tt_calc_block_size(sb.st_size, 10));
+static void hash_fail_entry(struct hash_entry *entry)
+{
+    hc_t *hc = entry->hc;
+    if(hc_send_fail_hash(hc, entry->filename) != 0)
+    {
+        hc_close_connection(hc);
+        return;
     }
+    hash_entry_remove(hc, entry);
+}
 
-    return_if_fail(hc->current_fd != -1);
-    return_if_fail(hc->current_entry);
+static int hash_worker_segment_done(void *user_data, int argc, char **argv)
+{
+    struct hash_worker *worker = user_data;
+    struct hash_entry *entry = worker->entry;
 
-    static unsigned char buf[HASHER_BUFSIZ];
+    worker->busy = false;
+    worker->entry = NULL;
+    if(entry == NULL)
+    {
+        /* aborted */
+        return 0;
+    }
 
-    ssize_t len = read(hc->current_fd, buf, HASHER_BUFSIZ);
-    if(len > 0)
+    struct hash_segment *seg = &entry->segments[worker->segment];
+    unsigned char *root = base32_decode(argv[0], NULL);
+    size_t maxlen = strlen(argv[1]);
+    seg->leaves = malloc(maxlen);
+    int len = base64_pton(argv[1], seg->leaves, maxlen);
+    if(root == NULL || len <= 0)
     {
-        tt_update(&hc->tth, buf, len);
+        WARNING("invalid segment hash from worker");
+        free(root);
+        hash_fail_entry(entry);
+        return 0;
     }
-    else
+    memcpy(seg->root, root, TIGERSIZE);
+    free(root);
+    seg->leaves_len = len;
+
+    if(++entry->segments_done == entry->nsegments)
+    {
+        hash_entry_finish(entry);
+        hash_entry_remove(entry->hc, entry);
+    }
+
+    return 0;
+}
+
+static int hash_worker_segment_failed(void *user_data, int argc, char **argv)
+{
+    struct hash_worker *worker = user_data;
+    struct hash_entry *entry = worker->entry;
+
+    worker->busy = false;
+    worker->entry = NULL;
+    if(entry)
+        hash_fail_entry(entry);
+
+    return 0;
+}
+
+#include "hash_worker_cmd_table.h"
+
+static void hash_worker_in_event(struct bufferevent *bufev, void *data)
+{
+    struct hash_worker *worker = data;
+
+    while(1)
     {
-        if(len < 0)
+        char *cmd = io_line_reader_next(&worker->reader,
+                EVBUFFER_INPUT(bufev));
+        if(cmd == NULL)
         {
-            WARNING("read(fd = %i): %s", hc->current_fd, strerror(errno));
+            break;
+        }
+        print_command(SP_TRACE_HASHD, cmd, "<- (worker fd %d)", worker->fd);
+        cmd_dispatch(cmd, "$", 1, &hash_worker_cmds, worker);
+    }
 
-            /* unreadable?, disable the file */
-            if(hc_send_fail_hash(hc, hc->current_entry->filename) != 0)
-            {
-                hc_close_connection(hc);
-                return;
-            }
+    hash_dispatch();
+}
+
+static void hash_worker_out_event(struct bufferevent *bufev, void *data)
+{
+}
+
+static void hash_worker_err_event(struct bufferevent *bufev, short why,
+        void *data)
+{
+    struct hash_worker *worker = data;
+
+    WARNING("lost hash worker %d, why = 0x%02X", (int)worker->pid, why);
+
+    bufferevent_free(worker->bufev);
+    worker->bufev = NULL;
+    close(worker->fd);
+    worker->fd = -1;
+    waitpid(worker->pid, NULL, WNOHANG);
+
+    /* The segment might be what killed the worker, don't retry it. The
+     * worker is not respawned as it would inherit client connections. */
+    if(worker->entry)
+    {
+        struct hash_entry *entry = worker->entry;
+        worker->entry = NULL;
+        hash_fail_entry(entry);
+    }
+    worker->busy = false;
+
+    int i;
+    for(i = 0; i < num_workers; i++)
+    {
+        if(workers[i].fd != -1)
+        {
+            hash_dispatch();
+            return;
+        }
+    }
+
+    WARNING("no hash workers left");
+    shutdown_sphashd_event(0, EV_SIGNAL, NULL);
+}
+
+/* Forks the worker processes. Must be called before event_init so the
+ * workers get their own event base.
+ */
+static int hash_start_workers(int n)
+{
+    int i;
+    for(i = 0; i < n; i++)
+    {
+        int fds[2];
+        if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+        {
+            WARNING("socketpair: %s", strerror(errno));
+            break;
         }
-        else /* len == 0 */
+
+        pid_t pid = fork();
+        if(pid == -1)
         {
-            DEBUG("finished hashing %s", hc->current_entry->filename);
-
-            struct timeval end;
-            gettimeofday(&end, NULL);
-            double e = end.tv_sec + (double)end.tv_usec / 1000000;
-            double s = start.tv_sec + (double)start.tv_usec / 1000000;
-            double d = e - s;
-            double Mps = ((double)size / (1024*1024)) / d;
-            DEBUG("Hashing speed: %.1lf MiB/s", Mps);
-
-            tt_digest(&hc->tth, NULL);
-            char *hash_base32 = tt_base32(&hc->tth);
-            char *leaves_base64 = tt_leafdata_base64(&hc->tth);
-            hc_send_add_hash(hc, hc->current_entry->filename,
-                    hash_base32, leaves_base64, Mps);
-            free(leaves_base64);
-            free(hash_base32);
+            WARNING("fork: %s", strerror(errno));
+            close(fds[0]);
+            close(fds[1]);
+            break;
+        }
+
+        if(pid == 0)
+        {
+            /* child */
+            int j;
+            for(j = 0; j < num_workers; j++)
+                close(workers[j].fd);
+            close(fds[0]);
+            worker_main(fds[1]);
         }
 
-        hc_pop_current(hc);
+        close(fds[1]);
+        workers[num_workers].pid = pid;
+        workers[num_workers].fd = fds[0];
+        num_workers++;
+    }
+
+    INFO("started %d hash worker%s", num_workers, num_workers == 1 ? "" : "s");
+
+    return num_workers > 0 ? 0 : -1;
+}
+
+/* sets up the event handlers for the workers, after event_init */
+static void hash_add_workers(void)
+{
+    int i;
+    for(i = 0; i < num_workers; i++)
+    {
+        struct hash_worker *worker = &workers[i];
+        io_set_blocking(worker->fd, 0);
+        worker->bufev = bufferevent_new(worker->fd, hash_worker_in_event,
+                hash_worker_out_event, hash_worker_err_event, worker);
+        bufferevent_enable(worker->bufev, EV_READ | EV_WRITE);
     }
 }
 
@@ -214,8 +642,11 @@ int hc_cb_add(hc_t *hc, const char *filename)
     DEBUG("adding filename [%s]", filename);
     entry = calloc(1, sizeof(struct hash_entry));
     entry->filename = strdup(filename);
+    entry->hc = hc;
     TAILQ_INSERT_TAIL(&hc->hash_queue_head, entry, link);
 
+    hash_dispatch();
+
     return 0;
 }
 
@@ -230,15 +661,12 @@ static void hc_free_hash_queue(hc_t *hc)
     struct hash_entry *entry;
     while((entry = TAILQ_FIRST(&hc->hash_queue_head)) != NULL)
     {
-        TAILQ_REMOVE(&hc->hash_queue_head, entry, link);
-        free(entry->filename);
-        free(entry);
+        hash_entry_remove(hc, entry);
     }
 }
 
 int hc_cb_abort(hc_t *hc)
 {
-    hc_pop_current(hc);
     hc_free_hash_queue(hc);
 
     return 0;
@@ -247,6 +675,14 @@ int hc_cb_abort(hc_t *hc)
 int hc_cb_set_delay(hc_t *hc, unsigned int delay)
 {
     global_delay = delay;
+
+    int i;
+    for(i = 0; i < num_workers; i++)
+    {
+        if(workers[i].fd != -1)
+            hash_worker_send(&workers[i], "set-delay$%u|", delay);
+    }
+
     return 0;
 }
 
@@ -254,7 +690,7 @@ void hc_free(hc_t *hc)
 {
     if(hc)
     {
-        hc_pop_current(hc);
+        LIST_REMOVE(hc, link);
         hc_free_hash_queue(hc);
         free(hc);
     }
@@ -287,14 +723,13 @@ static void hc_in_event(struct bufferevent *bufev, void *data)
 
     while(1)
     {
-        char *cmd = io_evbuffer_readline(EVBUFFER_INPUT(bufev));
+        char *cmd = io_line_reader_next(&hc->reader, EVBUFFER_INPUT(bufev));
         if(cmd == NULL)
         {
             break;
         }
-        print_command(cmd, "<- (fd %d)", hc->fd);
+        print_command(SP_TRACE_HASHD, cmd, "<- (fd %d)", hc->fd);
         hc_dispatch_command(cmd, "$", 1, hc);
-        free(cmd);
     }
 }
 
@@ -325,7 +760,6 @@ void hash_accept_connection(int fd, short condition, void *data)
 
     hc_t *hc = hc_init();
     hc->fd = afd;
-    hc->current_fd = -1;
     TAILQ_INIT(&hc->hash_queue_head);
 
     /* setup callbacks */
@@ -345,8 +779,9 @@ void hash_accept_connection(int fd, short condition, void *data)
 int main(int argc, char **argv)
 {
     const char *debug_level = "message";
+    int nworkers = sysconf(_SC_NPROCESSORS_ONLN);
     int c;
-    while ((c = getopt(argc, argv, "w:d:")) != EOF) {
+    while ((c = getopt(argc, argv, "w:d:j:")) != EOF) {
         switch (c) {
             case 'w':
                 working_directory = verify_working_directory(optarg);
@@ -354,6 +789,9 @@ int main(int argc, char **argv)
             case 'd':
                 debug_level = optarg;
                 break;
+            case 'j':
+                nworkers = atoi(optarg);
+                break;
             case '?':
             default:
                 /* skip unknown options */
@@ -361,6 +799,11 @@ int main(int argc, char **argv)
         }
     }
 
+    if (nworkers < 1)
+        nworkers = 1;
+    if (nworkers > HASHER_MAX_WORKERS)
+        nworkers = HASHER_MAX_WORKERS;
+
     if (working_directory == NULL) {
         working_directory = get_working_directory();
     }
@@ -371,13 +814,23 @@ int main(int argc, char **argv)
     sp_daemonize();
     sp_write_pid(working_directory, "sphashd");
 
+    /* set lower priority, inherited by the workers */
+    if (setpriority(PRIO_PROCESS, 0 /* current process */, 10) != 0)
+        WARNING("setpriority: %s (ignored)", strerror(errno));
+
+    if (hash_start_workers(nworkers) != 0)
+        return 1;
+
     event_init();
+    sp_trace_init();
 
     /* install signal handlers */
     struct event sigterm_event;
     signal_set(&sigterm_event, SIGTERM, shutdown_sphashd_event, NULL);
     signal_add(&sigterm_event, NULL);
 
+    hash_add_workers();
+
     /* create a socket for sphubd connections */
     int num_returned_bytes = asprintf(&socket_filename, "%s/sphashd", working_directory);
     if (num_returned_bytes == -1)
@@ -391,33 +844,8 @@ int main(int argc, char **argv)
     event_set(&ev, fd, EV_READ|EV_PERSIST, hash_accept_connection, NULL);
     event_add(&ev, NULL);
 
-    /* set lower priority */
-    if (setpriority(PRIO_PROCESS, 0 /* current process */, 10) != 0)
-        WARNING("setpriority: %s (ignored)", strerror(errno));
-
     DEBUG("starting main loop");
-    while(1) {
-        event_loop(EVLOOP_NONBLOCK);
-
-        /* loop through all client connections and see if we have something to do */
-        int block = 1;
-        hc_t *hc;
-        LIST_FOREACH(hc, &client_head, link) {
-            if (hc->current_fd != -1 || TAILQ_FIRST(&hc->hash_queue_head)) {
-                share_hasher(hc);
-                block = 0;
-            }
-        }
-
-        if (block) {
-            /* nothing to do, block for one event */
-            DEBUG("blocking for next event");
-            event_loop(EVLOOP_ONCE);
-        }
-        else if(global_delay)
-            usleep(global_delay);
-    }
-    
+    event_dispatch();
     DEBUG("main loop finished");
 
     return 0;
@@ -4,10 +4,27 @@
 #include "sphashd_cmd.h"
 #include "sphashd_send.h"
 
+struct hash_segment
+{
+    unsigned char root[TIGERSIZE];
+    void *leaves;
+    unsigned leaves_len;
+};
+
 struct hash_entry
 {
     TAILQ_ENTRY(hash_entry) link;
     char *filename;
+    hc_t *hc;
+    struct timeval start;
+
+    uint64_t size;
+    unsigned leafsize;
+    uint64_t segsize;
+    unsigned nsegments;
+    unsigned next_segment;   /* next segment to hand out to a worker */
+    unsigned segments_done;
+    struct hash_segment *segments; /* NULL until the file is started */
 };
 
 int hc_send_command(hc_t *hc, const char *fmt, ...)
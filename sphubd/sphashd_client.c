@@ -41,7 +41,7 @@ static int got_new_files = 1;
 
 int hs_send_string(hs_t *hs, const char *string)
 {
-    print_command(string, "-> (fd %i)", hs->fd);
+    print_command(SP_TRACE_HASHD, string, "-> (fd %i)", hs->fd);
     return bufferevent_write(hs->bufev, (void *)string, strlen(string));
 }
 
@@ -73,11 +73,7 @@ static void hs_finish_file(hs_t *hs, const char *filename,
     share_file_t *file = NULL;
     SLIST_FOREACH(file, hs->unfinished_list, link)
     {
-	char *local_path = share_complete_path(file);
-	int rc = strcmp(filename, local_path);
-	free(local_path);
-
-	if(rc == 0)
+	if(share_file_is_at(file, filename))
             break;
     }
 
@@ -90,7 +86,7 @@ static void hs_finish_file(hs_t *hs, const char *filename,
         SLIST_REMOVE(hs->unfinished_list, file, share_file, link);
 
 	nc_send_tth_available_notification(nc_default(),
-	    file, hash_base32, leaves_base64, mibs_per_sec);
+	    file, filename, hash_base32, leaves_base64, mibs_per_sec);
     }
 
     if(SLIST_FIRST(hs->unfinished_list) == NULL && !hs->paused)
@@ -153,14 +149,13 @@ static void hs_in_event(struct bufferevent *bufev, void *data)
 
     while(1)
     {
-        char *cmd = io_evbuffer_readline(EVBUFFER_INPUT(bufev));
+        char *cmd = io_line_reader_next(&hs->reader, EVBUFFER_INPUT(bufev));
         if(cmd == NULL)
         {
             break;
         }
-        print_command(cmd, "<- (fd %d)", hs->fd);
+        print_command(SP_TRACE_HASHD, cmd, "<- (fd %d)", hs->fd);
         hs_dispatch_command(cmd, "$", 1, hs);
-        free(cmd);
     }
 }
 
@@ -298,6 +293,44 @@ static void hs_handle_did_remove_share_notification(
 	}
 }
 
+static void hs_handle_share_changed_notification(
+        nc_t *nc,
+        const char *channel,
+        nc_share_changed_t *notification,
+        void *user_data)
+{
+	return_if_fail(global_hash_server);
+
+	/* files may have been added to a watched share */
+	if(!global_hash_server->paused)
+		hs_start_hash_feeder();
+}
+
+static void hs_handle_will_remove_file_notification(
+        nc_t *nc,
+        const char *channel,
+        nc_will_remove_file_t *notification,
+        void *user_data)
+{
+	return_if_fail(global_hash_server);
+
+	/* Forget the file if it is being hashed. The hash of it is ignored
+	 * when it arrives. */
+	share_file_t *file;
+	if(global_hash_server->unfinished_list)
+	{
+		SLIST_FOREACH(file, global_hash_server->unfinished_list, link)
+		{
+			if(file == notification->file)
+			{
+				SLIST_REMOVE(global_hash_server->unfinished_list,
+					file, share_file, link);
+				break;
+			}
+		}
+	}
+}
+
 int hs_start(void)
 {
     char *sphashd_socket_filename = 0;
@@ -341,6 +374,10 @@ int hs_start(void)
             hs_handle_will_remove_share_notification, NULL);
     nc_add_did_remove_share_observer(nc_default(),
             hs_handle_did_remove_share_notification, NULL);
+    nc_add_share_changed_observer(nc_default(),
+            hs_handle_share_changed_notification, NULL);
+    nc_add_will_remove_file_observer(nc_default(),
+            hs_handle_will_remove_file_notification, NULL);
 
     hs_set_prio(global_hash_prio);
 
@@ -33,10 +33,12 @@
 #include "client.h"
 #include "globals.h"
 #include "hub.h"
+#include "move.h"
 #include "notifications.h"
 #include "queue.h"
 #include "queue_match.h"
 #include "search_listener.h"
+#include "search_reply.h"
 #include "share.h"
 #include "sphashd_client.h"
 #include "sphubd.h"
@@ -143,6 +145,15 @@ void download_trigger(int fd, short why, void *data)
     evtimer_add(data, &tv);
 }
 
+/* Picks up the new TTH snapshot when a background compaction is done. */
+static void tth_compaction_check(int fd, short why, void *data)
+{
+    tth_store_check_compaction(global_tth_store);
+
+    struct timeval tv = {.tv_sec = 10, .tv_usec = 0};
+    evtimer_add(data, &tv);
+}
+
 /* Start (or restart) the client listener on the given port. Returns 0 on
  * success, or -1 on failure. Specify port == 0 to close client listener.
  */
@@ -265,46 +276,45 @@ void shutdown_sphubd(void)
     event_loopexit(NULL);
 }
 
-static void handle_download_finished_notification(nc_t *nc, const char *channel,
-        nc_download_finished_t *notification, void *user_data)
+/* Moves a completed download to the download directory. Returns 0 if the
+ * move is started, in which case the UI is told the download is finished
+ * when it is done. */
+static int move_download(const char *filename)
 {
-    return_if_fail(notification);
-    return_if_fail(notification->filename);
-
     if(global_incomplete_directory == 0 || global_download_directory == 0)
     {
         /* strange? */
-        return;
+        return -1;
     }
 
     if(strcmp(global_incomplete_directory, global_download_directory) == 0)
     {
         /* same directory */
-        return;
+        return -1;
     }
 
     if(access(global_download_directory, F_OK) != 0)
     {
         WARNING("Download directory doesn't exist, won't move complete file");
-        return;
+        return -1;
     }
 
-    queue_target_t *qt = queue_lookup_target(notification->filename);
-    return_if_fail(qt);
+    queue_target_t *qt = queue_lookup_target(filename);
+    return_val_if_fail(qt, -1);
 
     queue_directory_t *qd = NULL;
     if(qt->target_directory)
     {
         /* this target belongs to a directory download */
         qd = queue_db_lookup_directory(qt->target_directory);
-        return_if_fail(qd);
+        return_val_if_fail(qd, -1);
         if(qd->nleft > 1 && !global_move_partial_directories)
         {
             /* There are more than this file left in the directory, and we
              * don't want to move partial directories. */
             DEBUG("skipping moving partial directory [%s]",
                     qd->target_directory);
-            return;
+            return -1;
         }
     }
 
@@ -314,10 +324,10 @@ static void handle_download_finished_notification(nc_t *nc, const char *channel,
 
     if(global_move_partial_directories || qd == NULL)
     {
-        num_returned_bytes = asprintf(&source, "%s/%s", global_incomplete_directory, notification->filename);
+        num_returned_bytes = asprintf(&source, "%s/%s", global_incomplete_directory, filename);
         if (num_returned_bytes == -1)
             DEBUG("asprintf did not return anything");
-        num_returned_bytes = asprintf(&target, "%s/%s", global_download_directory, notification->filename);
+        num_returned_bytes = asprintf(&target, "%s/%s", global_download_directory, filename);
         if (num_returned_bytes == -1)
             DEBUG("asprintf did not return anything");
 
@@ -331,7 +341,7 @@ static void handle_download_finished_notification(nc_t *nc, const char *channel,
     }
     else
     {
-        return_if_fail(qd->nleft == 1);
+        return_val_if_fail(qd->nleft == 1, -1);
         num_returned_bytes = asprintf(&source, "%s/%s", global_incomplete_directory, qd->target_directory);
         if (num_returned_bytes == -1)
             DEBUG("asprintf did not return anything");
@@ -342,35 +352,33 @@ static void handle_download_finished_notification(nc_t *nc, const char *channel,
 
     DEBUG("moving [%s] to download directory [%s]", source, target);
 
-    /* FIXME: using rename() to move the file assumes the incomplete and
-     * download directory reside on the same device.
-     */
-    if(rename(source, target) != 0)
+    /* When the directory is complete, remove the (filesystem) directory
+     * in the incomplete directory. Moves to another filesystem finish in
+     * the background. */
+    char *root = NULL;
+    if(qd && qd->nleft == 1 && global_move_partial_directories)
     {
-        ui_send_status_message(NULL, NULL, "Unable to move file %s: %s",
-                source, strerror(errno));
-    }
-    else
-    {
-        if(qd && qd->nleft == 1 && global_move_partial_directories)
-        {
-            /* the directory is complete, remove the (filesystem) directory */
-            char *target_directory;
-            num_returned_bytes = asprintf(&target_directory, "%s/%s", global_incomplete_directory, qd->target_directory);
-            if (num_returned_bytes == -1)
-                DEBUG("asprintf did not return anything");
-            if(rmdir(target_directory) != 0)
-            {
-                ui_send_status_message(NULL, NULL,
-                        "Unable to remove directory %s: %s",
-                        target_directory, strerror(errno));
-            }
-            free(target_directory);
-        }
+        num_returned_bytes = asprintf(&root, "%s/%s", global_incomplete_directory, qd->target_directory);
+        if (num_returned_bytes == -1)
+            DEBUG("asprintf did not return anything");
     }
+    int rc = move_start(source, target, root, filename);
 
+    free(root);
     free(target);
     free(source);
+
+    return rc;
+}
+
+static void handle_download_finished_notification(nc_t *nc, const char *channel,
+        nc_download_finished_t *notification, void *user_data)
+{
+    return_if_fail(notification);
+    return_if_fail(notification->filename);
+
+    if(move_download(notification->filename) != 0)
+        ui_send_download_finished(NULL, notification->filename);
 }
 
 void schedule_init(void)
@@ -399,10 +407,12 @@ void init(int fd, short why, void *data)
     case 2:
 	/* FIXME: this is a possibly long operation! */
 	tth_store_init();
+	share_snapshot_load(global_share);
 	break;
 
     case 3:
 	queue_init();
+	move_init();
 	break;
 
     case 4:
@@ -513,6 +523,7 @@ int main(int argc, char **argv)
     evdns_init();
     /* need two priorities */
     event_priority_init(2);
+    sp_trace_init();
     INFO("using libevent version %s, method %s",
             event_get_version(), event_get_method());
 
@@ -587,6 +598,12 @@ int main(int argc, char **argv)
     struct timeval tv = {.tv_sec = 1, .tv_usec = 0};
     evtimer_add(&download_trigger_event, &tv);
 
+    struct event tth_compaction_event;
+    evtimer_set(&tth_compaction_event, tth_compaction_check,
+            &tth_compaction_event);
+    tv.tv_sec = 10;
+    evtimer_add(&tth_compaction_event, &tv);
+
     DEBUG("starting main loop");
     event_dispatch();
 
@@ -603,6 +620,9 @@ int main(int argc, char **argv)
     ui_close_all_connections();
     cc_close_all_connections();
     hub_close_all_connections();
+    search_reply_close();
+    share_snapshot_save(global_share);
+    move_close();
     hs_shutdown();
     tth_store_close();
     queue_close();
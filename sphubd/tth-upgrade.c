@@ -14,26 +14,19 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
-#include <assert.h>
-#include <sys/types.h>
-#include <fcntl.h>
-#include <limits.h>
-#include <db.h>
-#include <errno.h>
+/* Converts the text TTH database (tth2.db) to a binary snapshot (tth3.db).
+ * sphubd does this in the background on startup; this does it up front.
+ */
+
 #include <stdio.h>
-#include <string.h>
 #include <stdlib.h>
+#include <inttypes.h>
 
 #include "globals.h"
 #include "tthdb.h"
 #include "log.h"
-#include "xstr.h"
-#include "dbenv.h"
 #include "util.h"
 
-extern DB *tth_db;
-extern DB *tth_inode_db;
-
 int main(int argc, char **argv)
 {
     if(argc > 1)
@@ -42,78 +35,26 @@ int main(int argc, char **argv)
         global_working_directory = get_working_directory();
 
     printf("\nThis may take a while. Please be patient.\n\n");
-    sleep(3);
 
-    sp_log_set_level("debug");
+    sp_log_set_level("warning");
 
-    tthdb_open();
-    if(tth_db == NULL)
+    tth_store_init();
+    struct tth_store *store = global_tth_store;
+    if(store == NULL)
         return 2;
 
-    db_checkpoint();
-
-    g_message("Upgrading TTH database...");
-    bool modified;
-
-    do
+    /* tth_store_init may already have started the conversion */
+    if(tth_store_compact(store) != 0)
     {
-	modified = false;
-
-	/* create a cursor */
-	DBC *cursor;
-	tth_inode_db->cursor(tth_inode_db, NULL, &cursor, 0);
-
-	int rc = -1;
-	while(cursor)
-	{
-	    DBT key;
-	    DBT val;
-
-	    memset(&key, 0, sizeof(DBT));
-	    memset(&val, 0, sizeof(DBT));
+        printf("Failed to convert the TTH database\n");
+        tth_store_close();
+        return 1;
+    }
 
-	    rc = cursor->c_get(cursor, &key, &val, DB_NEXT);
-	    if(rc != 0)
-		break;
+    printf("Converted TTH database: %"PRIu64" TTHs, %"PRIu64" inodes\n",
+        store->nentries, store->ninodes);
 
-	    uint64_t inode = *(uint64_t *)key.data;
-	    tth_inode_t *ti = val.data;
-
-	    struct tthdb_data *d = tthdb_lookup(ti->tth);
-	    if(d == NULL || d->inode != inode)
-	    {
-		printf("No TTH found for inode %llu -- removing inode\n", inode);
-		tthdb_remove_inode(inode);
-		modified = true;
-		continue;
-	    }
-
-	    uint64_t new_inode = (uint64_t)(((uint64_t)d->size << 32) | (inode & 0xFFFFFFFF));
-	    if(d->inode != new_inode)
-	    {
-		printf("%s: inode %llu -> %llu\n", ti->tth, d->inode, new_inode);
-		d->inode = new_inode;
-		tthdb_update(ti->tth, d);
-		modified = true;
-	    }
-	}
-
-	if(rc == -1)
-	{
-	    printf("Failed: %s\n", strerror(errno));
-	}
-
-	if(cursor)
-	{
-	    cursor->c_close(cursor);
-	}
-    } while(modified);
-
-    db_checkpoint();
-
-    tthdb_close();
-    close_default_db_environment();
+    tth_store_close();
 
     return 0;
 }
-
@@ -15,14 +15,21 @@
  */
 
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <inttypes.h>
+#include <unistd.h>
 
 #include "tthdb.h"
 #include "base64.h"
@@ -31,29 +38,147 @@
 #include "compat.h"
 #include "xstr.h"
 
-int tth_entry_cmp(struct tth_entry *a, struct tth_entry *b)
+/* start compacting the journal into a new snapshot when it grows past this */
+#define TTH_JOURNAL_COMPACT_SIZE 16*1024*1024
+
+/*
+ * hash tables
+ */
+
+static uint32_t tth_entry_hash(const void *record)
 {
-	return strcmp(a->tth, b->tth);
+	return tth_hash(&((const struct tth_entry *)record)->tth);
 }
 
-int tth_inode_cmp(struct tth_inode *a, struct tth_inode *b)
+static uint32_t tth_inode_hash_value(uint64_t inode)
 {
-	/* This used to be:
-	 *  return b->inode - a->inode;
-	 * That doesn't work! The return type is int, so the return value
-	 * gets truncated if both a and b is large enough and only differs
-	 * in the higher 32 bits.
-	 */
+	/* inodes are mostly sequential, spread them out */
+	return (inode * 0x9E3779B97F4A7C15ULL) >> 32;
+}
 
-	if(a->inode < b->inode)
-		return -1;
-	if(a->inode > b->inode)
-		return 1;
-	return 0;
+static uint32_t tth_inode_hash(const void *record)
+{
+	return tth_inode_hash_value(((const struct tth_inode *)record)->inode);
+}
+
+static void tth_table_init(struct tth_table *t,
+	uint32_t (*hash)(const void *record), uint64_t nrecords)
+{
+	uint64_t size = 64;
+	while(size < nrecords * 2)
+		size *= 2;
+
+	t->slots = calloc(size, sizeof(void *));
+	t->mask = size - 1;
+	t->count = 0;
+	t->hash = hash;
+}
+
+static void tth_table_insert(struct tth_table *t, void *record);
+
+static void tth_table_grow(struct tth_table *t)
+{
+	void **slots = t->slots;
+	uint64_t i, size = t->mask + 1;
+
+	tth_table_init(t, t->hash, size);
+	for(i = 0; i < size; i++)
+		if(slots[i])
+			tth_table_insert(t, slots[i]);
+	free(slots);
+}
+
+static void tth_table_insert(struct tth_table *t, void *record)
+{
+	/* keep the load factor at most 1/2 */
+	if((t->count + 1) * 2 > t->mask + 1)
+		tth_table_grow(t);
+
+	uint64_t i = t->hash(record) & t->mask;
+	while(t->slots[i])
+		i = (i + 1) & t->mask;
+	t->slots[i] = record;
+	t->count++;
+}
+
+static void tth_table_remove(struct tth_table *t, void *record)
+{
+	uint64_t i = t->hash(record) & t->mask;
+	while(t->slots[i] != record)
+	{
+		if(t->slots[i] == NULL)
+			return;
+		i = (i + 1) & t->mask;
+	}
+
+	/* Close the hole by moving back later records of the cluster that
+	 * can't be found past it. */
+	uint64_t j = i;
+	for(;;)
+	{
+		t->slots[i] = NULL;
+		for(;;)
+		{
+			j = (j + 1) & t->mask;
+			if(t->slots[j] == NULL)
+			{
+				t->count--;
+				return;
+			}
+			uint64_t k = t->hash(t->slots[j]) & t->mask;
+			/* does the home slot k lie cyclically in (i, j] ? */
+			if(i <= j ? (i < k && k <= j) : (i < k || k <= j))
+				continue;
+			break;
+		}
+		t->slots[i] = t->slots[j];
+		i = j;
+	}
+}
+
+static struct tth_entry *tth_table_lookup_entry(struct tth_table *t,
+	const tth_t *tth)
+{
+	uint64_t i = tth_hash(tth) & t->mask;
+	struct tth_entry *te;
+	while((te = t->slots[i]) != NULL)
+	{
+		if(tth_equal(&te->tth, tth))
+			return te;
+		i = (i + 1) & t->mask;
+	}
+	return NULL;
+}
+
+static struct tth_inode *tth_table_lookup_inode(struct tth_table *t,
+	uint64_t inode)
+{
+	uint64_t i = tth_inode_hash_value(inode) & t->mask;
+	struct tth_inode *ti;
+	while((ti = t->slots[i]) != NULL)
+	{
+		if(ti->inode == inode)
+			return ti;
+		i = (i + 1) & t->mask;
+	}
+	return NULL;
+}
+
+static bool tth_is_snapshot_entry(struct tth_store *store,
+	const struct tth_entry *te)
+{
+	return te >= store->entries && te < store->entries + store->nentries;
+}
+
+static bool tth_is_snapshot_inode(struct tth_store *store,
+	const struct tth_inode *ti)
+{
+	return ti >= store->inodes && ti < store->inodes + store->ninodes;
 }
 
-RB_GENERATE(tth_entries_head, tth_entry, link, tth_entry_cmp);
-RB_GENERATE(tth_inodes_head, tth_inode, link, tth_inode_cmp);
+/*
+ * loading the journal
+ */
 
 static void tth_parse_add_tth(struct tth_store *store,
 	char *buf, size_t len, off_t offset)
@@ -74,8 +199,11 @@ static void tth_parse_add_tth(struct tth_store *store,
 		 * we easily can retrieve it when needed.
 		 */
 
-		buf[39] = 0;
-		tth_store_add_entry(store, buf, NULL, offset);
+		tth_t tth;
+		if(tth_from_base32(&tth, buf) != 0)
+			WARNING("invalid tth on line %u", store->line_number);
+		else
+			tth_store_add_entry(store, &tth, NULL, offset);
 	}
 }
 
@@ -88,20 +216,27 @@ static void tth_parse_add_inode(struct tth_store *store, char *buf, size_t len)
 
 	uint64_t inode;
 	unsigned long mtime;
-	char tth[40];
+	char tth_base32[40];
+	tth_t tth;
 
-	int rc = sscanf(buf, "%"PRIX64":%lX:%s", &inode, &mtime, tth);
-	if(rc != 3 || inode == 0 || mtime == 0 || tth[39] != 0)
+	int rc = sscanf(buf, "%"PRIX64":%lX:%39s", &inode, &mtime, tth_base32);
+	if(rc != 3 || inode == 0 || mtime == 0 ||
+	    tth_from_base32(&tth, tth_base32) != 0)
 		WARNING("failed to load inode on line %u", store->line_number);
 	else
-		tth_store_add_inode(store, inode, mtime, tth);
+		tth_store_add_inode(store, inode, mtime, &tth);
 }
 
 static void tth_parse_remove_tth(struct tth_store *store, char *buf, size_t len)
 {
 	buf += 3; /* skip past "-T:" */
 
-	tth_store_remove(store, buf);
+	tth_t tth;
+	if(tth_from_base32(&tth, buf) != 0)
+		WARNING("failed to load TTH remove on line %u",
+			store->line_number);
+	else
+		tth_store_remove(store, &tth);
 }
 
 static void tth_parse_remove_inode(struct tth_store *store, char *buf, size_t len)
@@ -188,7 +323,86 @@ static void tth_parse(struct tth_store *store)
 	store->loading = false;
 }
 
-static struct tth_store *tth_load(const char *filename)
+
+/* Maps the snapshot file, if there is one. A missing or invalid snapshot
+ * leaves the store empty; the files are hashed again in that case.
+ */
+static void tth_map_snapshot(struct tth_store *store)
+{
+	int fd = open(store->snapshot_filename, O_RDONLY);
+	if(fd == -1)
+	{
+		if(errno != ENOENT)
+			WARNING("%s: %s", store->snapshot_filename,
+			    strerror(errno));
+		return;
+	}
+
+	struct stat sb;
+	if(fstat(fd, &sb) != 0 ||
+	    sb.st_size < sizeof(struct tth_snapshot_header))
+	{
+		WARNING("%s: truncated snapshot, ignored",
+		    store->snapshot_filename);
+		close(fd);
+		return;
+	}
+
+	void *map = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED)
+	{
+		WARNING("%s: mmap: %s", store->snapshot_filename,
+		    strerror(errno));
+		return;
+	}
+
+	struct tth_snapshot_header *hdr = map;
+	uint64_t size = sb.st_size;
+	int rc = -1;
+
+	store->map = map;
+	store->map_size = sb.st_size;
+
+	if(memcmp(hdr->magic, TTH_SNAPSHOT_MAGIC, 8) != 0 ||
+	    hdr->heap_offset + hdr->heap_size > size)
+		rc = -1;
+	else if(hdr->version == TTH_SNAPSHOT_VERSION &&
+	    hdr->record_size == sizeof(struct tth_entry) &&
+	    hdr->entries_offset + hdr->nentries * sizeof(struct tth_entry) <=
+	    size &&
+	    hdr->inodes_offset + hdr->ninodes * sizeof(struct tth_inode) <=
+	    size)
+	{
+		store->entries = (struct tth_entry *)((char *)map +
+		    hdr->entries_offset);
+		store->nentries = hdr->nentries;
+		store->inodes = (struct tth_inode *)((char *)map +
+		    hdr->inodes_offset);
+		store->ninodes = hdr->ninodes;
+		rc = 0;
+	}
+
+	if(rc != 0)
+	{
+		WARNING("%s: invalid snapshot, ignored",
+		    store->snapshot_filename);
+		munmap(map, sb.st_size);
+		store->map = NULL;
+		store->map_size = 0;
+		return;
+	}
+
+	store->heap = (const char *)map + hdr->heap_offset;
+	store->heap_size = hdr->heap_size;
+
+	INFO("mapped TTH snapshot [%s] (%"PRIu64" TTHs, %"PRIu64" inodes)",
+	    store->snapshot_filename, store->nentries, store->ninodes);
+}
+
+static struct tth_store *tth_load(const char *filename,
+	const char *snapshot_filename)
 {
 	FILE *fp = fopen(filename, "a+");
 	return_val_if_fail(fp, NULL);
@@ -196,28 +410,85 @@ static struct tth_store *tth_load(const char *filename)
 	struct tth_store *store = calloc(1, sizeof(struct tth_store));
 
 	store->filename = strdup(filename);
+	store->snapshot_filename = strdup(snapshot_filename);
 	store->fp = fp;
-	RB_INIT(&store->entries);
-	RB_INIT(&store->inodes);
+	LIST_INIT(&store->journal_entries);
+	LIST_INIT(&store->journal_inodes);
+
+	tth_map_snapshot(store);
+
+	uint64_t i;
+	tth_table_init(&store->entry_table, tth_entry_hash, store->nentries);
+	for(i = 0; i < store->nentries; i++)
+		tth_table_insert(&store->entry_table, &store->entries[i]);
+	tth_table_init(&store->inode_table, tth_inode_hash, store->ninodes);
+	for(i = 0; i < store->ninodes; i++)
+		tth_table_insert(&store->inode_table, &store->inodes[i]);
 
 	rewind(store->fp);
-	INFO("loading TTH store from [%s]", filename);
+	INFO("loading TTH journal from [%s]", filename);
 	tth_parse(store);
 
 	return store;
 }
 
+static void tth_free_store(struct tth_store *store)
+{
+	struct tth_journal_entry *je;
+	while((je = LIST_FIRST(&store->journal_entries)) != NULL)
+	{
+		LIST_REMOVE(je, link);
+		free(je->leafdata);
+		free(je);
+	}
+
+	struct tth_journal_inode *ji;
+	while((ji = LIST_FIRST(&store->journal_inodes)) != NULL)
+	{
+		LIST_REMOVE(ji, link);
+		free(ji);
+	}
+
+	free(store->entry_table.slots);
+	free(store->inode_table.slots);
+
+	if(store->map)
+		munmap(store->map, store->map_size);
+	if(store->fp)
+		fclose(store->fp);
+	free(store->filename);
+	free(store->snapshot_filename);
+	free(store);
+}
+
+static off_t tth_journal_size(struct tth_store *store)
+{
+	fflush(store->fp);
+	fseek(store->fp, 0, SEEK_END);
+	return ftell(store->fp);
+}
+
+static void tth_maybe_compact(struct tth_store *store);
+
 void tth_store_init(void)
 {
 	return_if_fail(global_working_directory);
 	return_if_fail(global_tth_store == NULL);
 
-	char *tth_store_filename;
+	char *tth_store_filename, *snapshot_filename;
 	int num_returned_bytes = asprintf(&tth_store_filename, "%s/tth2.db", global_working_directory);
 	if (num_returned_bytes == -1)
         DEBUG("asprintf did not return anything");
-	global_tth_store = tth_load(tth_store_filename);
+	num_returned_bytes = asprintf(&snapshot_filename, "%s/tth3.db", global_working_directory);
+	if (num_returned_bytes == -1)
+        DEBUG("asprintf did not return anything");
+	global_tth_store = tth_load(tth_store_filename, snapshot_filename);
 	free(tth_store_filename);
+	free(snapshot_filename);
+
+	/* converts a text database from previous versions */
+	if(global_tth_store)
+		tth_maybe_compact(global_tth_store);
 }
 
 static void tth_close_database(struct tth_store *store)
@@ -225,70 +496,119 @@ static void tth_close_database(struct tth_store *store)
 	INFO("closing TTH database");
 	return_if_fail(store);
 
-	fclose(store->fp);
-	free(store->filename);
-	free(store);
+	if(store->compact_pid)
+	{
+		/* the journal is still intact, try again next time */
+		kill(store->compact_pid, SIGTERM);
+		waitpid(store->compact_pid, NULL, 0);
+	}
+
+	tth_free_store(store);
 }
 
 void tth_store_close(void)
 {
 	tth_close_database(global_tth_store);
+	global_tth_store = NULL;
 }
 
+/*
+ * lookups
+ */
+
+struct tth_entry *tth_store_lookup(struct tth_store *store, const tth_t *tth)
+{
+	return_val_if_fail(store, NULL);
+	return_val_if_fail(tth, NULL);
+
+	return tth_table_lookup_entry(&store->entry_table, tth);
+}
+
+struct tth_inode *tth_store_lookup_inode(struct tth_store *store,
+	uint64_t inode)
+{
+	return_val_if_fail(store, NULL);
+
+	return tth_table_lookup_inode(&store->inode_table, inode);
+}
+
+struct tth_entry *tth_store_lookup_by_inode(struct tth_store *store,
+	uint64_t inode)
+{
+	struct tth_inode *ti = tth_store_lookup_inode(store, inode);
+	if(ti)
+		return tth_store_lookup(store, &ti->tth);
+	return NULL;
+}
+
+/*
+ * modifications, appended to the journal
+ */
+
 void tth_store_add_inode(struct tth_store *store,
-	 uint64_t inode, time_t mtime, const char *tth)
+	 uint64_t inode, time_t mtime, const tth_t *tth)
 {
 	return_if_fail(store);
 	return_if_fail(tth);
 
-	struct tth_inode *ti;
+	struct tth_inode *ti = tth_store_lookup_inode(store, inode);
+	if(ti && ti->mtime == mtime && tth_equal(&ti->tth, tth))
+		return; /* unchanged */
 
-	ti = tth_store_lookup_inode(store, inode);
-	if(ti == NULL)
+	if(ti == NULL || tth_is_snapshot_inode(store, ti))
 	{
-		ti = calloc(1, sizeof(struct tth_inode));
-		ti->inode = inode;
-		RB_INSERT(tth_inodes_head, &store->inodes, ti);
+		/* the journal replaces any snapshot record */
+		if(ti)
+		{
+			ti->flags |= TTH_REMOVED;
+			tth_table_remove(&store->inode_table, ti);
+		}
+
+		struct tth_journal_inode *ji =
+		    calloc(1, sizeof(struct tth_journal_inode));
+		ji->inode.inode = inode;
+		LIST_INSERT_HEAD(&store->journal_inodes, ji, link);
+		ti = &ji->inode;
+		tth_table_insert(&store->inode_table, ti);
 	}
 
-	if(ti->mtime != mtime || strcmp(ti->tth, tth) != 0)
-	{
-		ti->mtime = mtime;
-		strlcpy(ti->tth, tth, sizeof(ti->tth));
+	ti->mtime = mtime;
+	ti->tth = *tth;
 
-		if(!store->loading)
-		{
-			fprintf(store->fp, "+I:%"PRIX64":%lX:%s\n",
-				inode, (unsigned long)mtime, tth);
-		}
+	if(!store->loading)
+	{
+		char tth_base32[TTH_BASE32_LEN + 1];
+		fprintf(store->fp, "+I:%"PRIX64":%lX:%s\n",
+			inode, (unsigned long)mtime,
+			tth_to_base32(tth, tth_base32));
+		tth_maybe_compact(store);
 	}
 }
 
 void tth_store_add_entry(struct tth_store *store,
-	const char *tth, const char *leafdata_base64,
+	const tth_t *tth, const char *leafdata_base64,
 	off_t leafdata_offset)
 {
 	return_if_fail(store);
+	return_if_fail(tth);
 
-	struct tth_entry *te;
-
-	te = tth_store_lookup(store, tth);
+	if(tth_store_lookup(store, tth) != NULL)
+		return;
 
-	if(te == NULL)
-	{
-		te = calloc(1, sizeof(struct tth_entry));
-		strlcpy(te->tth, tth, sizeof(te->tth));
-		te->leafdata_offset = leafdata_offset;
+	struct tth_journal_entry *je = calloc(1, sizeof(struct tth_journal_entry));
+	je->entry.tth = *tth;
+	je->entry.leafdata_offset = leafdata_offset;
 
-		RB_INSERT(tth_entries_head, &store->entries, te);
-	}
+	LIST_INSERT_HEAD(&store->journal_entries, je, link);
+	tth_table_insert(&store->entry_table, &je->entry);
 
 	if(!store->loading)
 	{
 		return_if_fail(leafdata_base64);
 
+		char tth_base32[TTH_BASE32_LEN + 1];
 		int len = fprintf(store->fp, "+T:%s:%s\n",
-			tth, leafdata_base64);
+			tth_to_base32(tth, tth_base32), leafdata_base64);
 
 		/* Call ftell() _after_ we have written the +T line, because
 		 * the file is opened in append mode and we might have
@@ -296,28 +616,99 @@ void tth_store_add_entry(struct tth_store *store,
 		 * we get the correct offset.
 		 */
 		if(len > 0)
-			te->leafdata_offset = ftell(store->fp) - len;
+			je->entry.leafdata_offset = ftell(store->fp) - len;
+
+		tth_maybe_compact(store);
 	}
 }
 
-/* load the leafdata for the given TTH from the backend store */
-int tth_store_load_leafdata(struct tth_store *store, struct tth_entry *entry)
+void tth_store_remove(struct tth_store *store, const tth_t *tth)
 {
-	char *lbuf = NULL;
-	return_val_if_fail(store, -1);
-	return_val_if_fail(entry, -1);
+	return_if_fail(store);
+	return_if_fail(tth);
 
-	if(entry->leafdata)
-		return 0; /* already loaded */
+	struct tth_entry *te = tth_store_lookup(store, tth);
+	if(te == NULL)
+		return;
 
-	INFO("loading leafdata for tth [%s] at offset %llu",
-		entry->tth, entry->leafdata_offset);
+	tth_table_remove(&store->entry_table, te);
+	if(tth_is_snapshot_entry(store, te))
+		te->flags |= TTH_REMOVED;
+	else
+	{
+		struct tth_journal_entry *je = (struct tth_journal_entry *)
+		    ((char *)te - offsetof(struct tth_journal_entry, entry));
+		LIST_REMOVE(je, link);
+		free(je->leafdata);
+		free(je);
+	}
 
-	/* seek to the entry->leafdata_offset position in the backend store */
+	if(!store->loading)
+	{
+		char tth_base32[TTH_BASE32_LEN + 1];
+		fprintf(store->fp, "-T:%s\n", tth_to_base32(tth, tth_base32));
+	}
+}
+
+void tth_store_remove_inode(struct tth_store *store, uint64_t inode)
+{
+	return_if_fail(store);
+
+	struct tth_inode *ti = tth_store_lookup_inode(store, inode);
+	if(ti == NULL)
+		return;
+
+	tth_table_remove(&store->inode_table, ti);
+	if(tth_is_snapshot_inode(store, ti))
+		ti->flags |= TTH_REMOVED;
+	else
+	{
+		struct tth_journal_inode *ji = (struct tth_journal_inode *)
+		    ((char *)ti - offsetof(struct tth_journal_inode, inode));
+		LIST_REMOVE(ji, link);
+		free(ji);
+	}
+
+	if(!store->loading)
+	{
+		fprintf(store->fp, "-I:%"PRIX64"\n", inode);
+	}
+}
+
+void tth_store_set_active_inode(struct tth_store *store,
+	const tth_t *tth, uint64_t inode)
+{
+	return_if_fail(store);
+	return_if_fail(tth);
+
+	struct tth_entry *te = tth_store_lookup(store, tth);
+	return_if_fail(te);
+
+	/* switch active inode for this TTH */
+	te->active_inode = inode;
+}
+
+/*
+ * leafdata
+ */
+
+/* load the leafdata for a journal entry from the journal */
+static int tth_journal_load_leafdata(struct tth_store *store,
+	struct tth_journal_entry *je)
+{
+	char *lbuf = NULL;
+	struct tth_entry *entry = &je->entry;
+	char tth_base32[TTH_BASE32_LEN + 1];
+
+	tth_to_base32(&entry->tth, tth_base32);
+	INFO("loading leafdata for tth [%s] at offset %"PRIu64,
+		tth_base32, entry->leafdata_offset);
+
+	/* seek to the entry->leafdata_offset position in the journal */
 	int rc = fseek(store->fp, entry->leafdata_offset, SEEK_SET);
 	if(rc == -1)
 	{
-		WARNING("seek to %llu failed", entry->leafdata_offset);
+		WARNING("seek to %"PRIu64" failed", entry->leafdata_offset);
 		goto failed;
 	}
 
@@ -325,7 +716,7 @@ int tth_store_load_leafdata(struct tth_store *store, struct tth_entry *entry)
 	char *buf = fgetln(store->fp, &len);
 	if(buf == NULL)
 	{
-		WARNING("failed to read line @offset %llu",
+		WARNING("failed to read line @offset %"PRIu64,
 			entry->leafdata_offset);
 		goto failed;
 	}
@@ -351,7 +742,7 @@ int tth_store_load_leafdata(struct tth_store *store, struct tth_entry *entry)
 	buf += 3;
 	len -= 3;
 
-	if(len <= 40 || buf[39] != ':' || strncmp(buf, entry->tth, 39) != 0)
+	if(len <= 40 || buf[39] != ':' || strncmp(buf, tth_base32, 39) != 0)
 	{
 		WARNING("offset points to wrong tth: [%s]", buf);
 		goto failed;
@@ -367,15 +758,15 @@ int tth_store_load_leafdata(struct tth_store *store, struct tth_entry *entry)
 		buf[base64_len] = 0;
 	}
 
-	entry->leafdata = malloc(base64_len);
-	assert(entry->leafdata);
+	je->leafdata = malloc(base64_len);
+	assert(je->leafdata);
 
-	rc = base64_pton(buf, (unsigned char *)entry->leafdata, base64_len);
+	rc = base64_pton(buf, (unsigned char *)je->leafdata, base64_len);
 	if(rc <= 0)
 	{
 		WARNING("invalid base64 encoded leafdata");
-		free(entry->leafdata);
-		entry->leafdata = NULL;
+		free(je->leafdata);
+		je->leafdata = NULL;
 		goto failed;
 	}
 
@@ -386,7 +777,7 @@ int tth_store_load_leafdata(struct tth_store *store, struct tth_entry *entry)
 
 failed:
 	WARNING("failed to load leafdata for tth [%s]: %s",
-		entry->tth, strerror(errno));
+		tth_base32, strerror(errno));
 
 	free(lbuf);
 
@@ -394,106 +785,564 @@ failed:
 	return -1;
 }
 
-struct tth_entry *tth_store_lookup(struct tth_store *store, const char *tth)
+/* Sets leafdata to the leafdata for the given TTH. Snapshot leafdata is
+ * returned directly from the mapped heap; journal leafdata is loaded from
+ * the journal on first use. The returned data belongs to the store and is
+ * only valid until the store is modified.
+ */
+int tth_store_load_leafdata(struct tth_store *store, struct tth_entry *entry,
+	const char **leafdata)
 {
-	return_val_if_fail(store, NULL);
+	return_val_if_fail(store, -1);
+	return_val_if_fail(entry, -1);
+	return_val_if_fail(leafdata, -1);
 
-	struct tth_entry find;
-	strlcpy(find.tth, tth, sizeof(find.tth));
-	return RB_FIND(tth_entries_head, &store->entries, &find);
+	if(entry >= store->entries && entry < store->entries + store->nentries)
+	{
+		if(entry->leafdata_len == 0 ||
+		    entry->leafdata_offset + entry->leafdata_len >
+		    store->heap_size)
+		{
+			char tth_base32[TTH_BASE32_LEN + 1];
+			WARNING("no leafdata for tth [%s]",
+			    tth_to_base32(&entry->tth, tth_base32));
+			return -1;
+		}
+		*leafdata = store->heap + entry->leafdata_offset;
+		return 0;
+	}
+
+	struct tth_journal_entry *je = (struct tth_journal_entry *)
+	    ((char *)entry - offsetof(struct tth_journal_entry, entry));
+	if(je->leafdata == NULL && tth_journal_load_leafdata(store, je) != 0)
+		return -1;
+
+	*leafdata = je->leafdata;
+	return 0;
+}
+
+/*
+ * compaction
+ */
+
+/* buffered sequential writer at an offset in a file */
+struct tth_writer
+{
+	int fd;
+	off_t offset;
+	size_t len;
+	char buf[64*1024];
+};
+
+static int tth_writer_flush(struct tth_writer *w)
+{
+	if(w->len && pwrite(w->fd, w->buf, w->len, w->offset) != w->len)
+		return -1;
+	w->offset += w->len;
+	w->len = 0;
+	return 0;
 }
 
-static void tth_entry_free(struct tth_entry *entry)
+static int tth_writer_put(struct tth_writer *w, const void *data, size_t len)
 {
-	if(entry)
+	if(w->len + len > sizeof(w->buf) && tth_writer_flush(w) != 0)
+		return -1;
+	if(len > sizeof(w->buf))
 	{
-		free(entry->leafdata);
-		free(entry);
+		if(pwrite(w->fd, data, len, w->offset) != len)
+			return -1;
+		w->offset += len;
+		return 0;
 	}
+	memcpy(w->buf + w->len, data, len);
+	w->len += len;
+	return 0;
 }
 
-void tth_store_remove(struct tth_store *store, const char *tth)
+/* Writes the current contents of the store as a snapshot. Snapshot and
+ * journal records never overlap (see tth_store_add_*), the records are
+ * looked up by hash so they are written in any order.
+ */
+static int tth_write_snapshot(struct tth_store *store, const char *filename)
 {
-	return_if_fail(store);
+	int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(fd == -1)
+	{
+		WARNING("%s: %s", filename, strerror(errno));
+		return -1;
+	}
 
-	struct tth_entry *entry = tth_store_lookup(store, tth);
-	if(entry)
+	struct tth_snapshot_header hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, TTH_SNAPSHOT_MAGIC, 8);
+	hdr.version = TTH_SNAPSHOT_VERSION;
+	hdr.record_size = sizeof(struct tth_entry);
+
+	uint64_t i;
+	struct tth_journal_entry *je;
+	struct tth_journal_inode *ji;
+	for(i = 0; i < store->nentries; i++)
+		if((store->entries[i].flags & TTH_REMOVED) == 0)
+			hdr.nentries++;
+	LIST_FOREACH(je, &store->journal_entries, link)
+		hdr.nentries++;
+	for(i = 0; i < store->ninodes; i++)
+		if((store->inodes[i].flags & TTH_REMOVED) == 0)
+			hdr.ninodes++;
+	LIST_FOREACH(ji, &store->journal_inodes, link)
+		hdr.ninodes++;
+
+	hdr.entries_offset = sizeof(hdr);
+	hdr.inodes_offset = hdr.entries_offset +
+	    hdr.nentries * sizeof(struct tth_entry);
+	hdr.heap_offset = hdr.inodes_offset +
+	    hdr.ninodes * sizeof(struct tth_inode);
+
+	struct tth_writer *records = calloc(1, sizeof(struct tth_writer));
+	struct tth_writer *heap = calloc(1, sizeof(struct tth_writer));
+	records->fd = heap->fd = fd;
+	records->offset = hdr.entries_offset;
+	heap->offset = hdr.heap_offset;
+
+	int rc = 0;
+	i = 0;
+	je = LIST_FIRST(&store->journal_entries);
+	while(rc == 0)
 	{
-		RB_REMOVE(tth_entries_head, &store->entries, entry);
+		while(i < store->nentries && store->entries[i].flags & TTH_REMOVED)
+			i++;
 
-		if(!store->loading)
+		struct tth_entry *te;
+		if(i < store->nentries)
+			te = &store->entries[i++];
+		else if(je)
 		{
-			fprintf(store->fp, "-T:%s\n", tth);
+			te = &je->entry;
+			je = LIST_NEXT(je, link);
 		}
+		else
+			break;
+
+		struct tth_entry rec;
+		memcpy(&rec, te, sizeof(rec));
+		rec.active_inode = 0;
+		rec.flags = 0;
+		rec.leafdata_offset = hdr.heap_size;
 
-		tth_entry_free(entry);
+		const char *leafdata = NULL;
+		if(tth_store_load_leafdata(store, te, &leafdata) != 0)
+			rec.leafdata_len = 0;
+		else
+			rc = tth_writer_put(heap, leafdata, te->leafdata_len);
+		hdr.heap_size += rec.leafdata_len;
+
+		if(rc == 0)
+			rc = tth_writer_put(records, &rec, sizeof(rec));
 	}
-}
 
-struct tth_entry *tth_store_lookup_by_inode(struct tth_store *store,
-	uint64_t inode)
-{
-	struct tth_inode *ti = tth_store_lookup_inode(store, inode);
-	if(ti)
-		return tth_store_lookup(store, ti->tth);
-	return NULL;
+	i = 0;
+	ji = LIST_FIRST(&store->journal_inodes);
+	while(rc == 0)
+	{
+		while(i < store->ninodes && store->inodes[i].flags & TTH_REMOVED)
+			i++;
+
+		struct tth_inode *ti;
+		if(i < store->ninodes)
+			ti = &store->inodes[i++];
+		else if(ji)
+		{
+			ti = &ji->inode;
+			ji = LIST_NEXT(ji, link);
+		}
+		else
+			break;
+
+		struct tth_inode rec;
+		memcpy(&rec, ti, sizeof(rec));
+		rec.flags = 0;
+		rc = tth_writer_put(records, &rec, sizeof(rec));
+	}
+
+	if(rc == 0)
+		rc = tth_writer_flush(records);
+	if(rc == 0)
+		rc = tth_writer_flush(heap);
+	if(rc == 0 && pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+		rc = -1;
+	if(rc == 0 && fsync(fd) != 0)
+		rc = -1;
+	if(rc != 0)
+		WARNING("%s: %s", filename, strerror(errno));
+
+	free(records);
+	free(heap);
+	close(fd);
+
+	return rc;
 }
 
-static void tth_inode_free(struct tth_inode *ti)
+/* Forks a child that writes a new snapshot from its copy of the store.
+ * The parent keeps appending to the journal meanwhile; the changes made
+ * after compact_offset are replayed when the child is done.
+ */
+static void tth_start_compaction(struct tth_store *store)
 {
-	if(ti)
+	return_if_fail(store->compact_pid == 0);
+
+	store->compact_offset = tth_journal_size(store);
+
+	INFO("compacting TTH journal (%llu bytes)",
+	    (unsigned long long)store->compact_offset);
+
+	pid_t pid = fork();
+	if(pid == -1)
 	{
-		free(ti);
+		WARNING("fork: %s", strerror(errno));
+		return;
 	}
+
+	if(pid == 0)
+	{
+		/* Use our own file descriptor, the offset of the parent's is
+		 * shared with us. */
+		store->fp = fopen(store->filename, "r");
+		if(store->fp == NULL)
+			_exit(1);
+
+		char *tmp_filename;
+		if(asprintf(&tmp_filename, "%s.tmp", store->snapshot_filename) == -1)
+			_exit(1);
+
+		if(tth_write_snapshot(store, tmp_filename) != 0 ||
+		    rename(tmp_filename, store->snapshot_filename) != 0)
+		{
+			unlink(tmp_filename);
+			_exit(1);
+		}
+		_exit(0);
+	}
+
+	store->compact_pid = pid;
 }
 
-void tth_store_remove_inode(struct tth_store *store, uint64_t inode)
+/* Copies the journal from the compaction offset to a new journal. */
+static int tth_truncate_journal(struct tth_store *store)
 {
-	return_if_fail(store);
+	char *tmp_filename;
+	int num_returned_bytes = asprintf(&tmp_filename, "%s.tmp", store->filename);
+	if (num_returned_bytes == -1)
+		return -1;
 
-	struct tth_inode *ti = tth_store_lookup_inode(store, inode);
-	if(ti)
+	FILE *in = fopen(store->filename, "r");
+	FILE *out = fopen(tmp_filename, "w");
+	int rc = -1;
+	if(in && out && fseek(in, store->compact_offset, SEEK_SET) == 0)
 	{
-		RB_REMOVE(tth_inodes_head, &store->inodes, ti);
-
-		if(!store->loading)
+		char buf[8192];
+		size_t n;
+		rc = 0;
+		while(rc == 0 && (n = fread(buf, 1, sizeof(buf), in)) > 0)
 		{
-			fprintf(store->fp, "-I:%"PRIX64"\n", inode);
+			if(fwrite(buf, 1, n, out) != n)
+				rc = -1;
 		}
+		if(ferror(in))
+			rc = -1;
+	}
+	if(in)
+		fclose(in);
+	if(out && fclose(out) != 0)
+		rc = -1;
+
+	if(rc == 0)
+		rc = rename(tmp_filename, store->filename);
+	if(rc != 0)
+	{
+		WARNING("%s: %s", tmp_filename, strerror(errno));
+		unlink(tmp_filename);
+	}
+	free(tmp_filename);
+
+	return rc;
+}
 
-		tth_inode_free(ti);
+static void tth_copy_active_inode(struct tth_store *to, struct tth_entry *te)
+{
+	if(te->active_inode)
+	{
+		struct tth_entry *new_te = tth_store_lookup(to, &te->tth);
+		if(new_te)
+			new_te->active_inode = te->active_inode;
 	}
 }
 
-struct tth_inode *tth_store_lookup_inode(struct tth_store *store,
-	uint64_t inode)
+/* Points the first journal records back at the list heads after the store
+ * struct is copied.
+ */
+static void tth_relink_journal(struct tth_store *store)
 {
-	return_val_if_fail(store, NULL);
+	if(!LIST_EMPTY(&store->journal_entries))
+		LIST_FIRST(&store->journal_entries)->link.le_prev =
+		    &LIST_FIRST(&store->journal_entries);
+	if(!LIST_EMPTY(&store->journal_inodes))
+		LIST_FIRST(&store->journal_inodes)->link.le_prev =
+		    &LIST_FIRST(&store->journal_inodes);
+}
+
+/* Switches to the new snapshot written by the compaction child. Returns 0
+ * on success, or -1 on error.
+ */
+static int tth_finish_compaction(struct tth_store *store, int status)
+{
+	store->compact_pid = 0;
+
+	if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+	{
+		WARNING("failed to compact TTH journal");
+		return -1;
+	}
 
-	struct tth_inode find;
-	find.inode = inode;
-	return RB_FIND(tth_inodes_head, &store->inodes, &find);
+	/* The snapshot contains everything before compact_offset. If we
+	 * crash before truncating the journal, replaying the whole journal
+	 * on the new snapshot gives the same result. */
+	fflush(store->fp);
+	if(tth_truncate_journal(store) != 0)
+		return -1;
+
+	struct tth_store *new_store = tth_load(store->filename,
+	    store->snapshot_filename);
+	return_val_if_fail(new_store, -1);
+
+	/* the active inodes are not saved, move them over */
+	uint64_t i;
+	for(i = 0; i < store->nentries; i++)
+	{
+		if((store->entries[i].flags & TTH_REMOVED) == 0)
+			tth_copy_active_inode(new_store, &store->entries[i]);
+	}
+	struct tth_journal_entry *je;
+	LIST_FOREACH(je, &store->journal_entries, link)
+		tth_copy_active_inode(new_store, &je->entry);
+
+	/* swap contents, the store pointer is kept by the callers */
+	struct tth_store tmp = *store;
+	*store = *new_store;
+	*new_store = tmp;
+	tth_relink_journal(store);
+	tth_relink_journal(new_store);
+	tth_free_store(new_store);
+
+	INFO("done compacting TTH journal");
+
+	return 0;
 }
 
-void tth_store_set_active_inode(struct tth_store *store,
-	const char *tth, uint64_t inode)
+static void tth_maybe_compact(struct tth_store *store)
+{
+	/* in append mode, ftell is the size of the journal after a write */
+	if(store->compact_pid == 0 &&
+	    ftell(store->fp) > TTH_JOURNAL_COMPACT_SIZE)
+		tth_start_compaction(store);
+}
+
+/* Switches to the new snapshot if a background compaction is finished.
+ * Invalidates all entry and inode pointers, so must only be called from
+ * the event loop.
+ */
+void tth_store_check_compaction(struct tth_store *store)
 {
 	return_if_fail(store);
-	return_if_fail(tth);
 
-	struct tth_entry *te = tth_store_lookup(store, tth);
-	return_if_fail(te);
+	int status;
+	if(store->compact_pid &&
+	    waitpid(store->compact_pid, &status, WNOHANG) == store->compact_pid)
+		tth_finish_compaction(store, status);
+}
 
-	/* switch active inode for this TTH */
-	te->active_inode = inode;
+/* Compacts the journal into a new snapshot and waits for it to finish.
+ * Returns 0 on success, or -1 on error.
+ */
+int tth_store_compact(struct tth_store *store)
+{
+	return_val_if_fail(store, -1);
+
+	int status;
+	if(store->compact_pid == 0)
+		tth_start_compaction(store);
+	if(store->compact_pid == 0 ||
+	    waitpid(store->compact_pid, &status, 0) != store->compact_pid)
+		return -1;
+
+	return tth_finish_compaction(store, status);
 }
 
 #ifdef TEST
 
-#include "unit_test.h"
+#include <sys/time.h>
 
 #include "unit_test.h"
 
+#define TEST_TTH "7LSZ6K2ZFQJBSEIRWM72N7VW2IULICCDW5ZUMJI"
+#define TEST_INODE 0x61529D00001A7BULL
+
+static tth_t test_tth, other_tth;
+
+static void test_compact(const char *leafdata, unsigned leafdata_len)
+{
+	struct tth_store *store = global_tth_store;
+
+	char *saved_leafdata = malloc(leafdata_len);
+	memcpy(saved_leafdata, leafdata, leafdata_len);
+	tth_store_set_active_inode(store, &test_tth, TEST_INODE);
+
+	fail_unless(tth_store_compact(store) == 0);
+	fail_unless(store->nentries == 1);
+	fail_unless(store->ninodes == 1);
+	fail_unless(LIST_EMPTY(&store->journal_entries));
+
+	/* entries now come from the snapshot, with the leafdata in the heap */
+	struct tth_entry *te = tth_store_lookup(store, &test_tth);
+	fail_unless(te == &store->entries[0]);
+	fail_unless(te->active_inode == TEST_INODE);
+	const char *new_leafdata = NULL;
+	fail_unless(tth_store_load_leafdata(store, te, &new_leafdata) == 0);
+	fail_unless(te->leafdata_len == leafdata_len);
+	fail_unless(memcmp(new_leafdata, saved_leafdata, leafdata_len) == 0);
+
+	/* changes go to the journal */
+	tth_store_add_entry(store, &other_tth, "AAAAAAAA", 0);
+	tth_store_add_inode(store, 17, 4711, &other_tth);
+	tth_store_add_inode(store, TEST_INODE, 0x404E3395, &test_tth);
+	fail_unless(store->inodes[0].flags & TTH_REMOVED);
+	struct tth_inode *ti = tth_store_lookup_inode(store, TEST_INODE);
+	fail_unless(ti && ti->mtime == 0x404E3395);
+	tth_store_remove(store, &test_tth);
+	fail_unless(tth_store_lookup(store, &test_tth) == NULL);
+	fail_unless(tth_store_lookup(store, &other_tth));
+
+	/* snapshot + journal is loaded on startup */
+	tth_store_close();
+	tth_store_init();
+	store = global_tth_store;
+	fail_unless(store->nentries == 1);
+	fail_unless(tth_store_lookup(store, &test_tth) == NULL);
+	te = tth_store_lookup(store, &other_tth);
+	fail_unless(te);
+	fail_unless(tth_store_load_leafdata(store, te, &new_leafdata) == 0);
+	fail_unless(te->leafdata_len == 6);
+	ti = tth_store_lookup_inode(store, TEST_INODE);
+	fail_unless(ti && ti->mtime == 0x404E3395);
+	fail_unless(tth_store_lookup_inode(store, 17) != NULL);
+
+	/* and compacted again */
+	tth_store_set_active_inode(store, &other_tth, 17);
+	tth_store_add_entry(store, &test_tth, "AAAAAAAA", 0);
+	fail_unless(tth_store_compact(store) == 0);
+	fail_unless(store->nentries == 2);
+	fail_unless(store->ninodes == 2);
+	te = tth_store_lookup(store, &other_tth);
+	fail_unless(te && te->active_inode == 17);
+	fail_unless(tth_store_lookup(store, &test_tth) != NULL);
+	tth_store_remove_inode(store, 17);
+	fail_unless(tth_store_lookup_inode(store, 17) == NULL);
+
+	free(saved_leafdata);
+}
+
+static void make_tth(tth_t *tth, unsigned i)
+{
+	memset(tth, 0xAA, sizeof(*tth));
+	memcpy(tth->data, &i, sizeof(i));
+}
+
+/* removing records from the hash table keeps the others reachable */
+static void test_table(void)
+{
+	struct tth_store *store = global_tth_store;
+	unsigned i, n = 5000;
+	tth_t tth;
+
+	for(i = 0; i < n; i++)
+	{
+		make_tth(&tth, i);
+		tth_store_add_entry(store, &tth, "AAAAAAAA", 0);
+		tth_store_add_inode(store, 1000 + i, 4711, &tth);
+	}
+	for(i = 0; i < n; i += 2)
+	{
+		make_tth(&tth, i);
+		tth_store_remove(store, &tth);
+		tth_store_remove_inode(store, 1000 + i);
+	}
+	for(i = 0; i < n; i++)
+	{
+		make_tth(&tth, i);
+		struct tth_entry *te = tth_store_lookup(store, &tth);
+		struct tth_inode *ti = tth_store_lookup_inode(store, 1000 + i);
+		if(i % 2)
+		{
+			fail_unless(te && tth_equal(&te->tth, &tth));
+			fail_unless(ti && tth_equal(&ti->tth, &tth));
+		}
+		else
+			fail_unless(te == NULL && ti == NULL);
+	}
+	for(i = 1; i < n; i += 2)
+	{
+		make_tth(&tth, i);
+		tth_store_remove(store, &tth);
+		tth_store_remove_inode(store, 1000 + i);
+	}
+	fail_unless(store->entry_table.count == 2);
+	fail_unless(store->inode_table.count == 1);
+}
+
+static double elapsed(struct timeval *start)
+{
+	struct timeval end;
+	gettimeofday(&end, NULL);
+	return (end.tv_sec - start->tv_sec) +
+	    (end.tv_usec - start->tv_usec) / 1000000.0;
+}
+
+/* compare startup time of the text journal and the snapshot */
+static void benchmark_load(void)
+{
+	system("/bin/rm -rf /tmp/sp-tthdb-test.d/*");
+
+	FILE *fp = fopen("/tmp/sp-tthdb-test.d/tth2.db", "w");
+	fail_unless(fp);
+	unsigned i, n = 100000;
+	for(i = 0; i < n; i++)
+	{
+		tth_t tth;
+		char tth_base32[TTH_BASE32_LEN + 1];
+		make_tth(&tth, i);
+		tth_to_base32(&tth, tth_base32);
+		fprintf(fp, "+T:%s:c8shGrB71Qbz5+2QO6og2deqPe+zWs48121TgHwoR1QpQUPu\n", tth_base32);
+		fprintf(fp, "+I:%X:404E3394:%s\n", i + 1, tth_base32);
+	}
+	fail_unless(fclose(fp) == 0);
+
+	struct timeval start;
+	gettimeofday(&start, NULL);
+	tth_store_init();
+	double text = elapsed(&start);
+	fail_unless(tth_store_compact(global_tth_store) == 0);
+	tth_store_close();
+
+	gettimeofday(&start, NULL);
+	tth_store_init();
+	double snapshot = elapsed(&start);
+	fail_unless(((struct tth_store *)global_tth_store)->nentries == n);
+	fail_unless(tth_store_lookup_inode(global_tth_store, n / 2) != NULL);
+	tth_store_close();
+
+	printf("loading %u TTHs: text journal %.3f s, snapshot %.3f s\n",
+	    n, text, snapshot);
+}
+
 int main(void)
 {
 	sp_log_set_level("debug");
@@ -501,6 +1350,10 @@ int main(void)
 	system("/bin/rm -rf /tmp/sp-tthdb-test.d");
 	system("mkdir /tmp/sp-tthdb-test.d");
 
+	fail_unless(tth_from_base32(&test_tth, TEST_TTH) == 0);
+	fail_unless(tth_from_base32(&other_tth,
+		"AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA") == 0);
+
 	const char *data = "+T:7LSZ6K2ZFQJBSEIRWM72N7VW2IULICCDW5ZUMJI:c8shGrB71Qbz5+2QO6og2deqPe+zWs48121TgHwoR1QpQUPut9qBY4csT9rbH68pefxFXkeISTwa1Vx5dnk09zpjnEO4oIYuDZZaXFMwR6RkBGsXLQ5sdsq0HADwZdyrGnd7SRYtOds5gcxEhoi1gOwUruktO6h5VtzR6Wc7JvYm0KmZZX6CgrcrPY/PN9BQGTJw5ADK5rdWRjMedZ/BHHq/8AzbC5a3sq7VvNikAPfqsyMdu5kXqCSIdKy4KXKexrnCKW2gP8VVclaniCnzHC74aEukOWIX7URTPgKBrlRBvXjtgwVeMj/ZZOG3btleUQCG6uQ1vRfyoRvNm+FsBZp1Zq43CAiyo6HhaSDErk1um7EqdxmM/u7BoOzqtkWby3wmvW87Wl0UJ/JejIXJNT+cNmIuL2q+ptkk4OcdLX0MkK6Frgss+LWUSEA4olOIv/uDBnF+mJbUwRYn9MrUWkPs7pJcjlJ0PJByaRFmoveOM3L3z4kW2tzWyOu1mD18kM9Rlf3Y+Ku5lJTB/e257F0lGI2k0rQmBDOLEskc4H3JMbqoWNjNipn/2xYZRFTmJKC7UTimyHfyICXLyedXhVXJYUNDaApRko0/MjKnCxPwVasA1O+iEbQnmUQHRUisY1w0RzWtI+f6Y+1/pJI7qd40bgGC7Lcq7dGfjEoX+NK7Jh1neWixu9dSsyFps36wb9n4uH0KK9zJ5YIAniLTVo5mu5YVsZ0yNM1BTF6IoAPNrZgSRsIkwHmLukijNXWPfXqBbSiHW8DRtIL/6YYxOi1UyDQ7zZY9I4PJr9YrzVWoprHpPVm39FHnlUXHYulhML1qmit4efC1NmBGbWPIV5xPW9OhUlyZpZeWvuW8W52j61VrGnr4BWK+DU6cgUA7T5l61MgMSbpbz4Q/5GpGH50LyRXwCkVkXtdcCt2b7MICOX7kr6vYk84d4rcO2k1AJ1U7PIj/UqIPNg9jZvQZgb1gSlVKmPOvIfr3uHMeGnWcpDIPNDmffnjyjjHRX94CYUf7f1j7BnMXVtiFAbcqfP8E74mJ84icKZSy2AOv88BmB/9ndPXB1fFcEP6wVsH95EivgSVZ9THv69WLK+1jzkJQ+vhZSVNz3igWLTgelznYmeBDma40qj+i+AveianegrO+5QidKeAVwYNpNXB47LPEhv2XtTLzHsrSyvUsKX+PRguuQdizcQLsdOB0FzWYqMoNoNhWoqR015FEsqrcQfE5ehxP8REhj+cG4PeWMnq/CE+QGhSh+YWfas5Da8VEEKRCvo/qBQvlqObORACe2iY5Voo4m5bjf4L1Kb4VksnTXdGCxU5aomXGubxcfQ1dqIIufANM7jGiZpn07eE13sXJMkP5jv9ruajpEIFGxrIsCHebYknl78SKLlguIjVipnLzBB39Np/pHx5BKdCuMu/JAdeLNP14EITh7aQQDXTJ1Yf4/0bu2GjGvWn1Q1pFKfsQ870VkZECF2JbemjOqDjvKO1QqHofEq7tmICdKWV3h7rr5FEDVJ0Q3B85eXVb0FDd9WHJEgWW0+9kob38JASiieFayf6VnWmAHM2lYv2XiDuCjGfY76hcEYp/5W1hGebxuXd9ywa3o5n69Jmv5KZaEkE/e9+cJGnoAjnKmzDjVy7bjD6q22YBw3H2dVgaVsXP3SH4+YlL6hbrkTh0QAR8PYkVrApZXCOD4Y9HsRnxvwtIWUwcgJLcWjgilBYW/bSLq+tjYTTejkdWKgoJK6Un3Jc8yzllsidvVZfAuHVxUrBvL7wFaXQZImmYP6PqGN60/t21Oo2ejUK1rAP40rTepKiT/IICIeGa5Nf39IuxKnnLn/5zICa84VuTzp3/jikJHt+FJEM0zZF+XDyDca1rn68nGSEswifrePekDTfhPIl6tnLhef9wIUCNjrKhjzPPBxELgCE5//3bXJ1pfJAoAJBfko68hUppj8NKPW+1hOZo0SQCaYp2wfiM5NZiAxBmphZA1JaEKr1Ew1JWcgyB1SrD9wGZPIWv9PTgDpDWsQaQlWNkBbArITmXSIFl7VPrEvelPiDNIYWS6kr0XzXRcS4FdqB3tV8WbEpGMoA72jOpU0fZKJ0uMRbpjysWU3F3ipic1JVXaEX5vcufJz5NlgBfKH6bDoEQq7peSINc9fHdLIIsTVM5cWyJa1PUpns3yvTX0ydQuIkg1f4NVOtXVqM7zXQyARitGRQmr683PeyRH+Tdy92wpn4qS/G4PuiK5Y2lgMUpBnqFqEKZT4eGJB9kvnxHHAz9bMC24AHqU4HVWU4ZNtwNEhJ1IZWwnmRVvLEOaHazY3zVhUiHL9JY22Dhq1uGQyBSBC7aOa/ZNWEjHw9DqU0ycCHj23jlzkq/v6yG8Z5NKGRe4YSyMVdUfVcAHyNhp9CkqM47wYZ6N1qp1Q3CFF6xZCaMwf4eaM77hDdRaDc0J2TmGCQXg+0S7g0spjIvB5cpyizCFmHTFEdW30xfIt9OXyDyNy7Q5VXHPM1H+JuWvLbMYBcXtnlYjo/E+8MZRn1Q2wJY8OCX6vdJNglsJep35aZXcmajE2AdZjX3VCrPofQe3Sq82sEXtHYlgkuC78uTH78Ayo5vsZ/Dnpcmw92GvrBB8Cue37IVxlQpxM5yEGgACcJm/1dOoIehBZTA+yF60Y2P9DRUkSpcYuF8GEFDstCyFbcimBL2zGlN5UJWq5vA/KrQs+5qxUaqV+SSn9p/1h5u9QZPh4JjibHVc69o5FmU9dKKXnwv4Pdgri7SOspmIHfAM6K4YDLOfj337YOnkWEifNVyr/N6BgSMTD+cESpyEJPh0HN8+93RyHGWjhEtn/D3NC1U/6ijeFsorxut+kkT7oU1wTgnf5oClSe0dUymaHi6lYO/ySn2LrE3y8msfefTCHSDdOo4wXX4fYMb5MtZ9nymy7ZmS6O74Yg4WIbALBz+lOj+8PJJbDsTcTPcowZoqhxM+o3skzoUVMNj722TY7FxIeQQ+T52Pz333r1F564i4AzW41+4JAa2zCN89EfjwZdqCassb74rGZanoQjOdWNcuG0wr3d/ljojT1Yz74YwpDonR9IPBLlmeDppYin5It6NiBtidutKzN7FmgP9BaTQqf8s8PbKTttkD+9+irfr\n"
 	"+I:61529D00001A7B:404E3394:7LSZ6K2ZFQJBSEIRWM72N7VW2IULICCDW5ZUMJI\n";
 	size_t len = strlen(data);
@@ -513,29 +1366,33 @@ int main(void)
 	tth_store_init();
 	fail_unless(global_tth_store);
 
-	struct tth_entry *te = tth_store_lookup(global_tth_store,
-		"7LSZ6K2ZFQJBSEIRWM72N7VW2IULICCDW5ZUMJI");
+	struct tth_entry *te = tth_store_lookup(global_tth_store, &test_tth);
 	fail_unless(te);
-	fail_unless(te->active_inode = 0x61529D00001A7BULL);
+	fail_unless(te->active_inode = TEST_INODE);
 
 	struct tth_inode *ti = tth_store_lookup_inode(global_tth_store, 0x61529D00001A7BULL);
 	fail_unless(ti);
-	fail_unless(strcmp(ti->tth, "7LSZ6K2ZFQJBSEIRWM72N7VW2IULICCDW5ZUMJI") == 0);
+	fail_unless(tth_equal(&ti->tth, &test_tth));
 	fail_unless(ti->mtime = 0x404E3394);
 
 	fail_unless(te->leafdata_offset == 0);
-	fail_unless(te->leafdata == NULL);
-	int rc = tth_store_load_leafdata(global_tth_store, te);
+	const char *leafdata = NULL;
+	int rc = tth_store_load_leafdata(global_tth_store, te, &leafdata);
 	fail_unless(rc == 0);
-	fail_unless(te->leafdata != NULL);
+	fail_unless(leafdata != NULL);
 	fail_unless(te->leafdata_len > 0);
 
+	test_compact(leafdata, te->leafdata_len);
+	test_table();
+
 	tth_store_close();
 
+
+	benchmark_load();
+
 	system("/bin/rm -rf /tmp/sp-tthdb-test.d");
 
 	return 0;
 }
 
 #endif
-
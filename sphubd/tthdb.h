@@ -17,65 +17,138 @@
 #ifndef _tthdb_h_
 #define _tthdb_h_
 
-#include "sys_tree.h"
+#include "sys_queue.h"
+#include "tth.h"
+
+#include <sys/types.h>
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
+
+/* The TTH store is a binary snapshot with a journal of changes made since
+ * the snapshot was written. The snapshot holds arrays of tth_entry and
+ * tth_inode records followed by a heap of leafdata, and is mapped
+ * copy-on-write so the run-time fields can be updated in place. The
+ * journal is the text logfile from previous versions (tth2.db).
+ *
+ * The records are used directly from the mapped file and must be 48 bytes.
+ */
+
+#define TTH_SNAPSHOT_MAGIC "SPTTHDB1"
+#define TTH_SNAPSHOT_VERSION 1
+
+struct tth_snapshot_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+	uint64_t nentries;
+	uint64_t ninodes;
+	uint64_t entries_offset;
+	uint64_t inodes_offset;
+	uint64_t heap_offset;
+	uint64_t heap_size;
+};
+
+/* flags for snapshot records */
+#define TTH_REMOVED	0x01	/* removed or replaced by the journal */
 
 typedef struct tth_entry tth_entry_t;
 struct tth_entry
 {
-	RB_ENTRY(tth_entry) link;
+	tth_t tth;
+	uint64_t active_inode;		/* run-time only, 0 on disk */
+	uint64_t leafdata_offset;	/* in the heap, or the journal */
+	uint32_t leafdata_len;
+	uint32_t flags;
+};
 
-	uint64_t active_inode;
-	char tth[40];
+struct tth_inode
+{
+	uint64_t inode;
+	uint64_t mtime;
+	tth_t tth;
+	uint32_t flags;
+	uint32_t reserved;
+};
 
-	off_t leafdata_offset;
-	unsigned leafdata_len;
+/* entries and inodes added since the snapshot was written */
+struct tth_journal_entry
+{
+	LIST_ENTRY(tth_journal_entry) link;
+	struct tth_entry entry;
 	char *leafdata;
 };
 
-struct tth_inode
+struct tth_journal_inode
 {
-	RB_ENTRY(tth_inode) link;
+	LIST_ENTRY(tth_journal_inode) link;
+	struct tth_inode inode;
+};
 
-	uint64_t inode;
-	time_t mtime;
-	char tth[40];
+/* Open addressing hash table of snapshot and journal records, with linear
+ * probing. Holds only records that aren't removed.
+ */
+struct tth_table
+{
+	void **slots;
+	uint64_t mask;			/* number of slots - 1 */
+	uint64_t count;
+	uint32_t (*hash)(const void *record);
 };
 
 struct tth_store
 {
-	char *filename;
+	char *filename;			/* journal */
+	char *snapshot_filename;
 	FILE *fp;
 	bool loading;
 	bool need_normalize;
 	unsigned line_number;
-	RB_HEAD(tth_entries_head, tth_entry) entries;
-	RB_HEAD(tth_inodes_head, tth_inode) inodes;
-};
 
-RB_PROTOTYPE(tth_entries_head, tth_entry, link, tth_entry_cmp);
-RB_PROTOTYPE(tth_inodes_head, tth_inode, link, tth_inode_cmp);
+	/* mapped snapshot */
+	void *map;
+	size_t map_size;
+	struct tth_entry *entries;
+	uint64_t nentries;
+	struct tth_inode *inodes;
+	uint64_t ninodes;
+	const char *heap;
+	uint64_t heap_size;
+
+	LIST_HEAD(, tth_journal_entry) journal_entries;
+	LIST_HEAD(, tth_journal_inode) journal_inodes;
+
+	struct tth_table entry_table;	/* by tth */
+	struct tth_table inode_table;	/* by inode */
+
+	/* background compaction */
+	pid_t compact_pid;
+	off_t compact_offset;		/* journal size when started */
+};
 
 void tth_store_init(void);
 void tth_store_close(void);
-int tth_store_load_leafdata(struct tth_store *store, struct tth_entry *entry);
+int tth_store_load_leafdata(struct tth_store *store, struct tth_entry *entry,
+	const char **leafdata);
+int tth_store_compact(struct tth_store *store);
+void tth_store_check_compaction(struct tth_store *store);
 
 void tth_store_add_entry(struct tth_store *store,
-	const char *tth, const char *leafdata_base64,
+	const tth_t *tth, const char *leafdata_base64,
 	off_t leafdata_offset);
 void tth_store_add_inode(struct tth_store *store,
-	uint64_t inode, time_t mtime, const char *tth);
+	uint64_t inode, time_t mtime, const tth_t *tth);
 
-struct tth_entry *tth_store_lookup(struct tth_store *store, const char *tth);
-void tth_store_remove(struct tth_store *store, const char *tth);
+struct tth_entry *tth_store_lookup(struct tth_store *store, const tth_t *tth);
+void tth_store_remove(struct tth_store *store, const tth_t *tth);
 
 struct tth_entry *tth_store_lookup_by_inode(struct tth_store *store, uint64_t inode);
 void tth_store_remove_inode(struct tth_store *store, uint64_t inode);
 struct tth_inode *tth_store_lookup_inode(struct tth_store *store, uint64_t inode);
 
-void tth_store_set_active_inode(struct tth_store *store, const char *tth, uint64_t inode);
+void tth_store_set_active_inode(struct tth_store *store, const tth_t *tth, uint64_t inode);
 
 #endif
 
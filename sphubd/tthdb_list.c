@@ -29,13 +29,29 @@ int main(int argc, char **argv)
 	uint64_t leafdata_size = 0;
 	unsigned ntths = 0;
 
-	struct tth_entry *te;
-	RB_FOREACH(te, tth_entries_head,
-	&((struct tth_store *)global_tth_store)->entries)
+	struct tth_store *store = global_tth_store;
+	struct tth_journal_entry *je = LIST_FIRST(&store->journal_entries);
+	uint64_t i = 0;
+	while(i < store->nentries || je)
 	{
-		printf("%s:", te->tth);
+		struct tth_entry *te;
+		if(i < store->nentries)
+		{
+			te = &store->entries[i++];
+			if(te->flags & TTH_REMOVED)
+				continue;
+		}
+		else
+		{
+			te = &je->entry;
+			je = LIST_NEXT(je, link);
+		}
+
+		char tth[TTH_BASE32_LEN + 1];
+		printf("%s:", tth_to_base32(&te->tth, tth));
 
-		int rc = tth_store_load_leafdata(global_tth_store, te);
+		const char *leafdata = NULL;
+		int rc = tth_store_load_leafdata(global_tth_store, te, &leafdata);
 		if(rc == 0)
 		{
 			printf(" leafdata size=%u\n", te->leafdata_len);
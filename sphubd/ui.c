@@ -54,16 +54,13 @@ static void ui_send_hub_state(hub_t *hub, void *user_data)
 
     DEBUG("sending nick list on hub '%s' to file descriptor %d",
             hub->address, hub->fd);
-    int i;
-    for(i = 0; i < HUB_USER_NHASH; i++)
+    unsigned pos = 0;
+    user_t *user;
+    while((user = htable_next(&hub->users, &pos)) != NULL)
     {
-        user_t *user;
-        LIST_FOREACH(user, &hub->users[i], link)
-        {
-            ui_send_user_login(ui, hub->address, user->nick,
-                    user->description, user->tag, user->speed, user->email,
-                    user->shared_size, user->is_operator, user->extra_slots);
-        }
+        ui_send_user_login(ui, hub->address, user->nick,
+                user->description, user->tag, user->speed, user->email,
+                user->shared_size, user->is_operator, user->extra_slots);
     }
 
     DEBUG("sending user-commands");
@@ -211,14 +208,13 @@ static void ui_in_event(struct bufferevent *bufev, void *data)
 
     while(1)
     {
-        char *cmd = io_evbuffer_readline(EVBUFFER_INPUT(bufev));
+        char *cmd = io_line_reader_next(&ui->reader, EVBUFFER_INPUT(bufev));
         if(cmd == NULL)
         {
             break;
         }
-        print_command(cmd, "<- (fd %d)", ui->fd);
+        print_command(SP_TRACE_UI, cmd, "<- (fd %d)", ui->fd);
         ui_dispatch_command(cmd, "$", 1, ui);
-        free(cmd);
     }
 }
 
@@ -495,7 +491,7 @@ static int ui_cb_download_filelist(ui_t *ui, const char *hub_address,
         {
             share_save(global_share, FILELIST_XML);
             char *xml_filename;
-            int num_returned_bytes = asprintf(&xml_filename, "%s/files.xml", global_working_directory);
+            int num_returned_bytes = asprintf(&xml_filename, "%s/files.xml.bz2", global_working_directory);
             if (num_returned_bytes == -1)
                 DEBUG("asprintf did not return anything");
             ui_send_filelist_finished(NULL, hub->address, nick, xml_filename);
@@ -740,6 +736,16 @@ static int ui_cb_log_level(ui_t *ui, const char *level)
     return 0;
 }
 
+/* subsystem is one of hub, peer, ui, hashd or all, level one of off,
+ * commands or full */
+static int ui_cb_set_trace_level(ui_t *ui, const char *subsystem,
+        const char *level)
+{
+    if(sp_trace_set_level(subsystem, level) != 0)
+        WARNING("invalid trace level [%s] for [%s]", level, subsystem);
+    return 0;
+}
+
 static int ui_cb_raw_command(ui_t *ui, const char *hub_address, const char *command)
 {
     hub_t *hub = hub_find_by_address(hub_address);
@@ -809,6 +815,52 @@ static int ui_cb_set_hash_prio(ui_t *ui, unsigned int prio)
     return 0;
 }
 
+static int ui_cb_set_search_reply_rate(ui_t *ui, unsigned int rate)
+{
+    global_search_reply_rate = rate;
+    return 0;
+}
+
+static int ui_cb_set_bandwidth_limit(ui_t *ui, unsigned int upload_rate,
+        unsigned int download_rate)
+{
+    global_upload_rate = upload_rate;
+    global_download_rate = download_rate;
+    return 0;
+}
+
+static int ui_cb_set_hub_bandwidth_limit(ui_t *ui, const char *hub_address,
+        unsigned int upload_rate, unsigned int download_rate)
+{
+    /* an empty address sets the limits of all hubs */
+    if(hub_address == NULL || *hub_address == 0)
+    {
+        hub_set_bandwidth_limit(NULL, upload_rate, download_rate);
+        return 0;
+    }
+
+    hub_t *hub = hub_find_by_address(hub_address);
+    if(hub == 0)
+        WARNING("hub not found: '%s'", hub_address);
+    else
+        hub_set_bandwidth_limit(hub, upload_rate, download_rate);
+    return 0;
+}
+
+static int ui_cb_set_connection_bandwidth_limit(ui_t *ui,
+        unsigned int upload_rate, unsigned int download_rate)
+{
+    global_connection_upload_rate = upload_rate;
+    global_connection_download_rate = download_rate;
+    return 0;
+}
+
+static int ui_cb_set_download_write_size(ui_t *ui, unsigned int size)
+{
+    global_download_write_size = size;
+    return 0;
+}
+
 static int ui_cb_set_download_directory(ui_t *ui, const char *download_directory)
 {
     if(download_directory)
@@ -904,6 +956,7 @@ void ui_accept_connection(int fd, short condition, void *data)
     ui->cb_set_passive = ui_cb_set_passive;
     ui->cb_forget_search = ui_cb_forget_search;
     ui->cb_log_level = ui_cb_log_level;
+    ui->cb_set_trace_level = ui_cb_set_trace_level;
     ui->cb_raw_command = ui_cb_raw_command;
     ui->cb_set_priority = ui_cb_set_priority;
     ui->cb_set_follow_redirects = ui_cb_set_follow_redirects;
@@ -912,6 +965,12 @@ void ui_accept_connection(int fd, short condition, void *data)
     ui->cb_resume_hashing = ui_cb_resume_hashing;
     ui->cb_set_auto_search = ui_cb_set_auto_search;
     ui->cb_set_hash_prio = ui_cb_set_hash_prio;
+    ui->cb_set_search_reply_rate = ui_cb_set_search_reply_rate;
+    ui->cb_set_bandwidth_limit = ui_cb_set_bandwidth_limit;
+    ui->cb_set_hub_bandwidth_limit = ui_cb_set_hub_bandwidth_limit;
+    ui->cb_set_connection_bandwidth_limit =
+        ui_cb_set_connection_bandwidth_limit;
+    ui->cb_set_download_write_size = ui_cb_set_download_write_size;
     ui->cb_set_download_directory = ui_cb_set_download_directory;
     ui->cb_set_incomplete_directory = ui_cb_set_incomplete_directory;
     ui->cb_expect_shared_paths = ui_cb_expect_shared_paths;
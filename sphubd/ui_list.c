@@ -66,24 +66,31 @@ void ui_schedule_share_stats_update(void)
 
 static void handle_tth_available_notification(nc_t *nc,
         const char *channel,
-        nc_tth_available_t *data, void *user_data)
+        nc_tth_available_t **data, unsigned count, void *user_data)
 {
-    share_file_t *file = data->file;
-
-    if(data->tth == NULL)
-    {
-	ui_send_status_message(NULL, NULL, "hashing failed for %s%s",
-	    file->mp->local_root, file->partial_path);
-    }
-    else
+    bool hashed = false;
+    unsigned i;
+    for(i = 0; i < count; i++)
     {
-	const char *filename = strrchr(file->partial_path, '/');
-	if(filename++ == NULL)
-	    filename = file->partial_path;
+	if(data[i]->tth == NULL)
+	{
+	    ui_send_status_message(NULL, NULL, "hashing failed for %s",
+		data[i]->local_path);
+	}
+	else
+	{
+	    const char *filename = strrchr(data[i]->local_path, '/');
+	    filename = filename ? filename + 1 : data[i]->local_path;
 
-	ui_send_status_message(NULL, NULL, "finished hashing %s (%.2lf MiB/s)",
-		filename, data->mibs_per_sec);
+	    ui_send_status_message(NULL, NULL,
+		    "finished hashing %s (%.2lf MiB/s)",
+		    filename, data[i]->mibs_per_sec);
+	    hashed = true;
+	}
+    }
 
+    if(hashed)
+    {
 	hub_set_need_myinfo_update(true);
 	ui_schedule_share_stats_update();
     }
@@ -109,12 +116,21 @@ static void handle_share_scan_finished_notification(nc_t *nc,
 
 static void handle_share_file_added_notification(nc_t *nc,
         const char *channel,
-        nc_share_file_added_t *data, void *user_data)
+        nc_share_file_added_t **data, unsigned count, void *user_data)
 {
     ui_schedule_share_stats_update();
 }
 
 
+static void handle_share_changed_notification(nc_t *nc,
+        const char *channel,
+        nc_share_changed_t *data, void *user_data)
+{
+    /* files may have been removed, the share size might have changed */
+    hub_set_need_myinfo_update(true);
+    ui_schedule_share_stats_update();
+}
+
 static void handle_share_duplicate_found_notification(nc_t *nc,
         const char *channel,
         nc_share_duplicate_found_t *data, void *user_data)
@@ -234,7 +250,7 @@ void ui_list_init(void)
 {
     LIST_INIT(&ui_list_head);
 
-    nc_add_tth_available_observer(nc_default(),
+    nc_add_tth_available_batch_observer(nc_default(),
             handle_tth_available_notification, NULL);
     nc_add_hashing_complete_observer(nc_default(),
             handle_hashing_complete_notification, NULL);
@@ -260,8 +276,10 @@ void ui_list_init(void)
             handle_filelist_finished_notification, NULL);
     nc_add_share_scan_finished_observer(nc_default(),
             handle_share_scan_finished_notification, NULL);
-    nc_add_share_file_added_observer(nc_default(),
+    nc_add_share_file_added_batch_observer(nc_default(),
             handle_share_file_added_notification, NULL);
+    nc_add_share_changed_observer(nc_default(),
+            handle_share_changed_notification, NULL);
 	nc_add_share_duplicate_found_observer(nc_default(),
 			handle_share_duplicate_found_notification, NULL);
     nc_add_did_remove_share_observer(nc_default(),
@@ -304,7 +322,7 @@ void ui_foreach(void (*func)(ui_t *, void *), void *user_data)
 
 int ui_send_string(ui_t *ui, const char *string)
 {
-    print_command(string, "-> (fd %i)", ui->fd);
+    print_command(SP_TRACE_UI, string, "-> (fd %i)", ui->fd);
     return bufferevent_write(ui->bufev, (void *)string, strlen(string));
 }
 
@@ -30,8 +30,6 @@ struct hub;
 typedef struct user user_t;
 struct user
 {
-    LIST_ENTRY(user) link;
-
     char *nick;
     char *tag;
     char *speed;
@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2007 Martin Hedenfalk <martin@bzero.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+/* objects are aligned for any of the types we put in them */
+#define ARENA_ALIGN (2 * sizeof(void *))
+
+struct arena_block
+{
+    struct arena_block *next;
+};
+
+#define ARENA_HEADER_SIZE \
+    ((sizeof(struct arena_block) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+
+void arena_init(arena_t *arena)
+{
+    memset(arena, 0, sizeof(arena_t));
+}
+
+void arena_free(arena_t *arena)
+{
+    if(arena)
+    {
+        struct arena_block *b, *next;
+        for(b = arena->blocks; b; b = next)
+        {
+            next = b->next;
+            free(b);
+        }
+        arena_init(arena);
+    }
+}
+
+static void *arena_new_block(arena_t *arena, size_t size)
+{
+    struct arena_block *b = malloc(ARENA_HEADER_SIZE + size);
+    if(b == NULL)
+        return NULL;
+    arena->allocated += ARENA_HEADER_SIZE + size;
+
+    if(size > ARENA_LARGE_SIZE && arena->blocks)
+    {
+        /* keep using the current block for small objects */
+        b->next = arena->blocks->next;
+        arena->blocks->next = b;
+    }
+    else
+    {
+        b->next = arena->blocks;
+        arena->blocks = b;
+    }
+
+    return (char *)b + ARENA_HEADER_SIZE;
+}
+
+/* Returns size bytes of unaligned memory, for strings. */
+static void *arena_alloc_bytes(arena_t *arena, size_t size)
+{
+    if(size > arena->left)
+    {
+        if(size > ARENA_LARGE_SIZE)
+            return arena_new_block(arena, size);
+
+        char *p = arena_new_block(arena, ARENA_BLOCK_SIZE);
+        if(p == NULL)
+            return NULL;
+        arena->next = p;
+        arena->left = ARENA_BLOCK_SIZE;
+    }
+
+    void *p = arena->next;
+    arena->next += size;
+    arena->left -= size;
+    return p;
+}
+
+void *arena_alloc(arena_t *arena, size_t size)
+{
+    size_t pad = -(uintptr_t)arena->next & (ARENA_ALIGN - 1);
+    if(pad <= arena->left)
+    {
+        arena->next += pad;
+        arena->left -= pad;
+    }
+    else
+    {
+        arena->left = 0;
+    }
+
+    /* new blocks start aligned */
+    return arena_alloc_bytes(arena, size ? size : 1);
+}
+
+void *arena_calloc(arena_t *arena, size_t size)
+{
+    void *p = arena_alloc(arena, size);
+    if(p)
+        memset(p, 0, size);
+    return p;
+}
+
+char *arena_strdup(arena_t *arena, const char *string)
+{
+    if(string == NULL)
+        return NULL;
+
+    size_t len = strlen(string) + 1;
+    char *s = arena_alloc_bytes(arena, len);
+    if(s)
+        memcpy(s, string, len);
+    return s;
+}
+
+#ifdef TEST
+
+#include "unit_test.h"
+
+int main(void)
+{
+    arena_t arena;
+    arena_init(&arena);
+
+    /* objects are aligned after strings */
+    char *s = arena_strdup(&arena, "abc");
+    fail_unless(s && strcmp(s, "abc") == 0);
+    uint64_t *n = arena_alloc(&arena, sizeof(uint64_t));
+    fail_unless(((uintptr_t)n & (ARENA_ALIGN - 1)) == 0);
+    *n = 17;
+    fail_unless(strcmp(s, "abc") == 0);
+
+    char *z = arena_calloc(&arena, 100);
+    int i;
+    for(i = 0; i < 100; i++)
+        fail_unless(z[i] == 0);
+
+    /* fill several blocks */
+    char *first = arena_strdup(&arena, "first");
+    for(i = 0; i < 100000; i++)
+    {
+        char *p = arena_alloc(&arena, 24);
+        memset(p, 0xAB, 24);
+    }
+    fail_unless(arena.allocated >= 100000 * 24);
+    fail_unless(strcmp(first, "first") == 0);
+
+    arena_free(&arena);
+    fail_unless(arena.blocks == NULL && arena.allocated == 0);
+
+    /* a large object doesn't waste the rest of the current block */
+    n = arena_alloc(&arena, sizeof(uint64_t));
+    *n = 17;
+    char *before = arena.next;
+    char *large = arena_alloc(&arena, ARENA_BLOCK_SIZE * 2);
+    memset(large, 0, ARENA_BLOCK_SIZE * 2);
+    char *after = arena_alloc(&arena, 8);
+    fail_unless(after - before < 2 * (int)ARENA_ALIGN);
+    fail_unless(*n == 17);
+    arena_free(&arena);
+
+    /* can be used again */
+    fail_unless(strcmp(arena_strdup(&arena, "again"), "again") == 0);
+    arena_free(&arena);
+
+    return 0;
+}
+
+#endif
+
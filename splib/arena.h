@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2007 Martin Hedenfalk <martin@bzero.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _arena_h_
+#define _arena_h_
+
+#include <stddef.h>
+
+/* Memory for many small objects freed together. Objects are carved out of
+ * large blocks and can't be freed one by one; arena_free() releases all
+ * blocks at once.
+ */
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+/* larger allocations get a block of their own */
+#define ARENA_LARGE_SIZE (ARENA_BLOCK_SIZE / 4)
+
+struct arena_block;
+
+typedef struct arena arena_t;
+struct arena
+{
+    struct arena_block *blocks;
+    char *next;
+    size_t left;
+    size_t allocated; /* bytes of blocks, for statistics */
+};
+
+void arena_init(arena_t *arena);
+void arena_free(arena_t *arena);
+void *arena_alloc(arena_t *arena, size_t size);
+void *arena_calloc(arena_t *arena, size_t size);
+char *arena_strdup(arena_t *arena, const char *string);
+
+#endif
+
@@ -26,37 +26,111 @@
  */
 
 #include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
-#include "args.h"
 #include "cmd_table.h"
 
-static cmd_t *cmd_find(const char *cmdline, int len, cmd_t *cmds)
+/* Keep in sync with cmd_hash() in support/cmd_hash.awk. */
+unsigned cmd_hash(const char *name, size_t len, unsigned seed)
 {
-    int i;
+    uint64_t h = 0;
+    uint64_t m = 2 * (uint64_t)seed + 1;
+    size_t i;
+
+    for(i = 0; i < len; i++)
+        h = (h * m + (unsigned char)name[i]) & 0xFFFFF;
+
+    return h + (h >> 10);
+}
+
+static cmd_t *cmd_find(const char *cmdline, size_t len,
+        cmd_table_t *table)
+{
+    if(cmdline == NULL || table == NULL)
+        return NULL;
 
-    if(cmdline == NULL || cmds == NULL)
+    unsigned i = table->slots[cmd_hash(cmdline, len, table->seed) &
+        table->mask];
+    if(i == 0)
         return NULL;
 
-    for(i = 0; cmds[i].name; i++)
+    cmd_t *cmd = &table->cmds[i - 1];
+    if(strncmp(cmdline, cmd->name, len) == 0 && cmd->name[len] == 0)
+        return cmd;
+
+    return NULL;
+}
+
+/* Splits str into arguments the same way as arg_create_max(), but in
+ * place: separators are overwritten with NULs and argv points into str.
+ * Empty fields are NULL. *argv is replaced with a heap array if there are
+ * more than *size arguments. Returns the number of arguments.
+ */
+static int cmd_split(char *str, const char *sep, int allow_null_fields,
+        int max_args, char ***argv, int *size)
+{
+    char *token = str;
+    int argc = 0;
+
+    if(!allow_null_fields)
     {
-        if(strncmp(cmdline, cmds[i].name, len) == 0 && len == strlen(cmds[i].name))
-            return &cmds[i];
+        token += strspn(token, sep); /* skip all initial separators */
     }
 
-    return NULL;
+    while(1)
+    {
+        size_t len;
+        if(max_args >= 0 && argc + 1 >= max_args)
+        {
+            len = strlen(token);
+        }
+        else
+        {
+            len = strcspn(token, sep);
+        }
+
+        if(len || allow_null_fields)
+        {
+            if(argc == *size)
+            {
+                char **argv_heap = malloc(2 * *size * sizeof(char *));
+                memcpy(argv_heap, *argv, *size * sizeof(char *));
+                if(*size > CMD_MAX_ARGS)
+                    free(*argv);
+                *argv = argv_heap;
+                *size *= 2;
+            }
+            (*argv)[argc++] = len ? token : NULL;
+            token += len;
+        }
+
+        if(*token == 0)
+        {
+            break;
+        }
+
+        *token++ = 0; /* terminate the argument, skip one separator */
+        if(!allow_null_fields)
+        {
+            token += strspn(token, sep); /* skip all separators */
+        }
+    }
+
+    return argc;
 }
 
-int cmd_dispatch(const char *cmdline,
+int cmd_dispatch(char *cmdline,
         const char *delimiters,
         int allow_null_elements,
-        cmd_t *command_table,
+        cmd_table_t *command_table,
         void *user_data)
 {
     if(cmdline == NULL || delimiters == NULL)
         return -1;
 
-    int cmdlen = strcspn(cmdline, delimiters);
+    size_t cmdlen = strcspn(cmdline, delimiters);
     if(cmdlen == 0)
     {
         /* got empty command */
@@ -71,9 +145,10 @@ int cmd_dispatch(const char *cmdline,
     }
 
     int max_args = -1;
-    if(cmd->required_arguments < 0)
+    int req_args = cmd->required_arguments;
+    if(req_args < 0)
     {
-        max_args = -cmd->required_arguments;
+        max_args = req_args = -req_args;
     }
 
     /* skip past the command name + one delimiter */
@@ -83,40 +158,26 @@ int cmd_dispatch(const char *cmdline,
         cmdline++;
     }
 
-    arg_t *args;
+    /* Commands that take the rest of the line as one argument, like
+     * $Search and $MyINFO, are not split at all. */
+    char *argv_stack[CMD_MAX_ARGS];
+    char **argv = argv_stack;
+    int size = CMD_MAX_ARGS;
+    int argc = 0;
     if(*cmdline)
     {
-        args = arg_create_max(cmdline, delimiters,
-                allow_null_elements, max_args);
-    }
-    else
-    {
-        args = arg_create_from_argv(0, NULL);
-    }
-    if(args == NULL)
-    {
-        /*WARNING("unable to split arguments in [%s] by [%s], max %i",
-                cmdline, delimiters, max_args);*/
-        return -1;
+        argc = cmd_split(cmdline, delimiters, allow_null_elements,
+                max_args, &argv, &size);
     }
 
-    int req_args = cmd->required_arguments;
-    if(req_args < 0)
+    int rc = 0;
+    if(argc >= req_args)
     {
-        req_args = -req_args;
+        rc = cmd->func(user_data, argc, argv);
     }
 
-    if(args->argc < req_args)
-    {
-        /*WARNING("command '%s' requires %i arguments, only %i given: [%s]",
-                cmd->name, req_args, args->argc, cmdline);*/
-        arg_free(args);
-        return 0;
-    }
-
-    int rc = cmd->func(user_data, args->argc, args->argv);
-
-    arg_free(args);
+    if(argv != argv_stack)
+        free(argv);
 
     return rc;
 }
@@ -157,41 +218,110 @@ int cmd_test_cb2(void *user_data, int argc, char **argv)
     return 42;
 }
 
-int main(void)
+int cmd_test_split_cb(void *user_data, int argc, char **argv)
 {
-    cmd_t cmds[] = {
-        {"test", cmd_test_cb, 1},
-        {"test2", cmd_test_cb2, -1},
-        {0, 0, -1}
-    };
+    char **expected = user_data;
+    int i;
+
+    fail_unless(argc == expected_args);
+    for(i = 0; i < argc; i++)
+    {
+        if(expected[i] == NULL)
+            fail_unless(argv[i] == NULL);
+        else
+            fail_unless(argv[i] && strcmp(argv[i], expected[i]) == 0);
+    }
+
+    return 1;
+}
+
+#include "cmd_table_test.h"
 
+int main(void)
+{
     int rc;
+    int i;
 
-    rc = cmd_dispatch(NULL, " ", 0, cmds, (void *)0xDEADBEEF);
+    /* every name hashes to its own command */
+    for(i = 0; cmds.cmds[i].name; i++)
+    {
+        const char *name = cmds.cmds[i].name;
+        fail_unless(cmds.slots[cmd_hash(name, strlen(name), cmds.seed) &
+                    cmds.mask] == i + 1);
+    }
+
+    rc = cmd_dispatch(NULL, " ", 0, &cmds, (void *)0xDEADBEEF);
     fail_unless(rc == -1);
 
-    rc = cmd_dispatch("foo", NULL, 0, cmds, (void *)0xDEADBEEF);
+    char line1[] = "foo";
+    rc = cmd_dispatch(line1, NULL, 0, &cmds, (void *)0xDEADBEEF);
     fail_unless(rc == -1);
 
     expected_args = 1;
-    rc = cmd_dispatch("test foobar", " ", 0, cmds, (void *)0xDEADBEEF);
+    char line2[] = "test foobar";
+    rc = cmd_dispatch(line2, " ", 0, &cmds, (void *)0xDEADBEEF);
     fail_unless(rc == 17);
 
     expected_args = 0;
-    rc = cmd_dispatch("test", " ", 0, cmds, (void *)0xDEADBEEF);
+    char line3[] = "test";
+    rc = cmd_dispatch(line3, " ", 0, &cmds, (void *)0xDEADBEEF);
     fail_unless(rc == 0);
 
     expected_args = -1;
-    rc = cmd_dispatch("fail foobar", " ", 0, cmds, (void *)0xDEADBEEF);
+    char line4[] = "fail foobar";
+    rc = cmd_dispatch(line4, " ", 0, &cmds, (void *)0xDEADBEEF);
     fail_unless(rc == 0);
 
     expected_args = 1;
-    rc = cmd_dispatch("test2 foo bar", " ", 0, cmds, (void *)0xDEADBEEF);
+    char line5[] = "test2 foo bar";
+    rc = cmd_dispatch(line5, " ", 0, &cmds, (void *)0xDEADBEEF);
     fail_unless(rc == 42);
 
-    rc = cmd_dispatch("t foobar", " ", 0, cmds, (void *)0xDEADBEEF);
+    char line6[] = "t foobar";
+    rc = cmd_dispatch(line6, " ", 0, &cmds, (void *)0xDEADBEEF);
+    fail_unless(rc == 0);
+
+    /* prefixes and extensions of known names are unknown */
+    char line7[] = "test22 foobar";
+    rc = cmd_dispatch(line7, " ", 0, &cmds, (void *)0xDEADBEEF);
     fail_unless(rc == 0);
 
+    /* empty fields */
+    char *expected1[] = {"a", NULL, "b", NULL};
+    expected_args = 4;
+    char line8[] = "split$a$$b$";
+    rc = cmd_dispatch(line8, "$", 1, &cmds, expected1);
+    fail_unless(rc == 1);
+
+    char *expected2[] = {"a", "b"};
+    expected_args = 2;
+    char line9[] = "split  a  b ";
+    rc = cmd_dispatch(line9, " ", 0, &cmds, expected2);
+    fail_unless(rc == 1);
+
+    /* the last argument gets the rest of the line */
+    char *expected3[] = {"a", "b c  d"};
+    expected_args = 2;
+    char line10[] = "split2 a b c  d";
+    rc = cmd_dispatch(line10, " ", 0, &cmds, expected3);
+    fail_unless(rc == 1);
+
+    /* more arguments than fit on the stack */
+    char line11[3 * CMD_MAX_ARGS * 3 + 16] = "split";
+    char *expected4[3 * CMD_MAX_ARGS];
+    for(i = 0; i < 3 * CMD_MAX_ARGS; i++)
+    {
+        char arg[4];
+        snprintf(arg, sizeof(arg), " %c", 'A' + i % 26);
+        strcat(line11, arg);
+        expected4[i] = strdup(arg + 1);
+    }
+    expected_args = 3 * CMD_MAX_ARGS;
+    rc = cmd_dispatch(line11, " ", 0, &cmds, expected4);
+    fail_unless(rc == 1);
+    for(i = 0; i < 3 * CMD_MAX_ARGS; i++)
+        free(expected4[i]);
+
     return 0;
 }
 
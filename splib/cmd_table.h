@@ -1,6 +1,8 @@
 #ifndef _cmd_table_h_
 #define _cmd_table_h_
 
+#include <stddef.h>
+
 typedef int (*cmd_handler_t)(void *user_data, int argc, char **argv);
 
 typedef struct cmd cmd_t;
@@ -11,10 +13,29 @@ struct cmd
     int required_arguments;
 };
 
-int cmd_dispatch(const char *cmdline,
+/* arguments split without allocating, longer commands use the heap */
+#define CMD_MAX_ARGS 32
+
+/* A table of commands with a perfect hash of the names, generated by
+ * support/cmd_hash.awk. Each name hashes to its own slot, which holds the
+ * index of the command plus one (0 for empty slots).
+ */
+typedef struct cmd_table cmd_table_t;
+struct cmd_table
+{
+    cmd_t *cmds;
+    const unsigned char *slots;
+    unsigned mask;
+    unsigned seed;
+};
+
+unsigned cmd_hash(const char *name, size_t len, unsigned seed);
+
+/* Splits the arguments in place, the command line is modified. */
+int cmd_dispatch(char *cmdline,
         const char *delimiters,
         int allow_null_elements,
-        cmd_t *command_table,
+        cmd_table_t *command_table,
         void *user_data);
 
 #endif
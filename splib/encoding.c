@@ -177,6 +177,30 @@ char *str_legacy_to_utf8_lossy(const char *string, const char *legacy_encoding)
     return str_legacy_to_utf8_internal(string, legacy_encoding, '?');
 }
 
+/* Like str_legacy_to_utf8_lossy, but doesn't allocate a new string. Returns
+ * <string> itself if it is already valid UTF-8 (eg, plain ASCII), otherwise a
+ * string converted with the converters in <cache>, which is overwritten by
+ * the next conversion. Returns NULL if conversion fails.
+ */
+char *str_legacy_to_utf8_cached(iconv_cache_t *cache, char *string,
+        const char *legacy_encoding)
+{
+    if(string == NULL || legacy_encoding == NULL)
+        return NULL;
+
+    const unsigned char *p = (const unsigned char *)string;
+    while(*p && *p < 0x80)
+        p++;
+    if(*p == 0)
+        return string;
+
+    if(g_utf8_validate((const char *)p, -1, NULL))
+        return string;
+
+    return iconv_cache_convert(cache, string, -1, legacy_encoding, "UTF-8",
+            NULL, '?');
+}
+
 char *str_convert_to_unescaped_utf8(const char *string, const char *legacy_encoding)
 {
     if(string == NULL || legacy_encoding == NULL)
@@ -279,6 +303,7 @@ char *str_utf8_to_escaped_legacy(const char *string,
 #ifdef TEST
 
 # include <stdio.h>
+# include <sys/time.h>
 
 #define fail_unless(test) \
     do { if(!(test)) { \
@@ -290,6 +315,79 @@ char *str_utf8_to_escaped_legacy(const char *string,
         exit(1); \
     } } while(0)
 
+static double elapsed(struct timeval *start)
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start->tv_sec) +
+        (now.tv_usec - start->tv_usec) / 1000000.0;
+}
+
+/* Replays the commands a hub sends at login, mostly $MyINFO, through both
+ * the allocating and the cached conversion, which must give the same result.
+ */
+static void test_login_stream(void)
+{
+    const unsigned nlines = 20000;
+    char **lines = calloc(nlines, sizeof(char *));
+    unsigned i;
+
+    for(i = 0; i < nlines; i++)
+    {
+        /* every 10th user has a non-ASCII nick or description */
+        int rc = asprintf(&lines[i],
+                "$MyINFO $ALL %s%u %s<++ V:0.674,M:A,H:1/0/0,S:3>$ $DSL%c$$%llu$",
+                i % 10 == 3 ? "Bj\xf6rn" : "user", i,
+                i % 10 == 7 ? "Gr\xfc\xdf" "e aus K\xf6ln" : "just chatting",
+                1, (unsigned long long)i * 1234567);
+        fail_unless(rc != -1);
+    }
+
+    for(i = 0; i < nlines; i++)
+    {
+        char *a = str_legacy_to_utf8_lossy(lines[i], "WINDOWS-1252");
+        fail_unless(a);
+        iconv_cache_t *cache = iconv_cache_new();
+        char *b = str_legacy_to_utf8_cached(cache, lines[i], "WINDOWS-1252");
+        fail_unless(b);
+        fail_unless(strcmp(a, b) == 0);
+        fail_unless((b == lines[i]) == (i % 10 != 3 && i % 10 != 7));
+        iconv_cache_free(cache);
+        free(a);
+    }
+
+    const unsigned nrounds = 5;
+    struct timeval start;
+    unsigned r;
+
+    gettimeofday(&start, NULL);
+    for(r = 0; r < nrounds; r++)
+    {
+        for(i = 0; i < nlines; i++)
+            free(str_legacy_to_utf8_lossy(lines[i], "WINDOWS-1252"));
+    }
+    double t_alloc = elapsed(&start);
+
+    iconv_cache_t *cache = iconv_cache_new();
+    gettimeofday(&start, NULL);
+    for(r = 0; r < nrounds; r++)
+    {
+        for(i = 0; i < nlines; i++)
+            fail_unless(str_legacy_to_utf8_cached(cache, lines[i],
+                        "WINDOWS-1252"));
+    }
+    double t_cached = elapsed(&start);
+    iconv_cache_free(cache);
+
+    printf("%u login commands: %.3f us/command, cached %.3f us/command\n",
+            nlines, t_alloc * 1e6 / (nlines * nrounds),
+            t_cached * 1e6 / (nlines * nrounds));
+
+    for(i = 0; i < nlines; i++)
+        free(lines[i]);
+    free(lines);
+}
+
 int main(void)
 {
     sp_log_set_level("debug");
@@ -307,6 +405,34 @@ int main(void)
     fail_unless(strcmp(w, "abc @, should fail: ? ? ? ? ?") == 0);
 #endif
 
+    /*
+     * str_legacy_to_utf8_cached
+     */
+    iconv_cache_t *cache = iconv_cache_new();
+    char ascii[] = "ascii";
+    fail_unless(str_legacy_to_utf8_cached(cache, ascii, "MS-ANSI") == ascii);
+    char utf8[] = "\xc3\xa5\xc3\xa4\xc3\xb6";
+    fail_unless(str_legacy_to_utf8_cached(cache, utf8, "MS-ANSI") == utf8);
+    char legacy[] = "abc \x40, should fail: \x81 \x8D \x8F \x9D \x9D";
+    w = str_legacy_to_utf8_cached(cache, legacy, "MS-ANSI");
+    fail_unless(w);
+    fail_unless(strcmp(w, "abc @, should fail: ? ? ? ? ?") == 0);
+    char latin1[] = "\xe5\xe4\xf6";
+    w = str_legacy_to_utf8_cached(cache, latin1, "WINDOWS-1252");
+    fail_unless(w);
+    fail_unless(strcmp(w, "\xc3\xa5\xc3\xa4\xc3\xb6") == 0);
+    /* the buffer grows as needed */
+    char *long_latin1 = malloc(10001);
+    memset(long_latin1, '\xe5', 10000);
+    long_latin1[10000] = 0;
+    w = str_legacy_to_utf8_cached(cache, long_latin1, "WINDOWS-1252");
+    fail_unless(w);
+    fail_unless(strlen(w) == 20000);
+    free(long_latin1);
+    iconv_cache_free(cache);
+
+    test_login_stream();
+
     /*
      * str_utf8_to_legacy
      */
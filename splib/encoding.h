@@ -21,8 +21,12 @@
 #ifndef _encoding_h_
 #define _encoding_h_
 
+#include "iconv_string.h"
+
 char *str_legacy_to_utf8(const char *string, const char *encoding);
 char *str_legacy_to_utf8_lossy(const char *string, const char *encoding);
+char *str_legacy_to_utf8_cached(iconv_cache_t *cache, char *string,
+        const char *encoding);
 char *str_convert_to_unescaped_utf8(const char *string, const char *encoding);
 char *str_convert_to_escaped_utf8(const char *string, const char *encoding);
 char *str_utf8_to_legacy(const char *string, const char *encoding);
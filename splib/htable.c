@@ -0,0 +1,429 @@
+/*
+ * Copyright (c) 2007 Martin Hedenfalk <martin@bzero.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "htable.h"
+
+#define HTABLE_MIN_SIZE 64
+
+/* Marks a slot in the previous table whose record is moved or removed.
+ * Nothing is inserted in the previous table, so the marks keep the probe
+ * sequences of the remaining records intact. */
+static char htable_removed_mark;
+#define HTABLE_REMOVED ((void *)&htable_removed_mark)
+
+void htable_init(htable_t *t, htable_hash_func hash)
+{
+    memset(t, 0, sizeof(htable_t));
+    t->hash = hash;
+}
+
+void htable_free(htable_t *t)
+{
+    if(t)
+    {
+        free(t->slots);
+        free(t->old_slots);
+        t->slots = t->old_slots = NULL;
+        t->mask = t->old_mask = 0;
+        t->count = t->old_count = 0;
+    }
+}
+
+static void htable_put(htable_t *t, void *record, uint32_t hash)
+{
+    uint32_t i = hash & t->mask;
+    while(t->slots[i].record)
+        i = (i + 1) & t->mask;
+    t->slots[i].record = record;
+    t->slots[i].hash = hash;
+    t->count++;
+}
+
+/* Moves up to n slots of the previous table to the current one. */
+static void htable_migrate(htable_t *t, unsigned n)
+{
+    while(t->old_slots && n--)
+    {
+        if(t->old_count == 0 || t->old_pos > t->old_mask)
+        {
+            free(t->old_slots);
+            t->old_slots = NULL;
+            t->old_mask = t->old_pos = t->old_count = 0;
+            break;
+        }
+
+        struct htable_slot *s = &t->old_slots[t->old_pos++];
+        if(s->record && s->record != HTABLE_REMOVED)
+        {
+            htable_put(t, s->record, s->hash);
+            s->record = HTABLE_REMOVED;
+            t->old_count--;
+        }
+    }
+}
+
+static void htable_grow(htable_t *t)
+{
+    /* Finish any previous move. This only happens if most records were
+     * inserted without removals in between, as each insert moves
+     * HTABLE_MIGRATE_STEP slots. */
+    htable_migrate(t, (unsigned)-1);
+
+    uint32_t size = t->slots ? (t->mask + 1) * 2 : HTABLE_MIN_SIZE;
+
+    t->old_slots = t->slots;
+    t->old_mask = t->mask;
+    t->old_pos = 0;
+    t->old_count = t->count;
+
+    t->slots = calloc(size, sizeof(struct htable_slot));
+    t->mask = size - 1;
+    t->count = 0;
+}
+
+void htable_insert(htable_t *t, void *record)
+{
+    htable_migrate(t, HTABLE_MIGRATE_STEP);
+
+    /* keep the load factor at most 1/2 */
+    if(t->slots == NULL || (t->count + t->old_count + 1) * 2 > t->mask + 1)
+        htable_grow(t);
+
+    htable_put(t, record, t->hash(record));
+}
+
+static int htable_remove_current(htable_t *t, void *record, uint32_t hash)
+{
+    uint32_t i = hash & t->mask;
+    while(t->slots[i].record != record)
+    {
+        if(t->slots[i].record == NULL)
+            return -1;
+        i = (i + 1) & t->mask;
+    }
+
+    /* Close the hole by moving back later records of the cluster that
+     * can't be found past it. */
+    uint32_t j = i;
+    for(;;)
+    {
+        t->slots[i].record = NULL;
+        for(;;)
+        {
+            j = (j + 1) & t->mask;
+            if(t->slots[j].record == NULL)
+            {
+                t->count--;
+                return 0;
+            }
+            uint32_t k = t->slots[j].hash & t->mask;
+            /* does the home slot k lie cyclically in (i, j] ? */
+            if(i <= j ? (i < k && k <= j) : (i < k || k <= j))
+                continue;
+            break;
+        }
+        t->slots[i] = t->slots[j];
+        i = j;
+    }
+}
+
+static void htable_remove_old(htable_t *t, void *record, uint32_t hash)
+{
+    uint32_t i = hash & t->old_mask;
+    while(t->old_slots[i].record != record)
+    {
+        if(t->old_slots[i].record == NULL)
+            return;
+        i = (i + 1) & t->old_mask;
+    }
+    t->old_slots[i].record = HTABLE_REMOVED;
+    t->old_count--;
+}
+
+void htable_remove(htable_t *t, void *record)
+{
+    if(t->slots == NULL)
+        return;
+
+    uint32_t hash = t->hash(record);
+    if(htable_remove_current(t, record, hash) != 0 && t->old_slots)
+        htable_remove_old(t, record, hash);
+
+    htable_migrate(t, HTABLE_MIGRATE_STEP);
+}
+
+/* Returns the record with the given hash that matches key, or NULL. */
+void *htable_lookup(htable_t *t, uint32_t hash,
+        htable_match_func match, const void *key)
+{
+    if(t->slots == NULL)
+        return NULL;
+
+    uint32_t i = hash & t->mask;
+    struct htable_slot *s;
+    while((s = &t->slots[i])->record)
+    {
+        if(s->hash == hash && match(s->record, key))
+            return s->record;
+        i = (i + 1) & t->mask;
+    }
+
+    if(t->old_slots)
+    {
+        i = hash & t->old_mask;
+        while((s = &t->old_slots[i])->record)
+        {
+            if(s->record != HTABLE_REMOVED && s->hash == hash &&
+               match(s->record, key))
+                return s->record;
+            i = (i + 1) & t->old_mask;
+        }
+    }
+
+    return NULL;
+}
+
+/* Iterates over all records. Start with *pos = 0. Returns NULL after the
+ * last record. The table must not be changed while iterating. */
+void *htable_next(htable_t *t, unsigned *pos)
+{
+    unsigned size = t->slots ? t->mask + 1 : 0;
+    unsigned old_size = t->old_slots ? t->old_mask + 1 : 0;
+
+    while(*pos < size + old_size)
+    {
+        unsigned i = (*pos)++;
+        void *record = i < size ? t->slots[i].record :
+            t->old_slots[i - size].record;
+        if(record && record != HTABLE_REMOVED)
+            return record;
+    }
+
+    return NULL;
+}
+
+unsigned htable_count(htable_t *t)
+{
+    return t->count + t->old_count;
+}
+
+/* FNV-1a, with a final mix so all bits depend on all input. */
+uint32_t htable_hash_string(const char *string)
+{
+    uint32_t h = 2166136261U;
+    const unsigned char *p;
+    for(p = (const unsigned char *)string; *p; p++)
+    {
+        h ^= *p;
+        h *= 16777619U;
+    }
+
+    h ^= h >> 16;
+    h *= 0x85EBCA6BU;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35U;
+    h ^= h >> 16;
+    return h;
+}
+
+uint32_t htable_hash_uint64(uint64_t n)
+{
+    n ^= n >> 33;
+    n *= 0xFF51AFD7ED558CCDULL;
+    n ^= n >> 33;
+    n *= 0xC4CEB9FE1A85EC53ULL;
+    n ^= n >> 33;
+    return (uint32_t)n;
+}
+
+#ifdef TEST
+
+#include <stdio.h>
+#include <sys/time.h>
+
+#include "unit_test.h"
+
+struct record
+{
+    uint64_t key;
+    char nick[16];
+};
+
+static uint32_t record_hash(const void *record)
+{
+    return htable_hash_uint64(((const struct record *)record)->key);
+}
+
+static int record_match(const void *record, const void *key)
+{
+    return ((const struct record *)record)->key == *(const uint64_t *)key;
+}
+
+static uint32_t nick_hash(const void *record)
+{
+    return htable_hash_string(((const struct record *)record)->nick);
+}
+
+static int nick_match(const void *record, const void *key)
+{
+    return strcmp(((const struct record *)record)->nick, key) == 0;
+}
+
+static struct record *lookup(htable_t *t, uint64_t key)
+{
+    return htable_lookup(t, htable_hash_uint64(key), record_match, &key);
+}
+
+static double elapsed(struct timeval *tv_start)
+{
+    struct timeval tv_end;
+    gettimeofday(&tv_end, NULL);
+    return (tv_end.tv_sec - tv_start->tv_sec) +
+        (tv_end.tv_usec - tv_start->tv_usec) / 1000000.0;
+}
+
+static void test_basic(void)
+{
+    htable_t t;
+    htable_init(&t, record_hash);
+    fail_unless(lookup(&t, 1) == NULL);
+    htable_remove(&t, &t);
+
+    const unsigned n = 10000;
+    struct record *records = calloc(n, sizeof(struct record));
+    unsigned i;
+    for(i = 0; i < n; i++)
+    {
+        records[i].key = i * 4096; /* like sizes or inodes, low bits equal */
+        htable_insert(&t, &records[i]);
+
+        /* records are found while being moved to a larger table */
+        fail_unless(lookup(&t, i * 4096) == &records[i]);
+        if(i > 0)
+            fail_unless(lookup(&t, (i - 1) * 4096) == &records[i - 1]);
+    }
+    fail_unless(htable_count(&t) == n);
+
+    for(i = 0; i < n; i++)
+        fail_unless(lookup(&t, i * 4096) == &records[i]);
+    fail_unless(lookup(&t, 4095) == NULL);
+
+    /* remove every other record */
+    for(i = 0; i < n; i += 2)
+        htable_remove(&t, &records[i]);
+    fail_unless(htable_count(&t) == n / 2);
+    for(i = 0; i < n; i++)
+        fail_unless(lookup(&t, i * 4096) == (i % 2 ? &records[i] : NULL));
+
+    /* iteration returns each record once */
+    unsigned pos = 0, count = 0;
+    struct record *r;
+    while((r = htable_next(&t, &pos)) != NULL)
+    {
+        fail_unless(r->key % 8192 == 4096);
+        count++;
+    }
+    fail_unless(count == n / 2);
+
+    /* removing records while the table is being grown */
+    htable_free(&t);
+    htable_init(&t, record_hash);
+    for(i = 0; i < 33; i++)
+        htable_insert(&t, &records[i]);
+    fail_unless(t.old_slots);
+    for(i = 0; i < 33; i += 3)
+        htable_remove(&t, &records[i]);
+    for(i = 0; i < 33; i++)
+        fail_unless(lookup(&t, i * 4096) == (i % 3 ? &records[i] : NULL));
+    fail_unless(htable_count(&t) == 22);
+
+    htable_free(&t);
+    free(records);
+}
+
+/* shared files by inode, and hub users by nick */
+static void test_benchmark(void)
+{
+    static const unsigned sizes[] = {30000, 500000, 0};
+    int i;
+    for(i = 0; sizes[i]; i++)
+    {
+        unsigned n = sizes[i];
+        struct record *records = calloc(n, sizeof(struct record));
+        htable_t inodes, nicks;
+        htable_init(&inodes, record_hash);
+        htable_init(&nicks, nick_hash);
+
+        struct timeval tv_start;
+        double worst = 0;
+        unsigned j;
+        for(j = 0; j < n; j++)
+        {
+            records[j].key = ((uint64_t)(1000 + j) << 32) | (j + 12345);
+            snprintf(records[j].nick, sizeof(records[j].nick),
+                    "user%08u", j * 7);
+        }
+
+        gettimeofday(&tv_start, NULL);
+        for(j = 0; j < n; j++)
+        {
+            struct timeval tv;
+            gettimeofday(&tv, NULL);
+            htable_insert(&inodes, &records[j]);
+            htable_insert(&nicks, &records[j]);
+            double t = elapsed(&tv);
+            if(t > worst)
+                worst = t;
+        }
+        double add_time = elapsed(&tv_start);
+
+        gettimeofday(&tv_start, NULL);
+        for(j = 0; j < n; j++)
+        {
+            fail_unless(lookup(&inodes, records[j].key) == &records[j]);
+            fail_unless(htable_lookup(&nicks,
+                        htable_hash_string(records[j].nick),
+                        nick_match, records[j].nick) == &records[j]);
+        }
+        double lookup_time = elapsed(&tv_start) * 1000000.0 / n / 2;
+
+        printf("%7u records: adding %.3f s (slowest %.3f ms), "
+                "lookups %.3f us\n",
+                n, add_time, worst * 1000.0, lookup_time);
+
+        htable_free(&inodes);
+        htable_free(&nicks);
+        free(records);
+    }
+}
+
+int main(void)
+{
+    fail_unless(htable_hash_string("a") != htable_hash_string("b"));
+    fail_unless((htable_hash_uint64(4096) & 0xFF) !=
+            (htable_hash_uint64(8192) & 0xFF));
+
+    test_basic();
+    test_benchmark();
+
+    return 0;
+}
+
+#endif
+
@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2007 Martin Hedenfalk <martin@bzero.se>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _htable_h_
+#define _htable_h_
+
+#include <stdint.h>
+
+/* A hash table of pointers to records, with open addressing and linear
+ * probing. When the table is half full, a table twice as large is
+ * allocated, and the records are moved over a few at a time by the
+ * following inserts and removals. No single operation rehashes the whole
+ * table.
+ */
+
+/* number of slots of the previous table moved per insert or removal */
+#define HTABLE_MIGRATE_STEP 16
+
+typedef uint32_t (*htable_hash_func)(const void *record);
+
+/* returns non-zero if the record has the key */
+typedef int (*htable_match_func)(const void *record, const void *key);
+
+struct htable_slot
+{
+    void *record;
+    uint32_t hash;
+};
+
+typedef struct htable htable_t;
+struct htable
+{
+    struct htable_slot *slots;
+    uint32_t mask;
+    unsigned count;
+
+    /* previous table, while records are moved from it */
+    struct htable_slot *old_slots;
+    uint32_t old_mask;
+    uint32_t old_pos; /* slots before this are moved */
+    unsigned old_count;
+
+    htable_hash_func hash;
+};
+
+void htable_init(htable_t *t, htable_hash_func hash);
+void htable_free(htable_t *t);
+void htable_insert(htable_t *t, void *record);
+void htable_remove(htable_t *t, void *record);
+void *htable_lookup(htable_t *t, uint32_t hash,
+        htable_match_func match, const void *key);
+void *htable_next(htable_t *t, unsigned *pos);
+unsigned htable_count(htable_t *t);
+
+uint32_t htable_hash_string(const char *string);
+uint32_t htable_hash_uint64(uint64_t n);
+
+#endif
+
@@ -30,6 +30,7 @@
 #include <stdio.h>
 
 #include "log.h"
+#include "iconv_string.h"
 
 char *iconv_string_full(const char *string, ssize_t length,
                         const char *src_encoding,
@@ -171,3 +172,164 @@ char *iconv_string_escaped(const char *string, ssize_t length,
             NULL, NULL, '?');
 }
 
+
+/* Number of converters kept open. A hub or peer connection normally uses a
+ * single encoding, but it may be changed. */
+#define ICONV_CACHE_SIZE 4
+
+struct iconv_cache_entry
+{
+    char *src_encoding;
+    char *dst_encoding;
+    iconv_t cd;
+};
+
+struct iconv_cache
+{
+    struct iconv_cache_entry entries[ICONV_CACHE_SIZE]; /* most recent first */
+    int nentries;
+
+    char *buf;
+    size_t bufsize;
+};
+
+iconv_cache_t *iconv_cache_new(void)
+{
+    return calloc(1, sizeof(iconv_cache_t));
+}
+
+void iconv_cache_free(iconv_cache_t *cache)
+{
+    if(cache == NULL)
+        return;
+
+    int i;
+    for(i = 0; i < cache->nentries; i++)
+    {
+        iconv_close(cache->entries[i].cd);
+        free(cache->entries[i].src_encoding);
+        free(cache->entries[i].dst_encoding);
+    }
+    free(cache->buf);
+    free(cache);
+}
+
+/* Returns an open converter, opening it if not cached. */
+static iconv_t iconv_cache_lookup(iconv_cache_t *cache,
+        const char *src_encoding, const char *dst_encoding)
+{
+    struct iconv_cache_entry entry;
+    int i;
+
+    for(i = 0; i < cache->nentries; i++)
+    {
+        if(strcmp(cache->entries[i].src_encoding, src_encoding) == 0 &&
+           strcmp(cache->entries[i].dst_encoding, dst_encoding) == 0)
+            break;
+    }
+
+    if(i < cache->nentries)
+    {
+        entry = cache->entries[i];
+        /* reset the conversion state */
+        iconv(entry.cd, NULL, NULL, NULL, NULL);
+    }
+    else
+    {
+        entry.cd = iconv_open(dst_encoding, src_encoding);
+        if(entry.cd == (iconv_t)-1)
+        {
+            WARNING("failed to open iconv: src=[%s], dst=[%s]",
+                    src_encoding, dst_encoding);
+            return entry.cd;
+        }
+        entry.src_encoding = strdup(src_encoding);
+        entry.dst_encoding = strdup(dst_encoding);
+
+        if(cache->nentries == ICONV_CACHE_SIZE)
+        {
+            /* evict the least recently used */
+            i = --cache->nentries;
+            iconv_close(cache->entries[i].cd);
+            free(cache->entries[i].src_encoding);
+            free(cache->entries[i].dst_encoding);
+        }
+        i = cache->nentries++;
+    }
+
+    memmove(&cache->entries[1], &cache->entries[0],
+            i * sizeof(struct iconv_cache_entry));
+    cache->entries[0] = entry;
+
+    return entry.cd;
+}
+
+/* Converts a string like iconv_string_full, but with a cached converter. The
+ * result is written to a buffer owned by the cache, which is overwritten by
+ * the next conversion; it must not be freed. Returns NULL if the conversion
+ * fails.
+ */
+char *iconv_cache_convert(iconv_cache_t *cache,
+                          const char *string, ssize_t length,
+                          const char *src_encoding,
+                          const char *dst_encoding,
+                          size_t *dst_length_p,
+                          int replacement_char)
+{
+    if(cache == NULL || string == NULL)
+        return NULL;
+
+    if(length < 0)
+        length = strlen(string);
+
+    iconv_t cd = iconv_cache_lookup(cache, src_encoding, dst_encoding);
+    if(cd == (iconv_t)-1)
+        return NULL;
+
+    if(cache->bufsize < length * 2 + 1)
+    {
+        cache->bufsize = length * 2 + 1; /* just a guess */
+        cache->buf = realloc(cache->buf, cache->bufsize);
+    }
+
+    ICONV_CONST char *inp = (ICONV_CONST char *)string;
+    char *outp = cache->buf;
+    size_t inbytesleft = length;
+    size_t outbytesleft = cache->bufsize - 1; /* room for the nul */
+
+    while(inbytesleft > 0)
+    {
+        size_t rc = iconv(cd, &inp, &inbytesleft, &outp, &outbytesleft);
+        if(rc != (size_t)-1)
+            break;
+
+        if(errno == E2BIG || (errno == EILSEQ && outbytesleft == 0))
+        {
+            /* The output buffer has not enough space. */
+            size_t used = outp - cache->buf;
+            cache->bufsize += length + 1;
+            cache->buf = realloc(cache->buf, cache->bufsize);
+            outp = cache->buf + used;
+            outbytesleft = cache->bufsize - 1 - used;
+        }
+        else if(errno == EILSEQ && replacement_char > 0)
+        {
+            /* inp points to the beginning of an invalid sequence */
+            *outp++ = (char)replacement_char;
+            outbytesleft--;
+            inp++;
+            inbytesleft--;
+        }
+        else
+        {
+            /* invalid or incomplete byte sequence */
+            return NULL;
+        }
+    }
+
+    *outp = 0;
+    if(dst_length_p)
+        *dst_length_p = outp - cache->buf;
+
+    return cache->buf;
+}
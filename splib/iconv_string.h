@@ -26,6 +26,8 @@
 #ifndef _iconv_string_h_
 #define _iconv_string_h_
 
+#include <sys/types.h>
+
 char *iconv_string_full(const char *string, ssize_t length,
                         const char *src_encoding,
                         const char *dst_encoding,
@@ -44,5 +46,18 @@ char *iconv_string_escaped(const char *string, ssize_t length,
                            const char *src_encoding,
                            const char *dst_encoding);
 
+/* A set of open converters, with a buffer reused for converted strings. */
+typedef struct iconv_cache iconv_cache_t;
+
+iconv_cache_t *iconv_cache_new(void);
+void iconv_cache_free(iconv_cache_t *cache);
+
+char *iconv_cache_convert(iconv_cache_t *cache,
+                          const char *string, ssize_t length,
+                          const char *src_encoding,
+                          const char *dst_encoding,
+                          size_t *dst_length_p,
+                          int replacement_char);
+
 #endif
 
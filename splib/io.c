@@ -21,6 +21,11 @@
 #include <sys/types.h>
 #include <sys/socket.h> /* for getsockname */
 #include <sys/un.h>
+#if defined(__linux__)
+# include <sys/sendfile.h>
+#elif defined(__APPLE__)
+# include <sys/uio.h>
+#endif
 
 #include <netinet/in.h> /* for inet_ntoa */
 #include <arpa/inet.h>
@@ -377,46 +382,225 @@ int io_set_blocking(int fd, int flag)
     return 0;
 }
 
-char *io_evbuffer_readline(struct evbuffer *buffer)
+/* Sends at most count bytes from the file fd, starting at offset, directly to
+ * the socket sock without copying the data through user space. The file
+ * position of fd is not changed.
+ *
+ * Returns the number of bytes sent, or -1 on error. errno is set to EAGAIN if
+ * the socket buffer is full, and to ENOSYS if not supported on this system.
+ */
+ssize_t io_sendfile(int sock, int fd, uint64_t offset, size_t count)
 {
-    char *data = (char *)EVBUFFER_DATA(buffer);
-    char *start;
-    size_t len = EVBUFFER_LENGTH(buffer);
-    char *line;
-    int i, n;
-
-    /* FIXME: '|' as end-of-line character is nmdc-specific */
-    for(i = n = 0; data[i] == '|' && i < len; i++)
-        /* skip leading '|'s */ n++;
-    start = data + i;
-    for(; i < len; i++)
+#if defined(__linux__)
+    off_t off = offset;
+    return sendfile(sock, fd, &off, count);
+#elif defined(__APPLE__)
+    off_t len = count;
+    if(sendfile(fd, sock, offset, &len, NULL, 0) == -1)
     {
-        if(data[i] == '|')
-            break;
+        /* partial writes are reported as EAGAIN with len set */
+        if((errno == EAGAIN || errno == EINTR) && len > 0)
+            return len;
+        return -1;
     }
+    return len;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
 
-    if (i == len)
-        return NULL;
-
-    if((line = malloc(i - n + 1)) == NULL)
+/* Drains the line returned last from the buffer. Needed before anything
+ * else reads the buffer, eg when a command switches the connection to
+ * receiving file data.
+ */
+void io_line_reader_done(struct io_line_reader *reader,
+        struct evbuffer *buffer)
+{
+    if(reader->pending)
     {
-        WARNING("%s: out of memory\n", __func__);
-        evbuffer_drain(buffer, i);
-        return (NULL);
+        evbuffer_drain(buffer, reader->pending);
+        reader->pending = 0;
     }
+}
 
-    memcpy(line, start, i - n);
-    line[i - n] = '\0';
+/* Returns the next complete line in the buffer, or NULL if there is none
+ * yet. Empty lines are skipped. Bytes already searched for a '|' aren't
+ * searched again when more data arrives.
+ */
+char *io_line_reader_next(struct io_line_reader *reader,
+        struct evbuffer *buffer)
+{
+    for(;;)
+    {
+        io_line_reader_done(reader, buffer);
+
+        size_t len = EVBUFFER_LENGTH(buffer);
+        if(reader->scanned > len)
+        {
+            /* drained by someone else */
+            reader->scanned = 0;
+        }
+        if(reader->scanned == len)
+            return NULL;
 
-    evbuffer_drain(buffer, i + 1);
+        char *data = (char *)EVBUFFER_DATA(buffer);
 
-    return line;
+        /* FIXME: '|' as end-of-line character is nmdc-specific */
+        char *end = memchr(data + reader->scanned, '|',
+                len - reader->scanned);
+        if(end == NULL)
+        {
+            reader->scanned = len;
+            return NULL;
+        }
+
+        *end = '\0';
+        reader->pending = end - data + 1;
+        reader->scanned = 0;
+
+        if(end > data)
+            return data;
+    }
 }
 
 #ifdef TEST
 
+#include <unistd.h>
+
 #include "unit_test.h"
 
+static void test_sendfile(void)
+{
+	char data[10000];
+	int i;
+	for(i = 0; i < sizeof(data); i++)
+		data[i] = i % 251;
+
+	char filename[] = "/tmp/sp-io-test.XXXXXX";
+	int fd = mkstemp(filename);
+	fail_unless(fd != -1);
+	unlink(filename);
+	fail_unless(write(fd, data, sizeof(data)) == sizeof(data));
+
+	int sv[2];
+	fail_unless(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+
+	ssize_t n = io_sendfile(sv[0], fd, 100, 5000);
+	if(n == -1 && (errno == ENOSYS || errno == EOPNOTSUPP ||
+		       errno == ENOTSOCK || errno == EINVAL))
+	{
+		/* not supported for unix sockets on this system */
+		printf("sendfile test skipped: %s\n", strerror(errno));
+	}
+	else
+	{
+		fail_unless(n == 5000);
+
+		/* the file position is untouched */
+		fail_unless(lseek(fd, 0, SEEK_CUR) == sizeof(data));
+
+		char buf[5000];
+		size_t got = 0;
+		while(got < sizeof(buf))
+		{
+			ssize_t rc = read(sv[1], buf + got, sizeof(buf) - got);
+			fail_unless(rc > 0);
+			got += rc;
+		}
+		fail_unless(memcmp(buf, data + 100, sizeof(buf)) == 0);
+	}
+
+	close(sv[0]);
+	close(sv[1]);
+	close(fd);
+}
+
+static void test_line_reader(void)
+{
+	struct evbuffer *buf = evbuffer_new();
+	struct io_line_reader reader;
+	memset(&reader, 0, sizeof(reader));
+
+	fail_unless(io_line_reader_next(&reader, buf) == NULL);
+
+	evbuffer_add(buf, "||$Lock abc|$Hel", 16);
+	char *line = io_line_reader_next(&reader, buf);
+	fail_unless(line && strcmp(line, "$Lock abc") == 0);
+	fail_unless(io_line_reader_next(&reader, buf) == NULL);
+	fail_unless(reader.scanned == 4);
+
+	evbuffer_add(buf, "lo nick|", 8);
+	line = io_line_reader_next(&reader, buf);
+	fail_unless(line && strcmp(line, "$Hello nick") == 0);
+	fail_unless(io_line_reader_next(&reader, buf) == NULL);
+	fail_unless(EVBUFFER_LENGTH(buf) == 0);
+
+	/* data following a command is left for the caller */
+	evbuffer_add(buf, "$ADCSND file|data|", 18);
+	line = io_line_reader_next(&reader, buf);
+	fail_unless(line && strcmp(line, "$ADCSND file") == 0);
+	io_line_reader_done(&reader, buf);
+	fail_unless(EVBUFFER_LENGTH(buf) == 5);
+	fail_unless(memcmp(EVBUFFER_DATA(buf), "data|", 5) == 0);
+
+	evbuffer_free(buf);
+}
+
+/* Replays a hub login: a long $NickList and a burst of $MyINFOs, received
+ * in network sized pieces. */
+static void test_line_reader_replay(void)
+{
+	const int nusers = 50000;
+	struct evbuffer *stream = evbuffer_new();
+	int i;
+
+	evbuffer_add_printf(stream, "$NickList ");
+	for(i = 0; i < nusers; i++)
+		evbuffer_add_printf(stream, "user%d$$", i);
+	evbuffer_add_printf(stream, "|");
+	for(i = 0; i < nusers; i++)
+		evbuffer_add_printf(stream, "$MyINFO $ALL user%d some "
+			"description<++ V:0.698,M:A,H:1/0/0,S:3>$ $DSL\x01$"
+			"user%d@example.com$%d$|", i, i, i * 1000);
+
+	size_t len = EVBUFFER_LENGTH(stream);
+	const char *data = (const char *)EVBUFFER_DATA(stream);
+
+	struct evbuffer *buf = evbuffer_new();
+	struct io_line_reader reader;
+	memset(&reader, 0, sizeof(reader));
+
+	struct timeval tv_start, tv_end;
+	gettimeofday(&tv_start, NULL);
+
+	int ncommands = 0;
+	size_t off;
+	for(off = 0; off < len; off += 1460)
+	{
+		evbuffer_add(buf, data + off, len - off < 1460 ? len - off : 1460);
+		char *line;
+		while((line = io_line_reader_next(&reader, buf)) != NULL)
+		{
+			fail_unless(line[0] == '$');
+			ncommands++;
+		}
+	}
+
+	gettimeofday(&tv_end, NULL);
+	double elapsed = (tv_end.tv_sec - tv_start.tv_sec) +
+		(tv_end.tv_usec - tv_start.tv_usec) / 1000000.0;
+
+	fail_unless(ncommands == nusers + 1);
+	fail_unless(EVBUFFER_LENGTH(buf) == 0);
+	printf("replayed %d commands (%lu bytes) in %.3f s, %.0f commands/s\n",
+		ncommands, (unsigned long)len, elapsed,
+		elapsed > 0 ? ncommands / elapsed : 0);
+
+	evbuffer_free(buf);
+	evbuffer_free(stream);
+}
+
 int main(void)
 {
 	sp_log_set_level("debug");
@@ -425,6 +609,10 @@ int main(void)
 	struct sockaddr_in *addr = io_lookup(":28589", &err);
 	fail_unless(addr == NULL);
 
+	test_sendfile();
+	test_line_reader();
+	test_line_reader_replay();
+
 	return 0;
 }
 
@@ -26,6 +26,7 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <event.h>
+#include <stdint.h>
 
 #include "xerr.h"
 
@@ -43,7 +44,22 @@ int io_exec_and_connect_unix(const char *filename, const char *program_path,
 int io_bind_unix_socket(const char *filename);
 int io_bind_tcp_socket(int port, xerr_t **err);
 int io_set_blocking(int fd, int flag);
-char *io_evbuffer_readline(struct evbuffer *buffer);
+ssize_t io_sendfile(int sock, int fd, uint64_t offset, size_t count);
+
+/* Splits '|'-terminated commands out of an input buffer without copying
+ * them. Each line is returned in place, NUL-terminated, and stays valid
+ * until the next call with the same reader. Zero-initialize before use.
+ */
+struct io_line_reader
+{
+    size_t scanned; /* bytes at the start of the buffer without a '|' */
+    size_t pending; /* length of the last returned line, drained next call */
+};
+
+char *io_line_reader_next(struct io_line_reader *reader,
+        struct evbuffer *buffer);
+void io_line_reader_done(struct io_line_reader *reader,
+        struct evbuffer *buffer);
 
 #endif
 
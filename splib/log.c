@@ -29,6 +29,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stdbool.h>
 
 #include <sys/time.h>
 #include <event.h>
@@ -46,12 +47,27 @@ static FILE *logfp = NULL;
 static char *logfile = NULL;
 static int max_log_level = LOG_LEVEL_INFO;
 
+unsigned char sp_trace_levels[SP_TRACE_NSUBSYSTEMS];
+
+static const char *sp_trace_subsystems[SP_TRACE_NSUBSYSTEMS] = {
+    "hub", "peer", "ui", "hashd"
+};
+
+/* Trace lines waiting to be written. Written from a timer once
+ * sp_trace_init() is called, before that as they come. */
+static char sp_trace_buf[SP_TRACE_BUFFER_SIZE];
+static size_t sp_trace_len = 0;
+static bool sp_trace_timer_started = false;
+static bool sp_trace_scheduled = false;
+static struct event sp_trace_event;
+
 static int sp_log_reinit(void);
 
 void sp_log_set_level(const char *level)
 {
     return_if_fail(level);
     sp_log_max_bytes = SP_LOG_MAX_BYTES_NORMAL;
+    memset(sp_trace_levels, SP_TRACE_OFF, sizeof(sp_trace_levels));
     if(strcasecmp(level, "none") == 0)
         max_log_level = LOG_LEVEL_ERROR;
     else if(strcasecmp(level, "warning") == 0)
@@ -64,6 +80,7 @@ void sp_log_set_level(const char *level)
     {
         max_log_level = LOG_LEVEL_DEBUG;
         sp_log_max_bytes = SP_LOG_MAX_BYTES_DEBUG;
+        memset(sp_trace_levels, SP_TRACE_FULL, sizeof(sp_trace_levels));
     }
 }
 
@@ -81,8 +98,150 @@ const char *sp_log_get_level(void)
         return "none";
 }
 
+/* Sets the trace level of a subsystem, or of "all". Returns -1 if the
+ * subsystem or level is unknown. */
+int sp_trace_set_level(const char *subsystem, const char *level)
+{
+    return_val_if_fail(subsystem, -1);
+    return_val_if_fail(level, -1);
+
+    unsigned char value;
+    if(strcasecmp(level, "off") == 0)
+        value = SP_TRACE_OFF;
+    else if(strcasecmp(level, "commands") == 0)
+        value = SP_TRACE_COMMANDS;
+    else if(strcasecmp(level, "full") == 0)
+        value = SP_TRACE_FULL;
+    else
+        return -1;
+
+    int i;
+    for(i = 0; i < SP_TRACE_NSUBSYSTEMS; i++)
+    {
+        if(strcasecmp(subsystem, "all") == 0 ||
+           strcasecmp(subsystem, sp_trace_subsystems[i]) == 0)
+        {
+            sp_trace_levels[i] = value;
+            if(strcasecmp(subsystem, "all") != 0)
+                return 0;
+        }
+    }
+
+    return strcasecmp(subsystem, "all") == 0 ? 0 : -1;
+}
+
+static const char *sp_log_timestamp(void)
+{
+    static time_t last = 0;
+    static char tmbuf[32];
+
+    time_t now = time(0);
+    if(now != last)
+    {
+        struct tm *tm = localtime(&now);
+        strftime(tmbuf, sizeof(tmbuf), "%a %e %H:%M:%S", tm);
+        last = now;
+    }
+    return tmbuf;
+}
+
+static void sp_log_check_size(FILE *fp)
+{
+    if(fp == logfp && ftell(logfp) > sp_log_max_bytes)
+    {
+        fprintf(logfp, "logfile turned over due to size > %u\n", sp_log_max_bytes);
+        fclose(logfp);
+        logfp = NULL;
+        sp_log_reinit();
+    }
+}
+
+void sp_trace_flush(void)
+{
+    if(sp_trace_len == 0)
+        return;
+
+    FILE *fp = logfp;
+    if(fp == NULL)
+        fp = stderr;
+
+    fwrite(sp_trace_buf, 1, sp_trace_len, fp);
+    sp_trace_len = 0;
+    sp_log_check_size(fp);
+}
+
+static void sp_trace_event_func(int fd, short why, void *user_data)
+{
+    sp_trace_scheduled = false;
+    sp_trace_flush();
+}
+
+/* Starts writing trace lines from a timer. Call after event_init(). */
+void sp_trace_init(void)
+{
+    sp_trace_flush();
+    evtimer_set(&sp_trace_event, sp_trace_event_func, NULL);
+    sp_trace_timer_started = true;
+}
+
+/* Adds a line to the trace buffer. */
+void sp_trace(const char *fmt, ...)
+{
+    const char *tmbuf = sp_log_timestamp();
+    va_list ap;
+
+    for(;;)
+    {
+        char *p = sp_trace_buf + sp_trace_len;
+        size_t avail = SP_TRACE_BUFFER_SIZE - sp_trace_len;
+
+        int n = snprintf(p, avail, "%s ", tmbuf);
+        if(n > 0 && (size_t)n < avail)
+        {
+            va_start(ap, fmt);
+            int m = vsnprintf(p + n, avail - n, fmt, ap);
+            va_end(ap);
+            if(m >= 0 && (size_t)m < avail - n)
+            {
+                /* replace the nul */
+                p[n + m] = '\n';
+                sp_trace_len += n + m + 1;
+                break;
+            }
+        }
+
+        if(sp_trace_len == 0)
+        {
+            /* doesn't fit in the buffer, write it directly */
+            FILE *fp = logfp ? logfp : stderr;
+            fprintf(fp, "%s ", tmbuf);
+            va_start(ap, fmt);
+            vfprintf(fp, fmt, ap);
+            va_end(ap);
+            fputc('\n', fp);
+            sp_log_check_size(fp);
+            return;
+        }
+
+        sp_trace_flush();
+    }
+
+    if(!sp_trace_timer_started)
+        sp_trace_flush();
+    else if(!sp_trace_scheduled)
+    {
+        struct timeval tv = {.tv_sec = 0,
+            .tv_usec = SP_TRACE_FLUSH_MSEC * 1000};
+        evtimer_add(&sp_trace_event, &tv);
+        sp_trace_scheduled = true;
+    }
+}
+
 static void sp_glog_func(int log_level, const char *message)
 {
+    /* keep the log in order */
+    sp_trace_flush();
+
     if(log_level > max_log_level)
         return;
 
@@ -90,10 +249,7 @@ static void sp_glog_func(int log_level, const char *message)
     if(fp == NULL)
         fp = stderr;
 
-    time_t now = time(0);
-    struct tm *tm = localtime(&now);
-    char tmbuf[32];
-    strftime(tmbuf, sizeof(tmbuf), "%a %e %H:%M:%S", tm);
+    const char *tmbuf = sp_log_timestamp();
     if((log_level & (LOG_LEVEL_WARNING | LOG_LEVEL_ERROR | LOG_LEVEL_CRITICAL)) > 0)
     {
         fprintf(fp, "%s ***** %s *****\n", tmbuf, message);
@@ -103,13 +259,7 @@ static void sp_glog_func(int log_level, const char *message)
         fprintf(fp, "%s %s\n", tmbuf, message);
     }
 
-    if(fp == logfp && ftell(logfp) > sp_log_max_bytes)
-    {
-        fprintf(logfp, "logfile turned over due to size > %u\n", sp_log_max_bytes);
-        fclose(logfp);
-        logfp = NULL;
-        sp_log_reinit();
-    }
+    sp_log_check_size(fp);
 }
 
 void sp_vlog(int level, const char *fmt, va_list ap)
@@ -257,6 +407,13 @@ int sp_log_init(const char *workdir, const char *prefix)
 
 void sp_log_close(void)
 {
+    sp_trace_flush();
+    if(sp_trace_scheduled)
+    {
+        evtimer_del(&sp_trace_event);
+        sp_trace_scheduled = false;
+    }
+
     if(logfp)
     {
         fclose(logfp);
@@ -41,6 +41,38 @@ void sp_log_close(void);
 void sp_vlog(int level, const char *fmt, va_list ap);
 void sp_log(int level, const char *fmt, ...);
 
+/* Protocol commands are traced per subsystem. Callers check
+ * sp_trace_enabled() before formatting anything, see print_command(). */
+enum sp_trace_subsystem
+{
+    SP_TRACE_HUB,
+    SP_TRACE_PEER,
+    SP_TRACE_UI,
+    SP_TRACE_HASHD,
+    SP_TRACE_NSUBSYSTEMS
+};
+
+enum sp_trace_level
+{
+    SP_TRACE_OFF,
+    SP_TRACE_COMMANDS,  /* $Lock and $Key data left out */
+    SP_TRACE_FULL       /* $Lock and $Key data hex dumped */
+};
+
+/* trace lines are buffered and written this often */
+#define SP_TRACE_FLUSH_MSEC 200
+#define SP_TRACE_BUFFER_SIZE (64*1024)
+
+extern unsigned char sp_trace_levels[SP_TRACE_NSUBSYSTEMS];
+#define sp_trace_enabled(subsystem) \
+    (sp_trace_levels[subsystem] != SP_TRACE_OFF)
+
+int sp_trace_set_level(const char *subsystem, const char *level);
+void sp_trace_init(void);
+void sp_trace(const char *fmt, ...)
+    __attribute__ (( format(printf, 1, 2) ));
+void sp_trace_flush(void);
+
 #undef g_debug
 #define g_debug(fmt, ...)  sp_log(LOG_LEVEL_DEBUG, "[%d] (%s:%i) " fmt, getpid(), __func__, __LINE__, ## __VA_ARGS__)
 
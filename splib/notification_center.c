@@ -20,6 +20,10 @@
 
 #include "notification_center.h"
 
+/* interned channel names, the index is the id */
+static char **nc_channel_names = NULL;
+static unsigned nc_nchannel_names = 0;
+
 nc_t *nc_new(void)
 {
     nc_t *nc = calloc(1, sizeof(nc_t));
@@ -36,35 +40,100 @@ nc_t *nc_default(void)
     return default_nc;
 }
 
-static nc_observer_t *nc_observer_new(const char *channel,
-        nc_callback_t callback, void *user_data)
+/* Returns the id of the channel. Look it up once and keep it, this
+ * compares names. */
+int nc_channel_id(const char *channel)
 {
-    nc_observer_t *ob = calloc(1, sizeof(nc_observer_t));
-    ob->channel = strdup(channel);
-    ob->callback = callback;
-    ob->user_data = user_data;
+    assert(channel);
+
+    unsigned i;
+    for(i = 0; i < nc_nchannel_names; i++)
+    {
+        if(strcmp(nc_channel_names[i], channel) == 0)
+            return i;
+    }
 
-    return ob;
+    nc_channel_names = realloc(nc_channel_names,
+            (nc_nchannel_names + 1) * sizeof(char *));
+    nc_channel_names[nc_nchannel_names] = strdup(channel);
+    return nc_nchannel_names++;
 }
 
-static void nc_observer_free(nc_observer_t *ob)
+const char *nc_channel_name(int id)
 {
-    if(ob)
+    assert(id >= 0 && (unsigned)id < nc_nchannel_names);
+    return nc_channel_names[id];
+}
+
+static struct nc_channel *nc_get_channel(nc_t *nc, int id)
+{
+    if((unsigned)id >= nc->nchannels)
     {
-        free(ob->channel);
-        free(ob);
+        nc->channels = realloc(nc->channels,
+                (id + 1) * sizeof(struct nc_channel));
+        memset(nc->channels + nc->nchannels, 0,
+                (id + 1 - nc->nchannels) * sizeof(struct nc_channel));
+        nc->nchannels = id + 1;
     }
+    return &nc->channels[id];
+}
+
+static void nc_add(nc_t *nc, int id, struct nc_observer *ob)
+{
+    struct nc_channel *ch = nc_get_channel(nc, id);
+    if(ch->nobservers == ch->size)
+    {
+        ch->size = ch->size ? ch->size * 2 : 4;
+        ch->observers = realloc(ch->observers,
+                ch->size * sizeof(struct nc_observer));
+    }
+    ch->observers[ch->nobservers++] = *ob;
+}
+
+void nc_add_observer_id(nc_t *nc, int id,
+        nc_callback_t callback, void *user_data)
+{
+    assert(nc);
+    assert(callback);
+
+    struct nc_observer ob = {.callback = callback, .user_data = user_data};
+    nc_add(nc, id, &ob);
 }
 
 void nc_add_observer(nc_t *nc, const char *channel,
         nc_callback_t callback, void *user_data)
+{
+    nc_add_observer_id(nc, nc_channel_id(channel), callback, user_data);
+}
+
+void nc_add_batch_observer_id(nc_t *nc, int id,
+        nc_batch_callback_t callback, nc_copy_func_t copy,
+        nc_free_func_t free_func, void *user_data)
 {
     assert(nc);
-    assert(channel);
     assert(callback);
+    assert(copy && free_func);
+
+    struct nc_observer ob = {.batch_callback = callback,
+        .user_data = user_data};
+    nc_add(nc, id, &ob);
 
-    nc_observer_t *ob = nc_observer_new(channel, callback, user_data);
-    LIST_INSERT_HEAD(&nc->observers, ob, next);
+    struct nc_channel *ch = &nc->channels[id];
+    ch->nbatch_observers++;
+    ch->copy = copy;
+    ch->free = free_func;
+}
+
+static void nc_compact(struct nc_channel *ch)
+{
+    unsigned i, n = 0;
+    for(i = 0; i < ch->nobservers; i++)
+    {
+        if(ch->observers[i].callback || ch->observers[i].batch_callback)
+            ch->observers[n++] = ch->observers[i];
+    }
+    ch->nobservers = n;
+    ch->removed = false;
 }
 
 void nc_remove_observer(nc_t *nc, const char *channel, nc_callback_t callback)
@@ -73,33 +142,116 @@ void nc_remove_observer(nc_t *nc, const char *channel, nc_callback_t callback)
     assert(channel);
     assert(callback);
 
-    nc_observer_t *ob;
-    LIST_FOREACH(ob, &nc->observers, next)
+    int id = nc_channel_id(channel);
+    if((unsigned)id >= nc->nchannels)
+        return;
+
+    struct nc_channel *ch = &nc->channels[id];
+    unsigned i;
+    for(i = 0; i < ch->nobservers; i++)
     {
-        if(ob->callback == callback && strcmp(ob->channel, channel) == 0)
+        if(ch->observers[i].callback == callback)
         {
-            LIST_REMOVE(ob, next);
-            nc_observer_free(ob);
+            ch->observers[i].callback = NULL;
+            if(nc->sending)
+                ch->removed = true;
+            else
+                nc_compact(ch);
             break;
         }
     }
 }
 
-void nc_send_notification(nc_t *nc, const char *channel, void *data)
+static void nc_batch_event(int fd, short why, void *user_data)
 {
-    assert(nc);
-    assert(channel);
+    nc_t *nc = user_data;
+    nc->batch_scheduled = false;
 
-    nc_observer_t *ob;
-    LIST_FOREACH(ob, &nc->observers, next)
+    unsigned id;
+    for(id = 0; id < nc->nchannels; id++)
     {
-        if(strcmp(channel, ob->channel) == 0)
+        struct nc_channel *ch = &nc->channels[id];
+        if(ch->npending == 0)
+            continue;
+
+        /* notifications sent by the observers go in the next batch */
+        void **pending = ch->pending;
+        unsigned npending = ch->npending;
+        ch->pending = NULL;
+        ch->npending = ch->pending_size = 0;
+
+        nc->sending++;
+        unsigned i;
+        for(i = 0; i < nc->channels[id].nobservers; i++)
         {
-            ob->callback(nc, channel, data, ob->user_data);
+            struct nc_observer *ob = &nc->channels[id].observers[i];
+            if(ob->batch_callback)
+                ob->batch_callback(nc, nc_channel_names[id],
+                        pending, npending, ob->user_data);
         }
+        nc->sending--;
+
+        ch = &nc->channels[id];
+        for(i = 0; i < npending; i++)
+            ch->free(pending[i]);
+        free(pending);
+
+        if(ch->removed && nc->sending == 0)
+            nc_compact(ch);
+    }
+}
+
+static void nc_queue_batch(nc_t *nc, struct nc_channel *ch, void *data)
+{
+    if(ch->npending == ch->pending_size)
+    {
+        ch->pending_size = ch->pending_size ? ch->pending_size * 2 : 16;
+        ch->pending = realloc(ch->pending, ch->pending_size * sizeof(void *));
+    }
+    ch->pending[ch->npending++] = ch->copy(data);
+
+    if(!nc->batch_scheduled)
+    {
+        struct timeval tv = {.tv_sec = 0, .tv_usec = 0};
+        if(!event_initialized(&nc->batch_event))
+            evtimer_set(&nc->batch_event, nc_batch_event, nc);
+        evtimer_add(&nc->batch_event, &tv);
+        nc->batch_scheduled = true;
     }
 }
 
+void nc_send_notification_id(nc_t *nc, int id, void *data)
+{
+    assert(nc);
+
+    if((unsigned)id >= nc->nchannels)
+        return;
+
+    /* observers may be added while sending, which moves the arrays */
+    nc->sending++;
+    unsigned i;
+    for(i = 0; i < nc->channels[id].nobservers; i++)
+    {
+        struct nc_observer *ob = &nc->channels[id].observers[i];
+        if(ob->callback)
+            ob->callback(nc, nc_channel_names[id], data, ob->user_data);
+    }
+    nc->sending--;
+
+    struct nc_channel *ch = &nc->channels[id];
+    if(ch->nbatch_observers)
+        nc_queue_batch(nc, ch, data);
+
+    if(ch->removed && nc->sending == 0)
+        nc_compact(ch);
+}
+
+void nc_send_notification(nc_t *nc, const char *channel, void *data)
+{
+    assert(channel);
+    nc_send_notification_id(nc, nc_channel_id(channel), data);
+}
+
 #ifdef TEST
 
 #include <stdio.h>
@@ -120,8 +272,41 @@ void sample_callback(nc_t *nc, const char *channel, void *data, void *user_data)
     ++sample_callback_called;
 }
 
+static int other_callback_called = 0;
+
+static void other_callback(nc_t *nc, const char *channel, void *data,
+        void *user_data)
+{
+    fail_unless(strcmp(channel, "other channel") == 0);
+    ++other_callback_called;
+
+    /* removing itself while sending */
+    nc_remove_observer(nc, channel, other_callback);
+}
+
+static unsigned batch_count = 0;
+static unsigned batch_calls = 0;
+
+static void *copy_string(const void *data)
+{
+    return strdup(data);
+}
+
+static void batch_callback(nc_t *nc, const char *channel, void **data,
+        unsigned count, void *user_data)
+{
+    fail_unless(strcmp(channel, "batch channel") == 0);
+    fail_unless(count > 0);
+    fail_unless(strcmp(data[0], "item 0") == 0);
+    fail_unless(strcmp(data[count - 1], "item 9") == 0);
+    batch_count += count;
+    batch_calls++;
+}
+
 int main(int argc, char **argv)
 {
+    event_init();
+
     /* create the shared, default notification center */
     nc_t *nc = nc_default();
 
@@ -131,18 +316,45 @@ int main(int argc, char **argv)
 
     /* add an observers */
     nc_add_observer(nc, "sample channel", sample_callback, nc);
+    nc_add_observer(nc, "other channel", other_callback, nc);
 
     /* notify all observers */
     nc_send_notification(nc, "sample channel", "sample data");
     fail_unless(sample_callback_called == 1);
+    fail_unless(other_callback_called == 0);
+
+    int id = nc_channel_id("sample channel");
+    fail_unless(id == nc_channel_id("sample channel"));
+    fail_unless(strcmp(nc_channel_name(id), "sample channel") == 0);
+    nc_send_notification_id(nc, id, "sample data");
+    fail_unless(sample_callback_called == 2);
 
     /* remove the observer */
     nc_remove_observer(nc, "sample channel", sample_callback);
     nc_send_notification(nc, "sample channel", "sample data");
-    fail_unless(sample_callback_called == 1);
+    fail_unless(sample_callback_called == 2);
+
+    nc_send_notification(nc, "other channel", "other data");
+    nc_send_notification(nc, "other channel", "other data");
+    fail_unless(other_callback_called == 1);
+
+    /* batch observers get the notifications on the next event loop turn */
+    int batch_id = nc_channel_id("batch channel");
+    nc_add_batch_observer_id(nc, batch_id, batch_callback,
+            copy_string, free, NULL);
+    int i;
+    for(i = 0; i < 10; i++)
+    {
+        char item[16];
+        snprintf(item, sizeof(item), "item %d", i);
+        nc_send_notification_id(nc, batch_id, item);
+    }
+    fail_unless(batch_calls == 0);
+    event_loop(EVLOOP_ONCE);
+    fail_unless(batch_calls == 1);
+    fail_unless(batch_count == 10);
 
     return 0;
 }
 
 #endif
-
@@ -17,34 +17,80 @@
 #ifndef _notification_center_h_
 #define _notification_center_h_
 
+#include <sys/types.h>
+#include <sys/time.h>
+#include <event.h>
+#include <stdbool.h>
+
 #include "sys_queue.h"
 
+/* Channel names are interned to small integers, the same in all
+ * notification centers. Observers are kept in an array per channel.
+ *
+ * Batch observers of a channel get the notifications sent during one turn
+ * of the event loop all at once, from a timer. The notification data is
+ * copied for them with the copy function of the channel, so it must not
+ * point to anything that might be gone by then.
+ */
+
 typedef struct notification_center nc_t;
-typedef struct nc_observer nc_observer_t;
 typedef void (*nc_callback_t)(nc_t *nc, const char *channel,
         void *data, void *user_data);
+typedef void (*nc_batch_callback_t)(nc_t *nc, const char *channel,
+        void **data, unsigned count, void *user_data);
+typedef void *(*nc_copy_func_t)(const void *data);
+typedef void (*nc_free_func_t)(void *data);
 
 struct nc_observer
 {
-    char *channel;
-    nc_callback_t callback;
+    nc_callback_t callback; /* NULL if removed while sending */
+    nc_batch_callback_t batch_callback;
     void *user_data;
-    LIST_ENTRY(nc_observer) next;
+};
+
+struct nc_channel
+{
+    struct nc_observer *observers;
+    unsigned nobservers;
+    unsigned size;
+    unsigned nbatch_observers;
+    bool removed; /* compact observers after sending */
+
+    /* copies waiting for the batch observers */
+    nc_copy_func_t copy;
+    nc_free_func_t free;
+    void **pending;
+    unsigned npending;
+    unsigned pending_size;
 };
 
 struct notification_center
 {
-    LIST_HEAD(, nc_observer) observers;
+    struct nc_channel *channels; /* indexed by channel id */
+    unsigned nchannels;
+    int sending;
+
+    struct event batch_event;
+    bool batch_scheduled;
 };
 
 nc_t *nc_new(void);
 nc_t *nc_default(void);
 
+int nc_channel_id(const char *channel);
+const char *nc_channel_name(int id);
+
 void nc_add_observer(nc_t *nc, const char *channel,
         nc_callback_t callback, void *user_data);
+void nc_add_observer_id(nc_t *nc, int id,
+        nc_callback_t callback, void *user_data);
+void nc_add_batch_observer_id(nc_t *nc, int id,
+        nc_batch_callback_t callback, nc_copy_func_t copy,
+        nc_free_func_t free_func, void *user_data);
 void nc_remove_observer(nc_t *nc, const char *channel,
         nc_callback_t callback);
 void nc_send_notification(nc_t *nc, const char *channel, void *data);
+void nc_send_notification_id(nc_t *nc, int id, void *data);
 
 #endif
 
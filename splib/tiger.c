@@ -198,3 +198,200 @@ void tiger(word64 *str, word64 length, word64 res[3])
   ((word64*)(&(temp[56])))[0] = ((word64)length)<<3;
   tiger_compress(((word64*)temp), res);
 }
+
+/* Multi-buffer Tiger: hashes several independent messages of the same
+ * length at once. With AVX2 each 64-bit lane of a vector register holds the
+ * state of one message, and the S-box lookups are done with gathers. Used
+ * for the leaves of a tiger tree, which are all hashed independently.
+ */
+
+#if defined(__GNUC__) && defined(__x86_64__) && !defined(__BIG_ENDIAN__)
+# define TIGER_AVX2 1
+#endif
+
+#ifdef TIGER_AVX2
+#include <immintrin.h>
+#include <string.h>
+
+#define AVX2 __attribute__ (( target("avx2") ))
+
+static inline AVX2 __m256i mm_lookup(const word64 *t, __m256i c, int n)
+{
+  __m256i idx = _mm256_and_si256(_mm256_srli_epi64(c, n*8),
+                                 _mm256_set1_epi64x(0xFF));
+  return _mm256_i64gather_epi64((const long long *)t, idx, 8);
+}
+
+/* b *= 5, 7 or 9 (no 64-bit multiply in AVX2) */
+static inline AVX2 __m256i mm_mul(__m256i b, int mul)
+{
+  if(mul == 5)
+    return _mm256_add_epi64(_mm256_slli_epi64(b, 2), b);
+  else if(mul == 7)
+    return _mm256_sub_epi64(_mm256_slli_epi64(b, 3), b);
+  return _mm256_add_epi64(_mm256_slli_epi64(b, 3), b);
+}
+
+#define mm_round(a,b,c,x,mul) \
+      c = _mm256_xor_si256(c, x); \
+      a = _mm256_sub_epi64(a, _mm256_xor_si256( \
+            _mm256_xor_si256(mm_lookup(t1,c,0), mm_lookup(t2,c,2)), \
+            _mm256_xor_si256(mm_lookup(t3,c,4), mm_lookup(t4,c,6)))); \
+      b = _mm256_add_epi64(b, _mm256_xor_si256( \
+            _mm256_xor_si256(mm_lookup(t4,c,1), mm_lookup(t3,c,3)), \
+            _mm256_xor_si256(mm_lookup(t2,c,5), mm_lookup(t1,c,7)))); \
+      b = mm_mul(b, mul);
+
+#define mm_pass(a,b,c,mul) \
+      mm_round(a,b,c,x[0],mul) \
+      mm_round(b,c,a,x[1],mul) \
+      mm_round(c,a,b,x[2],mul) \
+      mm_round(a,b,c,x[3],mul) \
+      mm_round(b,c,a,x[4],mul) \
+      mm_round(c,a,b,x[5],mul) \
+      mm_round(a,b,c,x[6],mul) \
+      mm_round(b,c,a,x[7],mul)
+
+#define mm_not(x) _mm256_xor_si256(x, _mm256_set1_epi64x(-1))
+
+static inline AVX2 void mm_key_schedule(__m256i *x)
+{
+  x[0] = _mm256_sub_epi64(x[0], _mm256_xor_si256(x[7],
+            _mm256_set1_epi64x(0xA5A5A5A5A5A5A5A5ULL)));
+  x[1] = _mm256_xor_si256(x[1], x[0]);
+  x[2] = _mm256_add_epi64(x[2], x[1]);
+  x[3] = _mm256_sub_epi64(x[3], _mm256_xor_si256(x[2],
+            _mm256_slli_epi64(mm_not(x[1]), 19)));
+  x[4] = _mm256_xor_si256(x[4], x[3]);
+  x[5] = _mm256_add_epi64(x[5], x[4]);
+  x[6] = _mm256_sub_epi64(x[6], _mm256_xor_si256(x[5],
+            _mm256_srli_epi64(mm_not(x[4]), 23)));
+  x[7] = _mm256_xor_si256(x[7], x[6]);
+  x[0] = _mm256_add_epi64(x[0], x[7]);
+  x[1] = _mm256_sub_epi64(x[1], _mm256_xor_si256(x[0],
+            _mm256_slli_epi64(mm_not(x[7]), 19)));
+  x[2] = _mm256_xor_si256(x[2], x[1]);
+  x[3] = _mm256_add_epi64(x[3], x[2]);
+  x[4] = _mm256_sub_epi64(x[4], _mm256_xor_si256(x[3],
+            _mm256_srli_epi64(mm_not(x[2]), 23)));
+  x[5] = _mm256_xor_si256(x[5], x[4]);
+  x[6] = _mm256_add_epi64(x[6], x[5]);
+  x[7] = _mm256_sub_epi64(x[7], _mm256_xor_si256(x[6],
+            _mm256_set1_epi64x(0x0123456789ABCDEFULL)));
+}
+
+static inline AVX2 __m256i mm_load_word(const byte *blk[4], int i)
+{
+  word64 w[4];
+  memcpy(&w[0], blk[0] + i*8, 8);
+  memcpy(&w[1], blk[1] + i*8, 8);
+  memcpy(&w[2], blk[2] + i*8, 8);
+  memcpy(&w[3], blk[3] + i*8, 8);
+  return _mm256_set_epi64x(w[3], w[2], w[1], w[0]);
+}
+
+/* compresses one 64-byte block from each of 4 messages */
+static AVX2 void tiger_compress_avx2(const byte *blk[4], __m256i state[3])
+{
+  __m256i a = state[0], b = state[1], c = state[2];
+  __m256i x[8];
+  int i;
+
+  for(i = 0; i < 8; i++)
+    x[i] = mm_load_word(blk, i);
+
+  /* three passes, unrolled as in OPTIMIZE_FOR_ALPHA */
+  mm_pass(a,b,c,5)
+  mm_key_schedule(x);
+  mm_pass(c,a,b,7)
+  mm_key_schedule(x);
+  mm_pass(b,c,a,9)
+
+  state[0] = _mm256_xor_si256(a, state[0]);
+  state[1] = _mm256_sub_epi64(b, state[1]);
+  state[2] = _mm256_add_epi64(c, state[2]);
+}
+
+static AVX2 void tiger_avx2(const byte *str[4], word64 length,
+    word64 res[][3])
+{
+  __m256i state[3];
+  const byte *blk[4];
+  byte temp[4][64];
+  word64 i, j;
+  int k;
+
+  state[0] = _mm256_set1_epi64x(0x0123456789ABCDEFULL);
+  state[1] = _mm256_set1_epi64x(0xFEDCBA9876543210ULL);
+  state[2] = _mm256_set1_epi64x(0xF096A5B4C3B2E187ULL);
+
+  for(i = 0; i + 64 <= length; i += 64)
+    {
+      for(k = 0; k < 4; k++)
+        blk[k] = str[k] + i;
+      tiger_compress_avx2(blk, state);
+    }
+
+  /* padding, same for all messages since they have the same length */
+  for(k = 0; k < 4; k++)
+    {
+      memcpy(temp[k], str[k] + i, length - i);
+      temp[k][length - i] = 0x01;
+      blk[k] = temp[k];
+    }
+  j = length - i + 1;
+  if(j > 56)
+    {
+      for(k = 0; k < 4; k++)
+        memset(temp[k] + j, 0, 64 - j);
+      tiger_compress_avx2(blk, state);
+      j = 0;
+    }
+  for(k = 0; k < 4; k++)
+    {
+      memset(temp[k] + j, 0, 56 - j);
+      word64 bits = length << 3;
+      memcpy(temp[k] + 56, &bits, 8);
+    }
+  tiger_compress_avx2(blk, state);
+
+  word64 out[3][4];
+  for(k = 0; k < 3; k++)
+    _mm256_storeu_si256((__m256i *)out[k], state[k]);
+  for(k = 0; k < 4; k++)
+    {
+      res[k][0] = out[0][k];
+      res[k][1] = out[1][k];
+      res[k][2] = out[2][k];
+    }
+}
+
+static int tiger_have_avx2(void)
+{
+  static int have_avx2 = -1;
+  if(have_avx2 == -1)
+    have_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+  return have_avx2;
+}
+#endif
+
+/* Hashes n messages of length bytes each, results in res[0..n-1]. Uses
+ * AVX2 for groups of TIGER_MULTI_LANES messages if the CPU supports it, and
+ * plain tiger() for the rest.
+ */
+void tiger_multi(const unsigned char **str, word64 length, word64 res[][3],
+    unsigned n)
+{
+  unsigned i = 0;
+
+#ifdef TIGER_AVX2
+  if(tiger_have_avx2())
+    {
+      for(; i + TIGER_MULTI_LANES <= n; i += TIGER_MULTI_LANES)
+        tiger_avx2(str + i, length, res + i);
+    }
+#endif
+
+  for(; i < n; i++)
+    tiger((word64 *)str[i], length, res[i]);
+}
@@ -9,6 +9,12 @@ typedef uint8_t byte;
 
 void tiger(word64 *str, word64 length, word64 res[3]);
 
+/* number of messages hashed in parallel by tiger_multi */
+#define TIGER_MULTI_LANES 4
+
+void tiger_multi(const unsigned char **str, word64 length, word64 res[][3],
+    unsigned n);
+
 #if !defined(__BIG_ENDIAN__) && !defined(__LITTLE_ENDIAN__)
 # if linux
 #  include <endian.h>
@@ -18,6 +18,8 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#include <sys/time.h>
+
 #include "tiger.h"
 #include "unit_test.h"
 
@@ -27,6 +29,61 @@
     fail_unless(res[1] == w2); \
     fail_unless(res[2] == w3);
 
+/* tiger_multi must give the same result as tiger for each message */
+static void test_multi(const unsigned char *data, unsigned length, unsigned n)
+{
+    const unsigned char *str[9];
+    word64 res[9][3];
+    word64 expected[3];
+    unsigned i;
+
+    for(i = 0; i < n; i++)
+        str[i] = data + i * 4099; /* unaligned, different data */
+    tiger_multi(str, length, res, n);
+
+    for(i = 0; i < n; i++)
+    {
+        tiger((word64 *)str[i], length, expected);
+        fail_unless(memcmp(res[i], expected, sizeof(expected)) == 0);
+    }
+}
+
+static double elapsed(struct timeval *start)
+{
+    struct timeval end;
+    gettimeofday(&end, NULL);
+    return (end.tv_sec - start->tv_sec) +
+        (end.tv_usec - start->tv_usec) / 1000000.0;
+}
+
+/* hash 1025 byte tiger tree leaves one at a time and in batches */
+static void benchmark_multi(const unsigned char *data, unsigned len)
+{
+    unsigned nleaves = len / 1025;
+    unsigned i;
+    word64 res[TIGER_MULTI_LANES][3];
+    struct timeval start;
+
+    gettimeofday(&start, NULL);
+    for(i = 0; i < nleaves; i++)
+        tiger((word64 *)(data + i * 1025), 1025, res[0]);
+    double single = (double)nleaves * 1024 / (1024*1024) / elapsed(&start);
+
+    gettimeofday(&start, NULL);
+    for(i = 0; i + TIGER_MULTI_LANES <= nleaves; i += TIGER_MULTI_LANES)
+    {
+        const unsigned char *str[TIGER_MULTI_LANES];
+        int j;
+        for(j = 0; j < TIGER_MULTI_LANES; j++)
+            str[j] = data + (i + j) * 1025;
+        tiger_multi(str, 1025, res, TIGER_MULTI_LANES);
+    }
+    double multi = (double)i * 1024 / (1024*1024) / elapsed(&start);
+
+    printf("tiger: %.1f MiB/s, tiger_multi: %.1f MiB/s (%.2fx)\n",
+            single, multi, multi / single);
+}
+
 int main(void)
 {
     word64 res[3];
@@ -49,6 +106,23 @@ int main(void)
     hash("ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+-ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+-",
             0x00B83EB4E53440C5LL, 0x76AC6AAEE0A74858LL, 0x25FD15E70A59FFE4LL);
 
+    unsigned len = 16*1024*1024;
+    unsigned char *data = malloc(len);
+    unsigned i, n;
+    for(i = 0; i < len; i++)
+        data[i] = (i * 2654435761U) >> 24;
+
+    for(n = 1; n <= 9; n++)
+    {
+        for(i = 0; i <= 200; i++)
+            test_multi(data + 1, i, n);
+        test_multi(data + 3, 1025, n);
+        test_multi(data, 4096, n);
+    }
+
+    benchmark_multi(data, len);
+    free(data);
+
     return 0;
 }
 
@@ -107,14 +107,11 @@ void tt_compose(TT_CONTEXT *ctx)
     ctx->top -= XTIGERSIZE;                      /* update top ptr */
 }
 
-static void tt_block(TT_CONTEXT *ctx)
+/* push the node at the top of the stack and compose complete subtrees */
+static void tt_push(TT_CONTEXT *ctx)
 {
     u_int64_t b;
 
-    tiger((u_int64_t *)ctx->leaf, (u_int64_t)ctx->index + 1, (u_int64_t *)ctx->top);
-    ((u_int64_t *)ctx->top)[0] = U_INT64_TO_LE(((u_int64_t *)ctx->top)[0]);
-    ((u_int64_t *)ctx->top)[1] = U_INT64_TO_LE(((u_int64_t *)ctx->top)[1]);
-    ((u_int64_t *)ctx->top)[2] = U_INT64_TO_LE(((u_int64_t *)ctx->top)[2]);
     u_int32_t *bsp = (u_int32_t *)(ctx->top + TIGERSIZE);
     *bsp = BLOCKSIZE;
     ctx->top += XTIGERSIZE;
@@ -127,6 +124,57 @@ static void tt_block(TT_CONTEXT *ctx)
     }
 }
 
+static void tt_block(TT_CONTEXT *ctx)
+{
+    tiger((u_int64_t *)ctx->leaf, (u_int64_t)ctx->index + 1, (u_int64_t *)ctx->top);
+    ((u_int64_t *)ctx->top)[0] = U_INT64_TO_LE(((u_int64_t *)ctx->top)[0]);
+    ((u_int64_t *)ctx->top)[1] = U_INT64_TO_LE(((u_int64_t *)ctx->top)[1]);
+    ((u_int64_t *)ctx->top)[2] = U_INT64_TO_LE(((u_int64_t *)ctx->top)[2]);
+    tt_push(ctx);
+}
+
+/* hash TIGER_MULTI_LANES full blocks at once with tiger_multi */
+static void tt_blocks(TT_CONTEXT *ctx, u_int8_t *buffer)
+{
+    unsigned char leaves[TIGER_MULTI_LANES][1+BLOCKSIZE];
+    const unsigned char *str[TIGER_MULTI_LANES];
+    u_int64_t res[TIGER_MULTI_LANES][3];
+    int i;
+
+    for(i = 0; i < TIGER_MULTI_LANES; i++)
+    {
+        leaves[i][0] = 0; /* leaf flag */
+        memcpy(leaves[i] + 1, buffer + i * BLOCKSIZE, BLOCKSIZE);
+        str[i] = leaves[i];
+    }
+
+    tiger_multi(str, 1 + BLOCKSIZE, res, TIGER_MULTI_LANES);
+
+    for(i = 0; i < TIGER_MULTI_LANES; i++)
+    {
+        ((u_int64_t *)ctx->top)[0] = U_INT64_TO_LE(res[i][0]);
+        ((u_int64_t *)ctx->top)[1] = U_INT64_TO_LE(res[i][1]);
+        ((u_int64_t *)ctx->top)[2] = U_INT64_TO_LE(res[i][2]);
+        tt_push(ctx);
+    }
+}
+
+/* Adds the root hash of an independently hashed subtree, instead of the
+ * data it covers. All subtrees added to a context must cover the same
+ * power-of-two number of blocks, except the last one which may be smaller.
+ * This way the segments of a file can be hashed in parallel and combined
+ * into the root of the whole file.
+ *
+ * Leaves are not collected for subtrees; the context should be initialized
+ * with a leafsize of 0 and the leaves of each segment concatenated instead.
+ */
+void tt_update_subtree(TT_CONTEXT *ctx, const unsigned char *root)
+{
+    assert(ctx->index == 0);
+    memcpy(ctx->top, root, TIGERSIZE);
+    tt_push(ctx);
+}
+
 void tt_update(TT_CONTEXT *ctx, u_int8_t *buffer, u_int32_t len)
 {
     assert(ctx->index <= BLOCKSIZE);
@@ -149,6 +197,12 @@ void tt_update(TT_CONTEXT *ctx, u_int8_t *buffer, u_int32_t len)
         }
     }
 
+    while(len >= TIGER_MULTI_LANES * BLOCKSIZE)
+    {
+        tt_blocks(ctx, buffer);
+        buffer += TIGER_MULTI_LANES * BLOCKSIZE;
+        len -= TIGER_MULTI_LANES * BLOCKSIZE;
+    }
     while(len >= BLOCKSIZE)
     {
         memmove(ctx->block, buffer, BLOCKSIZE);
@@ -239,3 +293,37 @@ u_int64_t tt_calc_block_size(u_int64_t filesize, unsigned max_levels)
     return tmp;
 }
 
+/* Returns the number of bytes covered by each leaf when a file of filesize
+ * bytes is described by nleaves leaves (eg, from TTHL), or 0 if no level of
+ * the hash tree has that many leaves.
+ */
+u_int64_t tt_leaf_block_size(u_int64_t filesize, unsigned nleaves)
+{
+    u_int64_t bs = BLOCKSIZE;
+
+    if(nleaves == 0)
+        return 0;
+
+    while((filesize + bs - 1) / bs > nleaves)
+        bs *= 2;
+
+    if((filesize + bs - 1) / bs == nleaves)
+        return bs;
+    if(filesize == 0 && nleaves == 1)
+        return bs;
+    return 0;
+}
+
+/* Computes the root hash of a tree from its leaves. */
+void tt_leaves_root(const unsigned char *leaves, unsigned nleaves,
+        unsigned char *root)
+{
+    TT_CONTEXT ctx;
+    unsigned i;
+
+    tt_init(&ctx, 0);
+    for(i = 0; i < nleaves; i++)
+        tt_update_subtree(&ctx, leaves + i * TIGERSIZE);
+    tt_digest(&ctx, root);
+    tt_destroy(&ctx);
+}
@@ -43,12 +43,16 @@ struct tt_context {
 
 void tt_init(TT_CONTEXT *ctx, unsigned int leafsize);
 void tt_update(TT_CONTEXT *ctx, unsigned char *buffer, unsigned len);
+void tt_update_subtree(TT_CONTEXT *ctx, const unsigned char *root);
 void tt_digest(TT_CONTEXT *ctx, unsigned char *hash);
 char *tt_base32(TT_CONTEXT *ctx);
 char *tt_leafdata_base32(TT_CONTEXT *ctx);
 char *tt_leafdata_base64(TT_CONTEXT *ctx);
 void tt_destroy(TT_CONTEXT *ctx);
 uint64_t tt_calc_block_size(uint64_t filesize, unsigned max_levels);
+uint64_t tt_leaf_block_size(uint64_t filesize, unsigned nleaves);
+void tt_leaves_root(const unsigned char *leaves, unsigned nleaves,
+        unsigned char *root);
 
 #endif
 
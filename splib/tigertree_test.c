@@ -18,11 +18,154 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */                                                                                      
 
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
 #include "tigertree.h"
 #include "unit_test.h"
 
 #define HASHER_BUFSIZ 256*1024
 
+/* Hash the data in segments of segsize bytes and combine the segment roots,
+ * the way sphashd workers do. Compares the result with hashing it all in one
+ * context.
+ */
+static void test_segments(unsigned char *data, unsigned len,
+        unsigned leafsize, unsigned segsize)
+{
+    struct tt_context whole;
+    unsigned char whole_root[TIGERSIZE];
+    tt_init(&whole, leafsize);
+    tt_update(&whole, data, len);
+    tt_digest(&whole, whole_root);
+
+    struct tt_context combined;
+    unsigned char combined_root[TIGERSIZE];
+    unsigned char *leaves = NULL;
+    unsigned leaves_len = 0;
+    tt_init(&combined, 0);
+
+    unsigned offset = 0;
+    do
+    {
+        unsigned seglen = len - offset < segsize ? len - offset : segsize;
+
+        struct tt_context seg;
+        unsigned char seg_root[TIGERSIZE];
+        tt_init(&seg, leafsize);
+        tt_update(&seg, data + offset, seglen);
+        tt_digest(&seg, seg_root);
+
+        leaves = realloc(leaves, leaves_len + seg.leaves_len);
+        memcpy(leaves + leaves_len, seg.leaves, seg.leaves_len);
+        leaves_len += seg.leaves_len;
+        tt_destroy(&seg);
+
+        tt_update_subtree(&combined, seg_root);
+        offset += seglen;
+    } while(offset < len);
+
+    tt_digest(&combined, combined_root);
+
+    fail_unless(memcmp(whole_root, combined_root, TIGERSIZE) == 0);
+    fail_unless(whole.leaves_len == leaves_len);
+    fail_unless(memcmp(whole.leaves, leaves, leaves_len) == 0);
+
+    free(leaves);
+    tt_destroy(&whole);
+    tt_destroy(&combined);
+}
+
+/* Large updates hash leaves in batches with tiger_multi, updates of a single
+ * block use plain tiger. Both must give the same tree.
+ */
+static void test_batched(unsigned char *data, unsigned len, unsigned leafsize)
+{
+    struct tt_context batched, single;
+    unsigned char batched_root[TIGERSIZE], single_root[TIGERSIZE];
+
+    tt_init(&batched, leafsize);
+    tt_update(&batched, data, len);
+    tt_digest(&batched, batched_root);
+
+    tt_init(&single, leafsize);
+    unsigned offset;
+    for(offset = 0; offset < len; offset += BLOCKSIZE)
+    {
+        unsigned n = len - offset < BLOCKSIZE ? len - offset : BLOCKSIZE;
+        tt_update(&single, data + offset, n);
+    }
+    tt_digest(&single, single_root);
+
+    fail_unless(memcmp(batched_root, single_root, TIGERSIZE) == 0);
+    fail_unless(batched.leaves_len == single.leaves_len);
+    fail_unless(memcmp(batched.leaves, single.leaves, single.leaves_len) == 0);
+
+    tt_destroy(&batched);
+    tt_destroy(&single);
+}
+
+/* The leaves collected while hashing must give back the leaf size and the
+ * root hash.
+ */
+static void test_leaves(unsigned char *data, unsigned len, unsigned leafsize)
+{
+    struct tt_context tth;
+    unsigned char root[TIGERSIZE], leaves_root[TIGERSIZE];
+
+    tt_init(&tth, leafsize);
+    tt_update(&tth, data, len);
+    tt_digest(&tth, root);
+
+    unsigned nleaves = tth.leaves_len / TIGERSIZE;
+    uint64_t bs = tt_leaf_block_size(len, nleaves);
+    if(len > leafsize)
+        fail_unless(bs == leafsize);
+    else
+        fail_unless(nleaves == 1 && bs >= len);
+
+    tt_leaves_root(tth.leaves, nleaves, leaves_root);
+    fail_unless(memcmp(root, leaves_root, TIGERSIZE) == 0);
+
+    fail_unless(tt_leaf_block_size(len, 0) == 0);
+
+    tt_destroy(&tth);
+}
+
+static double hash_throughput(unsigned char *data, unsigned len, int nprocs)
+{
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+
+    int i;
+    for(i = 0; i < nprocs; i++)
+    {
+        pid_t pid = fork();
+        fail_unless(pid != -1);
+        if(pid == 0)
+        {
+            struct tt_context tth;
+            tt_init(&tth, 64*1024);
+            tt_update(&tth, data, len);
+            tt_digest(&tth, NULL);
+            _exit(0);
+        }
+    }
+
+    int status;
+    for(i = 0; i < nprocs; i++)
+    {
+        fail_unless(wait(&status) != -1);
+        fail_unless(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+
+    gettimeofday(&end, NULL);
+    double d = (end.tv_sec - start.tv_sec) +
+        (end.tv_usec - start.tv_usec) / 1000000.0;
+    return ((double)len * nprocs / (1024*1024)) / d;
+}
+
 int main(void)
 {
     struct tt_context tth;
@@ -35,6 +178,37 @@ int main(void)
     char *hash_base32 = tt_base32(&tth);
     fail_unless(strcmp(hash_base32, "UUP2CKMGSUCSKXBQKSK7U76YVYFPUDXFNCYEOFI") == 0);
 
+    unsigned len = 16*1024*1024;
+    unsigned char *data = malloc(len);
+    unsigned i;
+    for(i = 0; i < len; i++)
+        data[i] = (i * 2654435761U) >> 24;
+
+    unsigned sizes[] = {1, 1023, 1024, 65536, 65537, 3*65536+5,
+        1024*1024, 1024*1024+100, 5*1024*1024+1234, 0};
+    for(i = 0; sizes[i]; i++)
+    {
+        test_segments(data, sizes[i], 64*1024, 64*1024);
+        test_segments(data, sizes[i], 64*1024, 128*1024);
+        test_segments(data, sizes[i], 64*1024, 1024*1024);
+        test_segments(data, sizes[i], 128*1024, 256*1024);
+        test_batched(data, sizes[i], 64*1024);
+        test_batched(data + 7, sizes[i], 64*1024);
+        test_leaves(data, sizes[i], 64*1024);
+    }
+
+    /* aggregate hashing throughput with one process per segment */
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int nprocs;
+    for(nprocs = 1; nprocs <= ncpus && nprocs <= 8; nprocs *= 2)
+    {
+        double mibs = hash_throughput(data, len, nprocs);
+        printf("%d process(es): %.1f MiB/s total, %.1f MiB/s per core\n",
+                nprocs, mibs, mibs / nprocs);
+    }
+
+    free(data);
+
     return 0;
 }
 
@@ -0,0 +1,195 @@
+/*
+ * Copyright 2007 Martin Hedenfalk <martin@bzero.se>
+ *
+ * This file is part of ShakesPeer.
+ *
+ * ShakesPeer is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ShakesPeer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ShakesPeer; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <string.h>
+
+#include "tth.h"
+
+static const char tth_base32_chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ234567";
+
+static int tth_base32_value(unsigned char c)
+{
+    if(c >= 'A' && c <= 'Z')
+        return c - 'A';
+    if(c >= 'a' && c <= 'z')
+        return c - 'a';
+    if(c >= '2' && c <= '7')
+        return c - '2' + 26;
+    return -1;
+}
+
+/* Decodes the first 39 characters of base32 into tth. Returns 0 on success,
+ * or -1 if base32 is too short or isn't valid base32.
+ *
+ * The 24 bytes are decoded as four groups of 5 bytes (8 characters each),
+ * and the last 4 bytes from 7 characters with 3 bits of padding.
+ */
+int tth_from_base32(tth_t *tth, const char *base32)
+{
+    const unsigned char *p = (const unsigned char *)base32;
+    unsigned char *out = tth->data;
+    int group, i;
+
+    if(base32 == NULL)
+        return -1;
+
+    for(group = 0; group < 5; group++)
+    {
+        int nchars = group < 4 ? 8 : 7;
+        uint64_t v = 0;
+        for(i = 0; i < nchars; i++)
+        {
+            int c = tth_base32_value(*p++);
+            if(c == -1)
+                return -1;
+            v = (v << 5) | c;
+        }
+
+        if(group < 4)
+        {
+            out[0] = v >> 32;
+            out[1] = v >> 24;
+            out[2] = v >> 16;
+            out[3] = v >> 8;
+            out[4] = v;
+            out += 5;
+        }
+        else
+        {
+            v >>= 3;
+            out[0] = v >> 24;
+            out[1] = v >> 16;
+            out[2] = v >> 8;
+            out[3] = v;
+        }
+    }
+
+    return 0;
+}
+
+/* Encodes tth as 39 characters of base32 and a nul in base32, which must
+ * have room for TTH_BASE32_LEN + 1 characters. Returns base32.
+ */
+char *tth_to_base32(const tth_t *tth, char *base32)
+{
+    const unsigned char *p = tth->data;
+    char *out = base32;
+    int group, i;
+
+    for(group = 0; group < 5; group++)
+    {
+        int nchars;
+        uint64_t v;
+        if(group < 4)
+        {
+            nchars = 8;
+            v = ((uint64_t)p[0] << 32) | ((uint64_t)p[1] << 24) |
+                ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 8) | p[4];
+            p += 5;
+        }
+        else
+        {
+            nchars = 7;
+            v = (((uint64_t)p[0] << 24) | ((uint64_t)p[1] << 16) |
+                ((uint64_t)p[2] << 8) | p[3]) << 3;
+        }
+
+        for(i = nchars - 1; i >= 0; i--)
+        {
+            out[i] = tth_base32_chars[v & 0x1F];
+            v >>= 5;
+        }
+        out += nchars;
+    }
+    *out = 0;
+
+    return base32;
+}
+
+/* Tiger hashes are uniformly distributed, so any part of them is a
+ * good hash value.
+ */
+uint32_t tth_hash(const tth_t *tth)
+{
+    uint32_t h;
+    memcpy(&h, tth->data, sizeof(h));
+    return h;
+}
+
+#ifdef TEST
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "base32.h"
+#include "unit_test.h"
+
+int main(void)
+{
+    tth_t tth;
+    char base32[TTH_BASE32_LEN + 1];
+
+    /* agrees with the generic base32 encoder */
+    const char *s = "7LSZ6K2ZFQJBSEIRWM72N7VW2IULICCDW5ZUMJI";
+    fail_unless(tth_from_base32(&tth, s) == 0);
+    unsigned char raw[TTH_SIZE + 1];
+    fail_unless(base32_decode_into(s, strlen(s), raw) == TTH_SIZE);
+    fail_unless(memcmp(raw, tth.data, TTH_SIZE) == 0);
+    fail_unless(strcmp(tth_to_base32(&tth, base32), s) == 0);
+
+    /* lowercase is accepted, trailing characters ignored */
+    fail_unless(tth_from_base32(&tth,
+                "7lsz6k2zfqjbseirwm72n7vw2iuliccdw5zumji") == 0);
+    fail_unless(tth_from_base32(&tth,
+                "7LSZ6K2ZFQJBSEIRWM72N7VW2IULICCDW5ZUMJI:more") == 0);
+    fail_unless(strcmp(tth_to_base32(&tth, base32), s) == 0);
+
+    /* invalid characters and short strings */
+    fail_unless(tth_from_base32(&tth,
+                "0LSZ6K2ZFQJBSEIRWM72N7VW2IULICCDW5ZUMJI") == -1);
+    fail_unless(tth_from_base32(&tth, "7LSZ6K2ZFQJBSEIRWM72N7VW2IULICCDW5ZUMJ")
+            == -1);
+    fail_unless(tth_from_base32(&tth, "") == -1);
+    fail_unless(tth_from_base32(&tth, NULL) == -1);
+
+    /* round trip of random data */
+    int i, j;
+    for(i = 0; i < 1000; i++)
+    {
+        tth_t a, b;
+        for(j = 0; j < TTH_SIZE; j++)
+            a.data[j] = random();
+        tth_to_base32(&a, base32);
+        fail_unless(strlen(base32) == TTH_BASE32_LEN);
+        fail_unless(tth_from_base32(&b, base32) == 0);
+        fail_unless(tth_equal(&a, &b));
+        fail_unless(tth_cmp(&a, &b) == 0);
+        fail_unless(tth_hash(&a) == tth_hash(&b));
+
+        char *generic = base32_encode(a.data, TTH_SIZE);
+        fail_unless(strcmp(generic, base32) == 0);
+        free(generic);
+    }
+
+    return 0;
+}
+
+#endif
+
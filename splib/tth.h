@@ -0,0 +1,48 @@
+/*
+ * Copyright 2007 Martin Hedenfalk <martin@bzero.se>
+ *
+ * This file is part of ShakesPeer.
+ *
+ * ShakesPeer is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * ShakesPeer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ShakesPeer; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _tth_h_
+#define _tth_h_
+
+#include <stdint.h>
+#include <string.h>
+
+/* A tiger tree hash root in binary form. TTHs are exchanged as 39
+ * characters of base32, but kept in memory as the 24 raw bytes.
+ */
+
+#define TTH_SIZE 24
+#define TTH_BASE32_LEN 39
+
+typedef struct tth tth_t;
+struct tth
+{
+    unsigned char data[TTH_SIZE];
+};
+
+#define tth_equal(a, b) (memcmp((a)->data, (b)->data, TTH_SIZE) == 0)
+#define tth_cmp(a, b) memcmp((a)->data, (b)->data, TTH_SIZE)
+
+int tth_from_base32(tth_t *tth, const char *base32);
+char *tth_to_base32(const tth_t *tth, char *base32);
+uint32_t tth_hash(const tth_t *tth);
+
+#endif
+
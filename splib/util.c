@@ -133,42 +133,48 @@ char *data_to_hex(const char *data, unsigned int len)
     return strHexData;
 }
 
-void print_command(const char *command, const char *fmt, ...)
+/* Use print_command(), which checks the trace level first. */
+void trace_command(int subsystem, const char *command, const char *fmt, ...)
 {
-    char *prestr;
+    char prestr[64];
 
     va_list ap;
     va_start(ap, fmt);
-    int num_returned_bytes = vasprintf(&prestr, fmt, ap);
-    if (num_returned_bytes == -1)
-        DEBUG("vasprintf did not return anything");
+    vsnprintf(prestr, sizeof(prestr), fmt, ap);
     va_end(ap);
 
-    if (str_has_prefix(command, "$Key")) {
-        char *hex = data_to_hex(command + 5, strlen(command + 5));
-        DEBUG("%s $Key 0x%s|", prestr, hex);
-        free(hex);
+    int full = (sp_trace_levels[subsystem] == SP_TRACE_FULL);
+
+    if (str_has_prefix(command, "$Key ")) {
+        if (full) {
+            char *hex = data_to_hex(command + 5, strlen(command + 5));
+            sp_trace("%s $Key 0x%s|", prestr, hex);
+            free(hex);
+        }
+        else
+            sp_trace("%s $Key ...|", prestr);
     }
-    else if (str_has_prefix(command, "$Lock")) {
-        char *hex = data_to_hex(command + 6, strlen(command + 6));
-        DEBUG("%s $Lock %s|", prestr, hex);
-        free(hex);
+    else if (str_has_prefix(command, "$Lock ")) {
+        if (full) {
+            char *hex = data_to_hex(command + 6, strlen(command + 6));
+            sp_trace("%s $Lock %s|", prestr, hex);
+            free(hex);
+        }
+        else
+            sp_trace("%s $Lock ...|", prestr);
     }
     else if (str_has_prefix(command, "add-hash$")) {
-	    char *f = strchr(command + 9, '$');
-	    if(f) {
-	        f = strchr(f + 1, '$');
-	        char *l = xstrndup(command, f - command);
-	        DEBUG("%s %s", prestr, l);
-	        free(l);
-	    }
+        /* leave out the leaf data */
+        const char *f = strchr(command + 9, '$');
+        if (f)
+            f = strchr(f + 1, '$');
+        sp_trace("%s %.*s", prestr,
+                f ? (int)(f - command) : (int)strlen(command), command);
     }
     else if (str_has_prefix(command, "$MyPass"))
-        DEBUG("%s $MyPass ...|", prestr);
+        sp_trace("%s $MyPass ...|", prestr);
     else
-        DEBUG("%s %s", prestr, command);
-
-    free(prestr);
+        sp_trace("%s %s", prestr, command);
 }
 
 char *tilde_expand_path(const char *path)
@@ -24,6 +24,8 @@
 #include <sys/types.h> /* for size_t */
 #include <stdint.h>
 
+#include "log.h"
+
 #define FILELIST_NONE 0
 #define FILELIST_DCLST 1
 #define FILELIST_XML 2
@@ -52,8 +54,15 @@ typedef enum share_size_restriction
 } share_size_restriction_t;
 
 char *str_size_human(uint64_t size);
-void print_command(const char *command, const char *fmt, ...)
-    __attribute__ (( format(printf, 2, 3) ));
+
+/* Traces a protocol command. Nothing is formatted unless tracing is
+ * enabled for the subsystem. */
+#define print_command(subsystem, command, fmt, ...) do {            \
+        if(sp_trace_enabled(subsystem))                             \
+            trace_command(subsystem, command, fmt, ## __VA_ARGS__); \
+    } while(0)
+void trace_command(int subsystem, const char *command, const char *fmt, ...)
+    __attribute__ (( format(printf, 3, 4) ));
 char *tilde_expand_path(const char *path);
 char *absolute_path(const char *path);
 char *get_working_directory(void);
@@ -23,6 +23,13 @@
 #include "util.h"
 #include "unit_test.h"
 
+static int ntrace_args = 0;
+
+static int trace_arg(void)
+{
+    return ++ntrace_args;
+}
+
 int main(void)
 {
     /*
@@ -96,6 +103,32 @@ int main(void)
     fail_unless(strcmp(str_size_human(1024), str_size_human(2048)) == -1);
     free(s);
 
+    /*
+     * print_command
+     */
+
+    /* arguments aren't evaluated unless tracing */
+    sp_log_set_level("info");
+    print_command(SP_TRACE_HUB, "$Lock abc", "<- (fd %d)", trace_arg());
+    fail_unless(ntrace_args == 0);
+
+    fail_unless(sp_trace_set_level("hub", "commands") == 0);
+    fail_unless(sp_trace_set_level("hubs", "full") == -1);
+    fail_unless(sp_trace_set_level("hub", "loud") == -1);
+    print_command(SP_TRACE_HUB, "$Lock abc", "<- (fd %d)", trace_arg());
+    print_command(SP_TRACE_PEER, "$Lock abc", "<- (fd %d)", trace_arg());
+    fail_unless(ntrace_args == 1);
+
+    fail_unless(sp_trace_set_level("all", "full") == 0);
+    print_command(SP_TRACE_PEER, "$Key abc", "<- (fd %d)", trace_arg());
+    fail_unless(ntrace_args == 2);
+
+    /* the debug log level traces everything */
+    sp_log_set_level("debug");
+    fail_unless(sp_trace_enabled(SP_TRACE_HASHD));
+    sp_log_set_level("info");
+    fail_unless(!sp_trace_enabled(SP_TRACE_HASHD));
+
     return 0;
 }
 
@@ -0,0 +1,81 @@
+# Perfect hashing of command names, shared by the command table generators.
+# cmd_hash() must give the same values as cmd_hash() in splib/cmd_table.c.
+#
+# Callers fill in cmd_names[1..n], cmd_handlers[1..n] and cmd_nargs[1..n]
+# and call cmd_print_table(name, n).
+
+function cmd_hash(name, seed,    h, m, i)
+{
+    if(!cmd_ord_initialized)
+    {
+        for(i = 1; i < 256; i++)
+            cmd_ord[sprintf("%c", i)] = i
+        cmd_ord_initialized = 1
+    }
+
+    h = 0
+    m = 2 * seed + 1
+    for(i = 1; i <= length(name); i++)
+        h = (h * m + cmd_ord[substr(name, i, 1)]) % 1048576
+    return h + int(h / 1024)
+}
+
+# Prints the commands, and the slots of a seed that hashes all names to
+# different slots, as a cmd_table_t called <table>.
+function cmd_print_table(table, n,    size, seed, found, i, s, used)
+{
+    if(n > 255)
+    {
+        printf("too many commands in %s\n", table) > "/dev/stderr"
+        exit 1
+    }
+
+    size = 4
+    while(size < 2 * n)
+        size *= 2
+
+    found = 0
+    while(!found)
+    {
+        for(seed = 0; seed < 10000; seed++)
+        {
+            delete used
+            found = 1
+            for(i = 1; i <= n; i++)
+            {
+                s = cmd_hash(cmd_names[i], seed) % size
+                if(s in used)
+                {
+                    found = 0
+                    break
+                }
+                used[s] = i
+            }
+            if(found)
+                break
+        }
+        if(!found)
+            size *= 2
+    }
+
+    printf("static cmd_t %s_list[] = {\n", table)
+    for(i = 1; i <= n; i++)
+    {
+        printf("    {\"%s\", %s, %d},\n",
+               cmd_names[i], cmd_handlers[i], cmd_nargs[i])
+    }
+    printf("    {0, 0, -1}\n")
+    printf("};\n\n")
+
+    printf("static const unsigned char %s_slots[%d] = {", table, size)
+    for(s = 0; s < size; s++)
+    {
+        if(s % 16 == 0)
+            printf("\n   ")
+        printf(" %d,", (s in used) ? used[s] : 0)
+    }
+    printf("\n};\n\n")
+
+    printf("static cmd_table_t %s = {%s_list, %s_slots, %d, %d};\n",
+           table, table, table, size - 1, seed)
+}
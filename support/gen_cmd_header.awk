@@ -60,7 +60,7 @@ END {
     }
     printf("};\n\n");
     printf("%s *%s_init(void);\n\n", struct, prefix);
-    printf("int %s_dispatch_command(const char *line, const char *delimiters,\n", prefix);
+    printf("int %s_dispatch_command(char *line, const char *delimiters,\n", prefix);
     printf("        int allow_null_elements, %s *%s);\n", struct, prefix);
     printf("#endif\n");
 }
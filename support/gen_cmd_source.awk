@@ -44,7 +44,10 @@ BEGIN {
             ncmd = n
         }
     }
-    cmdlist[cmd]=ncmd
+    ncmds++
+    cmd_names[ncmds]=cmd
+    cmd_handlers[ncmds]=prefix "_cmd_" ccmd
+    cmd_nargs[ncmds]=ncmd
     printf("\nstatic int %s_cmd_%s(void *user_data, int argc, char **argv)\n",
            prefix, ccmd)
     printf("{\n")
@@ -83,29 +86,18 @@ BEGIN {
 }
 
 END {
-    printf("static cmd_t %s_cmds[] = {\n", prefix)
-    for(cmd in cmdlist)
-    {
-        ccmd=cmd
-        gsub(/-/, "_", ccmd)
-        gsub(/\$/, "", ccmd)
-        gsub(/:/, "", ccmd)
-        printf("    {\"%s\", %s_cmd_%s, %d},\n",
-               cmd, prefix, ccmd, cmdlist[cmd])
-    }
-    printf("    {0, 0, -1}\n", prefix)
-    printf("};\n")
-
+    printf("\n")
+    cmd_print_table(prefix "_cmds", ncmds)
     printf("\n%s *%s_init(void)\n", struct, prefix)
     printf("{\n")
     printf("    %s *%s = calloc(1, sizeof(%s));\n", struct, prefix, struct)
     printf("    return %s;\n}\n\n", prefix)
 
-    printf("int %s_dispatch_command(const char *line, const char *delimiters,\n", prefix)
+    printf("int %s_dispatch_command(char *line, const char *delimiters,\n", prefix)
     printf("        int allow_null_elements, %s *%s)\n", struct, prefix)
     printf("{\n")
     printf("    return cmd_dispatch(line, delimiters, allow_null_elements,\n")
-    printf("        %s_cmds, %s);\n", prefix, prefix)
+    printf("        &%s_cmds, %s);\n", prefix, prefix)
     printf("}\n")
 }
 
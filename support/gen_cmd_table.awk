@@ -0,0 +1,44 @@
+# Generates hashed command tables from a list of commands and their
+# handlers. Each table starts with a line
+#
+#   table <name>
+#
+# followed by one line per command
+#
+#   <command> <handler> <required arguments>
+#
+# Run with -f cmd_hash.awk. The output is included by the source file
+# that defines the handlers.
+
+BEGIN {
+    printf("/* This is a generated file. Don't edit. Edit the source instead.\n */\n")
+    table = ""
+}
+
+/^#/ || NF == 0 { next; }
+
+/^table / {
+    if(table != "")
+    {
+        printf("\n")
+        cmd_print_table(table, n)
+    }
+    table = $2
+    n = 0
+    next
+}
+
+{
+    n++
+    cmd_names[n] = $1
+    cmd_handlers[n] = $2
+    cmd_nargs[n] = $3
+}
+
+END {
+    if(table != "")
+    {
+        printf("\n")
+        cmd_print_table(table, n)
+    }
+}
@@ -8,14 +8,17 @@ BEGIN {
     printf("#include \"notification_center.h\"\n");
 }
 
-/^notification / {
-    name=$2
+/^(batched )?notification / {
+    # batched notifications can also be observed in batches
+    batched = ($1 == "batched")
+    first = batched ? 3 : 2
+    name=$first
     delete args
     delete argnames
     delete argdef
     delete argtypes
     n=0;
-    for(i = 3; i <= NF; i++)
+    for(i = first + 1; i <= NF; i++)
     {
         args[n]=$i
         n++;
@@ -78,6 +81,16 @@ BEGIN {
     
     printf("void nc_add_%s_observer(nc_t *nc,\n" \
            "    nc_%s_callback_t callback, void *user_data);\n", name, name);
+
+    if(batched)
+    {
+        printf("\ntypedef void (*nc_%s_batch_callback_t)(nc_t *nc,\n" \
+               "    const char *channel, nc_%s_t **%s_data, unsigned count,\n" \
+               "    void *user_data);\n", name, name, name);
+        printf("void nc_add_%s_batch_observer(nc_t *nc,\n" \
+               "    nc_%s_batch_callback_t callback, void *user_data);\n",
+               name, name);
+    }
 }
 
 END {
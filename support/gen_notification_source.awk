@@ -1,17 +1,22 @@
 BEGIN {
     printf("/* This is a generated file. Don't edit. Edit the source instead.\n */\n\n");
 
+    printf("#include <stdlib.h>\n");
+    printf("#include <string.h>\n\n");
     printf("#include \"notifications.h\"\n");
 }
 
-/^notification / {
-    name=$2
+/^(batched )?notification / {
+    # batched notifications can also be observed in batches
+    batched = ($1 == "batched")
+    first = batched ? 3 : 2
+    name=$first
     delete args
     delete argnames
     delete argdef
     delete argtypes
     n=0;
-    for(i = 3; i <= NF; i++)
+    for(i = first + 1; i <= NF; i++)
     {
         args[n]=$i
         n++;
@@ -55,6 +60,11 @@ BEGIN {
         argtypes[i] = argtype
     }
     printf("\n\n/*\n * Notification type %s\n */\n\n", name);
+    printf("static int nc_%s_channel = -1;\n\n", name);
+    printf("static int nc_%s_channel_id(void)\n{\n", name);
+    printf("    if(nc_%s_channel == -1)\n", name);
+    printf("        nc_%s_channel = nc_channel_id(\"%s\");\n", name, name);
+    printf("    return nc_%s_channel;\n}\n\n", name);
     printf("void nc_send_%s_notification(nc_t *nc", name);
     for(i = 0; i < n; i++)
     {
@@ -69,13 +79,43 @@ BEGIN {
         printf("\n")
     }
     printf("    };\n");
-    printf("    nc_send_notification(nc, \"%s\", &%s_data);\n", name, name);
+    printf("    nc_send_notification_id(nc, nc_%s_channel_id(), &%s_data);\n", name, name);
     printf("}\n");
 
     printf("\nvoid nc_add_%s_observer(nc_t *nc, nc_%s_callback_t callback, void *user_data)\n", name, name)
     printf("{\n")
-    printf("    nc_add_observer(nc, \"%s\", (nc_callback_t)callback, user_data);\n", name);
+    printf("    nc_add_observer_id(nc, nc_%s_channel_id(), (nc_callback_t)callback, user_data);\n", name);
     printf("}\n");
+
+    if(batched)
+    {
+        printf("\nstatic void *nc_%s_copy(const void *data)\n{\n", name);
+        printf("    const nc_%s_t *%s_data = data;\n", name, name);
+        printf("    nc_%s_t *copy = malloc(sizeof(nc_%s_t));\n", name, name);
+        printf("    *copy = *%s_data;\n", name);
+        for(i = 0; i < n; i++)
+        {
+            if(argtypes[i] == "string")
+                printf("    copy->%s = %s_data->%s ? strdup(%s_data->%s) : NULL;\n",
+                       argnames[i], name, argnames[i], name, argnames[i]);
+        }
+        printf("    return copy;\n}\n");
+
+        printf("\nstatic void nc_%s_free(void *data)\n{\n", name);
+        printf("    nc_%s_t *%s_data = data;\n", name, name);
+        for(i = 0; i < n; i++)
+        {
+            if(argtypes[i] == "string")
+                printf("    free((char *)%s_data->%s);\n", name, argnames[i]);
+        }
+        printf("    free(%s_data);\n}\n", name);
+
+        printf("\nvoid nc_add_%s_batch_observer(nc_t *nc, nc_%s_batch_callback_t callback, void *user_data)\n", name, name)
+        printf("{\n")
+        printf("    nc_add_batch_observer_id(nc, nc_%s_channel_id(),\n", name);
+        printf("        (nc_batch_callback_t)callback, nc_%s_copy, nc_%s_free, user_data);\n", name, name);
+        printf("}\n");
+    }
 }
 
 END {